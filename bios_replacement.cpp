@@ -2,12 +2,11 @@
 #include "fileio.h"
 #include "cpu_flags.h"
 #include "disk_data.h"
-#include <print>
 #include <cstring>
 #include <cassert>
 #include <fstream>
 
-#define LOG(...) std::println("BIOS: " __VA_ARGS__)
+#define LOG(...) bus_.log().println("BIOS: " __VA_ARGS__)
 #define UNSUPPORTED(...) throw std::runtime_error{std::format("BIOS: Unspported: " __VA_ARGS__)}
 #define CHECK_DISK_PARAMETER(cond)                                 \
     do {                                                           \
@@ -76,6 +75,7 @@ private:
             lastStatus = DiskStatus::Success;
         }
     } drive_[MaxDrives] = {};
+    int setCursorLogCount_ = 0;
 
     Drive* getDrive(uint8_t drive);
     Drive& getDriveOrDir(uint8_t drive);
@@ -85,9 +85,14 @@ private:
         return romData_[offset & (romData_.size() - 1)];
     }
 
+    HostRegion hostRegion() override
+    {
+        return HostRegion { romData_.data(), romData_.size() };
+    }
+
     void writeU8(std::uint64_t addr, [[maybe_unused]] std::uint64_t offset, std::uint8_t value) override
     {
-        std::println("BIOS: Write to {:X} value {:02X}", addr, value);
+        bus_.log().println("BIOS: Write to {:X} value {:02X}", addr, value);
     }
 
     virtual void outU16(std::uint16_t port, std::uint16_t offset, std::uint16_t value) override;
@@ -207,9 +212,9 @@ void BiosReplacement::impl::outU16([[maybe_unused]] std::uint16_t port, [[maybe_
             auto data = ReadFile(filename);
             for (size_t i = 0; i < data.size(); ++i)
                 bus_.writeU8(0x10100 + i, data[i]);
-            cpu_.flags_ &= ~EFLAGS_MASK_ZF;
+            cpu_.flags() &= ~EFLAGS_MASK_ZF;
         } else {
-            cpu_.flags_ |= EFLAGS_MASK_ZF;
+            cpu_.flags() |= EFLAGS_MASK_ZF;
         }
         break;
     case 0xFEDE: {
@@ -224,10 +229,9 @@ void BiosReplacement::impl::outU16([[maybe_unused]] std::uint16_t port, [[maybe_
             break;
         case 0x02: // Set cursor position
         {
-            static int cnt = 0;
-            if (cnt < 5000) {
+            if (setCursorLogCount_ < 5000) {
                 LOG("Set Cursor {},{}", DX & 0xff, DX >> 8);
-                ++cnt;
+                ++setCursorLogCount_;
             }
             break;
         }
@@ -259,9 +263,9 @@ void BiosReplacement::impl::int13h_setStatus(BiosReplacement::impl::Drive* drive
     if (drive)
         drive->lastStatus = status;
     if (status == DiskStatus::Success)
-        cpu_.flags_ &= ~EFLAGS_MASK_CF;
+        cpu_.flags() &= ~EFLAGS_MASK_CF;
     else
-        cpu_.flags_ |= EFLAGS_MASK_CF;
+        cpu_.flags() |= EFLAGS_MASK_CF;
     // AH = status
     SET_REG8H(AX, static_cast<uint8_t>(status));
 }
@@ -306,9 +310,9 @@ void BiosReplacement::impl::int13h_diskOp(uint8_t op)
         const auto addr = (seg * 16) + ((ofs + i) & 0xffff);
         ///const auto addr = (seg * 16) + (ofs + i);
         if (op == 2) {
-            bus_.writeU8(addr, drive->diskData.data[srcAddr + i]);
+            bus_.writeU8(addr, drive->diskData.data.readU8(srcAddr + i));
         } else if (op == 3) {
-            drive->diskData.data[srcAddr + i] = bus_.readU8(addr);
+            drive->diskData.data.writeU8(srcAddr + i, bus_.readU8(addr));
         }
     }
 
@@ -2,9 +2,11 @@
 #include "cpu_flags.h"
 #include "cpu_exception.h"
 #include "system_bus.h"
-#include <print>
+#include "snapshot.h"
+#include "jit_x64.h"
 #include <cstring>
 #include <map>
+#include <utility>
 
 //
 // LOADALL: https://www.rcollins.org/articles/loadall/
@@ -13,7 +15,6 @@
 // TODO: PUSHF/POPF and VM flag
 // TODO: Writing through a protected mode code16 segment is probably not allowed
 
-constexpr uint32_t DEFAULT_EFLAGS_RESULT_MASK = EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF | EFLAGS_MASK_CF;
 constexpr uint32_t VALID_CR_MASK = 1 << 0 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 8;
 
 #define HANDLE_ADD_CARRY() carry = (l & r) | ((l | r) & ~result)
@@ -25,8 +26,8 @@ constexpr uint32_t VALID_CR_MASK = 1 << 0 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 8;
         if (cpuModel_ <= CPUModel::i8086) \
             throw std::runtime_error { IP_PREFIX()  + std::format("TODO:" __VA_ARGS__) }; \
         if (exceptionTraceMask_ & (1 << CPUExceptionNumber::InvalidOpcode)) { \
-            std::print("{}", IP_PREFIX()); \
-            std::println(__VA_ARGS__); \
+            bus_.log().print("{}", IP_PREFIX()); \
+            bus_.log().println(__VA_ARGS__); \
         } \
         throw CPUException{CPUExceptionNumber::InvalidOpcode}; \
     } while (false)
@@ -34,8 +35,8 @@ constexpr uint32_t VALID_CR_MASK = 1 << 0 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 8;
 #define THROW_WITH_ERR(number, errorCode, ...) do { \
         assert(cpuModel_ >= CPUModel::i80286); \
         if (exceptionTraceMask_ & (1 << number)) { \
-            std::print("{}", IP_PREFIX()); \
-            std::println(__VA_ARGS__); \
+            bus_.log().print("{}", IP_PREFIX()); \
+            bus_.log().println(__VA_ARGS__); \
         } \
         throw CPUException { number, errorCode }; \
     } while (false)
@@ -81,7 +82,7 @@ std::uint8_t CPUState::iopl() const
     return static_cast<uint8_t>((flags_ & EFLAGS_MASK_IOPL) >> EFLAGS_BIT_IOPL);
 }
 
-void ShowCPUState(const CPUState& state)
+void ShowCPUState(const CPUState& state, Logger& log)
 {
     const Reg regOrder[] = {
         REG_AX,
@@ -103,28 +104,34 @@ void ShowCPUState(const CPUState& state)
     };
     for (int i = 0; i < 8; ++i) {
         auto r = regOrder[i];
-        std::print("{}={:08X}{}", Reg32Text[r], state.regs_[r] & 0xffffffff, i == 7 ? '\n' : ' ');
+        log.print("{}={:08X}{}", Reg32Text[r], state.regs_[r] & 0xffffffff, i == 7 ? '\n' : ' ');
     }
     for (int i = 0; i < 6; ++i) {
         auto r = sregOrder[i];
-        std::print("{}={:04X} ", SRegText[r], state.sregs_[r]);
+        log.print("{}={:04X} ", SRegText[r], state.sregs_[r]);
     }
-    std::print("flags={} {}-bit", FormatCPUFlags(state.flags_), state.defaultOperandSize() * 8);
+    log.print("flags={} {}-bit", FormatCPUFlags(state.flags_), state.defaultOperandSize() * 8);
     if (state.protectedMode()) {
         if (state.vm86())
-            std::print(" v86");
-        std::print(" CPL={} IOPL={}", state.cpl(), state.iopl());
+            log.print(" v86");
+        log.print(" CPL={} IOPL={}", state.cpl(), state.iopl());
     }
-    std::println("");
+    log.println("");
 
 #if 1
-    std::print("Prefetch queue: ");
+    log.print("Prefetch queue: ");
     for (auto pos = state.prefetch_.getPos; pos != state.prefetch_.putPos; ++pos)
-        std::print("{:02X}", state.prefetch_.peek(pos - state.prefetch_.getPos));
-    std::println("");
+        log.print("{:02X}", state.prefetch_.peek(pos - state.prefetch_.getPos));
+    log.println("");
 #endif
 }
 
+void ShowCPUState(CPU& cpu, Logger& log)
+{
+    cpu.flags();
+    ShowCPUState(static_cast<const CPUState&>(cpu), log);
+}
+
 template <>
 struct std::formatter<SegmentedAddress> : std::formatter<const char*> {
     auto format(const SegmentedAddress& sa, std::format_context& ctx) const
@@ -259,8 +266,8 @@ struct IretDebugItem {
     int interrupt;
     std::uint32_t errorCode;
 };
-std::vector<IretDebugItem> iretDebugItems;
-bool check = false;
+thread_local std::vector<IretDebugItem> iretDebugItems;
+thread_local bool check = false;
 
 void OnInterrupt(CPU& cpu, int interrupt, std::uint32_t errorCode)
 {
@@ -310,17 +317,32 @@ CPU::CPU(CPUModel cpuModel, SystemBus& bus)
     , shiftMask_ { static_cast<uint8_t>(cpuModel <= CPUModel::i8086 ? 63 : 31) }
     , prefetchQueueLength_ { PrefixQueueLength(cpuModel) }
     , bus_ { bus }
+    , decodeCacheEnabled_ { cpuModel >= CPUModel::i80386sx } // Earlier models need the accurate prefetch queue
+    , fastFetchEnabled_ { cpuModel >= CPUModel::i80386sx }
+    , decodeCache_(DecodeCacheSize)
+    , blockCache_(BlockCacheSize)
 {
+    bus_.addWriteObserver(*this);
     reset();
 }
 
+CPU::~CPU()
+{
+    bus_.removeWriteObserver(*this);
+}
+
 void CPU::reset()
 {
     std::memset(static_cast<CPUState*>(this), 0, sizeof(CPUState));
     currentInstruction = {};
     instructionsExecuted_ = 0;
+    historyCount_ = 0;
+    lastException_ = ExceptionNone;
+    pendingException_.reset();
     controlTransferHistoryCount_ = 0;
     halted_ = false;
+    flushDecodeCache();
+    flushFastTLB();
 
     setFlags(0);
     for (int sr = SREG_ES; sr <= SREG_GS; ++sr) {
@@ -349,6 +371,37 @@ void CPU::reset()
     prefetch_.flush(ip_);
 }
 
+void CPU::saveState(SnapshotWriter& writer) const
+{
+    writer.section("cpu");
+    writer.write(cpuModel_);
+    writer.write(static_cast<const CPUState*>(this), sizeof(CPUState));
+    writer.write(lazyFlags_);
+    writer.write(instructionsExecuted_);
+    writer.write(halted_);
+}
+
+void CPU::loadState(SnapshotReader& reader)
+{
+    reader.section("cpu");
+    CPUModel model;
+    reader.read(model);
+    if (model != cpuModel_)
+        throw std::runtime_error { "Snapshot is for a different CPU model" };
+    reader.read(static_cast<CPUState*>(this), sizeof(CPUState));
+    reader.read(lazyFlags_);
+    reader.read(instructionsExecuted_);
+    reader.read(halted_);
+    // History and statistics are not part of the machine state
+    currentInstruction = {};
+    historyCount_ = 0;
+    lastException_ = ExceptionNone;
+    pendingException_.reset();
+    controlTransferHistoryCount_ = 0;
+    flushDecodeCache();
+    flushFastTLB();
+}
+
 CPUInfo CPU::cpuInfo() const
 {
     return CPUInfo { cpuModel_, defaultOperandSize() };
@@ -453,15 +506,17 @@ std::string PteText(uint32_t pte)
 
 #define PAGE_FAULT(...)                                                   \
     do {                                                                  \
-        if (exceptionTraceMask_ & (1 << CPUExceptionNumber::PageFault)) { \
-            std::print("{}#PF {:08X} ", IP_PREFIX(), linearAddress);      \
-            std::println(__VA_ARGS__);                                    \
+        if ((exceptionTraceMask_ & (1 << CPUExceptionNumber::PageFault))  \
+            && !(lookupFlags & PL_FLAG_MASK_PEEK)) {                      \
+            bus_.log().print("{}#PF {:08X} ", IP_PREFIX(), linearAddress);      \
+            bus_.log().println(__VA_ARGS__);                                    \
         }                                                                 \
-        cregs_[2] = linearAddress;                                        \
-        throw CPUException { CPUExceptionNumber::PageFault, err };        \
+        errorCode = err;                                                  \
+        return {};                                                        \
     } while (0)
 
-std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupFlags)
+// Returns std::nullopt on a page fault with the error code in errorCode. CR2 is left untouched.
+std::optional<std::uint64_t> CPU::tryPageLookup(std::uint64_t linearAddress, std::uint32_t lookupFlags, std::uint32_t& errorCode)
 {
     assert(!(lookupFlags & ~(PL_MASK_W | PL_MASK_I | PL_FLAG_MASK_PEEK | PL_FLAG_MASK_SYS)));
 
@@ -498,6 +553,7 @@ std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupF
 
     const auto pdeAddr = (cregs_[3] & PT32_MASK_ADDR) + ((linearAddress >> 22) & 1023) * 4;
     const auto pde = static_cast<uint32_t>(readMemPhysical(pdeAddr, 4));
+    ++busAccesses_;
     if (!(pde & PT32_MASK_P))
         PAGE_FAULT("PDE not present: {}", PdeText(pde));
 
@@ -507,6 +563,7 @@ std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupF
     // Only check permissions on PDE after checking if PTE is present
     const auto pteAddr = (pde & PT32_MASK_ADDR) + ((linearAddress >> 12) & 1023) * 4;
     const auto pte = static_cast<uint32_t>(readMemPhysical(pteAddr, 4));
+    ++busAccesses_;
     if (!(pte & PT32_MASK_P))
         PAGE_FAULT("PTE not present: {}", PteText(pte));
 
@@ -527,14 +584,16 @@ std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupF
 
     if (!(lookupFlags & PL_FLAG_MASK_PEEK)) {
         if (!(pde & PT32_MASK_A)) {
-            //std::println("Updating pde at {:X} from {:X} to {:X}", pdeAddr, pde, pde | PT32_MASK_A);
+            //bus_.log().println("Updating pde at {:X} from {:X} to {:X}", pdeAddr, pde, pde | PT32_MASK_A);
             writeMemPhysical(pdeAddr, pde | PT32_MASK_A, 4);
+            ++busAccesses_;
         }
 
         const uint32_t fl = PT32_MASK_A | (lookupFlags & PL_MASK_W ? PT32_MASK_D : (pte & PT32_MASK_D));
         if ((pte & (PT32_MASK_A | PT32_MASK_D)) != fl) {
-            //std::println("Updating pte at {:X} from {:X} to {:X}", pteAddr, pte, pte | fl);
+            //bus_.log().println("Updating pte at {:X} from {:X} to {:X}", pteAddr, pte, pte | fl);
             writeMemPhysical(pteAddr, pte | fl, 4);
+            ++busAccesses_;
         }
 
         if (!tlbEntry)
@@ -552,9 +611,87 @@ std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupF
     return (pte & PT32_MASK_ADDR) + (linearAddress & PAGE_MASK);
 }
 
+std::uint64_t CPU::pageLookup(std::uint64_t linearAddress, std::uint32_t lookupFlags)
+{
+    std::uint32_t errorCode;
+    if (const auto physicalAddress = tryPageLookup(linearAddress, lookupFlags, errorCode))
+        return *physicalAddress;
+    cregs_[2] = linearAddress;
+    throw CPUException { CPUExceptionNumber::PageFault, errorCode };
+}
+
+// Like pageLookup, but a page fault is made pending instead of thrown
+bool CPU::pagePresent(std::uint64_t linearAddress, std::uint32_t lookupFlags)
+{
+    std::uint32_t errorCode;
+    if (tryPageLookup(linearAddress, lookupFlags, errorCode))
+        return true;
+    cregs_[2] = linearAddress;
+    raiseException(CPUExceptionNumber::PageFault, errorCode);
+    return false;
+}
+
 void CPU::flushTLB()
 {
     tlb_.invalidate();
+    flushFastTLB();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fast TLB
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void CPU::flushFastTLB()
+{
+    if (fastTlbFilledCount_ < std::size(fastTlbFilled_)) {
+        for (size_t i = 0; i < fastTlbFilledCount_; ++i)
+            fastTlb_[fastTlbFilled_[i]].tag = UINT64_MAX;
+    } else {
+        for (auto& e : fastTlb_)
+            e.tag = UINT64_MAX;
+    }
+    fastTlbFilledCount_ = 0;
+    flushFetchWindow();
+    leaveBlock(); // The mapping of the code may have changed
+}
+
+void CPU::memoryMapChanged()
+{
+    flushFastTLB();
+}
+
+std::uint64_t CPU::fastTlbTag(std::uint64_t linearAddress) const
+{
+    return (linearAddress & ~std::uint64_t(PAGE_MASK)) | (cpl() == 3);
+}
+
+// Returns the entry for a data access that doesn't cross a page, or nullptr if it has to go through the bus
+const CPU::FastTLBEntry* CPU::fastTlbLookup(std::uint64_t linearAddress, std::uint8_t size, bool forWrite)
+{
+    if ((linearAddress & PAGE_MASK) + size > PAGE_SIZE)
+        return nullptr;
+    const auto& e = fastTlb_[fastTlbIndex(linearAddress, forWrite)];
+    if (e.tag == fastTlbTag(linearAddress))
+        return &e;
+    return fastTlbFill(linearAddress, size, forWrite);
+}
+
+const CPU::FastTLBEntry* CPU::fastTlbFill(std::uint64_t linearAddress, std::uint8_t size, bool forWrite, std::uint32_t lookupFlags)
+{
+    // Translate the same address as readMemLinear/writeMemLinear would, so faults (and CR2) are unchanged
+    const auto lookupAddress = forWrite ? linearAddress : linearAddress & ~std::uint64_t(size - 1);
+    const auto physicalAddress = toPhysicalAddress(lookupAddress, lookupFlags | (forWrite ? PL_MASK_W : 0)) & bus_.addressMask() & ~std::uint64_t(PAGE_MASK);
+    auto host = bus_.hostPage(physicalAddress, PAGE_SIZE, forWrite);
+    if (!host)
+        return nullptr;
+    const auto index = fastTlbIndex(linearAddress, forWrite);
+    auto& e = fastTlb_[index];
+    if (fastTlbFilledCount_ < std::size(fastTlbFilled_))
+        fastTlbFilled_[fastTlbFilledCount_++] = static_cast<std::uint16_t>(index);
+    e.tag = fastTlbTag(linearAddress);
+    e.physicalAddress = physicalAddress;
+    e.host = host;
+    return &e;
 }
 
 bool CPU::instructionFetch(bool prefetch)
@@ -642,7 +779,7 @@ bool CPU::instructionFetch(bool prefetch)
     std::string s;
     for (uint32_t i = maxFetch; i--;)
         s += HexString(&pf.data[(pf.putPos - i - 1) & (MaxPrefetchQueueLength - 1)], 1);
-    std::println("Fetched {} bytes from {:04X}:{:04X} ({:X}): {}", maxFetch, sregs_[SREG_CS], pf.ip, physAddress, s);
+    bus_.log().println("Fetched {} bytes from {:04X}:{:04X} ({:X}): {}", maxFetch, sregs_[SREG_CS], pf.ip, physAddress, s);
 #endif
 
     pf.ip += maxFetch;
@@ -662,6 +799,567 @@ void CPU::instructionPrefetch()
         ;
 }
 
+// Demand paged code usually faults on the first byte of an instruction. Catch that case
+// here, at the instruction boundary, so it can be delivered without unwinding.
+bool CPU::fetchPagePresent()
+{
+    if (!pagingEnabled() || ip_ > sdesc_[SREG_CS].limit)
+        return true;
+    return pagePresent(sdesc_[SREG_CS].base + ip_, PL_MASK_I);
+}
+
+std::uint8_t CPU::fetchCodeByte(std::uint64_t offset)
+{
+    const auto linearAddress = toLinearAddress(SegmentedAddress { SREG_CS, offset }, 1, false);
+    return static_cast<std::uint8_t>(readMemPhysical(toPhysicalAddress(linearAddress, PL_MASK_I), 1));
+}
+
+// Makes the fetch window cover the page containing CS:IP (from the start of the page or the segment up to
+// the end of the page or the segment limit), or leaves it empty if the code isn't backed by RAM/ROM
+void CPU::fillFetchWindow()
+{
+    flushFetchWindow();
+    const auto& cs = sdesc_[SREG_CS];
+    if (ip_ > cs.limit)
+        return;
+    const auto linearAddress = cs.base + ip_;
+    const FastTLBEntry* e = &fastTlb_[fastTlbIndex(linearAddress, false)];
+    if (e->tag != fastTlbTag(linearAddress))
+        e = fastTlbFill(linearAddress, 1, false, PL_MASK_I);
+    if (!e)
+        return;
+    const auto before = std::min<std::uint64_t>(ip_, linearAddress & PAGE_MASK);
+    fetchWindowIp_ = ip_ - before;
+    fetchWindowHost_ = e->host + (linearAddress & PAGE_MASK) - before;
+    fetchWindowSize_ = before + std::min<std::uint64_t>(PAGE_SIZE - (linearAddress & PAGE_MASK), cs.limit - ip_ + 1);
+}
+
+// Decode straight from host memory when CS:IP is in the fetch window. Bytes past its end (on the next
+// page or outside the segment limit) are fetched one at a time.
+InstructionDecodeResult CPU::fastFetchDecode()
+{
+    if (!inFetchWindow())
+        fillFetchWindow();
+    const std::uint8_t* host = nullptr;
+    std::uint64_t available = 0;
+    if (inFetchWindow()) {
+        host = fetchWindowHost_ + (ip_ - fetchWindowIp_);
+        available = fetchWindowSize_ - (ip_ - fetchWindowIp_);
+    }
+
+    std::uint64_t offset = 0;
+    const auto res = Decode(cpuInfo(), [&]() {
+        if (offset < available)
+            return host[offset++];
+        return fetchCodeByte(ip_ + offset++);
+    });
+    return res;
+}
+
+// Returns false if a fault is pending instead
+bool CPU::instructionDecode()
+{
+    const bool fastFetch = fastFetchEnabled_ && cpuModel_ >= CPUModel::i80286;
+    if (decodeCacheEnabled_) {
+        if (activeBlock_) {
+            if (ip_ == blockIp_) {
+                blockCacheNext();
+                return true;
+            }
+            leaveBlock(); // E.g. a restarted REP instruction
+        }
+        if (blockBoundary_ && blockCacheLookup())
+            return true;
+        if (decodeCacheLookup()) {
+            blockCacheDecoded();
+            return true;
+        }
+        if (!fetchPagePresent())
+            return false;
+        // Fetch on demand so the decoded bytes match memory (and can be cached)
+        prefetch_.flush(ip_);
+    } else if (fastFetch) {
+        if (!inFetchWindow() && !fetchPagePresent())
+            return false;
+    } else {
+        if (prefetch_.empty() && !fetchPagePresent())
+            return false;
+        instructionPrefetch();
+    }
+
+    if (fastFetch) {
+        currentInstruction = fastFetchDecode();
+    } else {
+        currentInstruction = Decode(cpuInfo(), [&]() {
+            if (!prefetch_.empty())
+                return prefetch_.get();
+            instructionFetch(false);
+            assert(!prefetch_.empty());
+            return prefetch_.get();
+        });
+    }
+    lowerInstruction();
+    bus_.addCycles(currentOp_.cycles);
+
+    if (decodeCacheEnabled_) {
+        decodeCacheInsert();
+        blockCacheDecoded();
+    }
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decode Cache
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void CPU::decodeCacheEnabled(bool enabled)
+{
+    decodeCacheEnabled_ = enabled;
+    flushDecodeCache();
+    prefetch_.flush(ip_);
+}
+
+void CPU::fastFetchEnabled(bool enabled)
+{
+    fastFetchEnabled_ = enabled;
+    prefetch_.flush(ip_);
+}
+
+void CPU::flushDecodeCache()
+{
+    for (auto& e : decodeCache_)
+        e.physicalAddress = UINT64_MAX;
+    for (auto& b : blockCache_)
+        b.physicalAddress = UINT64_MAX;
+    leaveBlock();
+}
+
+void CPU::memoryWritten(std::uint64_t addr, std::uint64_t length)
+{
+    leaveBlock();
+    const auto end = std::min(((addr + length - 1) >> SystemBus::WriteWatchShift) + 1, codeBlockVersion_.end());
+    for (auto block = addr >> SystemBus::WriteWatchShift; block < end; ++block) {
+        if (auto version = codeBlockVersion_.find(block); version)
+            ++*version;
+    }
+    ++decodeCacheStats_.invalidations;
+}
+
+std::uint32_t CPU::codeBlockVersion(std::uint64_t physicalAddress) const
+{
+    const auto version = codeBlockVersion_.find(physicalAddress >> SystemBus::WriteWatchShift);
+    return version ? *version : 0;
+}
+
+std::uint32_t CPU::decodeCacheKey() const
+{
+    // The decoding only depends on the CPU model and default operand size, but keep the modes apart
+    return static_cast<std::uint32_t>(cpuModel_) << 16 | (vm86() ? 2 : protectedMode() ? 1 : 0) << 8 | defaultOperandSize();
+}
+
+// Returns the physical address of CS:IP if it can be determined without side effects
+std::optional<std::uint64_t> CPU::instructionPhysicalAddress()
+{
+    std::uint64_t linearAddress;
+    if (cpuModel_ < CPUModel::i80286) {
+        linearAddress = sregs_[SREG_CS] * 16 + ip_;
+    } else {
+        if (ip_ > sdesc_[SREG_CS].limit)
+            return {};
+        linearAddress = sdesc_[SREG_CS].base + ip_;
+    }
+    if (pagingEnabled()) {
+        const auto tlbEntry = tlb_.find(linearAddress);
+        if (!tlbEntry || (cpl() == 3 && !(tlbEntry->value & TLB_MASK_U)))
+            return {};
+        linearAddress = (tlbEntry->value & PT32_MASK_ADDR) + (linearAddress & PAGE_MASK);
+    }
+    return linearAddress & bus_.addressMask();
+}
+
+bool CPU::decodeCacheLookup()
+{
+    const auto physicalAddress = instructionPhysicalAddress();
+    if (!physicalAddress)
+        return false;
+    const auto& e = decodeCache_[*physicalAddress & (DecodeCacheSize - 1)];
+    if (e.physicalAddress != *physicalAddress || e.key != decodeCacheKey())
+        return false;
+    const auto len = e.op.length;
+    if (e.version[0] != codeBlockVersion(*physicalAddress) || e.version[1] != codeBlockVersion(*physicalAddress + len - 1))
+        return false;
+    if (cpuModel_ < CPUModel::i80286 ? (ip_ & 0xffff) + len > 0x10000 : ip_ + len - 1 > sdesc_[SREG_CS].limit)
+        return false;
+
+    ++decodeCacheStats_.hits;
+    loadMicroOp(e.op);
+    bus_.addCycles(e.op.cycles);
+    return true;
+}
+
+void CPU::decodeCacheInsert()
+{
+    ++decodeCacheStats_.misses;
+
+    const auto physicalAddress = instructionPhysicalAddress();
+    const auto len = currentInstruction.numInstructionBytes;
+    if (!physicalAddress || (*physicalAddress & PAGE_MASK) + len > PAGE_SIZE)
+        return;
+    if (cpuModel_ < CPUModel::i80286 && (ip_ & 0xffff) + len > 0x10000)
+        return;
+
+    const auto lastAddress = *physicalAddress + len - 1;
+    codeBlockVersion_.allocate(*physicalAddress >> SystemBus::WriteWatchShift);
+    codeBlockVersion_.allocate(lastAddress >> SystemBus::WriteWatchShift);
+    bus_.watchWrites(*physicalAddress);
+    bus_.watchWrites(lastAddress);
+
+    auto& e = decodeCache_[*physicalAddress & (DecodeCacheSize - 1)];
+    e.physicalAddress = *physicalAddress;
+    e.key = decodeCacheKey();
+    e.version[0] = codeBlockVersion(*physicalAddress);
+    e.version[1] = codeBlockVersion(lastAddress);
+    e.ins = currentInstruction;
+    e.op = currentOp_;
+    e.op.ins = &e.ins;
+}
+
+// Makes op (from the decode or block cache) the current instruction
+void CPU::loadMicroOp(const MicroOp& op)
+{
+    currentInstruction = *op.ins;
+    currentOp_ = op;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block Cache
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void CPU::blockCacheMode(BlockCacheMode mode)
+{
+    blockCacheMode_ = mode;
+    flushDecodeCache();
+}
+
+void CPU::leaveBlock()
+{
+    activeBlock_ = nullptr;
+    recordingBlock_ = nullptr;
+    blockBoundary_ = true;
+}
+
+// Whether the instruction can be followed by another one in the same block, i.e. it doesn't
+// transfer control or change CS, the CPU mode or the paging structures
+static bool ContinuesBlock(const InstructionDecodeResult& ins)
+{
+    for (int i = 0; i < ins.numOperands; ++i) {
+        const auto t = ins.ea[i].type;
+        if ((t == DecodedEAType::sreg && ins.ea[i].regNum == SREG_CS) || t == DecodedEAType::creg || t == DecodedEAType::dreg)
+            return false;
+    }
+
+    switch (ins.instruction->mnemonic) {
+    case InstructionMnem::AAA:
+    case InstructionMnem::AAD:
+    case InstructionMnem::AAM:
+    case InstructionMnem::AAS:
+    case InstructionMnem::ADC:
+    case InstructionMnem::ADD:
+    case InstructionMnem::AND:
+    case InstructionMnem::BSF:
+    case InstructionMnem::BSR:
+    case InstructionMnem::BT:
+    case InstructionMnem::BTC:
+    case InstructionMnem::BTR:
+    case InstructionMnem::BTS:
+    case InstructionMnem::CBW:
+    case InstructionMnem::CDQ:
+    case InstructionMnem::CLC:
+    case InstructionMnem::CLD:
+    case InstructionMnem::CMC:
+    case InstructionMnem::CMP:
+    case InstructionMnem::CMPS:
+    case InstructionMnem::CMPSB:
+    case InstructionMnem::CWD:
+    case InstructionMnem::CWDE:
+    case InstructionMnem::DAA:
+    case InstructionMnem::DAS:
+    case InstructionMnem::DEC:
+    case InstructionMnem::DIV:
+    case InstructionMnem::IDIV:
+    case InstructionMnem::IMUL:
+    case InstructionMnem::INC:
+    case InstructionMnem::LAHF:
+    case InstructionMnem::LDS:
+    case InstructionMnem::LEA:
+    case InstructionMnem::LES:
+    case InstructionMnem::LFS:
+    case InstructionMnem::LGS:
+    case InstructionMnem::LODS:
+    case InstructionMnem::LODSB:
+    case InstructionMnem::LSS:
+    case InstructionMnem::MOV:
+    case InstructionMnem::MOVS:
+    case InstructionMnem::MOVSB:
+    case InstructionMnem::MOVSX:
+    case InstructionMnem::MOVZX:
+    case InstructionMnem::MUL:
+    case InstructionMnem::NEG:
+    case InstructionMnem::NOP:
+    case InstructionMnem::NOT:
+    case InstructionMnem::OR:
+    case InstructionMnem::POP:
+    case InstructionMnem::POPA:
+    case InstructionMnem::PUSH:
+    case InstructionMnem::PUSHA:
+    case InstructionMnem::PUSHF:
+    case InstructionMnem::RCL:
+    case InstructionMnem::RCR:
+    case InstructionMnem::ROL:
+    case InstructionMnem::ROR:
+    case InstructionMnem::SAHF:
+    case InstructionMnem::SAL:
+    case InstructionMnem::SAR:
+    case InstructionMnem::SBB:
+    case InstructionMnem::SCAS:
+    case InstructionMnem::SCASB:
+    case InstructionMnem::SETB:
+    case InstructionMnem::SETBE:
+    case InstructionMnem::SETL:
+    case InstructionMnem::SETLE:
+    case InstructionMnem::SETNB:
+    case InstructionMnem::SETNBE:
+    case InstructionMnem::SETNL:
+    case InstructionMnem::SETNLE:
+    case InstructionMnem::SETNO:
+    case InstructionMnem::SETNP:
+    case InstructionMnem::SETNS:
+    case InstructionMnem::SETNZ:
+    case InstructionMnem::SETO:
+    case InstructionMnem::SETP:
+    case InstructionMnem::SETS:
+    case InstructionMnem::SETZ:
+    case InstructionMnem::SHL:
+    case InstructionMnem::SHLD:
+    case InstructionMnem::SHR:
+    case InstructionMnem::SHRD:
+    case InstructionMnem::STC:
+    case InstructionMnem::STD:
+    case InstructionMnem::STOS:
+    case InstructionMnem::STOSB:
+    case InstructionMnem::SUB:
+    case InstructionMnem::TEST:
+    case InstructionMnem::XCHG:
+    case InstructionMnem::XLAT:
+    case InstructionMnem::XOR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Called at block boundaries (after control transfers, interrupts etc.) to start executing a block,
+// or to count the entries so a block can be recorded once it's hot
+bool CPU::blockCacheLookup()
+{
+    blockBoundary_ = false;
+    if (blockCacheMode_ == BlockCacheMode::off)
+        return false;
+    const auto physicalAddress = instructionPhysicalAddress();
+    if (!physicalAddress)
+        return false;
+
+    auto& b = blockCache_[*physicalAddress & (BlockCacheSize - 1)];
+    const auto key = decodeCacheKey();
+    if (b.physicalAddress != *physicalAddress || b.key != key) {
+        b.physicalAddress = *physicalAddress;
+        b.key = key;
+        b.length = 0;
+        b.entryCount = 0;
+    } else if (b.length) {
+        if (blockValid(b)) {
+            activeBlock_ = &b;
+            activeBlockIndex_ = 0;
+            blockIp_ = ip_;
+            blockCacheNext();
+            return true;
+        }
+        // Stale, record it again
+        b.length = 0;
+    }
+
+    if (blockCacheMode_ == BlockCacheMode::always || ++b.entryCount >= BlockHotCount) {
+        b.instructions.clear();
+        b.decoded.clear();
+        b.decoded.reserve(MaxBlockInstructions);
+        b.native = nullptr;
+        recordingBlock_ = &b;
+        recordedLength_ = 0;
+        blockIp_ = ip_;
+    }
+    return false;
+}
+
+// Whether the recorded block b (found for CS:IP) can still be used
+bool CPU::blockValid(const DecodedBlock& b) const
+{
+    const bool withinLimit = cpuModel_ < CPUModel::i80286 ? (ip_ & 0xffff) + b.length <= 0x10000 : ip_ + b.length - 1 <= sdesc_[SREG_CS].limit;
+    return withinLimit && b.version[0] == codeBlockVersion(b.physicalAddress) && b.version[1] == codeBlockVersion(b.physicalAddress + b.length - 1);
+}
+
+void CPU::blockCacheNext()
+{
+    const auto& e = activeBlock_->instructions[activeBlockIndex_];
+    loadMicroOp(e);
+    ++decodeCacheStats_.blockInstructions;
+    bus_.addCycles(e.cycles);
+    blockIp_ += e.length;
+    if (++activeBlockIndex_ == activeBlock_->instructions.size()) {
+        activeBlock_ = nullptr;
+        blockBoundary_ = true;
+    }
+}
+
+// Called for instructions decoded outside of a block
+void CPU::blockCacheDecoded()
+{
+    if (recordingBlock_)
+        blockCacheRecord();
+    else if (!ContinuesBlock(currentInstruction))
+        blockBoundary_ = true;
+}
+
+// Adds the just decoded instruction to the block being recorded
+void CPU::blockCacheRecord()
+{
+    auto& b = *recordingBlock_;
+    const auto len = currentInstruction.numInstructionBytes;
+    const auto lastAddress = b.physicalAddress + recordedLength_ + len - 1;
+    // Keep blocks physically contiguous (within a page) and inside two write watch blocks
+    const bool fits = ip_ == blockIp_
+        && (b.physicalAddress & PAGE_MASK) + recordedLength_ + len <= PAGE_SIZE
+        && (lastAddress >> SystemBus::WriteWatchShift) - (b.physicalAddress >> SystemBus::WriteWatchShift) <= 1
+        && (cpuModel_ >= CPUModel::i80286 || (ip_ & 0xffff) + len <= 0x10000);
+    if (fits) {
+        b.decoded.push_back(currentInstruction);
+        b.instructions.push_back(currentOp_);
+        b.instructions.back().ins = &b.decoded.back();
+        blockIp_ += len;
+        recordedLength_ += len;
+        if (ContinuesBlock(currentInstruction) && b.instructions.size() < MaxBlockInstructions)
+            return;
+    }
+
+    recordingBlock_ = nullptr;
+    blockBoundary_ = true;
+    if (b.instructions.empty())
+        return;
+
+    b.length = recordedLength_;
+    const auto endAddress = b.physicalAddress + b.length - 1;
+    codeBlockVersion_.allocate(b.physicalAddress >> SystemBus::WriteWatchShift);
+    codeBlockVersion_.allocate(endAddress >> SystemBus::WriteWatchShift);
+    bus_.watchWrites(b.physicalAddress);
+    bus_.watchWrites(endAddress);
+    b.version[0] = codeBlockVersion(b.physicalAddress);
+    b.version[1] = codeBlockVersion(endAddress);
+}
+
+// Runs the recorded block at CS:IP in one go, as native code if it can be compiled and otherwise as
+// a loop over its micro-ops. Returns false if the instruction has to be executed on its own.
+bool CPU::runBlock()
+{
+    if (!decodeCacheEnabled_ || blockCacheMode_ == BlockCacheMode::off || historyMode_ != HistoryMode::off || recordingBlock_)
+        return false;
+    const auto physicalAddress = instructionPhysicalAddress();
+    if (!physicalAddress)
+        return false;
+    auto& b = blockCache_[*physicalAddress & (BlockCacheSize - 1)];
+    if (b.physicalAddress != *physicalAddress || b.key != decodeCacheKey() || !b.length || !blockValid(b))
+        return false;
+
+    lastException_ = ExceptionNone;
+    activeBlock_ = &b; // Cleared (by leaveBlock) if e.g. the code is overwritten
+    std::uint32_t executed = 0;
+    if (const auto native = jitBlock(b)) {
+        executed = native(this);
+        decodeCacheStats_.nativeInstructions += executed;
+    } else {
+        for (const auto& op : b.instructions) {
+            ++executed;
+            if (!blockExecute(op))
+                break;
+        }
+    }
+    leaveBlock();
+    prefetch_.flush(ip_);
+
+    std::uint64_t cycles = 0;
+    for (std::uint32_t i = 0; i < executed; ++i)
+        cycles += b.instructions[i].cycles;
+    bus_.addCycles(cycles);
+    chargeBusAccesses();
+    instructionsExecuted_ += executed;
+    decodeCacheStats_.blockInstructions += executed;
+
+    if (blockException_)
+        std::rethrow_exception(std::exchange(blockException_, nullptr));
+    return true;
+}
+
+// Runs one instruction of the block with IP pointing at it, like step() does. Returns false if the
+// rest of the block must be skipped (exceptions, restarted instructions, the code being modified etc.).
+// Nothing is thrown since it's also called from native code, see blockException_.
+bool CPU::blockExecute(const MicroOp& op)
+{
+    const auto nextIp = ip_ + op.length;
+    intDelay_ = false;
+    currentIp_ = ip_;
+    try {
+        try {
+            try {
+                if (op.compact) {
+                    currentOp_ = op;
+                    ip_ += op.length;
+                    if (cpuModel_ < CPUModel::i80386sx)
+                        ip_ &= 0xffff;
+                    (this->*op.handler)();
+                } else {
+                    loadMicroOp(op);
+                    executeDecoded();
+                }
+            } catch (...) {
+                ip_ = currentIp_;
+                prefetch_.flush(ip_);
+                throw;
+            }
+        } catch (const CPUException& e) {
+            currentInstruction = *op.ins;
+            handleException(e);
+            return false;
+        }
+        if (pendingException_) {
+            ip_ = currentIp_;
+            prefetch_.flush(ip_);
+            const auto e = *pendingException_;
+            pendingException_.reset();
+            currentInstruction = *op.ins;
+            handleException(e);
+            return false;
+        }
+    } catch (...) {
+        blockException_ = std::current_exception();
+        return false;
+    }
+    return ip_ == nextIp && activeBlock_;
+}
+
+// Runs the ops the block compiler doesn't translate, defined here so blockExecute can be inlined
+bool CPU::jitInterpret(CPU* cpu, const MicroOp* op)
+{
+    return cpu->blockExecute(*op);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 // Physical Memory Access
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -718,6 +1416,7 @@ std::uint64_t CPU::toPhysicalAddress(uint64_t linearAddress, std::uint32_t looku
 
 std::uint64_t CPU::readMemLinear(std::uint64_t linearAddress, std::uint8_t size, uint32_t lookupFlags)
 {
+    ++busAccesses_;
     const auto lowBits = (linearAddress & (size - 1));
     if (lowBits == 0)
         return readMemPhysical(toPhysicalAddress(linearAddress, lookupFlags), size);
@@ -733,6 +1432,7 @@ std::uint64_t CPU::readMemLinear(std::uint64_t linearAddress, std::uint8_t size,
 
 void CPU::writeMemLinear(std::uint64_t linearAddress, std::uint64_t value, std::uint8_t size, uint32_t lookupFlags)
 {
+    ++busAccesses_;
     const auto lowBits = (linearAddress & (size - 1));
     lookupFlags |= PL_MASK_W;
     if (lowBits == 0) {
@@ -786,9 +1486,25 @@ std::uint64_t CPU::toLinearAddress(const SegmentedAddress& address, std::uint8_t
     return desc.base + address.offset;
 }
 
+template<typename T>
+static T LoadHost(const std::uint8_t* host)
+{
+    T value;
+    std::memcpy(&value, host, sizeof(T));
+    return value;
+}
+
+template<typename T>
+static void StoreHost(std::uint8_t* host, std::uint64_t value)
+{
+    const auto v = static_cast<T>(value);
+    std::memcpy(host, &v, sizeof(T));
+}
+
 std::uint64_t CPU::readMem(const SegmentedAddress& address, std::uint8_t size)
 {
     if (cpuModel_ <= CPUModel::i8086) {
+        ++busAccesses_;
         const auto phys0 = (sregs_[address.sreg] * 16 + (address.offset & 0xffff)) & 0xfffff;
         if (size == 1)
             return bus_.readU8(phys0);
@@ -799,7 +1515,22 @@ std::uint64_t CPU::readMem(const SegmentedAddress& address, std::uint8_t size)
         return res | bus_.readU8((sregs_[address.sreg] * 16 + ((address.offset + 1) & 0xffff)) & 0xfffff) << 8;
     }
 
-    return readMemLinear(toLinearAddress(address, size, false), size);
+    const auto linearAddress = toLinearAddress(address, size, false);
+    if (size <= 4) {
+        if (const auto e = fastTlbLookup(linearAddress, size, false)) {
+            const auto host = e->host + (linearAddress & PAGE_MASK);
+            ++busAccesses_;
+            switch (size) {
+            case 1:
+                return *host;
+            case 2:
+                return LoadHost<std::uint16_t>(host);
+            case 4:
+                return LoadHost<std::uint32_t>(host);
+            }
+        }
+    }
+    return readMemLinear(linearAddress, size);
 }
 
 std::optional<std::uint64_t> CPU::peekMem(const SegmentedAddress& address, std::uint8_t size)
@@ -810,7 +1541,14 @@ std::optional<std::uint64_t> CPU::peekMem(const SegmentedAddress& address, std::
         for (int i = 0; i < size; ++i) {
             uint64_t physAddress;
             if (cpuModel_ >= CPUModel::i80286) {
-                physAddress = toPhysicalAddress(toLinearAddress(addr, 1, false), PL_FLAG_MASK_PEEK);
+                physAddress = toLinearAddress(addr, 1, false);
+                if (pagingEnabled()) {
+                    std::uint32_t errorCode;
+                    const auto pa = tryPageLookup(physAddress, PL_FLAG_MASK_PEEK, errorCode);
+                    if (!pa)
+                        return {};
+                    physAddress = *pa;
+                }
             } else {
                 physAddress = sregs_[SREG_CS] * 16 + addr.offset;
             }
@@ -823,9 +1561,26 @@ std::optional<std::uint64_t> CPU::peekMem(const SegmentedAddress& address, std::
     }
 }
 
+// Makes sure the pages touched by an access are present (and in the TLB) before any state is modified.
+// Returns false if a page fault is pending instead.
+bool CPU::prepareAccess(const SegmentedAddress& address, std::uint8_t size, bool forWrite)
+{
+    if (!pagingEnabled())
+        return true;
+    const auto linearAddress = toLinearAddress(address, size, forWrite);
+    if ((linearAddress & PAGE_MASK) + size <= PAGE_SIZE && fastTlb_[fastTlbIndex(linearAddress, forWrite)].tag == fastTlbTag(linearAddress))
+        return true;
+    const auto lookupFlags = forWrite ? PL_MASK_W : 0;
+    if (!pagePresent(linearAddress, lookupFlags))
+        return false;
+    const auto lastAddress = linearAddress + size - 1;
+    return !((linearAddress ^ lastAddress) & PT32_MASK_ADDR) || pagePresent(lastAddress, lookupFlags);
+}
+
 void CPU::writeMem(const SegmentedAddress& address, std::uint64_t value, std::uint8_t size)
 {
     if (cpuModel_ <= CPUModel::i8086) {
+        ++busAccesses_;
         const auto phys0 = (sregs_[address.sreg] * 16 + (address.offset & 0xffff)) & 0xfffff;
         if (size == 1) {
             bus_.writeU8(phys0, static_cast<uint8_t>(value));
@@ -841,13 +1596,32 @@ void CPU::writeMem(const SegmentedAddress& address, std::uint64_t value, std::ui
         return;
     }
 
-    writeMemLinear(toLinearAddress(address, size, true), value, size);
+    const auto linearAddress = toLinearAddress(address, size, true);
+    if (size <= 4) {
+        if (const auto e = fastTlbLookup(linearAddress, size, true)) {
+            const auto host = e->host + (linearAddress & PAGE_MASK);
+            bus_.notifyWrite(e->physicalAddress + (linearAddress & PAGE_MASK), size);
+            ++busAccesses_;
+            switch (size) {
+            case 1:
+                *host = static_cast<std::uint8_t>(value);
+                return;
+            case 2:
+                StoreHost<std::uint16_t>(host, value);
+                return;
+            case 4:
+                StoreHost<std::uint32_t>(host, value);
+                return;
+            }
+        }
+    }
+    writeMemLinear(linearAddress, value, size);
 }
 
 Address CPU::readFarPtr(const DecodedEA& addrEa)
 {
     if (addrEa.type == DecodedEAType::rm16 || addrEa.type == DecodedEAType::rm32) {
-        auto addr = calcAddress(addrEa);
+        auto addr = calcAddress();
         const auto offset = readMem(addr, currentInstruction.operandSize);
         addr.offset += currentInstruction.operandSize;
         addr.offset &= currentInstruction.addressMask();
@@ -858,96 +1632,186 @@ Address CPU::readFarPtr(const DecodedEA& addrEa)
     }
 }
 
-SegmentedAddress CPU::calcAddressNoMask(const DecodedEA& ea) const
+CPU::AddressFormula CPU::lowerAddress() const
 {
-    std::uint64_t offset = 0;
-    SReg segment = SREG_DS;
+    constexpr std::uint8_t NoReg = 0; // Unused registers have a zero mask
+    AddressFormula f { .disp = 0, .offsetMask = UINT64_MAX, .addressMask = UINT64_MAX, .baseMask = 0, .indexMask = 0, .base = NoReg, .index = NoReg, .scale = 0, .sreg = SREG_DS };
+    auto setBase = [&f](std::uint8_t reg, std::uint32_t mask) {
+        f.base = reg;
+        f.baseMask = mask;
+    };
+    auto setIndex = [&f](std::uint8_t reg, std::uint32_t mask, std::uint8_t scale) {
+        f.index = reg;
+        f.indexMask = mask;
+        f.scale = scale;
+    };
+
+    const DecodedEA* eaPtr = nullptr;
+    for (int i = 0; i < currentInstruction.numOperands && !eaPtr; ++i) {
+        const auto t = currentInstruction.ea[i].type;
+        if (t == DecodedEAType::mem16 || t == DecodedEAType::mem32 || t == DecodedEAType::rm16 || t == DecodedEAType::rm32)
+            eaPtr = &currentInstruction.ea[i];
+    }
+    if (!eaPtr)
+        return f;
+    const auto& ea = *eaPtr;
 
     if (ea.type == DecodedEAType::mem16) {
-        offset = ea.address & 0xffff;
+        f.disp = ea.address & 0xffff;
     } else if (ea.type == DecodedEAType::mem32) {
-        offset = ea.address & 0xffffffff;
+        f.disp = ea.address & 0xffffffff;
     } else {
-        assert(ea.type == DecodedEAType::rm16 || ea.type == DecodedEAType::rm32);
         const auto mod = ModrmMod(ea.rm);
         const auto rm = ModrmRm(ea.rm);
         assert(mod != 0b11);
 
         if (ea.type == DecodedEAType::rm16) {
+            f.addressMask = 0xffff;
             if (mod == 0b00 && rm == 0b110) {
-                offset = ea.disp & 0xffff;
+                f.disp = ea.disp & 0xffff;
             } else {
                 // const char* const Rm16Text[8] = { "BX+SI", "BX+DI", "BP+SI", "BP+DI", "SI", "DI", "BP", "BX" };
                 constexpr Reg baseReg[8] = { REG_BX, REG_BX, REG_BP, REG_BP, REG_SI, REG_DI, REG_BP, REG_BX };
                 constexpr Reg indexReg[4] = { REG_SI, REG_DI, REG_SI, REG_DI };
                 if (baseReg[rm] == REG_BP)
-                    segment = SREG_SS;
-                offset = GetU16(regs_[baseReg[rm]]);
+                    f.sreg = SREG_SS;
+                setBase(baseReg[rm], 0xffff);
                 if (rm < 4)
-                    offset += GetU16(regs_[indexReg[rm]]);
+                    setIndex(indexReg[rm], 0xffff, 0);
                 if (mod == 0b01)
-                    offset += static_cast<int8_t>(ea.disp & 0xff);
+                    f.disp = static_cast<int8_t>(ea.disp & 0xff);
                 else if (mod == 0b10)
-                    offset += static_cast<int16_t>(ea.disp & 0xffff);
+                    f.disp = static_cast<int16_t>(ea.disp & 0xffff);
             }
-        } else if (ea.type == DecodedEAType::rm32) {
+        } else {
+            f.offsetMask = 0xffffffff;
             if (rm == REG_SP) {
                 assert(Modrm32HasSib(ea.rm));
                 // SIB
-                const auto scale = (ea.sib >> 6) & 3;
-                const auto index = (ea.sib >> 3) & 7;
-                const auto base = ea.sib & 7;
+                const auto scale = static_cast<std::uint8_t>((ea.sib >> 6) & 3);
+                const auto index = static_cast<std::uint8_t>((ea.sib >> 3) & 7);
+                const auto base = static_cast<std::uint8_t>(ea.sib & 7);
 
-                uint64_t indexVal = 0;
+                bool scaledBase = false;
                 if (index != REG_SP) {
-                    indexVal = regs_[index] << scale;
+                    setIndex(index, 0xffffffff, scale);
                 } else if (scale && cpuModel_ < CPUModel::i80586 && !(base == REG_BP && mod == 0b00)) {
                     // Undocumented 80386/80486 behavior - ss > 0 and "no index" => base is scaled by scale
                     // But not when there is no base register (disp32 only)
-                    indexVal = (regs_[base] << scale) - regs_[base];
+                    setIndex(base, 0xffffffff, scale);
+                    scaledBase = true;
                 }
                 if (base == REG_BP && mod == 0b00) {
                     // disp32 rather than base register
-                    offset = ea.disp + indexVal;
+                    f.disp = ea.disp;
                 } else {
                     if (base == REG_BP || base == REG_SP)
-                        segment = SREG_SS;
-                    offset = regs_[base] + indexVal;
+                        f.sreg = SREG_SS;
+                    if (!scaledBase)
+                        setBase(base, 0xffffffff);
                 }
             } else if (rm == REG_BP) {
                 assert(!Modrm32HasSib(ea.rm));
                 if (mod != 0b00) {
-                    offset = regs_[REG_BP];
-                    segment = SREG_SS;
+                    setBase(REG_BP, 0xffffffff);
+                    f.sreg = SREG_SS;
                 } else {
-                    offset = ea.disp; // [disp32]
+                    f.disp = ea.disp; // [disp32]
                 }
             } else {
                 assert(!Modrm32HasSib(ea.rm));
-                offset = regs_[rm];
+                setBase(rm, 0xffffffff);
             }
             if (mod == 0b01)
-                offset += static_cast<int8_t>(ea.disp & 0xff);
+                f.disp += static_cast<int8_t>(ea.disp & 0xff);
             else if (mod == 0b10)
-                offset += static_cast<int32_t>(ea.disp & 0xffffffff);
-            offset &= 0xffffffff;
-        } else {
-            throw std::runtime_error { "calcAddress " + std::string(DecodedEATypeText(ea.type)) };
+                f.disp += static_cast<int32_t>(ea.disp & 0xffffffff);
         }
+    }
+
+    if (currentInstruction.prefixes & PREFIX_SEG_MASK) {
+        f.sreg = static_cast<SReg>(((currentInstruction.prefixes & PREFIX_SEG_MASK) >> PREFIX_SEG_SHIFT) - 1);
+    }
+    return f;
+}
 
+// Execution cost (on top of the fetch and the memory accesses) of the instructions that take noticeably
+// longer than the rest. Rough figures, guest timing only needs to be plausible and reproducible.
+static constexpr std::uint32_t InstructionCycles(InstructionMnem mnemonic)
+{
+    switch (mnemonic) {
+    case InstructionMnem::MUL:
+    case InstructionMnem::IMUL:
+    case InstructionMnem::AAM:
+        return 8;
+    case InstructionMnem::DIV:
+    case InstructionMnem::IDIV:
+        return 16;
+    case InstructionMnem::AAD:
+    case InstructionMnem::ENTER:
+    case InstructionMnem::CALLF:
+    case InstructionMnem::JMPF:
+    case InstructionMnem::RETF:
+    case InstructionMnem::INT:
+    case InstructionMnem::INT1:
+    case InstructionMnem::INT3:
+    case InstructionMnem::INTO:
+    case InstructionMnem::IRET:
+        return 4;
+    default:
+        return 0;
     }
+}
 
-    if (currentInstruction.prefixes & PREFIX_SEG_MASK) {
-        segment = static_cast<SReg>(((currentInstruction.prefixes & PREFIX_SEG_MASK) >> PREFIX_SEG_SHIFT) - 1);
+// Lowers currentInstruction into currentOp_
+void CPU::lowerInstruction()
+{
+    const auto& ins = currentInstruction;
+    std::uint64_t imm = 0;
+    for (int i = 0; i < ins.numOperands; ++i) {
+        const auto t = ins.ea[i].type;
+        if (t == DecodedEAType::imm8 || t == DecodedEAType::rel8) {
+            imm = SignExtend(ins.ea[i].immediate, 1);
+            break;
+        } else if (t == DecodedEAType::imm16 || t == DecodedEAType::rel16) {
+            imm = SignExtend(ins.ea[i].immediate, 2);
+            break;
+        } else if (t == DecodedEAType::imm32 || t == DecodedEAType::rel32) {
+            imm = SignExtend(ins.ea[i].immediate, 4);
+            break;
+        }
     }
-    return SegmentedAddress { segment, offset };
+
+    auto& op = currentOp_;
+    op.handler = resolveHandler(op.compact);
+    op.compact = op.compact && !(ins.prefixes & PREFIX_LOCK);
+    op.address = lowerAddress();
+    op.imm = imm;
+    op.ins = &currentInstruction;
+    op.dst = ins.ea[0].regNum; // Only used for register operands
+    op.src = ins.ea[1].regNum;
+    op.size = ins.operationSize;
+    op.length = ins.numInstructionBytes;
+    op.cycles = static_cast<std::uint8_t>(op.length + InstructionCycles(ins.mnemoic));
+}
+
+void CPU::checkMemoryOperand(const DecodedEA& ea) const
+{
+    if (!EAIsMemory(ea.type) || ea.type == DecodedEAType::abs16_16 || ea.type == DecodedEAType::abs16_32)
+        throw std::runtime_error { "calcAddress " + std::string(DecodedEATypeText(ea.type)) };
 }
 
-SegmentedAddress CPU::calcAddress(const DecodedEA& ea) const
+SegmentedAddress CPU::calcAddressNoMask() const
 {
-    auto sa = calcAddressNoMask(ea);
-    if (ea.type == DecodedEAType::rm16)
-        sa.offset &= 0xffff;
+    const auto& f = currentOp_.address;
+    const auto offset = f.disp + (regs_[f.base] & f.baseMask) + ((regs_[f.index] & f.indexMask) << f.scale);
+    return SegmentedAddress { f.sreg, offset & f.offsetMask };
+}
+
+SegmentedAddress CPU::calcAddress() const
+{
+    auto sa = calcAddressNoMask();
+    sa.offset &= currentOp_.address.addressMask;
     return sa;
 }
 
@@ -999,7 +1863,7 @@ std::uint64_t CPU::readEA(int index)
     case DecodedEAType::rm32:
     case DecodedEAType::mem16:
     case DecodedEAType::mem32:
-        return readMem(calcAddress(ea), currentInstruction.operandSize);
+        return readMem(calcAddress(), currentInstruction.operandSize);
     default:
         throw std::runtime_error { std::string("TODO: readEA ") + DecodedEATypeText(ea.type) };
     }
@@ -1046,7 +1910,7 @@ void CPU::writeEA(int index, std::uint64_t value)
     case DecodedEAType::creg:
         assert(currentInstruction.operationSize == 4);
         assert(ea.regNum < 8);
-        //std::print("Write to CR{} value=0x{:08X}\n", ea.regNum, value);
+        //bus_.log().print("Write to CR{} value=0x{:08X}\n", ea.regNum, value);
         if (!(VALID_CR_MASK & (1U << ea.regNum)))
             THROW_UD("Warning: Write to Invalid CR{} value=0x{:08X}", ea.regNum, value);
 //        if (ea.regNum == 0 && pagingEnabled() && !(value >> 31))
@@ -1057,7 +1921,7 @@ void CPU::writeEA(int index, std::uint64_t value)
         assert(currentInstruction.operationSize == 4);
         assert(ea.regNum < 8);
         dregs_[ea.regNum] = value;
-        std::println("{} - Warning ignoring write to DR{} value {:08X}", IP_PREFIX(), ea.regNum, value);
+        bus_.log().println("{} - Warning ignoring write to DR{} value {:08X}", IP_PREFIX(), ea.regNum, value);
         if (ea.regNum == 7 && (value & 0xff))
             THROW_FLIPFLOP();
         break;
@@ -1065,15 +1929,58 @@ void CPU::writeEA(int index, std::uint64_t value)
     case DecodedEAType::rm32:
     case DecodedEAType::mem16:
     case DecodedEAType::mem32:
-        writeMem(calcAddress(ea), value, currentInstruction.operandSize);
+        writeMem(calcAddress(), value, currentInstruction.operandSize);
         break;
     default:
         throw std::runtime_error { std::string("TODO: writeEA ") + DecodedEATypeText(ea.type) + " value " + HexString(value, currentInstruction.operationSize * 2) };
     }
 }
 
+template<std::uint8_t Size>
+std::uint64_t CPU::readReg(std::uint8_t regNum) const
+{
+    assert(regNum < 8);
+    if constexpr (Size == 1)
+        return regNum & 4 ? GetU8H(regs_[regNum & 3]) : GetU8L(regs_[regNum & 3]);
+    else if constexpr (Size == 2)
+        return GetU16(regs_[regNum]);
+    else
+        return GetU32(regs_[regNum]);
+}
+
+template<std::uint8_t Size>
+void CPU::writeReg(std::uint8_t regNum, std::uint64_t value)
+{
+    assert(regNum < 8);
+    if constexpr (Size == 1) {
+        if (regNum & 4)
+            UpdateU8H(regs_[regNum & 3], value);
+        else
+            UpdateU8L(regs_[regNum & 3], value);
+    } else if constexpr (Size == 2) {
+        UpdateU16(regs_[regNum], value);
+    } else {
+        UpdateU32(regs_[regNum], value);
+    }
+}
+
+// Reads the second operand of the current micro-op, with its kind and size known up front
+template<std::uint8_t Size, CPU::OperandKind Kind>
+std::uint64_t CPU::readSource()
+{
+    if constexpr (Kind == OperandKind::reg)
+        return readReg<Size>(currentOp_.src);
+    else if constexpr (Kind == OperandKind::mem)
+        return readMem(calcAddress(), Size);
+    else {
+        static_assert(Kind == OperandKind::imm8 || Kind == OperandKind::imm);
+        return currentOp_.imm;
+    }
+}
+
 void CPU::setFlags(std::uint32_t value)
 {
+    lazyFlags_.mask = 0;
     flags_ = value;
     if (cpuModel_ < CPUModel::i80386sx) {
         flags_ &= 0xffff - 0x28;
@@ -1106,40 +2013,39 @@ uint32_t CPU::filterFlags(std::uint32_t flags, bool op16bit)
 
 void CPU::updateFlags(std::uint64_t value, std::uint64_t carry, std::uint32_t flagsMask)
 {
-    uint64_t msbMask;
-    switch (currentInstruction.operationSize) {
+    switch (currentOp_.size) {
     case 1:
-        value &= 0xff;
-        msbMask = 0x80;
+        updateFlags<1>(value, carry, flagsMask);
         break;
     case 2:
-        value &= 0xffff;
-        msbMask = 0x8000;
+        updateFlags<2>(value, carry, flagsMask);
         break;
     case 4:
-        value &= 0xffffffff;
-        msbMask = 0x80000000;
+        updateFlags<4>(value, carry, flagsMask);
         break;
     default:
         assert(false);
-        throw std::runtime_error { "Invalid result size " + std::to_string(currentInstruction.operationSize) };
-    }
-
-    std::uint32_t flags = 0;
-    if (carry & msbMask)
-        flags |= EFLAGS_MASK_CF;
-    if ((flagsMask & EFLAGS_MASK_PF) && Parity(static_cast<uint8_t>(value)))
-        flags |= EFLAGS_MASK_PF;
-    if (carry & (1 << 3))
-        flags |= EFLAGS_MASK_AF;
-    if (!value)
-        flags |= EFLAGS_MASK_ZF;
-    if (value & msbMask)
-        flags |= EFLAGS_MASK_SF;
-    // TODO: Check if overflow is correct
-    if (((carry << 1) ^ carry) & msbMask)
-        flags |= EFLAGS_MASK_OF;
-    flags_ = (flags_ & ~flagsMask) | (flags & flagsMask);
+        throw std::runtime_error { "Invalid result size " + std::to_string(currentOp_.size) };
+    }
+}
+
+// The flags aren't calculated until needed, just record the result of the operation
+template<std::uint8_t Size>
+void CPU::updateFlags(std::uint64_t value, std::uint64_t carry, std::uint32_t flagsMask)
+{
+    // Flags still pending from the previous operation that this one doesn't replace
+    if (lazyFlags_.mask & ~flagsMask)
+        materializeFlags();
+    lazyFlags_.result = value;
+    lazyFlags_.carry = carry;
+    lazyFlags_.mask = flagsMask;
+    lazyFlags_.size = Size;
+}
+
+void CPU::materializeFlags()
+{
+    flags_ = EvalLazyFlags(flags_, lazyFlags_, lazyFlags_.mask);
+    lazyFlags_.mask = 0;
 }
 
 std::uint64_t CPU::readStack(std::int32_t itemOffset)
@@ -1185,7 +2091,7 @@ std::uint64_t CPU::pop(std::uint8_t size)
 
 void CPU::showState(const CPUState& state, const uint8_t* instructionBytes)
 {
-    ShowCPUState(state);
+    ShowCPUState(state, bus_.log());
     auto pc = Address { state.sregs_[SREG_CS], state.ip_, state.defaultOperandSize() };
     try {
         int64_t offset = 0;
@@ -1196,32 +2102,103 @@ void CPU::showState(const CPUState& state, const uint8_t* instructionBytes)
             return uint8_t(b ? *b : 0xCC);
         };
         const auto res = Decode(CPUInfo { cpuModel_, state.defaultOperandSize() }, fetch);
-        std::print("{}\n", FormatDecodedInstructionFull(res, pc));
+        bus_.log().print("{}\n", FormatDecodedInstructionFull(res, pc));
     } catch (const std::exception& e) {
-        std::print("{} {}\n", pc, e.what());
+        bus_.log().print("{} {}\n", pc, e.what());
     }
 }
 
 void CPU::trace()
 {
+    flags();
     showState(*this, nullptr);
 }
 
 void CPU::clearHistory()
 {
-    instructionsExecuted_ = 0;
+    historyCount_ = 0;
+    lastException_ = ExceptionNone;
+}
+
+void CPU::historyMode(HistoryMode mode)
+{
+    historyMode_ = mode;
+    historyCount_ = 0;
+    if (mode == HistoryMode::off) {
+        history_.clear();
+        history_.shrink_to_fit();
+    } else {
+        history_.resize(MaxHistory);
+    }
+    if (mode == HistoryMode::full) {
+        historyState_.resize(MaxHistory);
+    } else {
+        historyState_.clear();
+        historyState_.shrink_to_fit();
+    }
+}
+
+void CPU::recordHistory(HistoryEntry& entry) const
+{
+    entry.ip = ip_;
+    for (int i = 0; i < 8; ++i)
+        entry.regs[i] = static_cast<std::uint32_t>(regs_[i]);
+    std::memcpy(entry.sregs, sregs_, sizeof(entry.sregs));
+    entry.defaultOperandSize = defaultOperandSize();
+    entry.flags = flags_;
+    entry.lazyFlags = lazyFlags_;
+    entry.exception = ExceptionNone;
+}
+
+void CPU::showHistoryEntry(const HistoryEntry& entry, const HistoryEntry& after)
+{
+    const auto pc = Address { entry.sregs[SREG_CS], entry.ip, entry.defaultOperandSize };
+    std::string text;
+    try {
+        const auto res = Decode(CPUInfo { cpuModel_, entry.defaultOperandSize }, std::span<const std::uint8_t> { entry.instructionBytes });
+        text = FormatDecodedInstructionFull(res, pc);
+    } catch (const std::exception& e) {
+        text = std::format("{} {}", pc, e.what());
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (entry.regs[i] != after.regs[i])
+            text += std::format(" {}={:08X}", Reg32Text[i], after.regs[i]);
+    }
+    for (int i = 0; i < 6; ++i) {
+        if (entry.sregs[i] != after.sregs[i] && i != SREG_CS)
+            text += std::format(" {}={:04X}", SRegText[i], after.sregs[i]);
+    }
+    const auto flagsBefore = EvalLazyFlags(entry.flags, entry.lazyFlags, entry.lazyFlags.mask);
+    const auto flagsAfter = EvalLazyFlags(after.flags, after.lazyFlags, after.lazyFlags.mask);
+    if (flagsBefore != flagsAfter)
+        text += std::format(" flags={}", FormatCPUFlags(flagsAfter));
+    bus_.log().println("{}", text);
 }
 
 void CPU::showHistory(size_t max)
 {
-    if (max > instructionsExecuted_)
-        max = instructionsExecuted_;
+    if (historyMode_ == HistoryMode::off) {
+        bus_.log().println("History disabled");
+        return;
+    }
 
-    for (size_t i = instructionsExecuted_ - max; i < instructionsExecuted_; ++i) {
+    const auto count = std::min(historyCount_, MaxHistory);
+    if (max > count)
+        max = count;
+
+    HistoryEntry current;
+    recordHistory(current);
+    for (size_t i = historyCount_ - max; i < historyCount_; ++i) {
         auto& history = history_[i % MaxHistory];
-        showState(history.state, history.instructionBytes);
+        if (historyMode_ == HistoryMode::full) {
+            auto& state = historyState_[i % MaxHistory];
+            state.flags_ = EvalLazyFlags(history.flags, history.lazyFlags, history.lazyFlags.mask);
+            showState(state, history.instructionBytes);
+        } else {
+            showHistoryEntry(history, i + 1 < historyCount_ ? history_[(i + 1) % MaxHistory] : current);
+        }
         if (history.exception != ExceptionNone) {
-            std::println("*** {} ***", FormatExceptionNumber(history.exception));
+            bus_.log().println("*** {} ***", FormatExceptionNumber(history.exception));
         }
     }
 }
@@ -1238,16 +2215,17 @@ SegmentedAddress CPU::currentSp() const
 
 int CPU::lastExceptionNo() const
 {
-    if (!instructionsExecuted_)
-        return -1;
-    return history_[(instructionsExecuted_ - 1) % MaxHistory].exception;
+    return lastException_;
 }
 
 void CPU::step()
 {
+    // Let the devices catch up with the cycles used by the previous instruction
+    bus_.sync();
+
     // XXX: Reconsider
     // TODO: Double fault
-    if ((flags_ & EFLAGS_MASK_IF) && intFunc_ && !intDelay_) {
+    if (intPending_ && (flags_ & EFLAGS_MASK_IF) && !intDelay_ && intFunc_) {
         int interrupt = intFunc_();
         if (interrupt >= 0) {
             halted_ = false;
@@ -1257,46 +2235,85 @@ void CPU::step()
     intDelay_ = false;
 
     if (halted_) {
-        bus_.addCycles(1);
+        // Nothing happens until an interrupt arrives, so skip ahead to the next device event
+        bus_.idle(SysClockFreqHz / 1000);
         return;
     }
 
-    auto& history = history_[instructionsExecuted_++ % MaxHistory];
-    std::memcpy(&history.state, &static_cast<const CPUState&>(*this), sizeof(CPUState));
-    history.exception = ExceptionNone;
+    // A whole block at a time, interrupts are checked between blocks
+    if (jitEnabled_ && blockBoundary_ && runBlock())
+        return;
+
+    HistoryEntry* history = nullptr;
+    if (historyMode_ != HistoryMode::off) {
+        const auto index = historyCount_++ % MaxHistory;
+        history = &history_[index];
+        recordHistory(*history);
+        if (historyMode_ == HistoryMode::full)
+            std::memcpy(&historyState_[index], &static_cast<const CPUState&>(*this), sizeof(CPUState));
+    }
+    ++instructionsExecuted_;
+    lastException_ = ExceptionNone;
     currentInstruction.numInstructionBytes = 0;
     currentIp_ = ip_;
     try {
         try {
             doStep();
-            memcpy(history.instructionBytes, currentInstruction.instructionBytes, currentInstruction.numInstructionBytes);
+            if (history)
+                memcpy(history->instructionBytes, currentInstruction.instructionBytes, currentInstruction.numInstructionBytes);
         } catch (...) {
             // Move back....
             ip_ = currentIp_;
             prefetch_.flush(ip_);
-            memcpy(history.instructionBytes, currentInstruction.instructionBytes, currentInstruction.numInstructionBytes);
+            if (history)
+                memcpy(history->instructionBytes, currentInstruction.instructionBytes, currentInstruction.numInstructionBytes);
             throw;
         }
     } catch (const CPUException& e) {
-        const auto exceptionNo = static_cast<std::uint8_t>(e.exceptionNo());
+        handleException(e);
+        chargeBusAccesses();
+        return;
+    }
+
+    if (pendingException_) {
+        ip_ = currentIp_;
+        prefetch_.flush(ip_);
+        const auto e = *pendingException_;
+        pendingException_.reset();
+        handleException(e);
+    }
+    chargeBusAccesses();
+}
 
-        if ((1 << exceptionNo) & exceptionTraceMask_)
-            std::print("{} - {}, SS:ESP = {:04X}:{:04X}\n", currentIp(), e.what(), sregs_[SREG_SS], regs_[REG_SP]);
+// Faults that are detected before any state has been modified can be raised this way
+// instead of being thrown. The instruction handler must return right away.
+void CPU::raiseException(CPUExceptionNumber exceptionNo, std::uint32_t errorCode)
+{
+    assert(!pendingException_);
+    pendingException_.emplace(exceptionNo, errorCode);
+}
 
-        if (exceptionNo == CPUExceptionNumber::DivisionError) {
-            if (cpuModel_ == CPUModel::i8088) {
-                // On the 8088 specifically, the return address pushed to the stack on divide exception is the address of the next instruction. (From SingleStepTests)
-                ip_ = (ip_ + currentInstruction.numInstructionBytes) & 0xffff;
-                prefetch_.flush(ip_);
-            }
+void CPU::handleException(const CPUException& e)
+{
+    const auto exceptionNo = static_cast<std::uint8_t>(e.exceptionNo());
+
+    if ((1 << exceptionNo) & exceptionTraceMask_)
+        bus_.log().print("{} - {}, SS:ESP = {:04X}:{:04X}\n", currentIp(), e.what(), sregs_[SREG_SS], regs_[REG_SP]);
+
+    if (exceptionNo == CPUExceptionNumber::DivisionError) {
+        if (cpuModel_ == CPUModel::i8088) {
+            // On the 8088 specifically, the return address pushed to the stack on divide exception is the address of the next instruction. (From SingleStepTests)
+            ip_ = (ip_ + currentInstruction.numInstructionBytes) & 0xffff;
+            prefetch_.flush(ip_);
         }
-        doInterrupt(exceptionNo | ExceptionTypeCPU, e.hasErrorCode() ? e.errorCode() : 0);
     }
+    doInterrupt(exceptionNo | ExceptionTypeCPU, e.hasErrorCode() ? e.errorCode() : 0);
 }
 
 void CPU::changeCpl(uint8_t newCpl)
 {
     sdesc_[SREG_CS].setDpl(newCpl);
+    flushFetchWindow();
 }
 
 constexpr uint32_t TSS16_SP0_OFFSET = 0x02;
@@ -1439,7 +2456,7 @@ void CPU::showControlTransferHistory(size_t max)
 
     for (size_t i = controlTransferHistoryCount_ - max; i < controlTransferHistoryCount_; ++i) {
         const auto& history = controlTransferHistory_[i % maxControlTransferHistory];
-        std::println("{} {} {} {}", history.addr, history.ins, history.destination, history.count);
+        bus_.log().println("{} {} {} {}", history.addr, history.ins, history.destination, history.count);
     }
 }
 
@@ -1486,6 +2503,8 @@ void CPU::loadSreg(SReg sr, std::uint16_t value)
         sdesc_[sr].base = static_cast<uint64_t>(value) << 4;
     }
     sregs_[sr] = value;
+    if (sr == SREG_CS)
+        flushFetchWindow();
 }
 
 void CPU::setCreg(std::uint8_t index, std::uint32_t value)
@@ -1497,8 +2516,10 @@ void CPU::setCreg(std::uint8_t index, std::uint32_t value)
         const auto change = cregs_[index] ^ value;
         if (change & CR0_MASK_PG)
             flushTLB();
+        else if (change)
+            flushFastTLB(); // Write protect
         //if (change & (CR0_MASK_PE | CR0_MASK_PG))
-        //    std::println("{}CR0 = {:08X} PE={} PG={}", IP_PREFIX(), value, value & CR0_MASK_PE ? "enabled" : "disabled", value & CR0_MASK_PG ? "enabled" : "disabled");
+        //    bus_.log().println("{}CR0 = {:08X} PE={} PG={}", IP_PREFIX(), value, value & CR0_MASK_PE ? "enabled" : "disabled", value & CR0_MASK_PG ? "enabled" : "disabled");
     }
     cregs_[index] = value;
     if (index == 3)
@@ -1517,7 +2538,7 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
 
     const auto oldCS = sregs_[SREG_CS];
     const auto oldIP = ip_;
-    const auto oldFlags = flags_;
+    const auto oldFlags = flags();
 
     auto saveRegs = [&]() {
         switch (type) {
@@ -1548,6 +2569,7 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
         sdesc_[SREG_CS].setRealModeCode(cs);
         if (vm86())
             sdesc_[SREG_CS].setDpl(3);
+        flushFetchWindow();
         ip_ = ip & ipMask();
         prefetch_.flush(ip_);
         return;
@@ -1576,10 +2598,10 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
 
             const auto newCpl = desc.dpl();
             if (newCpl < cpl()) {
-                //std::print("INT: Stack switch CPL {} -> {}\n", cpl(), newCpl);
+                //bus_.log().print("INT: Stack switch CPL {} -> {}\n", cpl(), newCpl);
                 tssRestoreStack(newCpl, fromVM86, opSize); // Lowers CPL and pushes SS:ESP, handles pushing/clearing registers in V86 mode
             } else {
-                //std::print("INT: CPL {} -> {}\n", cpl(), newCpl);
+                //bus_.log().print("INT: CPL {} -> {}\n", cpl(), newCpl);
                 cs = (cs & ~DESC_MASK_DPL) | newCpl;
             }
         } else if (type != ControlTransferType::iret) { // For IRET checks have already been performed
@@ -1627,7 +2649,7 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
             const auto oldStackMask = stackMask();
             const auto oldSP = regs_[REG_SP];
 
-            // std::print("Switching stack on call gate transition from {} to {}\n", cpl(), newCpl);
+            // bus_.log().print("Switching stack on call gate transition from {} to {}\n", cpl(), newCpl);
             tssRestoreStack(newCpl, false, opSize); // Also pushes SS:ESP
 
         // Transfer parameters
@@ -1637,7 +2659,7 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
             }
         }
 
-        //std::print("Using call descriptor:\n{}\n{}\n", desc, codeDesc);
+        //bus_.log().print("Using call descriptor:\n{}\n{}\n", desc, codeDesc);
 
 
         cs = desc.call32.selector;
@@ -1648,6 +2670,7 @@ void CPU::doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferT
     saveRegs();
     sregs_[SREG_CS] = cs;
     sdesc_[SREG_CS] = desc;
+    flushFetchWindow();
     ip_ = ip & ipMask();
     prefetch_.flush(ip_);
 }
@@ -1757,7 +2780,7 @@ void CPU::doInterruptReturn()
     }
 
     //if (flags & EFLAGS_MASK_NT)
-    //    std::println("TODO: IRET with nested task LTR={:04X}", taskIndex_);
+    //    bus_.log().println("TODO: IRET with nested task LTR={:04X}", taskIndex_);
 
     uint8_t requestedPL = static_cast<uint8_t>(cs & DESC_MASK_DPL);
 
@@ -1777,7 +2800,7 @@ void CPU::doInterruptReturn()
     if (requestedPL > cpl()) {
         // RETURN-TO-OUTER-PRIVILEGE-LEVEL
 
-        //std::print("IRET: Stack switch on {} -> {} transition\n", cpl(), (cs & DESC_MASK_DPL));
+        //bus_.log().print("IRET: Stack switch on {} -> {} transition\n", cpl(), (cs & DESC_MASK_DPL));
 
         // pop before changing privilege level
         const auto opSize = currentInstruction.operandSize;
@@ -1791,6 +2814,7 @@ void CPU::doInterruptReturn()
             sdesc_[SREG_CS].setRealModeCode(cs);
             sdesc_[SREG_CS].setDpl(requestedPL);
             sregs_[SREG_CS] = cs;
+            flushFetchWindow();
             ip_ = ip;
             prefetch_.flush(ip_);
         } else {
@@ -1839,7 +2863,10 @@ void CPU::doInterrupt(int interrupt, std::uint32_t errorCode)
     const auto interruptNo = static_cast<std::uint8_t>(interrupt);
     const bool hardwareInterrupt = (interrupt & ExceptionTypeMask) != ExceptionTypeSW;
 
-    history_[(instructionsExecuted_ - 1) % MaxHistory].exception = interrupt;
+    lastException_ = interrupt;
+    if (historyMode_ != HistoryMode::off)
+        history_[(historyCount_ - 1) % MaxHistory].exception = interrupt;
+    leaveBlock();
 
     if (protectedMode()) {
         if (interruptNo * 8 - 1 > idt_.limit)
@@ -1882,10 +2909,138 @@ void CPU::doInterrupt(int interrupt, std::uint32_t errorCode)
         if (interruptNo * 4 - 1 > idt_.limit)
             THROW_GP(0, "Interrupt {} over limit {}", interruptNo, idt_.limit);
         const auto addr = readMemPhysical(static_cast<uint64_t>(interruptNo) << 2, 4);
+        ++busAccesses_;
         doControlTransfer(static_cast<uint16_t>(addr >> 16), addr & 0xffff, ControlTransferType::int16);
     }
 }
 
+// Executes as many iterations of REP MOVS/STOS/SCAS/CMPS as possible directly on host memory.
+// Only elements that are in RAM, within the current page and inside the segment limit are handled
+// here, everything else (MMIO, page crossings, faults) is left to the element by element loop.
+// Returns false if no iterations were done.
+template <InstructionMnem Ins>
+bool CPU::bulkStringInstruction(SReg ds)
+{
+    constexpr bool usesSI = Ins == InstructionMnem::MOVS || Ins == InstructionMnem::CMPS;
+    constexpr bool usesDI = usesSI || Ins == InstructionMnem::STOS || Ins == InstructionMnem::SCAS;
+    constexpr bool isWrite = Ins == InstructionMnem::MOVS || Ins == InstructionMnem::STOS;
+
+    if (!usesDI || cpuModel_ < CPUModel::i80286 || (flags_ & EFLAGS_MASK_DF))
+        return false;
+
+    const auto opSize = currentInstruction.operationSize;
+    const auto addrSize = currentInstruction.addressSize;
+    const auto mask = currentInstruction.addressMask();
+    auto count = Get(regs_[REG_CX], addrSize);
+
+    auto load = [opSize](const std::uint8_t* host) -> std::uint64_t {
+        switch (opSize) {
+        case 1:
+            return *host;
+        case 2:
+            return LoadHost<std::uint16_t>(host);
+        default:
+            return LoadHost<std::uint32_t>(host);
+        }
+    };
+    auto store = [opSize](std::uint8_t* host, std::uint64_t value) {
+        switch (opSize) {
+        case 1:
+            *host = static_cast<std::uint8_t>(value);
+            break;
+        case 2:
+            StoreHost<std::uint16_t>(host, value);
+            break;
+        default:
+            StoreHost<std::uint32_t>(host, value);
+        }
+    };
+
+    // The first element is accessed like readMem/writeMem would, so a fault is raised for the right address.
+    // With two operands the element loop reads SI before DI faults, so DI has to be usable up front (it's
+    // only left to page faults and the limit since an iteration has already completed).
+    struct Pointer {
+        std::uint8_t* host;
+        std::uint64_t physicalAddress;
+    };
+    auto pointer = [&](SReg sreg, Reg reg, bool forWrite, bool first) -> std::optional<Pointer> {
+        const auto offset = regs_[reg] & mask;
+        if (!first && offset + opSize - 1 > sdesc_[sreg].limit)
+            return {};
+        const auto linearAddress = toLinearAddress(SegmentedAddress { sreg, offset }, opSize, forWrite);
+        const FastTLBEntry* e;
+        if (first) {
+            e = fastTlbLookup(linearAddress, opSize, forWrite);
+        } else {
+            e = &fastTlb_[fastTlbIndex(linearAddress, forWrite)];
+            if (e->tag != fastTlbTag(linearAddress))
+                e = nullptr;
+        }
+        if (!e)
+            return {};
+        const auto pageOffset = linearAddress & PAGE_MASK;
+        count = std::min({ count, (PAGE_SIZE - pageOffset) / opSize, (std::uint64_t(sdesc_[sreg].limit) + 1 - offset) / opSize, (mask + 1 - offset) / opSize });
+        return Pointer { e->host + pageOffset, e->physicalAddress + pageOffset };
+    };
+
+    std::optional<Pointer> src;
+    if constexpr (usesSI) {
+        src = pointer(ds, REG_SI, false, true);
+        if (!src)
+            return false;
+    }
+    const auto dst = pointer(SREG_ES, REG_DI, isWrite, !usesSI);
+    if (!dst || !count)
+        return false;
+
+    if constexpr (Ins == InstructionMnem::MOVS) {
+        const auto bytes = count * opSize;
+        if (src->host + bytes <= dst->host || dst->host + bytes <= src->host) {
+            std::memcpy(dst->host, src->host, bytes);
+        } else {
+            // Overlapping copies are often used to replicate a pattern, so copy in the same order as the CPU
+            for (std::uint64_t i = 0; i < bytes; i += opSize)
+                store(dst->host + i, load(src->host + i));
+        }
+        bus_.notifyWrite(dst->physicalAddress, bytes);
+        busAccesses_ += static_cast<std::uint32_t>(2 * count);
+    } else if constexpr (Ins == InstructionMnem::STOS) {
+        if (opSize == 1) {
+            std::memset(dst->host, static_cast<std::uint8_t>(regs_[REG_AX]), count);
+        } else {
+            for (std::uint64_t i = 0; i < count; ++i)
+                store(dst->host + i * opSize, regs_[REG_AX]);
+        }
+        bus_.notifyWrite(dst->physicalAddress, count * opSize);
+        busAccesses_ += static_cast<std::uint32_t>(count);
+    } else if constexpr (Ins == InstructionMnem::SCAS || Ins == InstructionMnem::CMPS) {
+        // Stop at the element that ends the REP (if any), its comparison determines the flags
+        const bool stopOnEqual = (currentInstruction.prefixes & PREFIX_REPNZ) != 0;
+        std::uint64_t l = regs_[REG_AX], r = 0, result, carry;
+        std::uint64_t n = 0;
+        while (n < count) {
+            if constexpr (Ins == InstructionMnem::CMPS)
+                l = load(src->host + n * opSize);
+            r = load(dst->host + n * opSize);
+            ++n;
+            if ((Get(l, opSize) == Get(r, opSize)) == stopOnEqual)
+                break;
+        }
+        count = n;
+        result = l - r;
+        HANDLE_SUB_CARRY();
+        updateFlags(result, carry, DEFAULT_EFLAGS_RESULT_MASK);
+        busAccesses_ += static_cast<std::uint32_t>(usesSI ? 2 * count : count);
+    }
+
+    const auto bytes = static_cast<std::int32_t>(count * opSize);
+    if constexpr (usesSI)
+        AddReg(regs_[REG_SI], bytes, addrSize);
+    AddReg(regs_[REG_DI], bytes, addrSize);
+    AddReg(regs_[REG_CX], -static_cast<std::int32_t>(count), addrSize);
+    return true;
+}
+
 template <InstructionMnem Ins>
 void CPU::doStringInstruction()
 {
@@ -1946,10 +3101,12 @@ void CPU::doStringInstruction()
             incReg(REG_DI);
         } else if constexpr (Ins == InstructionMnem::INS) {
             assert(opSize > 0);
+            ++busAccesses_;
             writeDI(bus_.ioInput(regs_[REG_DX] & 0xFFFF, opSize));
             incReg(REG_DI);
         } else if constexpr (Ins == InstructionMnem::OUTS) {
             assert(opSize > 0);
+            ++busAccesses_;
             bus_.ioOutput(regs_[REG_DX] & 0xFFFF, static_cast<uint32_t>(readSI()), opSize);
             incReg(REG_SI);
         } else {
@@ -1963,12 +3120,24 @@ void CPU::doStringInstruction()
         return;
     }
 
-    while (Get(regs_[REG_CX], addrSize) != 0) {
-        // TODO: Service interrupts
-        operation();
-        AddReg(regs_[REG_CX], -1, addrSize);
+    // Like the real thing the instruction is interrupted (and restarted with the updated registers on the
+    // next step) once a scheduled action is due on the bus or a bounded amount of work has been done.
+    // Only without the prefetch queue emulation, the cycle exact (8088/8086) path runs it to completion.
+    const bool interruptible = fastFetchEnabled_ && cpuModel_ >= CPUModel::i80286;
+    const auto startCount = Get(regs_[REG_CX], addrSize);
+    for (bool first = true; Get(regs_[REG_CX], addrSize) != 0; first = false) {
+        chargeBusAccesses();
+        if (interruptible && !first && (bus_.actionPending() || startCount - Get(regs_[REG_CX], addrSize) >= MaxRepeatCount)) {
+            ip_ = currentIp_;
+            prefetch_.flush(ip_);
+            return;
+        }
+        if (first || !bulkStringInstruction<Ins>(ds)) {
+            operation();
+            AddReg(regs_[REG_CX], -1, addrSize);
+        }
         if constexpr (isCompare) {
-            if (!(flags_ & EFLAGS_MASK_ZF) == !(currentInstruction.prefixes & PREFIX_REPNZ))
+            if (!(currentFlags<EFLAGS_MASK_ZF>() & EFLAGS_MASK_ZF) == !(currentInstruction.prefixes & PREFIX_REPNZ))
                 break;
         }
     }
@@ -1990,7 +3159,7 @@ void CPU::doBitInstruction()
             bitOffset %= 8 * currentInstruction.operandSize;
 
         const auto shift = opSize == 2 ? 4 : 5;
-        addr = calcAddressNoMask(currentInstruction.ea[0]);
+        addr = calcAddressNoMask();
         addr.offset += (static_cast<int64_t>(SignExtend(bitOffset, opSize)) >> shift) * opSize;
         addr.offset &= currentInstruction.addressMask();
         val = readMem(addr, opSize);
@@ -2001,16 +3170,16 @@ void CPU::doBitInstruction()
 
     const auto mask = uint64_t(1) << bitOffset;
     if (val & mask)
-        flags_ |= EFLAGS_MASK_CF;
+        flags() |= EFLAGS_MASK_CF;
     else
-        flags_ &= ~EFLAGS_MASK_CF;
+        flags() &= ~EFLAGS_MASK_CF;
 
     const auto rotated = val >> bitOffset | val << (8 * opSize - bitOffset);
     const auto overflow = ((rotated ^ (rotated << 1)) >> (8 * opSize - 1)) & 1;
     if (overflow)
-        flags_ |= EFLAGS_MASK_OF;
+        flags() |= EFLAGS_MASK_OF;
     else
-        flags_ &= ~EFLAGS_MASK_OF;
+        flags() &= ~EFLAGS_MASK_OF;
     
     if constexpr (Ins == InstructionMnem::BTC)
         val ^= mask;
@@ -2144,20 +3313,21 @@ static std::uint64_t GetDoubleReg(const CPUState& state, std::uint8_t halfSize)
 
 void CPU::doStep()
 {
-    instructionPrefetch();
+    if (!instructionDecode())
+        return;
+    executeDecoded();
+}
 
-    currentInstruction = Decode(cpuInfo(), [&]() {
-        if (!prefetch_.empty())
-            return prefetch_.get();
-        instructionFetch(false);
-        assert(!prefetch_.empty());
-        return prefetch_.get();
-    });
+// Executes the instruction in currentInstruction (with IP still pointing at it)
+void CPU::executeDecoded()
+{
     const auto& ins = currentInstruction;
 
     ip_ += ins.numInstructionBytes;
     if (cpuModel_ < CPUModel::i80386sx)
         ip_ &= 0xffff;
+    if (decodeCacheEnabled_ || fastFetchEnabled_)
+        prefetch_.flush(ip_);
 
     if ((ins.prefixes & PREFIX_LOCK) && cpuModel_ >= CPUModel::i80386sx) {
         //The LOCK prefix can be prepended only to the following instructions and only to those forms of the instructions where the destination operand is a memory operand:
@@ -2190,22 +3360,28 @@ LockException:
         }
     }
 
+    (this->*currentOp_.handler)();
+}
+
+void CPU::executeGeneric()
+{
+    const auto& ins = currentInstruction;
     uint32_t flagsMask = 0;
     uint64_t result = 0, carry = 0, l, r;
     //DEFAULT_EFLAGS_RESULT_MASK
     switch (ins.instruction->mnemonic) {
     case InstructionMnem::AAA:
         // TODO: OF/SF/ZF/PF
-        if ((regs_[REG_AX] & 0xf) > 9 || (flags_ & EFLAGS_MASK_AF)) {
+        if ((regs_[REG_AX] & 0xf) > 9 || (flags() & EFLAGS_MASK_AF)) {
             if (cpuModel_ < CPUModel::i80386sx) {
                 UpdateU8L(regs_[REG_AX], (regs_[REG_AX] + 6) & 0xf); // AL = (AL + 6) & 0xf
                 UpdateU8H(regs_[REG_AX], (regs_[REG_AX] >> 8) + 1);  // AH += 1
             } else {
                 UpdateU16(regs_[REG_AX], (regs_[REG_AX] + 0x106) & 0xff0f);
             }
-            flags_ |= EFLAGS_MASK_CF | EFLAGS_MASK_AF;
+            flags() |= EFLAGS_MASK_CF | EFLAGS_MASK_AF;
         } else {
-            flags_ &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_AF);
+            flags() &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_AF);
             UpdateU8L(regs_[REG_AX], regs_[REG_AX] & 0xf);
         }
         break;
@@ -2213,7 +3389,7 @@ LockException:
         result = (GetU8L(regs_[REG_AX]) + GetU8H(regs_[REG_AX]) * readEA(0)) & 0xff;
         UpdateU16(regs_[REG_AX], result);
         flagsMask = EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_PF;
-        currentInstruction.operationSize = 1;
+        currentInstruction.operationSize = currentOp_.size = 1; // updateFlags uses the size from the micro-op
         break;
     case InstructionMnem::AAM:
         // TODO: OF/AF/CF
@@ -2221,7 +3397,7 @@ LockException:
         l = regs_[REG_AX] & 0xff;
         r = readEA(0) & 0xff;
         if (!r) {
-            flags_ &= ~(EFLAGS_MASK_ZF | EFLAGS_MASK_SF | EFLAGS_MASK_AF); // TODO: flags on exception...
+            flags() &= ~(EFLAGS_MASK_ZF | EFLAGS_MASK_SF | EFLAGS_MASK_AF); // TODO: flags on exception...
             //flags_ |= EFLAGS_MASK_PF;
             throw CPUException { CPUExceptionNumber::DivisionError };
         }
@@ -2232,7 +3408,7 @@ LockException:
         break;
     case InstructionMnem::AAS:
         // TODO: OF/SF/ZF/PF
-        if ((regs_[REG_AX] & 0xf) > 9 || (flags_ & EFLAGS_MASK_AF)) {
+        if ((regs_[REG_AX] & 0xf) > 9 || (flags() & EFLAGS_MASK_AF)) {
             if (cpuModel_ < CPUModel::i80386sx) {
                 UpdateU8L(regs_[REG_AX], (regs_[REG_AX] - 6) & 0xf); // AL = (AL - 6) & 0xf
                 UpdateU8H(regs_[REG_AX], (regs_[REG_AX] >> 8) - 1); // AH -= 1
@@ -2241,9 +3417,9 @@ LockException:
                 ax = ((ax - 0x100) & 0xff00) | (ax & 0x0f); // AH -= 1, AL &= 0xF^M
                 UpdateU16(regs_[REG_AX], ax);
             }
-            flags_ |= EFLAGS_MASK_CF | EFLAGS_MASK_AF;
+            flags() |= EFLAGS_MASK_CF | EFLAGS_MASK_AF;
         } else {
-            flags_ &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_AF);
+            flags() &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_AF);
             UpdateU8L(regs_[REG_AX], regs_[REG_AX] & 0xf);
         }
         break;
@@ -2251,7 +3427,7 @@ LockException:
     case InstructionMnem::ADC:
         l = readEA(0);
         r = readEA(1);
-        result = l + r + !!(flags_ & EFLAGS_MASK_CF);
+        result = l + r + !!(flags() & EFLAGS_MASK_CF);
         writeEA(0, result);
         HANDLE_ADD_CARRY();
         flagsMask = DEFAULT_EFLAGS_RESULT_MASK;
@@ -2272,10 +3448,10 @@ LockException:
         l = readEA(0);
         r = readEA(1);
         if ((l & DESC_MASK_DPL) < (r & DESC_MASK_DPL)) {
-            flags_ |= EFLAGS_MASK_ZF;
+            flags() |= EFLAGS_MASK_ZF;
             writeEA(0, (l & ~DESC_MASK_DPL) | (r & DESC_MASK_DPL));
         } else {
-            flags_ &= ~EFLAGS_MASK_ZF;
+            flags() &= ~EFLAGS_MASK_ZF;
         }
         break;
     case InstructionMnem::BOUND: {
@@ -2284,14 +3460,14 @@ LockException:
             THROW_UD("Second operand for BOUND is not a memory location");
 
         l = SignExtend(readEA(0), ins.operandSize);
-        auto addr = calcAddress(ins.ea[1]);
+        auto addr = calcAddress();
         int64_t lower = SignExtend(readMem(addr, ins.operandSize), ins.operandSize);
         addr.offset += ins.operandSize;
         addr.offset &= ins.addressMask();
         int64_t upper = SignExtend(readMem(addr, ins.operandSize), ins.operandSize);
         if (static_cast<int64_t>(l) < lower || static_cast<int64_t>(l) > upper) {
             if (exceptionTraceMask_ & (1 << CPUExceptionNumber::BoundRangeExceeded))
-                std::println("{}Out of bounds: {} <= {} <= {}", IP_PREFIX(), lower, static_cast<int64_t>(l), upper);
+                bus_.log().println("{}Out of bounds: {} <= {} <= {}", IP_PREFIX(), lower, static_cast<int64_t>(l), upper);
             throw CPUException { CPUExceptionNumber::BoundRangeExceeded };
         }
         break;
@@ -2299,10 +3475,10 @@ LockException:
     case InstructionMnem::BSF:
         r = readEA(1);
         if (!r) {
-            flags_ |= EFLAGS_MASK_ZF;
+            flags() |= EFLAGS_MASK_ZF;
             // Dest is undefined
         } else {
-            flags_ &= ~EFLAGS_MASK_ZF;
+            flags() &= ~EFLAGS_MASK_ZF;
 #ifdef _MSC_VER
             unsigned long index;
             _BitScanForward64(&index, r);
@@ -2315,10 +3491,10 @@ LockException:
     case InstructionMnem::BSR:
         r = readEA(1);
         if (!r) {
-            flags_ |= EFLAGS_MASK_ZF;
+            flags() |= EFLAGS_MASK_ZF;
             // Dest is undefined
         } else {
-            flags_ &= ~EFLAGS_MASK_ZF;
+            flags() &= ~EFLAGS_MASK_ZF;
 #ifdef _MSC_VER
             unsigned long index;
             _BitScanReverse64(&index, r);
@@ -2367,7 +3543,7 @@ LockException:
         break;
     }
     case InstructionMnem::CLC:
-        flags_ &= ~EFLAGS_MASK_CF;
+        flags() &= ~EFLAGS_MASK_CF;
         break;
     case InstructionMnem::CLD:
         flags_ &= ~EFLAGS_MASK_DF;
@@ -2377,7 +3553,7 @@ LockException:
         flags_ &= ~EFLAGS_MASK_IF;
         break;
     case InstructionMnem::CMC:
-        flags_ ^= EFLAGS_MASK_CF;
+        flags() ^= EFLAGS_MASK_CF;
         break;
     case InstructionMnem::CMP:
         l = readEA(0);
@@ -2397,24 +3573,24 @@ LockException:
         assert(currentInstruction.operationSize == 1);
         const int32_t adjust = ins.instruction->mnemonic == InstructionMnem::DAA ? 6 : -6;
         const auto old_AL = static_cast<uint8_t>(regs_[REG_AX]);
-        const uint8_t upperCheck = (cpuModel_ <= CPUModel::i8086 && (flags_ & EFLAGS_MASK_AF)) ? 0x9F : 0x99;
-        const bool old_CF = (flags_ & EFLAGS_MASK_CF);
-        if ((old_AL & 0xf) > 9 || (flags_ & EFLAGS_MASK_AF)) {
+        const uint8_t upperCheck = (cpuModel_ <= CPUModel::i8086 && (flags() & EFLAGS_MASK_AF)) ? 0x9F : 0x99;
+        const bool old_CF = (flags() & EFLAGS_MASK_CF);
+        if ((old_AL & 0xf) > 9 || (flags() & EFLAGS_MASK_AF)) {
             AddReg(regs_[REG_AX], adjust, 1);
-            flags_ |= EFLAGS_MASK_AF;
+            flags() |= EFLAGS_MASK_AF;
             if (cpuModel_ >= CPUModel::i80386sx && adjust < 0 && (old_AL - 6) < 0)
-                flags_ |= EFLAGS_MASK_CF;
+                flags() |= EFLAGS_MASK_CF;
         }
         if (old_AL > upperCheck || old_CF) {
             AddReg(regs_[REG_AX], adjust << 4, 1);
-            flags_ |= EFLAGS_MASK_CF;
+            flags() |= EFLAGS_MASK_CF;
         }
         // OF is undefined, but set only if bit 7 changes from 0 to 1
         // On 8088 this it's the opposite for DAS
         if (cpuModel_ <= CPUModel::i8086 && ins.instruction->mnemonic == InstructionMnem::DAS) {
-            SetFlag(flags_, EFLAGS_MASK_OF, (old_AL & 0x80) && !(regs_[REG_AX] & 0x80));
+            SetFlag(flags(), EFLAGS_MASK_OF, (old_AL & 0x80) && !(regs_[REG_AX] & 0x80));
         } else {
-            SetFlag(flags_, EFLAGS_MASK_OF, !(old_AL & 0x80) && (regs_[REG_AX] & 0x80));
+            SetFlag(flags(), EFLAGS_MASK_OF, !(old_AL & 0x80) && (regs_[REG_AX] & 0x80));
         }
         result = regs_[REG_AX] & 0xff;
         flagsMask = EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_PF;
@@ -2436,7 +3612,7 @@ LockException:
 
         if (nestingLevel > 1 && ((regs_[REG_BP] - ins.operandSize) & stackMask()) + ins.operandSize - 1 > sdesc_[SREG_SS].limit) {
             if (exceptionTraceMask_ & (1 << CPUExceptionNumber::StackSegmentFault))
-                std::println("{}(E)BP would be outside stack limit", IP_PREFIX());
+                bus_.log().println("{}(E)BP would be outside stack limit", IP_PREFIX());
             throw CPUException { CPUExceptionNumber::StackSegmentFault };
         }
         try {
@@ -2462,7 +3638,7 @@ LockException:
     }
     case InstructionMnem::ESC:
     case InstructionMnem::FWAIT:
-        //std::print("Warning: Ignoring ESC {:02X}{:02X}\n", ins.instructionBytes[0], ins.instructionBytes[1]);
+        //bus_.log().print("Warning: Ignoring ESC {:02X}{:02X}\n", ins.instructionBytes[0], ins.instructionBytes[1]);
         break;
     case InstructionMnem::IN: {
         l = readEA(1);
@@ -2470,6 +3646,7 @@ LockException:
             l &= 0xff;
         const uint8_t size = ins.opcode == 0xE4 || ins.opcode == 0xEC ? 1 : ins.operandSize;
         checkIOAccess(static_cast<uint16_t>(l), size);
+        ++busAccesses_;
         writeEA(0, bus_.ioInput(static_cast<uint16_t>(l), size));
         break;
     }
@@ -2502,7 +3679,7 @@ LockException:
             case 0x0F:
                 break;
             default:
-                std::println("INT10h AX={:04X}", static_cast<uint16_t>(regs_[REG_AX]));
+                bus_.log().println("INT10h AX={:04X}", static_cast<uint16_t>(regs_[REG_AX]));
                 //if (GetU16(regs_[REG_AX]) == 3 && sregs_[SREG_CS] == 0x53) {
                 //    THROW_FLIPFLOP();
                 //}
@@ -2514,27 +3691,26 @@ LockException:
             if (o_serviceId && o_vxdId) {
                 const auto serviceId = static_cast<uint16_t>(*o_serviceId);
                 const auto vxdId = static_cast<uint16_t>(*o_vxdId);
-                std::print("{}INT20h service={:04X} VxD={:04X}", IP_PREFIX(), serviceId, vxdId);
+                bus_.log().print("{}INT20h service={:04X} VxD={:04X}", IP_PREFIX(), serviceId, vxdId);
 #include "debug_vxd_info.h"
                 if (auto it = vxdNames.find(vxdId); it != vxdNames.end())
-                    std::print(" {}", it->second);
+                    bus_.log().print(" {}", it->second);
                 if (vxdId == 1) { // VMM
                     if (auto idx = static_cast<uint16_t>(serviceId & 0x7fff); idx < std::size(VmmServiceIds))
-                        std::print(" {}", VmmServiceIds[idx]);
+                        bus_.log().print(" {}", VmmServiceIds[idx]);
                 }
-                std::println("");
+                bus_.log().println("");
                 for (int reg = REG_AX; reg <= REG_DI; ++reg)
-                    std::print("{}={:08X}{}", Reg32Text[reg], regs_[reg], reg == REG_DI ? "\n" : " ");
-                std::print("ARGS: ");
+                    bus_.log().print("{}={:08X}{}", Reg32Text[reg], regs_[reg], reg == REG_DI ? "\n" : " ");
+                bus_.log().print("ARGS: ");
                 for (int i = 0; i < 6; ++i)
-                    std::print("{:08X} ", readStack(i));
-                std::println("");
-                static std::string debugOut;
+                    bus_.log().print("{:08X} ", readStack(i));
+                bus_.log().println("");
                 auto dbgOut = [&](uint8_t ch) {
-                    debugOut += ch;
+                    vxdDebugOut_ += ch;
                     if (ch == '\n') {
-                        std::print("DEBUG OUT: {}", debugOut);
-                        debugOut.clear();
+                        bus_.log().print("DEBUG OUT: {}", vxdDebugOut_);
+                        vxdDebugOut_.clear();
                     }
                 };
                 if (vxdId == 1 && serviceId == 0x00C2) { // Out_Debug_String
@@ -2559,7 +3735,7 @@ LockException:
         doInterrupt(3 | ExceptionTypeSW);
         break;
     case InstructionMnem::INTO:
-        if (flags_ & EFLAGS_MASK_OF)
+        if (flags() & EFLAGS_MASK_OF)
             doInterrupt(CPUExceptionNumber::Overflow | ExceptionTypeSW);
         break;
     case InstructionMnem::LEAVE: {
@@ -2584,9 +3760,9 @@ LockException:
         } else {
             throw std::runtime_error { "TODO: IMUL with " + std::to_string(ins.numOperands) + " operands" };
         }
-        flags_ &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF);
+        flags() &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF);
         if (res.overflow)
-            flags_ |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
+            flags() |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
 
         // 8088/8086 flags (except CF and OF) are set by the ALU operation in "IMULCOF"
         // ADC of tmpA and ZERO with CF from LRCY of tmpC
@@ -2612,17 +3788,17 @@ LockException:
         // On 8088/8086 flags are set according to "tmpA" by passing it (unmodified) through the ALU
         // https://www.righto.com/2023/03/8086-multiplication-microcode.html
         //
-        flags_ &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF);
+        flags() &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF);
         if (result >> 8 * ins.operandSize)
-            flags_ |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
+            flags() |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
         else
-            flags_ |= EFLAGS_MASK_ZF;
+            flags() |= EFLAGS_MASK_ZF;
         if (result >> (16*ins.operandSize-1))
-            flags_ |= EFLAGS_MASK_SF;
+            flags() |= EFLAGS_MASK_SF;
 
         if (cpuModel_ <= CPUModel::i8086) {
             if (Parity(static_cast<uint8_t>(ins.operandSize == 1 ? regs_[REG_AX] >> 8 : regs_[REG_DX])))
-                flags_ |= EFLAGS_MASK_PF;
+                flags() |= EFLAGS_MASK_PF;
         }
 
         break;
@@ -2730,14 +3906,14 @@ LockException:
     case InstructionMnem::JNL: // 7D
     case InstructionMnem::JLE: // 7E
     case InstructionMnem::JNLE: // 7E
-        if (EvalCond(flags_, ins.opcode & 0xf))
+        if (EvalCond(flags(), ins.opcode & 0xf))
             doNearControlTransfer(ControlTransferType::jump);
         break;
     case InstructionMnem::JMP:
         doNearControlTransfer(ControlTransferType::jump);
         break;
     case InstructionMnem::LAHF:
-        UpdateU8H(regs_[REG_AX], flags_);
+        UpdateU8H(regs_[REG_AX], flags());
         break;
     case InstructionMnem::LAR:
     case InstructionMnem::LSL: {
@@ -2767,26 +3943,28 @@ LockException:
         } catch ([[maybe_unused]] const CPUException& e) {
             assert(e.exceptionNo() == CPUExceptionNumber::GeneralProtection);
         }
-        SetFlag(flags_, EFLAGS_MASK_ZF, ok);
+        SetFlag(flags(), EFLAGS_MASK_ZF, ok);
         break;
     }
     case InstructionMnem::LEA:
         if (cpuModel_ >= CPUModel::i8086 && !EAIsMemory(ins.ea[1].type))
             THROW_UD("LEA with non-memory {}", ins.ea[1]);
-        writeEA(0, calcAddress(ins.ea[1]).offset);
+        checkMemoryOperand(ins.ea[1]);
+        writeEA(0, calcAddress().offset);
         break;
     case InstructionMnem::LGDT:
         //THROW_FLIPFLOP();
     case InstructionMnem::LIDT: {
         assert(ins.operandSize == 2 || ins.operandSize == 4);
-        auto addr = calcAddress(ins.ea[0]);
+        checkMemoryOperand(ins.ea[0]);
+        auto addr = calcAddress();
         auto& table = ins.mnemoic == InstructionMnem::LGDT ? gdt_ : idt_;
         const auto limit = static_cast<uint16_t>(readMem(addr, 2));
         addr.offset += 2;
         auto base = readMem(addr, 4);
         if (ins.operandSize == 2)
             base &= 0xffffff;
-        //std::print("{} limit=0x{:04X} base=0x{:08X}\n", ins.mnemoic, limit, base);
+        //bus_.log().print("{} limit=0x{:04X} base=0x{:08X}\n", ins.mnemoic, limit, base);
         table.limit = limit;
         table.base = base;
         break;
@@ -2795,7 +3973,7 @@ LockException:
         const auto index = static_cast<uint16_t>(readEA(0));
         assert(!(index & 7));
         if ((index & ~3) == 0) {
-            //std::println("Invalid LDT loaded: {:04X}", index);
+            //bus_.log().println("Invalid LDT loaded: {:04X}", index);
             ldt_ = SegmentDescriptor {};
             ldtIndex_ = index;
             break;
@@ -2851,10 +4029,10 @@ LockException:
         l = 1;
         goto DoLoop;
     case InstructionMnem::LOOPZ:
-        l = !!(flags_ & EFLAGS_MASK_ZF);
+        l = !!(flags() & EFLAGS_MASK_ZF);
         goto DoLoop;
     case InstructionMnem::LOOPNZ:
-        l = !(flags_ & EFLAGS_MASK_ZF);
+        l = !(flags() & EFLAGS_MASK_ZF);
 DoLoop:
         assert(ins.addressSize == 2 || ins.addressSize == 4);
         result = AddReg(regs_[REG_CX], -1, ins.addressSize);
@@ -2903,6 +4081,7 @@ DoLoop:
             l &= 0xff;
         const uint8_t size = ins.opcode == 0xE6 || ins.opcode == 0xEE ? 1 : ins.operandSize;
         checkIOAccess(static_cast<uint16_t>(l), size);
+        ++busAccesses_;
         bus_.ioOutput(static_cast<uint16_t>(l), static_cast<uint32_t>(r), size);
         break;
     }
@@ -2973,7 +4152,7 @@ DoLoop:
     case InstructionMnem::PUSHF:
         // ?? At least for i386 it seems like the upper bits read as zero
         checkPrivVM86();
-        push(flags_ & 0xffff, ins.operandSize);
+        push(flags() & 0xffff, ins.operandSize);
         break;
     case InstructionMnem::IRET:
         checkPrivVM86();
@@ -3004,10 +4183,10 @@ DoLoop:
         break;
     }
     case InstructionMnem::SALC:
-        UpdateU8L(regs_[REG_AX], flags_ & EFLAGS_MASK_CF ? 0xFF : 0x00);
+        UpdateU8L(regs_[REG_AX], flags() & EFLAGS_MASK_CF ? 0xFF : 0x00);
         break;
     case InstructionMnem::SAHF:
-        setFlags((flags_ & ~0xff) | GetU8H(regs_[REG_AX]));
+        setFlags((flags() & ~0xff) | GetU8H(regs_[REG_AX]));
         break;
     case InstructionMnem::SETB:
     case InstructionMnem::SETBE:
@@ -3025,7 +4204,7 @@ DoLoop:
     case InstructionMnem::SETP:
     case InstructionMnem::SETS:
     case InstructionMnem::SETZ:
-        writeEA(0, EvalCond(flags_, ins.opcode & 0xf));
+        writeEA(0, EvalCond(flags(), ins.opcode & 0xf));
         break;
     case InstructionMnem::SETMO:
         if (readEA(1)) {
@@ -3042,17 +4221,17 @@ DoLoop:
             result = l << r;
             carry = l << (r - 1);
             writeEA(0, result);
-            flags_ &= ~EFLAGS_MASK_OF;
+            flags() &= ~EFLAGS_MASK_OF;
             if (((result ^ carry) >> (8 * ins.operationSize - 1)) & 1)
-                flags_ |= EFLAGS_MASK_OF;
+                flags() |= EFLAGS_MASK_OF;
             flagsMask = DEFAULT_EFLAGS_RESULT_MASK & ~EFLAGS_MASK_OF;
 
             // CF is undefined if count > size
             if (ins.operationSize == 1 && cpuModel_ == CPUModel::i80386sx && r > 8) {
                 if ((r == 16 || r == 24) && (l & 1))
-                    flags_ |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
+                    flags() |= EFLAGS_MASK_CF | EFLAGS_MASK_OF;
                 else
-                    flags_ &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF);
+                    flags() &= ~(EFLAGS_MASK_CF | EFLAGS_MASK_OF);
                 flagsMask &= ~EFLAGS_MASK_CF;
             }
         }
@@ -3073,7 +4252,7 @@ DoLoop:
             result = result << 1 | cy;
         }
         writeEA(0, result);
-        SetFlag(flags_, EFLAGS_MASK_OF, (((result ^ carry) >> msbShift) & 1));
+        SetFlag(flags(), EFLAGS_MASK_OF, (((result ^ carry) >> msbShift) & 1));
         flagsMask = DEFAULT_EFLAGS_RESULT_MASK & ~(EFLAGS_MASK_OF | EFLAGS_MASK_AF);
         break;
     }
@@ -3084,9 +4263,9 @@ DoLoop:
             result = static_cast<int64_t>(l) >> r;
             carry = static_cast<int64_t>(l) >> (r - 1);
             writeEA(0, result);
-            flags_ &= ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF);
+            flags() &= ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF);
             if (carry & 1)
-                flags_ |= EFLAGS_MASK_CF;
+                flags() |= EFLAGS_MASK_CF;
             flagsMask = DEFAULT_EFLAGS_RESULT_MASK & ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF);
         }
         break;
@@ -3096,21 +4275,21 @@ DoLoop:
         if (r) {
             result = l >> r;
             carry = l >> (r - 1);
-            flags_ &= ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF);
+            flags() &= ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF);
             if (carry & 1)
-                flags_ |= EFLAGS_MASK_CF;
+                flags() |= EFLAGS_MASK_CF;
             // (1-bit shift only...) For the SHR instruction, the OF flag is set to the most-significant bit of the original operand.
             if (r == 1 && l >> (8 * ins.operandSize - 1))
-                flags_ |= EFLAGS_MASK_OF;
+                flags() |= EFLAGS_MASK_OF;
             // Update flags before writing back result
             updateFlags(result, carry, DEFAULT_EFLAGS_RESULT_MASK & ~(EFLAGS_MASK_OF | EFLAGS_MASK_CF | EFLAGS_MASK_AF));
             // result is undefined if count > size
             if (ins.operationSize == 1 && cpuModel_ == CPUModel::i80386sx && r > 8) {
-                flags_ &= ~EFLAGS_MASK_OF; // Always cleared
+                flags() &= ~EFLAGS_MASK_OF; // Always cleared
                 if ((r == 16 || r == 24) && (l & 0x80))
-                    flags_ |= EFLAGS_MASK_CF;
+                    flags() |= EFLAGS_MASK_CF;
                 else
-                    flags_ &= ~EFLAGS_MASK_CF;
+                    flags() &= ~EFLAGS_MASK_CF;
             }
             writeEA(0, result);
         }
@@ -3134,9 +4313,9 @@ DoLoop:
         }
         writeEA(0, result);
         if (overflow)
-            flags_ |= EFLAGS_MASK_OF;
+            flags() |= EFLAGS_MASK_OF;
         else
-            flags_ &= ~EFLAGS_MASK_OF;
+            flags() &= ~EFLAGS_MASK_OF;
         flagsMask = DEFAULT_EFLAGS_RESULT_MASK & ~EFLAGS_MASK_OF;
         break;
     }
@@ -3145,7 +4324,7 @@ DoLoop:
         l = readEA(0);
         r = readEA(1) & shiftMask_;
         uint64_t overflow = 0;
-        carry = (flags_ & EFLAGS_MASK_CF) != 0;
+        carry = (flags() & EFLAGS_MASK_CF) != 0;
         for (int i = 0; i < static_cast<int>(r); ++i) {
             const auto oldCy = carry;
             carry = (l >> (width - 1)) & 1;
@@ -3153,9 +4332,9 @@ DoLoop:
             l |= oldCy;
             overflow = (carry ^ (l >> (width - 1))) & 1;
         }
-        SetFlag(flags_, EFLAGS_MASK_CF, carry != 0);
+        SetFlag(flags(), EFLAGS_MASK_CF, carry != 0);
         if (r)
-            SetFlag(flags_, EFLAGS_MASK_OF, overflow != 0);
+            SetFlag(flags(), EFLAGS_MASK_OF, overflow != 0);
         writeEA(0, l);
         break;
     }
@@ -3164,7 +4343,7 @@ DoLoop:
         l = readEA(0);
         r = readEA(1) & shiftMask_;
         uint64_t overflow = 0;
-        carry = (flags_ & EFLAGS_MASK_CF) != 0;
+        carry = (flags() & EFLAGS_MASK_CF) != 0;
         for (int i = 0; i < static_cast<int>(r); ++i) {
             const auto oldCy = carry;
             carry = l & 1;
@@ -3172,9 +4351,9 @@ DoLoop:
             overflow = (oldCy ^ (l >> (width - 2))) & 1;
             l |= oldCy << (width - 1);
         }
-        SetFlag(flags_, EFLAGS_MASK_CF, carry != 0);
+        SetFlag(flags(), EFLAGS_MASK_CF, carry != 0);
         if (r)
-            SetFlag(flags_, EFLAGS_MASK_OF, overflow != 0);
+            SetFlag(flags(), EFLAGS_MASK_OF, overflow != 0);
         writeEA(0, l);
         break;
     }
@@ -3183,16 +4362,16 @@ DoLoop:
         l = readEA(0);
         r = readEA(1) & shiftMask_;
         uint64_t overflow = 0;
-        carry = flags_ & EFLAGS_MASK_CF;
+        carry = flags() & EFLAGS_MASK_CF;
         for (int i = 0; i < static_cast<int>(r); ++i) {
             carry = (l >> (width - 1)) & 1;
             l <<= 1;
             overflow = (carry ^ (l >> (width - 1))) & 1;
             l |= carry;
         }
-        SetFlag(flags_, EFLAGS_MASK_CF, carry != 0);
+        SetFlag(flags(), EFLAGS_MASK_CF, carry != 0);
         if (r)
-            SetFlag(flags_, EFLAGS_MASK_OF, overflow != 0);
+            SetFlag(flags(), EFLAGS_MASK_OF, overflow != 0);
         writeEA(0, l);
         break;
     }
@@ -3201,29 +4380,30 @@ DoLoop:
         l = readEA(0);
         r = readEA(1) & shiftMask_;
         uint64_t overflow = 0;
-        carry = flags_ & EFLAGS_MASK_CF;
+        carry = flags() & EFLAGS_MASK_CF;
         for (int i = 0; i < static_cast<int>(r); ++i) {
             carry = l & 1;
             l >>= 1;
             overflow = (carry ^ (l >> (width - 2))) & 1;
             l |= carry << (width - 1);
         }
-        SetFlag(flags_, EFLAGS_MASK_CF, carry != 0);
+        SetFlag(flags(), EFLAGS_MASK_CF, carry != 0);
         if (r)
-            SetFlag(flags_, EFLAGS_MASK_OF, overflow != 0);
+            SetFlag(flags(), EFLAGS_MASK_OF, overflow != 0);
         writeEA(0, l);
         break;
     }
     case InstructionMnem::SBB:
         l = readEA(0);
         r = readEA(1);
-        result = l - r - !!(flags_ & EFLAGS_MASK_CF);
+        result = l - r - !!(flags() & EFLAGS_MASK_CF);
         writeEA(0, result);
         HANDLE_SUB_CARRY();
         flagsMask = DEFAULT_EFLAGS_RESULT_MASK;
         break;
     case InstructionMnem::SGDT: {
-        auto addr = calcAddress(ins.ea[0]);
+        checkMemoryOperand(ins.ea[0]);
+        auto addr = calcAddress();
         writeMem(addr, gdt_.limit, 2);
         addr.offset += 2;
         writeMem(addr, gdt_.base, 4);
@@ -3233,7 +4413,8 @@ DoLoop:
         writeEA(0, ldtIndex_);
         break;
     case InstructionMnem::SIDT: {
-        auto addr = calcAddress(ins.ea[0]);
+        checkMemoryOperand(ins.ea[0]);
+        auto addr = calcAddress();
         writeMem(addr, idt_.limit, 2);
         addr.offset += 2;
         writeMem(addr, idt_.base, 4);
@@ -3255,7 +4436,7 @@ DoLoop:
         writeEA(0, cregs_[0] & 0xffff);
         break;
     case InstructionMnem::STC:
-        flags_ |= EFLAGS_MASK_CF;
+        flags() |= EFLAGS_MASK_CF;
         break;
     case InstructionMnem::STD:
         flags_ |= EFLAGS_MASK_DF;
@@ -3282,7 +4463,7 @@ DoLoop:
     case InstructionMnem::VERR:
     case InstructionMnem::VERW: {
         const auto seg = static_cast<uint16_t>(readEA(0));
-        flags_ &= ~EFLAGS_MASK_ZF;
+        flags() &= ~EFLAGS_MASK_ZF;
         if (!seg)
             break;
         try {
@@ -3303,7 +4484,7 @@ DoLoop:
                 break;
             }
             if (accessOk)
-                flags_ |= EFLAGS_MASK_ZF;
+                flags() |= EFLAGS_MASK_ZF;
         } catch (const CPUException& e) {
             assert(e.exceptionNo() == CPUExceptionNumber::GeneralProtection && e.errorCode() == static_cast<uint32_t>(seg & ~DESC_MASK_DPL));
             (void)e;
@@ -3339,3 +4520,287 @@ DoLoop:
     if (flagsMask)
         updateFlags(result, carry, flagsMask);
 }
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Instruction Handlers
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CPU::OperandKind CPU::operandKind(int index) const
+{
+    const auto& ins = currentInstruction;
+    switch (ins.ea[index].type) {
+    case DecodedEAType::reg8:
+        return ins.operationSize == 1 ? OperandKind::reg : OperandKind::other;
+    case DecodedEAType::reg16:
+        return ins.operationSize == 2 ? OperandKind::reg : OperandKind::other;
+    case DecodedEAType::reg32:
+        return ins.operationSize == 4 ? OperandKind::reg : OperandKind::other;
+    case DecodedEAType::rm16:
+    case DecodedEAType::rm32:
+    case DecodedEAType::mem16:
+    case DecodedEAType::mem32:
+        return ins.operandSize == ins.operationSize ? OperandKind::mem : OperandKind::other;
+    case DecodedEAType::imm8:
+        return OperandKind::imm8;
+    case DecodedEAType::imm16:
+        return ins.operationSize == 2 ? OperandKind::imm : OperandKind::other;
+    case DecodedEAType::imm32:
+        return ins.operationSize == 4 ? OperandKind::imm : OperandKind::other;
+    default:
+        return OperandKind::other;
+    }
+}
+
+// Returns the handler for the current instruction, specialized on operation size and operand kinds
+// when possible. Everything else goes through executeGeneric. compact is set if the handler only
+// needs the operands resolved in the micro-op (see lowerInstruction).
+CPU::InstructionHandler CPU::resolveHandler(bool& compact) const
+{
+    const auto& ins = currentInstruction;
+    InstructionHandler handler = nullptr;
+    compact = false;
+
+    switch (ins.instruction->mnemonic) {
+    case InstructionMnem::ADC:
+        handler = binaryHandler<InstructionMnem::ADC>();
+        break;
+    case InstructionMnem::ADD:
+        handler = binaryHandler<InstructionMnem::ADD>();
+        break;
+    case InstructionMnem::AND:
+        handler = binaryHandler<InstructionMnem::AND>();
+        break;
+    case InstructionMnem::CMP:
+        handler = binaryHandler<InstructionMnem::CMP>();
+        break;
+    case InstructionMnem::MOV:
+        handler = binaryHandler<InstructionMnem::MOV>();
+        break;
+    case InstructionMnem::OR:
+        handler = binaryHandler<InstructionMnem::OR>();
+        break;
+    case InstructionMnem::SBB:
+        handler = binaryHandler<InstructionMnem::SBB>();
+        break;
+    case InstructionMnem::SUB:
+        handler = binaryHandler<InstructionMnem::SUB>();
+        break;
+    case InstructionMnem::TEST:
+        handler = binaryHandler<InstructionMnem::TEST>();
+        break;
+    case InstructionMnem::XOR:
+        handler = binaryHandler<InstructionMnem::XOR>();
+        break;
+    case InstructionMnem::DEC:
+    case InstructionMnem::INC: {
+        static constexpr InstructionHandler handlers[2][3][2] = {
+            {
+                { &CPU::executeIncDec<InstructionMnem::DEC, 1, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::DEC, 1, OperandKind::mem> },
+                { &CPU::executeIncDec<InstructionMnem::DEC, 2, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::DEC, 2, OperandKind::mem> },
+                { &CPU::executeIncDec<InstructionMnem::DEC, 4, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::DEC, 4, OperandKind::mem> },
+            },
+            {
+                { &CPU::executeIncDec<InstructionMnem::INC, 1, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::INC, 1, OperandKind::mem> },
+                { &CPU::executeIncDec<InstructionMnem::INC, 2, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::INC, 2, OperandKind::mem> },
+                { &CPU::executeIncDec<InstructionMnem::INC, 4, OperandKind::reg>, &CPU::executeIncDec<InstructionMnem::INC, 4, OperandKind::mem> },
+            },
+        };
+        const auto dst = operandKind(0);
+        assert(ins.operationSize == 1 || ins.operationSize == 2 || ins.operationSize == 4);
+        if (ins.numOperands == 1 && (dst == OperandKind::reg || dst == OperandKind::mem))
+            handler = handlers[ins.instruction->mnemonic == InstructionMnem::INC][ins.operationSize >> 1][dst == OperandKind::mem];
+        break;
+    }
+    case InstructionMnem::POP:
+    case InstructionMnem::PUSH: {
+        static constexpr InstructionHandler handlers[2][2] = {
+            { &CPU::executePushPop<InstructionMnem::POP, 2>, &CPU::executePushPop<InstructionMnem::POP, 4> },
+            { &CPU::executePushPop<InstructionMnem::PUSH, 2>, &CPU::executePushPop<InstructionMnem::PUSH, 4> },
+        };
+        const bool push = ins.instruction->mnemonic == InstructionMnem::PUSH;
+        // PUSH SP pushes the updated value on the 8086/8088
+        const bool pushSp = push && cpuModel_ <= CPUModel::i8086 && ins.ea[0].regNum == REG_SP;
+        if (ins.numOperands == 1 && operandKind(0) == OperandKind::reg && ins.operandSize == ins.operationSize && ins.operationSize != 1 && !pushSp)
+            handler = handlers[push][ins.operationSize >> 2];
+        break;
+    }
+    case InstructionMnem::JO:
+    case InstructionMnem::JNO:
+    case InstructionMnem::JB:
+    case InstructionMnem::JNB:
+    case InstructionMnem::JZ:
+    case InstructionMnem::JNZ:
+    case InstructionMnem::JBE:
+    case InstructionMnem::JNBE:
+    case InstructionMnem::JS:
+    case InstructionMnem::JNS:
+    case InstructionMnem::JP:
+    case InstructionMnem::JNP:
+    case InstructionMnem::JL:
+    case InstructionMnem::JNL:
+    case InstructionMnem::JLE:
+    case InstructionMnem::JNLE: {
+        static constexpr InstructionHandler handlers[16] = {
+            &CPU::executeJcc<0x0>, &CPU::executeJcc<0x1>, &CPU::executeJcc<0x2>, &CPU::executeJcc<0x3>,
+            &CPU::executeJcc<0x4>, &CPU::executeJcc<0x5>, &CPU::executeJcc<0x6>, &CPU::executeJcc<0x7>,
+            &CPU::executeJcc<0x8>, &CPU::executeJcc<0x9>, &CPU::executeJcc<0xA>, &CPU::executeJcc<0xB>,
+            &CPU::executeJcc<0xC>, &CPU::executeJcc<0xD>, &CPU::executeJcc<0xE>, &CPU::executeJcc<0xF>,
+        };
+        return handlers[ins.opcode & 0xf]; // Not compact, the control transfer is recorded from the decode result
+    }
+    default:
+        break;
+    }
+
+    compact = handler != nullptr;
+    return handler ? handler : &CPU::executeGeneric;
+}
+
+template<InstructionMnem Mnem>
+CPU::InstructionHandler CPU::binaryHandler() const
+{
+    const auto& ins = currentInstruction;
+    if (ins.numOperands != 2)
+        return nullptr;
+    // N.B. segment/control registers etc. are OperandKind::other and are left to executeGeneric
+    const auto dst = operandKind(0);
+    const auto src = operandKind(1);
+    switch (ins.operationSize) {
+    case 1:
+        return binaryHandler<Mnem, 1>(dst, src);
+    case 2:
+        return binaryHandler<Mnem, 2>(dst, src);
+    case 4:
+        return binaryHandler<Mnem, 4>(dst, src);
+    default:
+        return nullptr;
+    }
+}
+
+template<InstructionMnem Mnem, std::uint8_t Size>
+CPU::InstructionHandler CPU::binaryHandler(OperandKind dst, OperandKind src)
+{
+    static constexpr InstructionHandler handlers[2][4] = {
+        {
+            &CPU::executeBinary<Mnem, Size, OperandKind::reg, OperandKind::reg>,
+            &CPU::executeBinary<Mnem, Size, OperandKind::reg, OperandKind::mem>,
+            &CPU::executeBinary<Mnem, Size, OperandKind::reg, OperandKind::imm8>,
+            &CPU::executeBinary<Mnem, Size, OperandKind::reg, OperandKind::imm>,
+        },
+        {
+            &CPU::executeBinary<Mnem, Size, OperandKind::mem, OperandKind::reg>,
+            nullptr,
+            &CPU::executeBinary<Mnem, Size, OperandKind::mem, OperandKind::imm8>,
+            &CPU::executeBinary<Mnem, Size, OperandKind::mem, OperandKind::imm>,
+        },
+    };
+    if (dst > OperandKind::mem || src > OperandKind::imm)
+        return nullptr;
+    return handlers[static_cast<int>(dst)][static_cast<int>(src)];
+}
+
+template<InstructionMnem Mnem, std::uint8_t Size, CPU::OperandKind Dst, CPU::OperandKind Src>
+void CPU::executeBinary()
+{
+    static_assert(Dst == OperandKind::reg || Dst == OperandKind::mem);
+    constexpr bool readsDst = Mnem != InstructionMnem::MOV;
+    constexpr bool writesDst = Mnem != InstructionMnem::CMP && Mnem != InstructionMnem::TEST;
+    const auto address = Dst == OperandKind::mem ? calcAddress() : SegmentedAddress {};
+    if constexpr (Src == OperandKind::mem) {
+        if (!prepareAccess(calcAddress(), Size, false))
+            return;
+    }
+    if constexpr (Dst == OperandKind::mem) {
+        if (readsDst && !prepareAccess(address, Size, false))
+            return;
+        if (writesDst && !prepareAccess(address, Size, true))
+            return;
+    }
+    auto writeResult = [&](std::uint64_t value) {
+        if constexpr (Dst == OperandKind::reg)
+            writeReg<Size>(currentOp_.dst, value);
+        else
+            writeMem(address, value, Size);
+    };
+
+    if constexpr (Mnem == InstructionMnem::MOV) {
+        writeResult(readSource<Size, Src>());
+        return;
+    } else {
+        const auto l = Dst == OperandKind::reg ? readReg<Size>(currentOp_.dst) : readMem(address, Size);
+        const auto r = readSource<Size, Src>();
+        uint64_t result, carry = 0;
+        if constexpr (Mnem == InstructionMnem::ADD || Mnem == InstructionMnem::ADC) {
+            result = l + r;
+            if constexpr (Mnem == InstructionMnem::ADC)
+                result += !!(currentFlags<EFLAGS_MASK_CF>() & EFLAGS_MASK_CF);
+            HANDLE_ADD_CARRY();
+        } else if constexpr (Mnem == InstructionMnem::SUB || Mnem == InstructionMnem::SBB || Mnem == InstructionMnem::CMP) {
+            result = l - r;
+            if constexpr (Mnem == InstructionMnem::SBB)
+                result -= !!(currentFlags<EFLAGS_MASK_CF>() & EFLAGS_MASK_CF);
+            HANDLE_SUB_CARRY();
+        } else if constexpr (Mnem == InstructionMnem::AND || Mnem == InstructionMnem::TEST) {
+            result = l & r;
+        } else if constexpr (Mnem == InstructionMnem::OR) {
+            result = l | r;
+        } else {
+            static_assert(Mnem == InstructionMnem::XOR);
+            result = l ^ r;
+        }
+        if constexpr (Mnem != InstructionMnem::CMP && Mnem != InstructionMnem::TEST)
+            writeResult(result);
+        updateFlags<Size>(result, carry, DEFAULT_EFLAGS_RESULT_MASK);
+    }
+}
+
+template<InstructionMnem Mnem, std::uint8_t Size, CPU::OperandKind Dst>
+void CPU::executeIncDec()
+{
+    const auto address = Dst == OperandKind::mem ? calcAddress() : SegmentedAddress {};
+    if constexpr (Dst == OperandKind::mem) {
+        if (!prepareAccess(address, Size, false) || !prepareAccess(address, Size, true))
+            return;
+    }
+    const auto l = Dst == OperandKind::reg ? readReg<Size>(currentOp_.dst) : readMem(address, Size);
+    const uint64_t r = 1;
+    uint64_t result, carry;
+    if constexpr (Mnem == InstructionMnem::INC) {
+        result = l + r;
+        HANDLE_ADD_CARRY();
+    } else {
+        result = l - r;
+        HANDLE_SUB_CARRY();
+    }
+    if constexpr (Dst == OperandKind::reg)
+        writeReg<Size>(currentOp_.dst, result);
+    else
+        writeMem(address, result, Size);
+    updateFlags<Size>(result, carry, DEFAULT_EFLAGS_RESULT_MASK & ~EFLAGS_MASK_CF); // Carry not updated
+}
+
+template<InstructionMnem Mnem, std::uint8_t Size>
+void CPU::executePushPop()
+{
+    if constexpr (Mnem == InstructionMnem::PUSH)
+        push(readReg<Size>(currentOp_.dst), Size);
+    else
+        writeReg<Size>(currentOp_.dst, pop(Size));
+}
+
+template<std::uint8_t Cond>
+void CPU::executeJcc()
+{
+    constexpr std::uint32_t condFlags[8] = {
+        EFLAGS_MASK_OF,
+        EFLAGS_MASK_CF,
+        EFLAGS_MASK_ZF,
+        EFLAGS_MASK_CF | EFLAGS_MASK_ZF,
+        EFLAGS_MASK_SF,
+        EFLAGS_MASK_PF,
+        EFLAGS_MASK_SF | EFLAGS_MASK_OF,
+        EFLAGS_MASK_ZF | EFLAGS_MASK_SF | EFLAGS_MASK_OF,
+    };
+    if (EvalCond(currentFlags<condFlags[Cond >> 1]>(), Cond))
+        doNearControlTransfer(ControlTransferType::jump);
+}
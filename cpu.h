@@ -2,12 +2,20 @@
 #define CPU_H
 
 #include <cstdint>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 #include <cassert>
 #include "cpu_descriptor.h"
+#include "cpu_exception.h"
+#include "cpu_flags.h"
 #include "cpu_registers.h"
 #include "decode.h"
+#include "system_bus.h"
 
 constexpr std::uint32_t CR0_BIT_PE = 0; // Protected Mode Enable
 constexpr std::uint32_t CR0_BIT_WP = 16; // Write protect (CPU cannot write to R/O pages in ring 0)
@@ -157,7 +165,7 @@ struct CPUState {
 };
 
 std::string FormatCPUFlags(uint32_t flags);
-void ShowCPUState(const CPUState& state);
+void ShowCPUState(const CPUState& state, Logger& log);
 
 struct SegmentedAddress {
     SReg sreg;
@@ -169,8 +177,6 @@ inline bool operator==(const SegmentedAddress& l, const SegmentedAddress& r)
     return l.sreg == r.sreg && l.offset == r.offset;
 }
 
-class SystemBus;
-
 class CPUHaltedException : public std::exception {
 public:
     explicit CPUHaltedException() { }
@@ -180,19 +186,63 @@ public:
     }
 };
 
-class CPU : public CPUState {
+// Arithmetic flags calculation deferred until the flags are needed
+struct LazyFlags {
+    std::uint64_t result;
+    std::uint64_t carry;
+    std::uint32_t mask; // Flags not yet calculated (0 = none)
+    std::uint8_t size;
+};
+
+std::uint32_t EvalLazyFlags(std::uint32_t flags, const LazyFlags& lazyFlags, std::uint32_t mask);
+
+class JitCodeBuffer;
+
+class CPU : public CPUState, public MemoryWriteObserver {
 public:
     using InterruptFunc = std::function<int ()>;
 
+    struct DecodeCacheStats {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::uint64_t invalidations;
+        std::uint64_t blockInstructions; // Executed from the block cache
+        std::uint64_t nativeInstructions; // Executed from blocks compiled to native code (also counted as block instructions)
+        std::uint64_t nativeBlocks; // Blocks compiled
+    };
+
     explicit CPU(CPUModel cpuModel, SystemBus& bus);
+    ~CPU();
 
     static constexpr size_t MaxHistory = 256;
 
+    enum class HistoryMode {
+        off,
+        compact, // CS:IP, instruction bytes, general purpose/segment registers and flags
+        full, // Entire CPUState
+    };
+
+    enum class BlockCacheMode {
+        off,
+        hot, // Blocks are built once they have been entered a number of times
+        always,
+    };
+
     void reset();
+
+    // Must be called between steps
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
+    // The interrupt function is only called (to acknowledge the interrupt) while the pending line is set
     void setInterruptFunction(InterruptFunc func)
     {
         intFunc_ = func;
     }
+    void setInterruptPending(bool pending)
+    {
+        intPending_ = pending;
+    }
     CPUInfo cpuInfo() const;
     uint64_t instructionsExecuted() const
     {
@@ -223,22 +273,129 @@ public:
 
     void clearHistory();
 
+    HistoryMode historyMode() const
+    {
+        return historyMode_;
+    }
+
+    void historyMode(HistoryMode mode);
+
+    bool decodeCacheEnabled() const
+    {
+        return decodeCacheEnabled_;
+    }
+
+    void decodeCacheEnabled(bool enabled);
+
+    // Fetch instruction bytes directly from memory rather than through the modeled prefetch queue (only for 80286+)
+    bool fastFetchEnabled() const
+    {
+        return fastFetchEnabled_;
+    }
+
+    void fastFetchEnabled(bool enabled);
+
+    // Straight-line runs of instructions kept as blocks of decoded instructions (only with the decode cache)
+    BlockCacheMode blockCacheMode() const
+    {
+        return blockCacheMode_;
+    }
+
+    void blockCacheMode(BlockCacheMode mode);
+
+    // Hot blocks are run a whole block per step(): compiled to native code on x86-64 hosts (see cpu_jit.cpp),
+    // as a loop over their micro-ops in real/VM86 mode, 16-bit code and elsewhere. Needs the block cache
+    // and HistoryMode::off, otherwise the blocks are executed an instruction at a time.
+    bool jitEnabled() const
+    {
+        return jitEnabled_;
+    }
+
+    void jitEnabled(bool enabled);
+
+    const DecodeCacheStats& decodeCacheStats() const
+    {
+        return decodeCacheStats_;
+    }
+
+    void memoryWritten(std::uint64_t addr, std::uint64_t length) override;
+    void memoryMapChanged() override;
+
+    // The arithmetic flags are calculated lazily, outside the CPU use this rather than accessing flags_ directly
+    std::uint32_t& flags()
+    {
+        if (lazyFlags_.mask)
+            materializeFlags();
+        return flags_;
+    }
+
 private:
     const CPUModel cpuModel_;
     const uint8_t shiftMask_;
     const uint8_t prefetchQueueLength_;
     SystemBus& bus_;
     InterruptFunc intFunc_;
+    bool intPending_ = false;
     InstructionDecodeResult currentInstruction;
-    struct {
-        CPUState state;
+
+    // Instruction handlers are resolved once per decoded instruction (see resolveHandler)
+    using InstructionHandler = void (CPU::*)();
+    enum class OperandKind { reg, mem, imm8, imm, other };
+
+    // Offset of the memory operand as (disp + (base & baseMask) + ((index & indexMask) << scale)) & offsetMask,
+    // with the ModR/M, SIB and segment override resolved when the instruction is decoded (see lowerAddress)
+    struct AddressFormula {
+        std::uint64_t disp;
+        std::uint64_t offsetMask; // calcAddressNoMask
+        std::uint64_t addressMask; // calcAddress
+        std::uint32_t baseMask;
+        std::uint32_t indexMask;
+        std::uint8_t base;
+        std::uint8_t index;
+        std::uint8_t scale;
+        SReg sreg;
+    };
+
+    // A decoded instruction lowered for execution (see lowerInstruction). Compact ops are run by their
+    // handler from these fields alone, the others (executeGeneric, control transfers, LOCK) also need
+    // the full decode result. Blocks run as a loop over their ops (see runBlock), which is also what the
+    // block compiler (cpu_jit.cpp) translates.
+    struct MicroOp {
+        InstructionHandler handler;
+        AddressFormula address; // Memory operand
+        std::uint64_t imm; // Immediate or relative operand, sign extended
+        const InstructionDecodeResult* ins; // Stored next to the op in the decode/block cache
+        std::uint8_t dst; // Register index of the first operand
+        std::uint8_t src; // Register index of the second operand
+        std::uint8_t size; // Operation size
+        std::uint8_t length; // Instruction bytes
+        std::uint8_t cycles; // Fetch and execution cost, memory accesses are counted separately
+        bool compact; // The handler doesn't need ins
+    };
+    MicroOp currentOp_ {};
+
+    // Registers are from before the instruction was executed
+    struct HistoryEntry {
+        std::uint64_t ip;
+        std::uint32_t regs[8];
+        std::uint16_t sregs[6];
+        std::uint8_t defaultOperandSize;
+        std::uint32_t flags;
+        LazyFlags lazyFlags;
         uint8_t instructionBytes[MaxInstructionBytes];
         int exception;
-    } history_[MaxHistory];
+    };
+    HistoryMode historyMode_ = HistoryMode::off;
+    std::vector<HistoryEntry> history_;
+    std::vector<CPUState> historyState_; // Only for HistoryMode::full
+    size_t historyCount_;
+    int lastException_;
     size_t instructionsExecuted_;
+    std::uint32_t busAccesses_ = 0; // Memory and I/O accesses not yet charged, see chargeBusAccesses
     uint64_t currentIp_;
+    std::optional<CPUException> pendingException_; // Delivered at the end of the current instruction
     bool halted_;
-    uint32_t exceptionTraceMask_ = UINT32_MAX & ~(1 << 0); // #DE
+    uint32_t exceptionTraceMask_ = UINT32_MAX & ~(1 << CPUExceptionNumber::DivisionError | 1 << CPUExceptionNumber::PageFault); // Page faults are routine with paging
 
     static constexpr size_t maxControlTransferHistory = 64;
     struct {
@@ -248,27 +405,177 @@ private:
         uint32_t count;
     } controlTransferHistory_[maxControlTransferHistory];
     size_t controlTransferHistoryCount_ = 0;
+    std::string vxdDebugOut_; // Out_Debug_String/Out_Debug_Char output up to the next newline
+
+    // Decoded instructions by physical address (only instructions that don't cross a page)
+    static constexpr size_t DecodeCacheSize = 4096; // Keep power of two
+    struct DecodeCacheEntry {
+        std::uint64_t physicalAddress;
+        std::uint32_t key;
+        std::uint32_t version[2]; // Versions of the first/last write watch block
+        InstructionDecodeResult ins;
+        MicroOp op;
+    };
+    bool decodeCacheEnabled_;
+    bool fastFetchEnabled_;
+    DecodeCacheStats decodeCacheStats_ {};
+    std::vector<DecodeCacheEntry> decodeCache_;
+    SparseTable<std::uint32_t, SystemBus::TableChunkShift - SystemBus::WriteWatchShift> codeBlockVersion_; // Per write watch block
+
+    // Decoded blocks by physical address of their first instruction. A block ends at the first
+    // instruction that may transfer control or change how the following code is decoded.
+    static constexpr size_t BlockCacheSize = 1024; // Keep power of two
+    static constexpr size_t MaxBlockInstructions = 32;
+    static constexpr std::uint32_t BlockHotCount = 16;
+    using NativeBlock = std::uint32_t (*)(CPU* cpu); // Returns the number of instructions executed
+    struct DecodedBlock {
+        std::uint64_t physicalAddress;
+        std::uint32_t key;
+        std::uint32_t version[2]; // Versions of the first/last write watch block
+        std::uint32_t length; // Instruction bytes, 0 until the block has been completely recorded
+        std::uint32_t entryCount;
+        std::vector<MicroOp> instructions;
+        std::vector<InstructionDecodeResult> decoded; // Referenced by the ops, never reallocated once recording starts
+        NativeBlock native; // Compiled code, null until the block has been compiled
+    };
+    BlockCacheMode blockCacheMode_ = BlockCacheMode::hot;
+    std::vector<DecodedBlock> blockCache_;
+    DecodedBlock* activeBlock_ = nullptr; // Being executed
+    DecodedBlock* recordingBlock_ = nullptr; // Being built from the instructions as they're decoded
+    size_t activeBlockIndex_ = 0;
+    std::uint64_t blockIp_ = 0; // IP of the next instruction in the active/recording block
+    std::uint32_t recordedLength_ = 0;
+    bool blockBoundary_ = true; // Look for a block at the next instruction
+    std::exception_ptr blockException_; // Thrown by an instruction in runBlock (or native code), rethrown by step()
+
+    // Native code for the blocks
+    static constexpr size_t JitCodeBufferSize = 4 << 20;
+    bool jitEnabled_ = false;
+    std::unique_ptr<JitCodeBuffer> jitCode_;
+
+    // Linear page -> host memory for pages backed by plain RAM/ROM. Complements the architectural
+    // TLB (faults and accessed/dirty bits are handled when an entry is filled).
+    static constexpr size_t FastTLBSize = 256; // Keep power of two
+    struct FastTLBEntry {
+        std::uint64_t tag; // Linear page address | 1 if filled at CPL 3
+        std::uint64_t physicalAddress;
+        std::uint8_t* host;
+    };
+    FastTLBEntry fastTlb_[2 * FastTLBSize]; // Read entries followed by write entries
+    // Indices of filled entries so flushing (e.g. on every CR3 load) doesn't have to clear everything
+    std::uint16_t fastTlbFilled_[2 * FastTLBSize];
+    size_t fastTlbFilledCount_ = 2 * FastTLBSize; // Full flush needed
+
+    // Host memory that code at IPs [fetchWindowIp_, fetchWindowIp_ + fetchWindowSize_) is decoded from by
+    // fastFetchDecode, i.e. the rest of the page (within the CS limit). Valid until IP leaves it, CS (or CPL)
+    // changes or the fast TLB is flushed (CR0/CR3 writes and memory map changes).
+    const std::uint8_t* fetchWindowHost_ = nullptr;
+    std::uint64_t fetchWindowIp_ = 0;
+    std::uint64_t fetchWindowSize_ = 0;
 
     // Instruction fetching
     void instructionPrefetch();
     bool instructionFetch(bool prefetch);
+    bool fetchPagePresent();
+    std::uint8_t fetchCodeByte(std::uint64_t offset);
+    bool inFetchWindow() const
+    {
+        return ip_ - fetchWindowIp_ < fetchWindowSize_;
+    }
+    void flushFetchWindow()
+    {
+        fetchWindowSize_ = 0;
+    }
+    void fillFetchWindow();
+    InstructionDecodeResult fastFetchDecode();
+    bool instructionDecode();
+
+    // Decode cache
+    std::optional<std::uint64_t> instructionPhysicalAddress();
+    std::uint32_t decodeCacheKey() const;
+    std::uint32_t codeBlockVersion(std::uint64_t physicalAddress) const;
+    bool decodeCacheLookup();
+    void decodeCacheInsert();
+    void flushDecodeCache();
+
+    // Block cache
+    bool blockCacheLookup();
+    void blockCacheNext();
+    void blockCacheDecoded();
+    void blockCacheRecord();
+    bool blockValid(const DecodedBlock& b) const;
+    void leaveBlock();
+    bool runBlock();
+    bool blockExecute(const MicroOp& op);
+
+    // JIT
+    NativeBlock jitBlock(DecodedBlock& b);
+    bool jitCompile(DecodedBlock& b);
+    void jitFlush();
+    // Called from the generated code
+    static bool jitInterpret(CPU* cpu, const MicroOp* op);
+    static bool jitCondition(CPU* cpu, std::uint32_t cond);
+    static void jitMaterializeFlags(CPU* cpu);
 
     SegmentedAddress currentSp() const;
 
     void showState(const CPUState& state, const uint8_t* instructionBytes);
+    void recordHistory(HistoryEntry& entry) const;
+    void showHistoryEntry(const HistoryEntry& entry, const HistoryEntry& after);
 
+    LazyFlags lazyFlags_ {};
     void updateFlags(std::uint64_t value, std::uint64_t carry, std::uint32_t flagsMask);
+    template<std::uint8_t Size>
+    void updateFlags(std::uint64_t value, std::uint64_t carry, std::uint32_t flagsMask);
+    void materializeFlags();
+
+    // Returns flags_ with (at least) the flags in Needed up to date
+    template<std::uint32_t Needed>
+    std::uint32_t currentFlags() const
+    {
+        return EvalLazyFlags(flags_, lazyFlags_, Needed);
+    }
     void setFlags(std::uint32_t value);
     uint32_t filterFlags(std::uint32_t flags, bool op16bit);
 
     // EA
     std::uint64_t readEA(int index);
     void writeEA(int index, std::uint64_t value);
-    SegmentedAddress calcAddress(const DecodedEA& ea) const;
-    SegmentedAddress calcAddressNoMask(const DecodedEA& ea) const;
+    AddressFormula lowerAddress() const;
+    void lowerInstruction();
+    void loadMicroOp(const MicroOp& op);
+    SegmentedAddress calcAddress() const;
+    SegmentedAddress calcAddressNoMask() const;
+    void checkMemoryOperand(const DecodedEA& ea) const;
+    template<std::uint8_t Size>
+    std::uint64_t readReg(std::uint8_t regNum) const;
+    template<std::uint8_t Size>
+    void writeReg(std::uint8_t regNum, std::uint64_t value);
+    template<std::uint8_t Size, OperandKind Kind>
+    std::uint64_t readSource();
+
+    // Fast TLB
+    std::uint64_t fastTlbTag(std::uint64_t linearAddress) const;
+    static size_t fastTlbIndex(std::uint64_t linearAddress, bool forWrite)
+    {
+        return (forWrite ? FastTLBSize : 0) + ((linearAddress >> PT32_SHIFT) & (FastTLBSize - 1));
+    }
+    const FastTLBEntry* fastTlbLookup(std::uint64_t linearAddress, std::uint8_t size, bool forWrite);
+    const FastTLBEntry* fastTlbFill(std::uint64_t linearAddress, std::uint8_t size, bool forWrite, std::uint32_t lookupFlags = 0);
+    void flushFastTLB();
 
     // Paging
+    std::optional<std::uint64_t> tryPageLookup(std::uint64_t linearAddress, std::uint32_t lookupFlags, std::uint32_t& errorCode);
     std::uint64_t pageLookup(std::uint64_t linearAddress, std::uint32_t lookupFlags);
+    bool pagePresent(std::uint64_t linearAddress, std::uint32_t lookupFlags);
+
+    // Instructions are charged their fetch/execution cost when decoded plus BusAccessCycles for each
+    // (logical) memory or I/O access, no matter how many bus accesses it's split into
+    static constexpr std::uint32_t BusAccessCycles = 2;
+    void chargeBusAccesses()
+    {
+        bus_.addCycles(std::exchange(busAccesses_, 0) * BusAccessCycles);
+    }
 
     // Physical access
     std::uint64_t readMemPhysical(std::uint64_t address, std::uint8_t size);
@@ -284,6 +591,7 @@ private:
     void writeMem(const SegmentedAddress& address, std::uint64_t value, std::uint8_t size);
     std::uint64_t readMem(const SegmentedAddress& address, std::uint8_t size);
     std::optional<std::uint64_t> peekMem(const SegmentedAddress& address, std::uint8_t size);
+    bool prepareAccess(const SegmentedAddress& address, std::uint8_t size, bool forWrite);
 
     // Memory access helpers
     std::uint64_t descriptorLinearAddress(std::uint16_t value);
@@ -300,6 +608,27 @@ private:
 
     enum class ControlTransferType { jump, call, int32, int16, iret, retf, max };
     void doStep();
+    void executeDecoded();
+    void executeGeneric();
+    void raiseException(CPUExceptionNumber exceptionNo, std::uint32_t errorCode = 0);
+    void handleException(const CPUException& e);
+
+    // Specialized instruction handlers
+    OperandKind operandKind(int index) const;
+    InstructionHandler resolveHandler(bool& compact) const;
+    template<InstructionMnem Mnem>
+    InstructionHandler binaryHandler() const;
+    template<InstructionMnem Mnem, std::uint8_t Size>
+    static InstructionHandler binaryHandler(OperandKind dst, OperandKind src);
+    template<InstructionMnem Mnem, std::uint8_t Size, OperandKind Dst, OperandKind Src>
+    void executeBinary();
+    template<InstructionMnem Mnem, std::uint8_t Size, OperandKind Dst>
+    void executeIncDec();
+    template<InstructionMnem Mnem, std::uint8_t Size>
+    void executePushPop();
+    template<std::uint8_t Cond>
+    void executeJcc();
+
     void doControlTransfer(std::uint16_t cs, std::uint64_t ip, ControlTransferType type);
     void doNearControlTransfer(ControlTransferType type);
     void doInterrupt(int interrupt, std::uint32_t errorCode = 0);
@@ -314,8 +643,11 @@ private:
     void clearSreg(SReg sr);
     void clearAllSregs();
 
+    static constexpr std::uint64_t MaxRepeatCount = 4096; // REP iterations per step
     template<InstructionMnem>
     void doStringInstruction();
+    template<InstructionMnem>
+    bool bulkStringInstruction(SReg ds);
 
     template <InstructionMnem>
     void doBitInstruction();
@@ -337,9 +669,40 @@ private:
     void checkIpLimit(uint16_t cs, uint64_t ip);
 };
 
+void ShowCPUState(CPU& cpu, Logger& log); // Brings the flags up to date first
+
 constexpr bool Parity(uint8_t v) // Returns true if parity bit should be set
 {
     return (!((0x6996 >> ((v ^ (v >> 4)) & 0xf)) & 1));
 }
 
+// Returns flags with the pending flags in mask calculated
+inline std::uint32_t EvalLazyFlags(std::uint32_t flags, const LazyFlags& lazyFlags, std::uint32_t mask)
+{
+    mask &= lazyFlags.mask;
+    if (!mask)
+        return flags;
+
+    assert(lazyFlags.size == 1 || lazyFlags.size == 2 || lazyFlags.size == 4);
+    const std::uint64_t msbMask = std::uint64_t(1) << (8 * lazyFlags.size - 1);
+    const std::uint64_t value = lazyFlags.result & ((msbMask << 1) - 1);
+    const std::uint64_t carry = lazyFlags.carry;
+
+    std::uint32_t res = 0;
+    if ((mask & EFLAGS_MASK_CF) && (carry & msbMask))
+        res |= EFLAGS_MASK_CF;
+    if ((mask & EFLAGS_MASK_PF) && Parity(static_cast<uint8_t>(value)))
+        res |= EFLAGS_MASK_PF;
+    if ((mask & EFLAGS_MASK_AF) && (carry & (1 << 3)))
+        res |= EFLAGS_MASK_AF;
+    if ((mask & EFLAGS_MASK_ZF) && !value)
+        res |= EFLAGS_MASK_ZF;
+    if ((mask & EFLAGS_MASK_SF) && (value & msbMask))
+        res |= EFLAGS_MASK_SF;
+    // TODO: Check if overflow is correct
+    if ((mask & EFLAGS_MASK_OF) && (((carry << 1) ^ carry) & msbMask))
+        res |= EFLAGS_MASK_OF;
+    return (flags & ~mask) | res;
+}
+
 #endif
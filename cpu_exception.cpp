@@ -44,12 +44,23 @@ static_assert(std::size(CPUExceptionNumberShortText) == CPUExceptionNumber::Exce
 
 CPUException::CPUException(CPUExceptionNumber exceptionNo, std::uint32_t errorCode)
     : exceptionNo_ { exceptionNo }
-    , description_ { std::format("CPUException(0x{:02X}) - {} {}{}", static_cast<std::uint8_t>(exceptionNo), CPUExceptionNumberShortText[exceptionNo], CPUExceptionNumberText[exceptionNo],  exceptionNo < 32 && (CPUExceptionErrorCodeMask & (1 << exceptionNo)) ? std::format(" ErrorCode 0x{:08X}", errorCode) : "") }
     , errorCode_ { errorCode }
 {
     assert(errorCode == 0 || hasErrorCode());
 }
 
+const char* CPUException::what() const noexcept
+{
+    if (description_.empty()) {
+        try {
+            description_ = std::format("CPUException(0x{:02X}) - {} {}{}", static_cast<std::uint8_t>(exceptionNo_), CPUExceptionNumberShortText[exceptionNo_], CPUExceptionNumberText[exceptionNo_], hasErrorCode() ? std::format(" ErrorCode 0x{:08X}", errorCode_) : "");
+        } catch (...) {
+            return "CPUException";
+        }
+    }
+    return description_.c_str();
+}
+
 
 std::string FormatExceptionNumber(int exceptionNo)
 {
@@ -45,10 +45,8 @@ class CPUException : public std::exception {
 public:
     explicit CPUException(CPUExceptionNumber exceptionNo, std::uint32_t errorCode = 0);
 
-    const char* what() const noexcept override
-    {
-        return description_.c_str();
-    }
+    // The description is only formatted when asked for
+    const char* what() const noexcept override;
 
     CPUExceptionNumber exceptionNo() const
     {
@@ -68,7 +66,7 @@ public:
 
 private:
     CPUExceptionNumber exceptionNo_;
-    std::string description_;
+    mutable std::string description_;
     std::uint32_t errorCode_;
 };
 
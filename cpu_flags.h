@@ -36,6 +36,8 @@ constexpr std::uint32_t EFLAGS_MASK_IOPL = 3 << EFLAGS_BIT_IOPL; // 0x0000`3000
 constexpr std::uint32_t EFLAGS_MASK_NT = 1 << EFLAGS_BIT_NT; // 0x0000`4000
 constexpr std::uint32_t EFLAGS_MASK_VM = 1 << EFLAGS_BIT_VM; // 0x0002`0000
 
+constexpr std::uint32_t DEFAULT_EFLAGS_RESULT_MASK = EFLAGS_MASK_OF | EFLAGS_MASK_SF | EFLAGS_MASK_ZF | EFLAGS_MASK_AF | EFLAGS_MASK_PF | EFLAGS_MASK_CF;
+
 static inline bool EvalCond(std::uint32_t flags, std::uint8_t cond)
 {
     uint8_t res;
@@ -0,0 +1,362 @@
+#include "cpu.h"
+#include "cpu_flags.h"
+#include "jit_x64.h"
+#include "util.h"
+#include <utility>
+
+//
+// Blocks from the block cache compiled to x86-64 code. The guest state stays in the CPU object (RBX
+// points to it and R12D holds EIP of the first instruction) so the interpreter can take over after
+// any instruction. The input is the block's micro-ops: only 32-bit register forms of MOV, the ALU
+// instructions, INC/DEC and Jcc are translated, everything else calls back into C++ to run the op
+// (see blockExecute). The code is dropped along with the block when the block cache notices that
+// the instructions changed.
+//
+
+void CPU::jitEnabled(bool enabled)
+{
+    jitEnabled_ = enabled;
+    if (jitEnabled_ && JIT_X64 && !jitCode_)
+        jitCode_ = std::make_unique<JitCodeBuffer>(JitCodeBufferSize);
+}
+
+// Native code for the block (compiling it if needed), null if it has to be interpreted
+CPU::NativeBlock CPU::jitBlock(DecodedBlock& b)
+{
+#if JIT_X64
+    // The generated code assumes 32-bit code (IP wraps at 4GB)
+    if (!protectedMode() || vm86() || defaultOperandSize() != 4)
+        return nullptr;
+    if (!b.native && !jitCompile(b))
+        return nullptr;
+    return b.native;
+#else
+    (void)b;
+    return nullptr;
+#endif
+}
+
+void CPU::jitFlush()
+{
+    for (auto& b : blockCache_)
+        b.native = nullptr;
+    if (jitCode_)
+        jitCode_->clear();
+}
+
+bool CPU::jitCondition(CPU* cpu, std::uint32_t cond)
+{
+    return EvalCond(cpu->currentFlags<DEFAULT_EFLAGS_RESULT_MASK>(), static_cast<std::uint8_t>(cond));
+}
+
+void CPU::jitMaterializeFlags(CPU* cpu)
+{
+    cpu->materializeFlags();
+}
+
+#if JIT_X64
+
+using R = X64Emitter;
+
+enum class JitOpKind { interpret, mov, alu, incDec, jcc };
+
+static JitOpKind ClassifyOp(const InstructionDecodeResult& ins)
+{
+    if (ins.prefixes & PREFIX_LOCK)
+        return JitOpKind::interpret; // #UD
+    const auto src = ins.ea[1].type;
+    const bool regSrc = src == DecodedEAType::reg32 || src == DecodedEAType::imm8 || src == DecodedEAType::imm32;
+    const bool regDst = ins.ea[0].type == DecodedEAType::reg32 && ins.operationSize == 4;
+
+    switch (ins.instruction->mnemonic) {
+    case InstructionMnem::MOV:
+        return ins.numOperands == 2 && regDst && src != DecodedEAType::imm8 && regSrc ? JitOpKind::mov : JitOpKind::interpret;
+    case InstructionMnem::ADD:
+    case InstructionMnem::SUB:
+    case InstructionMnem::CMP:
+    case InstructionMnem::AND:
+    case InstructionMnem::TEST:
+    case InstructionMnem::OR:
+    case InstructionMnem::XOR:
+        return ins.numOperands == 2 && regDst && regSrc ? JitOpKind::alu : JitOpKind::interpret;
+    case InstructionMnem::INC:
+    case InstructionMnem::DEC:
+        return ins.numOperands == 1 && regDst ? JitOpKind::incDec : JitOpKind::interpret;
+    case InstructionMnem::JO:
+    case InstructionMnem::JNO:
+    case InstructionMnem::JB:
+    case InstructionMnem::JNB:
+    case InstructionMnem::JZ:
+    case InstructionMnem::JNZ:
+    case InstructionMnem::JBE:
+    case InstructionMnem::JNBE:
+    case InstructionMnem::JS:
+    case InstructionMnem::JNS:
+    case InstructionMnem::JP:
+    case InstructionMnem::JNP:
+    case InstructionMnem::JL:
+    case InstructionMnem::JNL:
+    case InstructionMnem::JLE:
+    case InstructionMnem::JNLE:
+        return JitOpKind::jcc;
+    default:
+        return JitOpKind::interpret;
+    }
+}
+
+// Generates the code for a block. Returns false if there isn't room for it.
+bool CPU::jitCompile(DecodedBlock& b)
+{
+    const auto offsetOf = [this](const void* field) {
+        return static_cast<std::int32_t>(static_cast<const char*>(field) - reinterpret_cast<const char*>(this));
+    };
+    const auto ipOffset = offsetOf(&ip_);
+    const auto flagsOffset = offsetOf(&flags_);
+    const auto resultOffset = offsetOf(&lazyFlags_.result);
+    const auto carryOffset = offsetOf(&lazyFlags_.carry);
+    const auto maskOffset = offsetOf(&lazyFlags_.mask);
+    const auto sizeOffset = offsetOf(&lazyFlags_.size);
+
+    R e;
+    const auto epilogue = e.newLabel();
+    std::vector<std::pair<R::Label, std::uint32_t>> exits; // Instruction count to return
+
+    // RBX = this, R12D = EIP of the first instruction. The stack is kept 16-byte aligned, with 32 bytes of shadow space for Win64.
+    constexpr std::int8_t frameSize = 40;
+    e.push(R::RBX);
+    e.push(R::R12);
+    e.addRsp(-frameSize);
+    e.mov64(R::RBX, R::ArgReg0);
+    e.load32(R::R12, R::RBX, ipOffset);
+
+    const auto setIp = [&](std::uint32_t offset) {
+        e.mov32(R::RAX, R::R12);
+        e.alu32(R::AluOp::add, R::RAX, offset);
+        e.store64(R::RBX, ipOffset, R::RAX);
+    };
+    const auto exitWith = [&](std::uint32_t count) {
+        e.mov32(R::RAX, count);
+        e.jmp(epilogue);
+    };
+    const auto callHelper = [&](const void* func, std::uint64_t arg) {
+        e.mov64(R::ArgReg0, R::RBX);
+        e.mov64(R::ArgReg1, arg);
+        e.call(func);
+    };
+    // Continues with the next instruction if the helper returned true
+    const auto exitIfFalse = [&](std::uint32_t count) {
+        const auto label = e.newLabel();
+        e.test8(R::RAX, R::RAX);
+        e.jcc(R::Z, label);
+        exits.emplace_back(label, count);
+    };
+
+    // What the lazy flags hold when known at compile time: the result of a 32-bit ALU instruction,
+    // possibly with CF already in flags_ (INC/DEC)
+    enum class FlagsState { unknown, alu, incDec } flagsState = FlagsState::unknown;
+    std::uint32_t offset = 0;
+    bool ipUpdated = false;
+    const auto count = static_cast<std::uint32_t>(b.instructions.size());
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const auto& op = b.instructions[i];
+        const auto& ins = *op.ins;
+        const auto next = offset + op.length;
+        const auto opAddress = reinterpret_cast<std::uint64_t>(&op);
+
+        switch (ClassifyOp(ins)) {
+        case JitOpKind::interpret:
+            setIp(offset);
+            callHelper(reinterpret_cast<const void*>(&CPU::jitInterpret), opAddress);
+            flagsState = FlagsState::unknown;
+            if (i + 1 == count)
+                ipUpdated = true; // Control transfers etc. end the block
+            else
+                exitIfFalse(i + 1);
+            break;
+        case JitOpKind::mov:
+            if (ins.ea[1].type == DecodedEAType::reg32)
+                e.load32(R::RAX, R::RBX, offsetOf(&regs_[op.src]));
+            else
+                e.mov32(R::RAX, static_cast<std::uint32_t>(op.imm));
+            e.store32(R::RBX, offsetOf(&regs_[op.dst]), R::RAX);
+            break;
+        case JitOpKind::alu:
+        case JitOpKind::incDec: {
+            const auto mnem = ins.instruction->mnemonic;
+            const bool incDec = mnem == InstructionMnem::INC || mnem == InstructionMnem::DEC;
+            const auto dstOffset = offsetOf(&regs_[op.dst]);
+            std::uint32_t flagsMask = DEFAULT_EFLAGS_RESULT_MASK;
+            if (incDec) {
+                // CF isn't updated, calculate it first if it's still pending (see updateFlags)
+                flagsMask &= ~EFLAGS_MASK_CF;
+                const auto skip = e.newLabel();
+                e.test32(R::RBX, maskOffset, EFLAGS_MASK_CF);
+                e.jcc(R::Z, skip);
+                e.mov64(R::ArgReg0, R::RBX);
+                e.call(reinterpret_cast<const void*>(&CPU::jitMaterializeFlags));
+                e.bind(skip);
+            }
+
+            // EAX = l, ECX = r, EDX = result, then EAX = carry as in HANDLE_ADD_CARRY/HANDLE_SUB_CARRY
+            e.load32(R::RAX, R::RBX, dstOffset);
+            if (incDec)
+                e.mov32(R::RCX, 1U);
+            else if (ins.ea[1].type == DecodedEAType::reg32)
+                e.load32(R::RCX, R::RBX, offsetOf(&regs_[op.src]));
+            else
+                e.mov32(R::RCX, static_cast<std::uint32_t>(op.imm));
+            e.mov32(R::RDX, R::RAX);
+            switch (mnem) {
+            case InstructionMnem::ADD:
+            case InstructionMnem::INC:
+                e.alu32(R::AluOp::add, R::RDX, R::RCX);
+                e.mov32(R::R8, R::RAX);
+                e.alu32(R::AluOp::and_, R::R8, R::RCX); // l & r
+                e.alu32(R::AluOp::or_, R::RAX, R::RCX);
+                e.mov32(R::R9, R::RDX);
+                e.not32(R::R9);
+                e.alu32(R::AluOp::and_, R::RAX, R::R9); // (l | r) & ~result
+                e.alu32(R::AluOp::or_, R::RAX, R::R8);
+                break;
+            case InstructionMnem::SUB:
+            case InstructionMnem::CMP:
+            case InstructionMnem::DEC:
+                e.alu32(R::AluOp::sub, R::RDX, R::RCX);
+                e.mov32(R::R8, R::RAX);
+                e.not32(R::R8);
+                e.alu32(R::AluOp::and_, R::R8, R::RCX); // ~l & r
+                e.alu32(R::AluOp::xor_, R::RAX, R::RCX);
+                e.not32(R::RAX);
+                e.alu32(R::AluOp::and_, R::RAX, R::RDX); // ~(l ^ r) & result
+                e.alu32(R::AluOp::or_, R::RAX, R::R8);
+                break;
+            default:
+                e.alu32(mnem == InstructionMnem::OR ? R::AluOp::or_ : mnem == InstructionMnem::XOR ? R::AluOp::xor_ : R::AluOp::and_, R::RDX, R::RCX);
+                e.mov32(R::RAX, 0U);
+                break;
+            }
+            if (mnem != InstructionMnem::CMP && mnem != InstructionMnem::TEST)
+                e.store32(R::RBX, dstOffset, R::RDX); // The upper half of the 64-bit register is kept
+            e.store64(R::RBX, resultOffset, R::RDX);
+            e.store64(R::RBX, carryOffset, R::RAX);
+            e.store32(R::RBX, maskOffset, flagsMask);
+            e.store8(R::RBX, sizeOffset, 4);
+            flagsState = incDec ? FlagsState::incDec : FlagsState::alu;
+            break;
+        }
+        case JitOpKind::jcc: {
+            assert(i + 1 == count);
+            const auto disp = static_cast<std::int32_t>(op.imm);
+            const auto cond = static_cast<std::uint8_t>(ins.opcode & 0xf);
+
+            // AL bit 0 = the condition without the negation (cond & 1)
+            const auto loadCarry = [&](R::Reg dst) {
+                if (flagsState == FlagsState::incDec) {
+                    e.load32(dst, R::RBX, flagsOffset);
+                    e.alu32(R::AluOp::and_, dst, EFLAGS_MASK_CF);
+                } else {
+                    e.load32(dst, R::RBX, carryOffset);
+                    e.shr32(dst, 31);
+                }
+            };
+            const auto loadZero = [&](R::Reg dst) {
+                e.load32(dst, R::RBX, resultOffset);
+                e.test32(dst, dst);
+                e.setcc(R::Z, dst);
+            };
+            const auto loadOverflow = [&]() { // Into EAX, clobbers ECX
+                e.load32(R::RAX, R::RBX, carryOffset);
+                e.mov32(R::RCX, R::RAX);
+                e.alu32(R::AluOp::add, R::RCX, R::RCX);
+                e.alu32(R::AluOp::xor_, R::RAX, R::RCX);
+            };
+            const auto loadLess = [&]() { // SF != OF into bit 31 of EAX, clobbers ECX/EDX
+                loadOverflow();
+                e.load32(R::RDX, R::RBX, resultOffset);
+                e.alu32(R::AluOp::xor_, R::RAX, R::RDX);
+                e.shr32(R::RAX, 31);
+            };
+            if (flagsState == FlagsState::unknown || (cond >> 1) == 5) { // No shortcut for PF
+                e.mov64(R::ArgReg0, R::RBX);
+                e.mov32(R::ArgReg1, static_cast<std::uint32_t>(cond & ~1));
+                e.call(reinterpret_cast<const void*>(&CPU::jitCondition));
+            } else {
+                switch (cond >> 1) {
+                case 0: // O
+                    loadOverflow();
+                    e.shr32(R::RAX, 31);
+                    break;
+                case 1: // B
+                    loadCarry(R::RAX);
+                    break;
+                case 2: // Z
+                    loadZero(R::RAX);
+                    break;
+                case 3: // BE
+                    loadCarry(R::RCX);
+                    loadZero(R::RAX);
+                    e.alu32(R::AluOp::or_, R::RAX, R::RCX);
+                    break;
+                case 4: // S
+                    e.load32(R::RAX, R::RBX, resultOffset);
+                    e.shr32(R::RAX, 31);
+                    break;
+                case 6: // L
+                    loadLess();
+                    break;
+                default: // LE
+                    loadLess();
+                    loadZero(R::RCX);
+                    e.alu32(R::AluOp::or_, R::RAX, R::RCX);
+                    break;
+                }
+            }
+            const auto taken = e.newLabel();
+            e.test8(R::RAX, R::RAX);
+            e.jcc(cond & 1 ? R::Z : R::NZ, taken);
+            setIp(next);
+            exitWith(count);
+            e.bind(taken);
+            setIp(next + disp); // Wraps like ipMask() for 32-bit code
+            ipUpdated = true;
+            break;
+        }
+        }
+        offset = next;
+    }
+
+    if (!ipUpdated)
+        setIp(offset);
+    e.mov32(R::RAX, count);
+    e.bind(epilogue);
+    e.addRsp(frameSize);
+    e.pop(R::R12);
+    e.pop(R::RBX);
+    e.ret();
+    for (const auto& [label, executed] : exits) {
+        e.bind(label);
+        exitWith(executed);
+    }
+
+    const auto& code = e.finish();
+    auto native = jitCode_->install(code);
+    if (!native) {
+        // Out of room, start over (no generated code is running at this point)
+        jitFlush();
+        native = jitCode_->install(code);
+        if (!native)
+            return false;
+    }
+    b.native = reinterpret_cast<NativeBlock>(const_cast<void*>(native));
+    ++decodeCacheStats_.nativeBlocks;
+    return true;
+}
+
+#else
+
+bool CPU::jitCompile(DecodedBlock&)
+{
+    return false;
+}
+
+#endif
@@ -1,8 +1,11 @@
 #include "debugger.h"
 #include "util.h"
 
+#include <atomic>
 #include <iostream>
 #include <string_view>
+#include <algorithm>
+#include <functional>
 #include <optional>
 #include <print>
 #include <variant>
@@ -206,16 +209,17 @@ void RegSet(RegValueType rt, std::uint64_t value)
     }
 }
 
-volatile bool breakActivated;
+// Incremented for each Ctrl+C, so every debugger (one per machine) breaks once
+std::atomic<unsigned> breakCount;
+static_assert(std::atomic<unsigned>::is_always_lock_free); // Used from a signal handler
 
 void BreakHandler(int)
 {
-    breakActivated = true;
+    breakCount.fetch_add(1, std::memory_order_relaxed);
 }
 
 void InstallBreakHandler(void)
 {
-    breakActivated = false;
     signal(SIGINT, &BreakHandler);
 }
 
@@ -632,6 +636,7 @@ struct std::formatter<DebuggerMemState> : std::formatter<const char*> {
 Debugger::Debugger(CPU& cpu, SystemBus& bus)
     : cpu_ { cpu }
     , bus_ { bus }
+    , breakCount_ { breakCount.load(std::memory_order_relaxed) }
 {
     InstallBreakHandler();
 }
@@ -707,7 +712,8 @@ bool Debugger::checkBreakPoint(const BreakPoint& bp)
 
 void Debugger::check(void)
 {
-    if (breakActivated) {
+    if (const auto count = breakCount.load(std::memory_order_relaxed); count != breakCount_) [[unlikely]] {
+        breakCount_ = count;
         InstallBreakHandler();
         activate();
     }
@@ -1033,7 +1039,18 @@ bool Debugger::handleLine(const std::string& line)
                 std::println("{:02X} {:016X} {}", offset, descValue, desc);
         }
     } else if (cmd == "h") {
-        cpu_.showHistory();
+        if (auto mode = parser.getWord(); !mode.empty()) {
+            if (mode == "off")
+                cpu_.historyMode(CPU::HistoryMode::off);
+            else if (mode == "compact")
+                cpu_.historyMode(CPU::HistoryMode::compact);
+            else if (mode == "full")
+                cpu_.historyMode(CPU::HistoryMode::full);
+            else
+                throw std::runtime_error { std::format("Invalid history mode {}", mode) };
+        } else {
+            cpu_.showHistory();
+        }
     } else if (cmd == "hc") {
         cpu_.showControlTransferHistory();
     } else if (cmd == "idt") {
@@ -1082,22 +1099,36 @@ bool Debugger::handleLine(const std::string& line)
                 throw std::runtime_error { std::format("Invalid register {}", regName) };
             }
         }
-        ShowCPUState(cpu_);
+        ShowCPUState(cpu_, bus_.log());
     } else if (cmd == "search") {
         auto bytes = HexDecode(parser.getWord());
         if (bytes.empty())
             throw std::runtime_error { "Missing argument" };
 
-        const uint64_t start = 0;
-        const uint64_t end = 1 << 20;
-        for (uint64_t pos = start, sz = bytes.size(); pos + sz <= end; ++pos) {
-            if (bus_.peekU8(pos) != bytes[0])
+        // Search all mapped memory one page at a time, keeping the tail of the previous page so matches can straddle pages
+        const std::boyer_moore_horspool_searcher searcher { bytes.begin(), bytes.end() };
+        const auto end = bus_.memoryEnd();
+        std::vector<uint8_t> buffer;
+        uint64_t bufferStart = 0;
+        for (uint64_t page = 0; page < end; page += SystemBus::MemPageSize) {
+            if (buffer.size() >= bytes.size()) {
+                const auto keep = bytes.size() - 1;
+                buffer.erase(buffer.begin(), buffer.end() - keep);
+                bufferStart = page - keep;
+            } else if (buffer.empty()) {
+                bufferStart = page;
+            }
+            const auto pos = buffer.size();
+            buffer.resize(pos + SystemBus::MemPageSize);
+            try {
+                bus_.peekBlock(page, buffer.data() + pos, SystemBus::MemPageSize);
+            } catch (...) {
+                // Unmapped
+                buffer.clear();
                 continue;
-            bool found = true;
-            for (uint64_t j = 1; j < bytes.size() && found; ++j)
-                found &= bus_.peekU8(pos + j) == bytes[j];
-            if (found)
-                std::println("Found at {:X}", pos);
+            }
+            for (auto it = buffer.begin(); (it = std::search(it, buffer.end(), searcher)) != buffer.end(); ++it)
+                std::println("Found at {:X}", bufferStart + (it - buffer.begin()));
         }
     } else if (cmd == "sr") {
         for (int i = 0; i < 6; ++i) {
@@ -58,6 +58,7 @@ private:
     BreakPoint breakPoints_[maxBreakPoints];
     BreakPoint autoBreakPoint_;
     uint32_t traceCount_ = 0;
+    unsigned breakCount_; // Ctrl+C presses seen
     std::function<void (bool)> onSetActive_;
     std::map<std::string, FunctionCallback> functions_;
 
@@ -2,9 +2,15 @@
 #define DECODE_H
 
 #include <cstdint>
+#include <cassert>
+#include <concepts>
 #include <functional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include "opcodes.h"
+#include "util.h"
 #include "address.h"
 #include "cpu_registers.h"
 
@@ -19,6 +25,42 @@ enum class CPUModel {
     i80586,
 };
 
+// Model names as used in options and reports
+inline constexpr std::pair<const char*, CPUModel> CPUModelNames[] = {
+    { "8088", CPUModel::i8088 },
+    { "8086", CPUModel::i8086 },
+    { "80186", CPUModel::i80186 },
+    { "80286", CPUModel::i80286 },
+    { "80386sx", CPUModel::i80386sx },
+    { "80386", CPUModel::i80386 },
+    { "80486", CPUModel::i80486 },
+    { "80586", CPUModel::i80586 },
+};
+
+constexpr const char* CPUModelName(CPUModel model)
+{
+    for (const auto& [name, m] : CPUModelNames) {
+        if (m == model)
+            return name;
+    }
+    return "unknown";
+}
+
+// Models that have decode tables (see GetDecodeTable), the others can't run code yet
+constexpr bool CPUModelSupported(CPUModel model)
+{
+    switch (model) {
+    case CPUModel::i8088:
+    case CPUModel::i8086:
+    case CPUModel::i80386sx:
+    case CPUModel::i80386:
+    case CPUModel::i80586:
+        return true;
+    default:
+        return false;
+    }
+}
+
 struct CPUInfo {
     CPUModel model;
     std::uint8_t defaultOperandSize;
@@ -107,6 +149,7 @@ struct InstructionDecodeResult {
 };
 
 InstructionDecodeResult Decode(const CPUInfo& cpuInfo, std::function<std::uint8_t()> instructionFetch);
+InstructionDecodeResult Decode(const CPUInfo& cpuInfo, std::span<const std::uint8_t> bytes);
 
 using LabelLookupFunc = std::function<std::string (std::uint64_t)>;
 
@@ -151,6 +194,360 @@ constexpr bool Modrm32HasDisp(uint8_t modrm)
     }
 }
 
+struct DecodeTables {
+    const Instruction* instructionTable;
+    const std::uint32_t* hasModrm;
+    const Instruction* instructionTable_0F;
+    const std::uint32_t* hasModrm_0F;
+};
+
+const DecodeTables& GetDecodeTable(const CPUInfo& info);
+std::uint8_t ResultSizeFromOpmode(OperandMode opmode, std::uint8_t vSize, InstructionMnem mnemonic);
+
+constexpr uint8_t OPCODE_ES = 0x26;
+constexpr uint8_t OPCODE_CS = 0x2E;
+constexpr uint8_t OPCODE_SS = 0x36;
+constexpr uint8_t OPCODE_DS = 0x3E;
+constexpr uint8_t OPCODE_FS = 0x64;
+constexpr uint8_t OPCODE_GS = 0x65;
+constexpr uint8_t OPCODE_OPER = 0x66;
+constexpr uint8_t OPCODE_ADDR = 0x67;
+constexpr uint8_t OPCODE_LOCK = 0xF0;
+constexpr uint8_t OPCODE_REPNZ = 0xF2;
+constexpr uint8_t OPCODE_REPZ = 0xF3;
+
+// Decode one instruction calling instructionFetch() for each byte. A template so the fetch can be
+// inlined, the std::function/span overloads above are thin wrappers around this.
+template <typename InstructionFetch>
+    requires std::invocable<InstructionFetch&>
+InstructionDecodeResult Decode(const CPUInfo& cpuInfo, InstructionFetch&& instructionFetch)
+{
+    InstructionDecodeResult res {};
+
+    auto ibfetch = [&]() -> std::uint8_t {
+        if (res.numInstructionBytes == MaxInstructionBytes) {
+            res.mnemoic = InstructionMnem::UNDEF;
+            return 0xFF;
+        }
+        auto ib = instructionFetch();
+        res.instructionBytes[res.numInstructionBytes++] = ib;
+        return ib;
+    };
+
+    auto iwfetch = [&]() {
+        std::uint16_t res = ibfetch();
+        res |= ibfetch() << 8;
+        return res;
+    };
+
+    auto idfetch = [&]() {
+        std::uint32_t res = iwfetch();
+        res |= iwfetch() << 16;
+        return res;
+    };
+
+    uint8_t opcode;
+
+    const auto& decodeTables = GetDecodeTable(cpuInfo);
+    auto instructionTable = decodeTables.instructionTable;
+    auto hasModrmTable = decodeTables.hasModrm;
+
+    res.operandSize = cpuInfo.defaultOperandSize;
+    res.addressSize = cpuInfo.defaultOperandSize;
+
+    // Prefixes
+    for (;;) {
+        opcode = ibfetch();
+        if (instructionTable[opcode].mnemonic != InstructionMnem::PREFIX)
+            break;
+        switch (opcode) {
+        case OPCODE_ES:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_ES;
+            break;
+        case OPCODE_CS:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_CS;
+            break;
+        case OPCODE_SS:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_SS;
+            break;
+        case OPCODE_DS:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_DS;
+            break;
+        case OPCODE_FS:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_FS;
+            break;
+        case OPCODE_GS:
+            res.prefixes = (res.prefixes & ~PREFIX_SEG_MASK) | PREFIX_GS;
+            break;
+        case OPCODE_OPER:
+            res.prefixes |= PREFIX_OPER_SIZE;
+            res.operandSize = cpuInfo.defaultOperandSize ^ 6;
+            break;
+        case OPCODE_ADDR:
+            res.prefixes |= PREFIX_ADDR_SIZE;
+            res.addressSize = cpuInfo.defaultOperandSize ^ 6;
+            break;
+        case OPCODE_LOCK:
+            res.prefixes |= PREFIX_LOCK;
+            break;
+        case OPCODE_REPNZ:
+            res.prefixes = (res.prefixes & ~PREFIX_REP_MASK) | PREFIX_REPNZ;
+            break;
+        case OPCODE_REPZ:
+            res.prefixes = (res.prefixes & ~PREFIX_REP_MASK) | PREFIX_REPZ;
+            break;
+        default:
+            throw std::runtime_error { "TODO: Handle prefix " + HexString(opcode) };
+        }
+    }
+
+    uint16_t fullOpcode = opcode;
+
+    if (opcode == 0x0F && decodeTables.instructionTable_0F) {
+        instructionTable = decodeTables.instructionTable_0F;
+        hasModrmTable = decodeTables.hasModrm_0F;
+        opcode = ibfetch();
+        fullOpcode = fullOpcode << 8 | opcode;
+    }
+
+    const auto* ins = &instructionTable[opcode];
+    //if (ins->mnemonic == InstructionMnem::UNDEF)
+    //    throw std::runtime_error { "TODO: Undefined instruction " + HexString(fullOpcode) };
+
+    const bool hasModrm = hasModrmTable[opcode / 32] & (1 << (opcode % 32));
+    const uint8_t modrm = hasModrm ? ibfetch() : 0;
+
+    if (ins->mnemonic == InstructionMnem::TABLE) {
+        assert(hasModrm);
+        ins = &ins->table[ModrmReg(modrm)];
+    }
+
+    res.mnemoic = ins->mnemonic;
+    res.instruction = ins;
+    res.opcode = fullOpcode;
+
+    if (ins->operands[0] != OperandMode::None) {
+        res.operationSize = ResultSizeFromOpmode(ins->operands[0], res.operandSize, ins->mnemonic);
+    } else {
+        switch (ins->mnemonic) {
+        case InstructionMnem::DAA:
+        case InstructionMnem::DAS:
+        case InstructionMnem::INSB:
+        case InstructionMnem::MOVSB:
+        case InstructionMnem::LODSB:
+        case InstructionMnem::STOSB:
+        case InstructionMnem::SCASB:
+        case InstructionMnem::CMPSB:
+        case InstructionMnem::OUTSB:
+            res.operationSize = 1;
+            break;
+        default:
+            res.operationSize = res.operandSize;
+        }
+    }
+
+    for (int i = 0; i < MaxInstructionOperands && ins->operands[i] != OperandMode::None; ++i) {
+        auto& ea = res.ea[res.numOperands++];
+        const auto opmode = ins->operands[i];
+
+        if (opmode >= OperandMode::AL && opmode <= OperandMode::BH) {
+            ea.type = DecodedEAType::reg8;
+            ea.regNum = static_cast<uint8_t>(static_cast<int>(opmode) - static_cast<int>(OperandMode::AL));
+            continue;
+        }
+        if (opmode >= OperandMode::eAX && opmode <= OperandMode::eDI) {
+            ea.type = res.operandSize == 4 ? DecodedEAType::reg32 : DecodedEAType::reg16;
+            ea.regNum = static_cast<uint8_t>(static_cast<int>(opmode) - static_cast<int>(OperandMode::eAX));
+            continue;
+        }
+        if (opmode >= OperandMode::ES && opmode <= OperandMode::GS) {
+            ea.type = DecodedEAType::sreg;
+            ea.regNum = static_cast<uint8_t>(static_cast<int>(opmode) - static_cast<int>(OperandMode::ES));
+            continue;
+        }
+        switch (opmode) {
+        case OperandMode::C1:
+            ea.type = DecodedEAType::imm8;
+            ea.immediate = 1;
+            break;
+        case OperandMode::DX:
+            ea.type = DecodedEAType::reg16;
+            ea.regNum = REG_DX;
+            break;
+        case OperandMode::Ap:
+            if (res.operandSize == 4) {
+                ea.type = DecodedEAType::abs16_32;
+                ea.address = idfetch();
+                ea.address |= static_cast<uint64_t>(iwfetch()) << 32;
+            } else {
+                ea.type = DecodedEAType::abs16_16;
+                ea.address = idfetch();
+            }
+            break;
+        case OperandMode::Cd:
+            assert(hasModrm);
+            ea.type = DecodedEAType::creg;
+            ea.regNum = ModrmReg(modrm);
+            break;
+        case OperandMode::Dd:
+            assert(hasModrm);
+            ea.type = DecodedEAType::dreg;
+            ea.regNum = ModrmReg(modrm);
+            break;
+        case OperandMode::Eb:
+            res.operandSize = 1;
+            ea.type = DecodedEAType::reg8;
+            goto HandleE;
+        case OperandMode::Ew:
+            res.operandSize = 2; // Operation sized forced to 2 (e.g. 8C)
+            ea.type = DecodedEAType::reg16;
+            goto HandleE;
+        case OperandMode::Ev:
+        handleEv:
+            ea.type = res.operandSize == 4 ? DecodedEAType::reg32 : DecodedEAType::reg16;
+        HandleE:
+            assert(hasModrm);
+            if (ModrmMod(modrm) == 0b11) {
+                ea.regNum = ModrmRm(modrm);
+                break;
+            }
+            ea.rm = modrm;
+            if (res.addressSize == 4) {
+                ea.type = DecodedEAType::rm32;
+                if (Modrm32HasSib(modrm)) {
+                    ea.sib = ibfetch();
+
+                    if ((ea.sib & 7) == REG_BP && ModrmMod(modrm) == 0b00)
+                        ea.disp = idfetch();
+                }
+                if (Modrm32HasDisp(modrm)) {
+                    if (ModrmMod(modrm) == 0b01)
+                        ea.disp = ibfetch();
+                    else
+                        ea.disp = idfetch();
+                }
+            } else {
+                ea.type = DecodedEAType::rm16;
+                if (ModrmMod(modrm) == 0b01) {
+                    ea.disp = ibfetch();
+                } else if (ModrmMod(modrm) == 0b10 || (ModrmMod(modrm) == 0b00 && ModrmRm(modrm) == 0b110)) {
+                    ea.disp = iwfetch();
+                }
+            }
+            break;
+        case OperandMode::Gb:
+            assert(hasModrm);
+            ea.type = DecodedEAType::reg8;
+            ea.regNum = ModrmReg(modrm);
+            break;
+        case OperandMode::Gv:
+            assert(hasModrm);
+            ea.type = res.operandSize == 4 ? DecodedEAType::reg32 : DecodedEAType::reg16;
+            ea.regNum = ModrmReg(modrm);
+            break;
+        case OperandMode::Gw:
+            assert(hasModrm);
+            ea.type = DecodedEAType::reg16;
+            ea.regNum = ModrmReg(modrm);
+            break;
+        case OperandMode::Ib:
+        case OperandMode::Ibs:
+            ea.type = DecodedEAType::imm8;
+            ea.immediate = ibfetch();
+            break;
+        case OperandMode::Ibss:
+            ea.type = DecodedEAType::imm8;
+            ea.immediate = static_cast<int64_t>(static_cast<int8_t>(ibfetch()));
+            break;
+        case OperandMode::Ivs:
+            if (res.operandSize == 4) {
+                ea.type = DecodedEAType::imm32;
+                ea.immediate = static_cast<int64_t>(static_cast<int32_t>(idfetch()));
+            } else {
+                ea.type = DecodedEAType::imm16;
+                ea.immediate = static_cast<int64_t>(static_cast<int16_t>(iwfetch()));
+            }
+            break;
+        case OperandMode::Iv:
+        case OperandMode::Ivds:
+            if (res.operandSize == 4) {
+                ea.type = DecodedEAType::imm32;
+                ea.immediate = idfetch();
+            } else {
+                ea.type = DecodedEAType::imm16;
+                ea.immediate = iwfetch();
+            }
+            break;
+        case OperandMode::Iw:
+            ea.type = DecodedEAType::imm16;
+            ea.immediate = iwfetch();
+            break;
+        case OperandMode::Jbs:
+            ea.type = DecodedEAType::rel8;
+            ea.immediate = ibfetch();
+            break;
+        case OperandMode::Jvds:
+            if (res.operandSize == 4) {
+                ea.type = DecodedEAType::rel32;
+                ea.immediate = idfetch();
+            } else {
+                ea.type = DecodedEAType::rel16;
+                ea.immediate = iwfetch();
+            }
+            break;
+        case OperandMode::Ob:
+            res.operandSize = 1;
+            goto HandleO;
+        case OperandMode::Ov:
+        HandleO:
+            if (res.addressSize == 2) {
+                ea.type = DecodedEAType::mem16;
+                ea.address = iwfetch();
+            } else {
+                ea.type = DecodedEAType::mem32;
+                ea.address = idfetch();
+            }
+            break;
+        case OperandMode::M:
+        case OperandMode::Ma: // TODO: Can be 16/16 or 32/32
+        case OperandMode::Mp:
+        case OperandMode::Mptp: // TODO: Can be 16:64
+        case OperandMode::Ms: // TODO: Can be 16:64
+            assert(hasModrm);
+            if (ModrmMod(modrm) == 0b11)
+                goto handleEv; // This will should cause an #UD later on, but allow decoding
+            goto HandleE;
+        case OperandMode::Rd:
+            assert(hasModrm);
+            ea.type = DecodedEAType::reg32;
+            if (ModrmMod(modrm) != 0b11)
+                throw std::runtime_error { std::string("Invalid for 'R': ") + OpModeText(opmode) + " INS " + MnemonicText(ins->mnemonic) + " OPCODE " + HexString(fullOpcode) + " " + ModrmString(modrm) };
+            ea.regNum = ModrmRm(modrm);
+            break;
+        case OperandMode::Sw:
+            assert(hasModrm);
+            ea.type = DecodedEAType::sreg;
+            ea.regNum = ModrmReg(modrm);
+            if (cpuInfo.model < CPUModel::i80386sx)
+                ea.regNum &= 3; // Only lower two bits used
+            break;
+        case OperandMode::MwRv:
+            // 8C MOV r/m, Sreg is a bit tricky. It's "Ew" when the destination is memory, but "Ev" when it's a register
+            if (ModrmMod(modrm) == 0b11) {
+                res.operationSize = res.operandSize;
+                goto handleEv;
+            }
+            res.operandSize = 2;
+            res.operationSize = 2;
+            goto HandleE;
+        default:
+            throw std::runtime_error { std::string("TODO [EA] opmode ") + OpModeText(opmode) + " INS " + MnemonicText(ins->mnemonic) + " OPCODE " + HexString(fullOpcode) };
+        }
+    }
+
+    return res;
+}
+
 #include <format>
 
 struct DecodedEAInfo {
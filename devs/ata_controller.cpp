@@ -1,10 +1,11 @@
 #include "ata_controller.h"
 #include "disk_data.h"
-#include <print>
+#include "snapshot.h"
 #include <utility>
 #include <cstring>
+#include <optional>
 
-//#define LOG(...) std::println("ATA: " __VA_ARGS__)
+//#define LOG(...) bus_.log().println("ATA: " __VA_ARGS__)
 #define LOG(...)
 
 namespace {
@@ -88,12 +89,15 @@ std::string CommandString(std::uint8_t command)
 
 } // unnamed namespace
 
-class ATAController::impl : public IOHandler, public CycleObserver {
+class ATAController::impl : public IOHandler {
 public:
     impl(SystemBus& bus, uint16_t baseRegister, uint16_t controlRegister, onIrqType onIrq);
 
     void reset();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     std::uint8_t inU8(std::uint16_t port, std::uint16_t offset) override;
     std::uint16_t inU16(std::uint16_t port, std::uint16_t offset) override;
     std::uint32_t inU32(std::uint16_t port, std::uint16_t offset) override;
@@ -101,10 +105,8 @@ public:
     void outU16(std::uint16_t port, std::uint16_t offset, std::uint16_t value) override;
     void outU32(std::uint16_t port, std::uint16_t offset, std::uint32_t value) override;
 
-    void runCycles(std::uint64_t numCycles) override;
-    std::uint64_t nextAction() override;
-
     void insertDisk(uint8_t driveNum, std::string_view filename);
+    void shareDisks(const impl& other);
 
 private:
     SystemBus& bus_;
@@ -112,11 +114,12 @@ private:
     onIrqType onIRQ_;
     uint8_t driveHead_;
     uint8_t deviceControl_;
-    uint8_t* dataPtr_;
+    uint8_t* dataPtr_; // Into tempBuf_
     uint32_t bytesRemaining_;
-    uint32_t cycleCountdown_;
+    uint64_t diskOffset_; // Disk offset of the sector in tempBuf_ for read/write commands
     uint8_t currentCommand_;
     std::function<void(void)> nextTransition_;
+    ScheduledEvent transitionEvent_;
     struct Drive {
         void reset()
         {
@@ -169,11 +172,11 @@ private:
                 return std::format("CHS {}/{}/{}", cylinderNumber(), driveHead & DH_MASK_ADDR_MASK, sectorNumber());
         }
 
-        uint8_t* dataPtr(uint8_t driveHead)
+        std::optional<uint64_t> dataOffset(uint8_t driveHead)
         {
             uint32_t addr;
             if (!sectorCount)
-                return nullptr;
+                return std::nullopt;
             if (driveHead & DH_MASK_LBA) {
                 addr = lbaAddress(driveHead);
             } else {
@@ -181,14 +184,14 @@ private:
                 const auto h = static_cast<uint8_t>(driveHead & DH_MASK_ADDR_MASK);
                 const auto s = sectorNumber();
                 if (!data.format.validCHS(c, h, s))
-                    return nullptr;
+                    return std::nullopt;
                 addr = data.format.toLBA(c, h, s);
             }
             if (addr >= data.format.totalSectors() || sectorCount > data.format.totalSectors() - addr)
-                return nullptr;
+                return std::nullopt;
             writeOffset = addr * bytesPerSector;
             writeCount = sectorCount * bytesPerSector;
-            return &data.data[addr * bytesPerSector];
+            return writeOffset;
         }
 
         void afterWrite()
@@ -215,11 +218,10 @@ private:
 
     void setTransition(const std::function<void(void)>& func, uint32_t commandTime = 1000)
     {
-        if (cycleCountdown_)
+        if (transitionEvent_.scheduled())
             throw std::runtime_error{std::format("Command already active")};
-        cycleCountdown_ = commandTime;
         nextTransition_ = func;
-        bus_.recalcNextAction();
+        bus_.scheduleEvent(transitionEvent_, bus_.time() + commandTime);
     }
 
     using CommandFuncType = void (impl::*)(Drive&);
@@ -233,10 +235,10 @@ ATAController::impl::impl(SystemBus& bus, uint16_t baseRegister, uint16_t contro
     : bus_ { bus } 
     , baseRegister_ { baseRegister }
     , onIRQ_ { onIrq }
+    , transitionEvent_ { [this]() { std::exchange(nextTransition_, {})(); }, "ata" }
 {
     bus.addIOHandler(baseRegister, 8, *this, true);
     bus.addIOHandler(controlRegister, 2, *this, true);
-    bus.addCycleObserver(*this);
     reset();
 }
 
@@ -246,7 +248,8 @@ void ATAController::impl::reset()
     deviceControl_ = DC_MASK_nIEN;
     dataPtr_ = 0;
     bytesRemaining_ = 0;
-    cycleCountdown_ = 0;
+    diskOffset_ = 0;
+    bus_.cancelEvent(transitionEvent_);
     nextTransition_ = {};
     currentCommand_ = 0;
     commandDrive_ = nullptr;
@@ -255,22 +258,56 @@ void ATAController::impl::reset()
     }
 }
 
-void ATAController::impl::runCycles(std::uint64_t numCycles)
+void ATAController::impl::saveState(SnapshotWriter& writer) const
 {
-    if (!cycleCountdown_)
-        return;
-    if (numCycles < cycleCountdown_) {
-        cycleCountdown_ -= static_cast<uint32_t>(numCycles);
-        return;
+    // Transitions are only pending for a short while, and can't be saved
+    if (transitionEvent_.scheduled())
+        throw std::runtime_error { "ATA: Can't save state while a command is in progress" };
+    writer.section("ata");
+    writer.write(driveHead_);
+    writer.write(deviceControl_);
+    writer.write(bytesRemaining_);
+    writer.write(currentCommand_);
+    writer.write(tempBuf_);
+    writer.write(static_cast<int32_t>(dataPtr_ ? dataPtr_ - tempBuf_ : -1));
+    writer.write(diskOffset_);
+    writer.write(static_cast<int8_t>(commandDrive_ ? commandDrive_ - drives_ : -1));
+    for (const auto& dr : drives_) {
+        writer.write(dr.status);
+        writer.write(dr.sectorCount);
+        writer.write(dr.lba);
+        writer.write(dr.writeOffset);
+        writer.write(dr.writeCount);
     }
-    assert(nextTransition_);
-    cycleCountdown_ = 0;
-    std::exchange(nextTransition_, {})();
 }
 
-std::uint64_t ATAController::impl::nextAction()
+void ATAController::impl::loadState(SnapshotReader& reader)
 {
-    return cycleCountdown_ ? cycleCountdown_: UINT64_MAX;
+    reader.section("ata");
+    bus_.cancelEvent(transitionEvent_);
+    nextTransition_ = {};
+    reader.read(driveHead_);
+    reader.read(deviceControl_);
+    reader.read(bytesRemaining_);
+    reader.read(currentCommand_);
+    reader.read(tempBuf_);
+    int32_t dataOffset;
+    int8_t commandDrive;
+    reader.read(dataOffset);
+    reader.read(diskOffset_);
+    reader.read(commandDrive);
+    for (auto& dr : drives_) {
+        reader.read(dr.status);
+        reader.read(dr.sectorCount);
+        reader.read(dr.lba);
+        reader.read(dr.writeOffset);
+        reader.read(dr.writeCount);
+    }
+
+    if (dataOffset > static_cast<int32_t>(sizeof(tempBuf_)))
+        throw std::runtime_error { "ATA: Invalid data offset in snapshot" };
+    dataPtr_ = dataOffset >= 0 ? tempBuf_ + dataOffset : nullptr;
+    commandDrive_ = commandDrive >= 0 && commandDrive < 2 ? &drives_[commandDrive] : nullptr;
 }
 
 void ATAController::impl::insertDisk(uint8_t driveNum, std::string_view filename)
@@ -285,6 +322,12 @@ void ATAController::impl::insertDisk(uint8_t driveNum, std::string_view filename
     }
 }
 
+void ATAController::impl::shareDisks(const impl& other)
+{
+    for (int i = 0; i < 2; ++i)
+        drives_[i].data = other.drives_[i].data.share();
+}
+
 std::uint8_t ATAController::impl::inU8(std::uint16_t port, std::uint16_t offset)
 {
     if (isControlRegister(port)) {
@@ -401,7 +444,11 @@ std::uint16_t ATAController::impl::inU16(std::uint16_t port, std::uint16_t offse
         dataPtr_ = nullptr;
         currentCommand_ = 0;
         commandDrive_ = nullptr;
-
+    } else if (dataPtr_ == tempBuf_ + sizeof(tempBuf_)) {
+        assert(commandDrive_);
+        diskOffset_ += bytesPerSector;
+        commandDrive_->data.data.read(diskOffset_, tempBuf_, bytesPerSector);
+        dataPtr_ = tempBuf_;
     }
     return res;
 }
@@ -419,6 +466,11 @@ void ATAController::impl::outU16(std::uint16_t port, std::uint16_t offset, std::
     PutU16(dataPtr_, value);
     dataPtr_ += 2;
     bytesRemaining_ -= 2;
+    if (dataPtr_ == tempBuf_ + sizeof(tempBuf_)) {
+        commandDrive_->data.data.write(diskOffset_, tempBuf_, bytesPerSector);
+        diskOffset_ += bytesPerSector;
+        dataPtr_ = tempBuf_;
+    }
     if (!bytesRemaining_) {
         dataPtr_ = nullptr;
         currentCommand_ = 0;
@@ -495,11 +547,16 @@ void ATAController::impl::cmdIdentifyDrive(Drive& drive)
 void ATAController::impl::cmdReadWriteSectors(Drive& drive)
 {
     //assert(!dataPtr_ && !bytesRemaining_);
-    dataPtr_ = drive.dataPtr(driveHead_);
-    if (!dataPtr_)
+    const auto offset = drive.dataOffset(driveHead_);
+    if (!offset)
         throw std::runtime_error { std::format("TODO: {} invalid sectorCount = {} {}", CommandString(currentCommand_), drive.sectorCount, drive.addressDesc(driveHead_)) };
-    if (!IsWriteCommand(currentCommand_))
+    // Data is transferred through tempBuf_ one sector at a time
+    diskOffset_ = *offset;
+    dataPtr_ = tempBuf_;
+    if (!IsWriteCommand(currentCommand_)) {
         drive.writeCount = 0;
+        drive.data.data.read(diskOffset_, tempBuf_, bytesPerSector);
+    }
     bytesRemaining_ = bytesPerSector * drive.sectorCount;
 }
 
@@ -510,7 +567,22 @@ ATAController::ATAController(SystemBus& bus, uint16_t baseRegister, uint16_t con
 
 ATAController::~ATAController() = default;
 
+void ATAController::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void ATAController::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void ATAController::insertDisk(uint8_t driveNum, std::string_view filename)
 {
     impl_->insertDisk(driveNum, filename);
+}
+
+void ATAController::shareDisks(const ATAController& other)
+{
+    impl_->shareDisks(*other.impl_);
 }
\ No newline at end of file
@@ -13,7 +13,12 @@ public:
     explicit ATAController(SystemBus& bus, uint16_t baseRegister, uint16_t controlRegister, onIrqType onIrq);
     ~ATAController();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     void insertDisk(uint8_t driveNum, std::string_view filename);
+    // Insert copy-on-write copies of the disks in other (changes aren't written back to the image files)
+    void shareDisks(const ATAController& other);
 
 private:
     class impl;
@@ -1,5 +1,5 @@
 #include "CGA.h"
-#include <print>
+#include "snapshot.h"
 #include <cstring>
 
 namespace {
@@ -85,7 +85,7 @@ constexpr uint8_t cgaMode4Palettes[4][4] = {
 
 } // unnamed namespace
 
-class CGA::impl : public CycleObserver, public IOHandler {
+class CGA::impl : public IOHandler {
 public:
     explicit impl(SystemBus& bus);
 
@@ -96,8 +96,9 @@ public:
     }
 
     void reset();
-    void runCycles(std::uint64_t numCycles) override;
-    std::uint64_t nextAction() override;
+
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
 
     std::uint8_t inU8(uint16_t port, uint16_t) override;
     void outU8(uint16_t port, uint16_t, std::uint8_t value) override;
@@ -105,24 +106,29 @@ public:
     void render();
 
 private:
+    SystemBus& bus_;
     DrawFunction onDraw_;
     RamHandler videoMem_;
 
     std::vector<uint32_t> pixels_;
 
-    uint64_t cycles_;
+    uint64_t frameStart_; // Bus time
+    ScheduledEvent frameEvent_;
     uint32_t numFrames_;
     uint8_t mcr_;
     uint8_t palette_;
 
     uint8_t registerIndex_;
     uint8_t mc6845Registers_[static_cast<int>(MC6845RegisterIndex::Max)];
+
+    void frameDone();
 };
 
 CGA::impl::impl(SystemBus& bus)
-    : videoMem_ { 16 * 1024 }
+    : bus_ { bus }
+    , videoMem_ { 16 * 1024 }
+    , frameEvent_ { [this]() { frameDone(); }, "cga" }
 {
-    bus.addCycleObserver(*this);
     bus.addIOHandler(0x3D0, 0x10, *this, true);
     bus.addMemHandler(0xB8000, videoMem_.size(), videoMem_); // TODO: needSync to implement snow
     //bus.addMemHandler(0xBC000, videoMem_.size(), videoMem_); // Mirrored
@@ -132,7 +138,8 @@ CGA::impl::impl(SystemBus& bus)
 
 void CGA::impl::reset()
 {
-    cycles_ = 0;
+    frameStart_ = bus_.time();
+    bus_.scheduleEvent(frameEvent_, frameStart_ + cyclesPerFrameSys);
     numFrames_ = 0;
     mcr_ = 0;
     palette_ = 0;
@@ -140,21 +147,40 @@ void CGA::impl::reset()
     std::memset(mc6845Registers_, 0, sizeof(mc6845Registers_));
 }
 
-void CGA::impl::runCycles(std::uint64_t numCycles)
+void CGA::impl::saveState(SnapshotWriter& writer) const
 {
-    cycles_ += numCycles;
-    for (; cycles_ >= cyclesPerFrameSys; cycles_ -= cyclesPerFrameSys) {
-        if (mcr_ & MCR_MASK_VIDEO_ENABLE) {
-            render();
-            ++numFrames_;
-        }
-    }
+    writer.section("cga");
+    writer.write(videoMem_.data());
+    writer.write(frameStart_);
+    writer.write(frameEvent_);
+    writer.write(numFrames_);
+    writer.write(mcr_);
+    writer.write(palette_);
+    writer.write(registerIndex_);
+    writer.write(mc6845Registers_);
 }
 
-std::uint64_t CGA::impl::nextAction()
+void CGA::impl::loadState(SnapshotReader& reader)
 {
-    assert(cycles_ <= cyclesPerFrameSys);
-    return cyclesPerFrameSys - cycles_;
+    reader.section("cga");
+    reader.readFixed(videoMem_.data());
+    reader.read(frameStart_);
+    reader.read(bus_, frameEvent_);
+    reader.read(numFrames_);
+    reader.read(mcr_);
+    reader.read(palette_);
+    reader.read(registerIndex_);
+    reader.read(mc6845Registers_);
+}
+
+void CGA::impl::frameDone()
+{
+    frameStart_ += cyclesPerFrameSys;
+    bus_.scheduleEvent(frameEvent_, frameStart_ + cyclesPerFrameSys);
+    if (mcr_ & MCR_MASK_VIDEO_ENABLE) {
+        render();
+        ++numFrames_;
+    }
 }
 
 void CGA::impl::render()
@@ -263,17 +289,19 @@ std::uint8_t CGA::impl::inU8(uint16_t port, uint16_t)
     switch (port) {
     case 0x3D5:
     case 0x3DF:
-        std::println("CGA: Warning read from port {:04X}", port);
+        bus_.log().println("CGA: Warning read from port {:04X}", port);
         return 0;
-    case 0x3DA:
+    case 0x3DA: {
+        const auto cycles = bus_.time() - frameStart_;
         value = STAT_MASK_LP_TRIGGER | STAT_MASK_LP_SWITCH;
-        if (cycles_ >= vsyncStartSys)
+        if (cycles >= vsyncStartSys)
             value |= STAT_MASK_VSYNC_ACTIVE;
-        if (cycles_ % cyclesPerLineSys >= hsyncSys)
+        if (cycles % cyclesPerLineSys >= hsyncSys)
             value |= STAT_MASK_DISPLAY_INACTIVE;
         break;
+    }
     default:
-        std::println("CGA TODO");
+        bus_.log().println("CGA TODO");
         return IOHandler::inU8(port, 0);
     }
     return value;
@@ -294,24 +322,24 @@ void CGA::impl::outU8(uint16_t port, uint16_t, std::uint8_t value)
     case 0x3D7:
         if (registerIndex_ < static_cast<int>(MC6845RegisterIndex::Max)) {
             if (registerIndex_ != MC6845RegisterIndex::CursorAddressH && registerIndex_ != MC6845RegisterIndex::CursorAddressL)
-                std::println("CGA write to register {} 0x{:02X}", registerIndex_, value);
+                bus_.log().println("CGA write to register {} 0x{:02X}", registerIndex_, value);
             mc6845Registers_[registerIndex_] = value;
         } else {
             throw std::runtime_error { std::format("Write to invalid CGA MC6845 register {} value 0x{:02X}", registerIndex_, value) };
         }
         break;
     case 0x3D8:
-        std::println("CGA MCR={:02X} 0b{:08b}", value, value);
+        bus_.log().println("CGA MCR={:02X} 0b{:08b}", value, value);
         mcr_ = value;
         if (!(mcr_ & MCR_MASK_VIDEO_ENABLE))
             onDraw_(nullptr, 0, 0);
         break;
     case 0x3D9:
-        std::println("CGA CGA palette register={:02X}", value);
+        bus_.log().println("CGA CGA palette register={:02X}", value);
         palette_ = value;
         break;
     default:
-        std::println("CGA TODO");
+        bus_.log().println("CGA TODO");
         IOHandler::outU8(port, 0, value);
     }
 }
@@ -324,6 +352,16 @@ CGA::CGA(SystemBus& bus)
 
 CGA::~CGA() = default;
 
+void CGA::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void CGA::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void CGA::setDrawFunction(const DrawFunction& onDraw)
 {
     impl_->setDrawFunction(onDraw);
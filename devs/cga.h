@@ -12,6 +12,9 @@ public:
     explicit CGA(SystemBus& bus);
     ~CGA();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     void setDrawFunction(const DrawFunction& onDraw);
     void forceRedraw();
 
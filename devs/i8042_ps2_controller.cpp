@@ -1,8 +1,8 @@
 #include "i8042_ps2_controller.h"
-#include <print>
+#include "snapshot.h"
 #include <cstring>
 
-#define LOG(...) std::println("i8042: " __VA_ARGS__)
+#define LOG(...) log_.println("i8042: " __VA_ARGS__)
 
 enum : uint8_t {
     CMD_DISABLE_PORT2 = 0xA7,
@@ -60,11 +60,15 @@ public:
 
     void reset();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     std::uint8_t inU8(std::uint16_t port, std::uint16_t offset) override;
     void outU8(std::uint16_t port, std::uint16_t offset, std::uint8_t value) override;
 
     void enqueueKey(const KeyPress& key);
 private:
+    Logger& log_;
     CallbackType onDevice1IRQ_;
     A20CallbackType onA20CLinehange_;
     uint8_t status_;
@@ -98,7 +102,8 @@ private:
 };
 
 i8042_PS2Controller::impl::impl(SystemBus& bus, CallbackType onDevice1IRQ, A20CallbackType onA20CLinehange)
-    : onDevice1IRQ_ { onDevice1IRQ }
+    : log_ { bus.log() }
+    , onDevice1IRQ_ { onDevice1IRQ }
     , onA20CLinehange_ { onA20CLinehange }
 {
     bus.addIOHandler(0x60, 5, *this, true);
@@ -120,6 +125,36 @@ void i8042_PS2Controller::impl::reset()
     setA20State(false);
 }
 
+void i8042_PS2Controller::impl::saveState(SnapshotWriter& writer) const
+{
+    writer.section("ps2");
+    writer.write(status_);
+    writer.write(portB_);
+    writer.write(outputBuffer_);
+    writer.write(ram_);
+    writer.write(ramWriteOffset_);
+    writer.write(nextDest_);
+    writer.write(expectedCommandBytes_);
+    writer.write(commandPos_);
+    writer.write(port1CommandBytes_);
+    writer.write(lastData_);
+}
+
+void i8042_PS2Controller::impl::loadState(SnapshotReader& reader)
+{
+    reader.section("ps2");
+    reader.read(status_);
+    reader.read(portB_);
+    reader.read(outputBuffer_);
+    reader.read(ram_);
+    reader.read(ramWriteOffset_);
+    reader.read(nextDest_);
+    reader.read(expectedCommandBytes_);
+    reader.read(commandPos_);
+    reader.read(port1CommandBytes_);
+    reader.read(lastData_);
+}
+
 void i8042_PS2Controller::impl::checkIrq()
 {
     if (((ram_[RAM_LOC_CONFIG] & (CONFIG_MASK_PORT1_IRQ | CONFIG_MASK_PORT1_CLOCK_DISABLE)) == CONFIG_MASK_PORT1_IRQ)
@@ -324,7 +359,7 @@ void i8042_PS2Controller::impl::outU8(std::uint16_t port, std::uint16_t offset,
 void i8042_PS2Controller::impl::enqueueKey(const KeyPress& key)
 {
     // TODO: Use scan set 2?
-    std::println("Keyboard event: down={} code={:02X}", key.down ? 1 : 0, key.scanCode);
+    log_.println("Keyboard event: down={} code={:02X}", key.down ? 1 : 0, key.scanCode);
     if (key.extendedKey)
         enqueueOutputByte(0xE0);
     enqueueOutputByte(static_cast<uint8_t>(key.scanCode | (key.down ? 0x00 : 0x80)));
@@ -343,6 +378,16 @@ i8042_PS2Controller::i8042_PS2Controller(SystemBus& bus, CallbackType onDevice1I
 
 i8042_PS2Controller::~i8042_PS2Controller() = default;
 
+void i8042_PS2Controller::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void i8042_PS2Controller::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void i8042_PS2Controller::enqueueKey(const KeyPress& key)
 {
     impl_->enqueueKey(key);
@@ -13,6 +13,9 @@ public:
     explicit i8042_PS2Controller(SystemBus& bus, CallbackType onDevice1IRQ, A20CallbackType onA20CLinehange);
     ~i8042_PS2Controller();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     void enqueueKey(const KeyPress& key);
 
 private:
@@ -1,6 +1,6 @@
 #include "i8237a_dma_controller.h"
+#include "snapshot.h"
 #include <cassert>
-#include <print>
 #include <format>
 #include <cstring>
 
@@ -48,7 +48,7 @@ std::string ModeString(uint8_t mode)
 
 } // unnamed namespace
 
-class i8237a_DMAController::impl : public IOHandler, public CycleObserver {
+class i8237a_DMAController::impl : public IOHandler {
 public:
     impl(SystemBus& bus, uint16_t ioBase, uint16_t pageIoBase, bool wordMode)
         : bus_ { bus }
@@ -57,7 +57,6 @@ public:
     {
         assert(pageIoBase == 0x81 || pageIoBase == 0x89);
         assert(wordMode_ == (pageIoBase == 0x89));
-        bus.addCycleObserver(*this);
         bus.addIOHandler(ioBase, wordMode_ ? 32 : 16, *this, true);
         bus.addIOHandler(pageIoBase, 3, *this, true);
         bus.addIOHandler(pageIoBase|7, 1, *this, true);
@@ -72,17 +71,22 @@ public:
         std::memset(channels_, 0, sizeof(channels_));
     }
 
-    void runCycles([[maybe_unused]] std::uint64_t cycles) override
+    void saveState(SnapshotWriter& writer) const
     {
-        // Fake activity for the sake of IBM XT BIOS (uses it for delay...)
-        auto& ch0 = channels_[0];
-        if (enabled_ && ch0.mode == 0x58)
-            ch0.currentAddress--;
+        writer.section("dma");
+        writer.write(msbFlipFlop_);
+        writer.write(mask_);
+        writer.write(enabled_);
+        writer.write(channels_);
     }
 
-    std::uint64_t nextAction() override
+    void loadState(SnapshotReader& reader)
     {
-        return UINT64_MAX;
+        reader.section("dma");
+        reader.read(msbFlipFlop_);
+        reader.read(mask_);
+        reader.read(enabled_);
+        reader.read(channels_);
     }
 
     std::uint8_t inU8(std::uint16_t port, std::uint16_t offset) override;
@@ -137,6 +141,10 @@ std::uint8_t i8237a_DMAController::impl::internalRead8(std::uint16_t regNum)
     case 0x05:
     case 0x06:
     case 0x07: {
+        if (regNum == 0 && enabled_ && channels_[0].mode == 0x58) {
+            // Fake (refresh) activity for the sake of IBM XT BIOS (uses it for delay...)
+            channels_[0].currentAddress--;
+        }
         auto value = regNum & 1 ? channels_[regNum >> 1].currentCount : channels_[regNum >> 1].currentAddress;
         if (msbFlipFlop_)
             value >>= 8;
@@ -146,7 +154,7 @@ std::uint8_t i8237a_DMAController::impl::internalRead8(std::uint16_t regNum)
     case 0x08:
         // Status register
         // Should be: REQ3|REQ2|REQ1|REQ0|TC3|TC2|TC1|TC0 (TC3-0 are cleared on read)
-        std::println("{}TODO read of status register, just returning 1 (TC0)", desc());
+        bus_.log().println("{}TODO read of status register, just returning 1 (TC0)", desc());
         return 1; // Return TC0 for IBM PC XT BIOS
     default:
         throw std::runtime_error { std::format("{}Unsupported read from register {:02X}", desc(), regNum) };
@@ -190,27 +198,27 @@ void i8237a_DMAController::impl::internalWrite8(std::uint16_t port, std::uint16_
 {
     switch (regNum) {
     case 0x08: // Command
-        std::println("{}Command {:02X}", desc(), value);
+        bus_.log().println("{}Command {:02X}", desc(), value);
         if (value & ~4)
             throw std::runtime_error { std::format("DMA: Unsupported write value {:02X} (0b{:08b}) for port {:04X} regNum {:02X}", value, value, port, regNum) };
         enabled_ = (value & 4) == 0;
         break;
     case 0x0A: // Mask single channel
-        std::println("{}{}masking channel {}", desc(), value & 4 ? "" : "un", value & 3);
+        bus_.log().println("{}{}masking channel {}", desc(), value & 4 ? "" : "un", value & 3);
         if (value & 4)
             mask_ |= 1 << (value & 3);
         else
             mask_ &= ~(1 << (value & 3));
         break;
     case 0x0B: // Mode write
-        std::println("{}Channel {} setting mode to {:02X} {}", desc(), value & MODE_MASK_SEL, value, ModeString(value));
+        bus_.log().println("{}Channel {} setting mode to {:02X} {}", desc(), value & MODE_MASK_SEL, value, ModeString(value));
         channels_[value & MODE_MASK_SEL].mode = value & ~MODE_MASK_SEL;
         break;
     case 0x0C: // Clear flip/flop
         msbFlipFlop_ = false;
         break;
     case 0x0D: // Master reset
-        std::println("{}Master reset {:02X}", desc(), value);
+        bus_.log().println("{}Master reset {:02X}", desc(), value);
         reset();
         break;
     default:
@@ -222,7 +230,7 @@ void i8237a_DMAController::impl::outU8(std::uint16_t port, std::uint16_t offset,
 {
     if (port >= 0x80 && port <= 0x8F) {
         const auto idx = pagePortIndex(port);
-        std::println("{}Channel {} setting page register to {:02x}",   desc(), idx, value);
+        bus_.log().println("{}Channel {} setting page register to {:02x}",   desc(), idx, value);
         channels_[idx].page = value;
         return;
     }
@@ -253,7 +261,7 @@ void i8237a_DMAController::impl::outU8(std::uint16_t port, std::uint16_t offset,
         } else {
             reg2 = reg = (reg & 0xff00) | value;
         }
-        std::println("{}Channel {} setting {} to {:04X} [{}SB]", desc(), offset >> 1, offset & 1 ? "count" : "address", reg, msbFlipFlop_ ? 'M' : 'L');
+        bus_.log().println("{}Channel {} setting {} to {:04X} [{}SB]", desc(), offset >> 1, offset & 1 ? "count" : "address", reg, msbFlipFlop_ ? 'M' : 'L');
         msbFlipFlop_ = !msbFlipFlop_;
         break;
     }
@@ -285,7 +293,7 @@ void i8237a_DMAController::impl::startGet(uint8_t channel, DMAHandler& handler)
 {
     assert(channel < 4);
     auto& ch = channels_[channel];
-    std::println("{}Starting get on channel {} address = 0x{:X} count = 0x{:X}", desc(), channel, ch.currentAddress | ch.page << 16, ch.currentCount);
+    bus_.log().println("{}Starting get on channel {} address = 0x{:X} count = 0x{:X}", desc(), channel, ch.currentAddress | ch.page << 16, ch.currentCount);
 
     if (!enabled_)
         throw std::runtime_error { std::format("DMA: Unsupported write (get) - channel {}, DMA controller disabled", channel) };
@@ -296,11 +304,16 @@ void i8237a_DMAController::impl::startGet(uint8_t channel, DMAHandler& handler)
     if ((ch.mode & ~MODE_MASK_AUTO) != (MODE_SINGLE << MODE_BIT_MOD0 | TRA_WRITE << MODE_BIT_TRA0))
         throw std::runtime_error { std::format("DMA: Unsupported write (get) mode", ModeString(ch.mode)) };
 
-    do {
-        bus_.writeU8(ch.currentAddress | ch.page << 16, handler.dmaGetU8());
-        ch.currentAddress += 1;
-        --ch.currentCount;
-    } while (ch.currentCount != 0xFFFF);
+    // Gather the data and write it in (at most two, the address wraps within the 64K page) blocks
+    std::vector<uint8_t> data(ch.currentCount + 1);
+    for (auto& d : data)
+        d = handler.dmaGetU8();
+    const auto first = std::min<std::size_t>(data.size(), 0x10000 - ch.currentAddress);
+    bus_.writeBlock(ch.currentAddress | ch.page << 16, data.data(), first);
+    if (first < data.size())
+        bus_.writeBlock(ch.page << 16, data.data() + first, data.size() - first);
+    ch.currentAddress += static_cast<uint16_t>(data.size());
+    ch.currentCount = 0xFFFF;
 
     if (ch.mode & MODE_MASK_AUTO) {
         ch.currentAddress = ch.baseAddress;
@@ -318,6 +331,16 @@ i8237a_DMAController::i8237a_DMAController(SystemBus& bus, uint16_t ioBase, uint
 }
 i8237a_DMAController::~i8237a_DMAController() = default;
 
+void i8237a_DMAController::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void i8237a_DMAController::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void i8237a_DMAController::startGet(uint8_t channel, DMAHandler& handler)
 {
     impl_->startGet(channel, handler);
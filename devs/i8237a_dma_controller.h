@@ -10,6 +10,9 @@ public:
     explicit i8237a_DMAController(SystemBus& bus, uint16_t ioBase, uint16_t pageIoBase, bool wordMode);
     ~i8237a_DMAController();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     void startGet(uint8_t channel, DMAHandler& handler);
 
 private:
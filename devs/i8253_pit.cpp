@@ -1,6 +1,6 @@
 #include "i8253_pit.h"
+#include "snapshot.h"
 #include <format>
-#include <print>
 #include <cstring>
 
 static constexpr uint8_t accessShift = 4;
@@ -12,41 +12,45 @@ static constexpr uint8_t bcdMask = 1 << 0;
 i8253_PIT::i8253_PIT(SystemBus& bus, CallbackType cb)
     : bus_ { bus }
     , cb_ { cb }
+    , terminalCountEvent_ { [this]() { terminalCount(); }, "pit" }
 {
-    bus.addCycleObserver(*this);
     bus.addIOHandler(0x40, 4, *this, true);
     reset();
 }
 
 void i8253_PIT::reset()
 {
-    cycles_ = 0;
+    bus_.cancelEvent(terminalCountEvent_);
     std::memset(&channel_, 0, sizeof(channel_));
 }
 
-void i8253_PIT::runCycles(std::uint64_t numCycles)
+void i8253_PIT::saveState(SnapshotWriter& writer) const
+{
+    writer.section("pit");
+    writer.write(channel_);
+    writer.write(terminalCountEvent_);
+}
+
+void i8253_PIT::loadState(SnapshotReader& reader)
+{
+    reader.section("pit");
+    reader.read(channel_);
+    reader.read(bus_, terminalCountEvent_);
+}
+
+std::uint64_t i8253_PIT::currentTick() const
 {
     // Rate is 1/12th of the system bus frequency
-    cycles_ += numCycles;
-    auto numCounts = cycles_ / 12;
-    cycles_ %= 12;
-    while (numCounts--) {
-        for (int i = 0; i < 3; ++i) {
-            if (channel_[i].clock(bus_) && i == 0)
-                cb_();
-        }
-    }
+    return bus_.time() / 12;
 }
 
-std::uint64_t i8253_PIT::nextAction()
+void i8253_PIT::terminalCount()
 {
+    // Only channel 0 is connected to an IRQ line
     auto& ch = channel_[0];
-    if (ch.active) {
-        if (ch.reload)
-            return 12;
-        return ch.counter * 12;
-    }
-    return UINT64_MAX;
+    if ((ch.control & modeMask) >> modeShift != 0)
+        bus_.scheduleEvent(terminalCountEvent_, terminalCountEvent_.time() + ch.period() * 12);
+    cb_();
 }
 
 std::uint8_t i8253_PIT::inU8(uint16_t port, uint16_t offset)
@@ -66,12 +70,12 @@ void i8253_PIT::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
         if (ch == 3)
             throw std::runtime_error { std::format("PIT: Read-back not supported 0x{:02X}", value) };
         if (((value & accessMask) >> accessShift) == 0) {
-            channel_[ch].latch = channel_[ch].counter;
-            //std::println("PIT: Latching channel {} value=0x{:04X}", ch, channel_[ch].latch);
+            channel_[ch].latch = channel_[ch].value(currentTick());
+            //bus_.log().println("PIT: Latching channel {} value=0x{:04X}", ch, channel_[ch].latch);
             return;
         }
 
-        std::println("PIT channel {} access mode={:02b} operating mode={:03b} bcd={}", ch, (value & accessMask) >> accessShift, (value & modeMask) >> modeShift, value & bcdMask);
+        bus_.log().println("PIT channel {} access mode={:02b} operating mode={:03b} bcd={}", ch, (value & accessMask) >> accessShift, (value & modeMask) >> modeShift, value & bcdMask);
         const auto mode = (value & modeMask) >> modeShift;
         if (mode != 0 && mode != 2 && mode != 3)
             throw std::runtime_error { std::format("PIT: TODO mode not supported value=0x{:02X}", value) };
@@ -102,39 +106,26 @@ void i8253_PIT::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
             break;
         }
         if (loaded) {
-            std::println("PIT: Channel {}: Reload=0x{:04X}", port & 3, ch.initialCount);
+            bus_.log().println("PIT: Channel {}: Reload=0x{:04X}", port & 3, ch.initialCount);
+            // The new count is loaded on the next clock, and (for channel 0) the first terminal count is period clocks later
+            const auto tick = currentTick();
+            ch.counter = ch.value(tick);
             ch.active = true;
-            ch.reload = true;
-            bus_.recalcNextAction();
+            ch.startTick = tick + 1;
+            if (&ch == &channel_[0])
+                bus_.scheduleEvent(terminalCountEvent_, (ch.startTick + ch.period() - 1) * 12);
         }
     }
 }
 
-bool i8253_PIT::Channel::clock(SystemBus& bus)
+uint16_t i8253_PIT::Channel::value(std::uint64_t tick) const
 {
-    if (!active)
-        return false;
-
-    if (reload) {
-        counter = initialCount;
-        reload = false;
-        bus.recalcNextAction();
-    }
+    if (!active || tick < startTick)
+        return counter;
 
     // TODO: Actually handle the different modes...
-    const auto mode = (control & modeMask) >> modeShift;
-
-    if (!counter) {
-        counter = 0xffff;
-    } else {
-        counter--;
-        if (counter == 0) {
-            if (mode == 0)
-                active = false;
-            else
-                reload = true;
-            return true;
-        }
-    }
-    return false;
+    const auto elapsed = tick - startTick;
+    if (((control & modeMask) >> modeShift) == 0 && elapsed >= period() - 1)
+        return 0; // Stopped at terminal count
+    return static_cast<uint16_t>(period() - 1 - elapsed % period());
 }
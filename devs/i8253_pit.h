@@ -4,7 +4,7 @@
 #include "system_bus.h"
 #include <functional>
 
-class i8253_PIT : public CycleObserver, public IOHandler {
+class i8253_PIT : public IOHandler {
 public:
     using CallbackType = std::function<void(void)>;
 
@@ -12,8 +12,8 @@ public:
 
     void reset();
 
-    void runCycles(std::uint64_t numCycles) override;
-    std::uint64_t nextAction() override;
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
 
     std::uint8_t inU8(uint16_t port, uint16_t) override;
     void outU8(uint16_t port, uint16_t, std::uint8_t value) override;
@@ -21,18 +21,26 @@ public:
 private:
     SystemBus& bus_;
     CallbackType cb_;
-    std::uint64_t cycles_;
+    ScheduledEvent terminalCountEvent_;
     struct Channel {
         uint8_t control;
         uint16_t initialCount;
-        uint16_t counter;
+        uint16_t counter; // Value until startTick
         uint16_t latch;
         bool msb;
-        bool reload;
         bool active;
+        std::uint64_t startTick; // Tick where initialCount is loaded
 
-        bool clock(SystemBus& bus);
+        std::uint32_t period() const
+        {
+            return initialCount ? initialCount : 0x10000;
+        }
+
+        uint16_t value(std::uint64_t tick) const;
     } channel_[3];
+
+    std::uint64_t currentTick() const;
+    void terminalCount();
 };
 
 #endif
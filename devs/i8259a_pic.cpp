@@ -1,10 +1,10 @@
 #include "i8259a_pic.h"
+#include "snapshot.h"
 #include <cassert>
 #include <format>
-#include <print>
 
 #if 0
-#define LOG(...) std::println(__VA_ARGS__)
+#define LOG(...) log_.println(__VA_ARGS__)
 #else
 #define LOG(...)
 #endif
@@ -19,6 +19,7 @@ static constexpr uint8_t ICW4_MASK_8086 = 1 << 0;
 static constexpr uint8_t ICW4_MASK_SFNM = 1 << 3;
 
 i8259a_PIC::i8259a_PIC(SystemBus& bus, uint16_t ioBase)
+    : log_ { bus.log() }
 {
     bus.addIOHandler(ioBase, 2, *this, true);
     reset();
@@ -35,6 +36,56 @@ void i8259a_PIC::reset()
     isr_ = 0;
     imr_ = 0xff;
     nextReg_ = 0;
+    updatePending();
+}
+
+void i8259a_PIC::saveState(SnapshotWriter& writer) const
+{
+    writer.section("pic");
+    writer.write(icwCnt_);
+    writer.write(icw1_);
+    writer.write(icw2_);
+    writer.write(icw3_);
+    writer.write(icw4_);
+    writer.write(irr_);
+    writer.write(isr_);
+    writer.write(imr_);
+    writer.write(nextReg_);
+}
+
+void i8259a_PIC::loadState(SnapshotReader& reader)
+{
+    reader.section("pic");
+    reader.read(icwCnt_);
+    reader.read(icw1_);
+    reader.read(icw2_);
+    reader.read(icw3_);
+    reader.read(icw4_);
+    reader.read(irr_);
+    reader.read(isr_);
+    reader.read(imr_);
+    reader.read(nextReg_);
+    // The CPU doesn't save the line, so always signal it
+    pending_ = !icwCnt_ && pendingMask();
+    if (pendingCallback_)
+        pendingCallback_(pending_);
+}
+
+void i8259a_PIC::setPendingCallback(const PendingCallback& callback)
+{
+    pendingCallback_ = callback;
+    if (pendingCallback_)
+        pendingCallback_(pending_);
+}
+
+void i8259a_PIC::updatePending()
+{
+    const bool pending = !icwCnt_ && pendingMask();
+    if (pending == pending_)
+        return;
+    pending_ = pending;
+    if (pendingCallback_)
+        pendingCallback_(pending);
 }
 
 std::uint8_t i8259a_PIC::inU8(uint16_t port, uint16_t offset)
@@ -59,7 +110,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                 throw std::runtime_error { std::format("{}: Unsupported ICW1: {:02X} - Configured in cascade mode without master/slave", name, value) };
             icw1_ = value;
             icwCnt_ = 2;
-            std::println("{}: ICW1={:02X}", name, value);
+            log_.println("{}: ICW1={:02X}", name, value);
         } else {
             // OCW2/3 depending on bit3
             if (value & 8) {
@@ -73,7 +124,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                     return;
                 }
                 //if (value == 0x6b || value == 0x4a) {
-                //    std::println("{}: TODO OCW3 {:X} written?!", name, value);
+                //    log_.println("{}: TODO OCW3 {:X} written?!", name, value);
                 //    return;
                 //}
             } else {
@@ -86,7 +137,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                             return;
                         }
                     }
-                    std::println("{}: TODO: non-specific EOI with ISR {:02X}", name, isr_);
+                    log_.println("{}: TODO: non-specific EOI with ISR {:02X}", name, isr_);
                     return;
                 }
                 const auto level = value & 7;
@@ -106,7 +157,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                 if (value & 7)
                     throw std::runtime_error { std::format("{}: Invalid ICW2: {:02X}", name, value) };
                 icw2_ = value;
-                std::println("{}: ICW2={:02X}", name, value);
+                log_.println("{}: ICW2={:02X}", name, value);
                 if (icw1_ & ICW1_MASK_SINGLE) {
                     icwCnt_ = icw1_ & ICW1_MASK_ICW4 ? 4 : 0;
                 } else {
@@ -116,7 +167,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
             case 3:
                 assert(!(icw1_ & ICW1_MASK_SINGLE));
                 assert(companion_);
-                std::println("{}: ICW3={:02X}", name, value);
+                log_.println("{}: ICW3={:02X}", name, value);
                 icw3_ = value;
                 icwCnt_ = icw1_ & ICW1_MASK_ICW4 ? 4 : 0;
                 if ((isSlave_ && icw3_ > 7) || (!isSlave_ && (icw3_ == 0 || (icw3_ & (icw3_ - 1)))))
@@ -126,7 +177,7 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                 assert(icw1_ & ICW1_MASK_ICW4);
                 icw4_ = value;
                 icwCnt_ = 0;
-                std::println("{}: ICW4={:02X}", name, value);
+                log_.println("{}: ICW4={:02X}", name, value);
                 if ((value & ~ICW4_MASK_SFNM) != ICW4_MASK_8086)
                     throw std::runtime_error { std::format("{}: Unsupported ICW4: {:02X}", name, value) };
                 break;
@@ -134,11 +185,12 @@ void i8259a_PIC::outU8(uint16_t port, uint16_t offset, std::uint8_t value)
                 throw std::runtime_error { std::format("{}: Not ready (icw_cnt {}): {:02X}", name, icwCnt_, value) };
             }
             if (!icwCnt_)
-                std::println("{}: Ready!", name);
+                log_.println("{}: Ready!", name);
         } else {
             LOG("{}: IMR={:02X} 0b{:08b}", name, value, value);
             imr_ = value;
         }
+        updatePending();
     }
 }
 
@@ -160,7 +212,8 @@ int i8259a_PIC::getInterrupt()
         if (pending & mask) {
             irr_ &= ~mask;
             isr_ |= mask;
-            //std::println("PIC: IRQ {}", i);
+            updatePending();
+            //log_.println("PIC: IRQ {}", i);
             return i | icw2_;
         }
     }
@@ -172,6 +225,7 @@ void i8259a_PIC::setInterrupt(std::uint8_t line)
     const uint8_t mask = static_cast<uint8_t>(1 << line);
     assert(line < 8);
     irr_ |= mask;
+    updatePending();
 
     if (icw1_ & ICW1_MASK_SINGLE)
         return;
@@ -190,6 +244,7 @@ void i8259a_PIC::clearInterrupt(std::uint8_t line)
 {
     assert(line < 8);
     irr_ &= ~(1 << line);
+    updatePending();
 }
 
 void i8259a_PIC::addSlave(i8259a_PIC& slave)
@@ -2,6 +2,7 @@
 #define I8259A_PIC
 
 #include "system_bus.h"
+#include <functional>
 
 class i8259a_PIC : public IOHandler {
 public:
@@ -9,16 +10,24 @@ public:
 
     void reset();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     std::uint8_t inU8(uint16_t port, uint16_t offset) override;
     void outU8(uint16_t port, uint16_t offset, std::uint8_t value) override;
 
-    int getInterrupt(); // -1 -> No interrupt
+    // Called with the state of the interrupt output whenever it changes
+    using PendingCallback = std::function<void(bool pending)>;
+    void setPendingCallback(const PendingCallback& callback);
+
+    int getInterrupt(); // -1 -> No interrupt (acknowledges the interrupt)
     void setInterrupt(std::uint8_t line);
     void clearInterrupt(std::uint8_t line);
 
     void addSlave(i8259a_PIC& slave);
 
 private:
+    Logger& log_;
     uint8_t icwCnt_; // Initialization Command Words (sequence)
     uint8_t icw1_;
     uint8_t icw2_; // Base
@@ -34,7 +43,11 @@ private:
 
     uint8_t nextReg_;
 
+    PendingCallback pendingCallback_;
+    bool pending_ = false;
+
     uint8_t pendingMask() const;
+    void updatePending();
 };
 
 enum : uint8_t {
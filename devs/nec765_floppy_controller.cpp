@@ -1,8 +1,8 @@
 #include "nec765_floppy_controller.h"
 #include "disk_data.h"
+#include "snapshot.h"
 #include <stdexcept>
 #include <format>
-#include <print>
 #include <cassert>
 #include <cstring>
 #include <utility>
@@ -129,7 +129,7 @@ enum : uint8_t {
 
 } // unnamed namespace
 
-class NEC765_FloppyController::impl : public IOHandler, public CycleObserver, public DMAHandler {
+class NEC765_FloppyController::impl : public IOHandler, public DMAHandler {
 public:
     using OnInterrupt = std::function<void(void)>;
 
@@ -137,8 +137,8 @@ public:
 
     void reset();
 
-    void runCycles(std::uint64_t cycles) override;
-    std::uint64_t nextAction() override;
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
 
     std::uint8_t inU8(uint16_t port, uint16_t) override;
     void outU8(uint16_t port, uint16_t, std::uint8_t value) override;
@@ -159,16 +159,21 @@ public:
         diskData_[drive].insert(filename);
     }
 
+    void shareDisks(const impl& other)
+    {
+        for (int i = 0; i < 4; ++i)
+            diskData_[i] = other.diskData_[i].share();
+    }
+
 private:
     SystemBus& bus_;
     OnInterrupt onInt_;
     OnDmaStart onDmaStart_;
-    uint64_t cycles_;
 
     using TransitionFunc = std::function<void(void)>;
 
-    uint64_t nextTransition_;
     TransitionFunc transition_;
+    ScheduledEvent transitionEvent_;
 
     void setTransition(uint64_t cycles, const TransitionFunc& func);
     void raiseIRQ();
@@ -205,17 +210,16 @@ NEC765_FloppyController::impl::impl(SystemBus& bus, const OnInterrupt& onInt, co
     : bus_(bus)
     , onInt_(onInt)
     , onDmaStart_(onDmaStart)
+    , transitionEvent_([this]() { std::exchange(transition_, TransitionFunc {})(); }, "floppy")
 {
     bus.addIOHandler(0x3f0, reducedIORange ? 6 : 8, *this, true);
-    bus.addCycleObserver(*this);
     reset();
 }
 
 void NEC765_FloppyController::impl::reset()
 {
-    cycles_ = 0;
+    bus_.cancelEvent(transitionEvent_);
     transition_ = TransitionFunc {};
-    nextTransition_ = 0;
     state_ = State::Initial;
     dor_ = 0;
     command_ = 0;
@@ -226,43 +230,54 @@ void NEC765_FloppyController::impl::reset()
     result_.clear();
 }
 
-void NEC765_FloppyController::impl::runCycles(std::uint64_t cycles)
+void NEC765_FloppyController::impl::saveState(SnapshotWriter& writer) const
 {
-    if (transition_) {
-        cycles_ += cycles;
-        if (cycles_ >= nextTransition_) {
-            std::exchange(transition_, TransitionFunc {})();
-            cycles_ = 0;
-        }
-    } else {
-        cycles_ = 0;
-    }
+    // Transitions are only pending for a short while, and can't be saved
+    if (transitionEvent_.scheduled())
+        throw std::runtime_error { "Floppy: Can't save state while a command is in progress" };
+    writer.section("floppy");
+    writer.write(state_);
+    writer.write(dor_);
+    writer.write(command_);
+    writer.write(argsCnt_);
+    writer.write(resetCnt_);
+    writer.write(commandArgs_);
+    writer.write(result_);
+    writer.write(st0_);
+    writer.write(curDrive_);
+    writer.write(driveState_);
 }
 
-std::uint64_t NEC765_FloppyController::impl::nextAction()
+void NEC765_FloppyController::impl::loadState(SnapshotReader& reader)
 {
-    if (transition_) {
-        assert(nextTransition_ >= cycles_);
-        return nextTransition_ - cycles_;
-    } else {
-        return UINT64_MAX;
-    }
+    reader.section("floppy");
+    bus_.cancelEvent(transitionEvent_);
+    transition_ = TransitionFunc {};
+    reader.read(state_);
+    reader.read(dor_);
+    reader.read(command_);
+    reader.read(argsCnt_);
+    reader.read(resetCnt_);
+    reader.read(commandArgs_);
+    reader.read(result_);
+    reader.read(st0_);
+    reader.read(curDrive_);
+    reader.read(driveState_);
 }
 
 void NEC765_FloppyController::impl::setTransition(uint64_t cycles, const TransitionFunc& func)
 {
-    nextTransition_ = cycles_ + cycles;
     transition_ = func;
-    bus_.recalcNextAction();
+    bus_.scheduleEvent(transitionEvent_, bus_.time() + cycles);
 }
 
 void NEC765_FloppyController::impl::raiseIRQ()
 {
     if (dor_ & DOR_MASK_IRQ) {
-        std::println("Floppy: IRQ");
+        bus_.log().println("Floppy: IRQ");
         onInt_();
     } else {
-        std::println("Floppy: IRQ suppressed");
+        bus_.log().println("Floppy: IRQ suppressed");
     }
 }
 
@@ -270,7 +285,7 @@ std::uint8_t NEC765_FloppyController::impl::inU8(uint16_t port, uint16_t offset)
 {
     switch (offset) {
     case NEC765_REG_SRB_R:
-        std::println("Floppy: Returning 0 for read to port {:4X}", port);
+        bus_.log().println("Floppy: Returning 0 for read to port {:4X}", port);
         return 0;
     case NEC765_REG_DOR_RW:
         return dor_;
@@ -309,15 +324,15 @@ void NEC765_FloppyController::impl::outU8(uint16_t port, uint16_t offset, std::u
     switch (offset) {
     case NEC765_REG_DOR_RW:
         dor_ = value;
-        std::println("Floppy: DOR={:02X}", value);
+        bus_.log().println("Floppy: DOR={:02X}", value);
         if (!(value & DOR_MASK_RESET_N)) {
-            std::println("Floppy: Resetting");
+            bus_.log().println("Floppy: Resetting");
             state_ = State::Initial;
         } else if (state_ == State::Initial) {
-            std::println("Floppy: Exiting reset");
+            bus_.log().println("Floppy: Exiting reset");
             state_ = State::Reset;
             setTransition(1000, [&, value]() {
-                std::println("Floppy: Reset done");
+                bus_.log().println("Floppy: Reset done");
                 reset();
                 dor_ = value;
                 state_ = State::CommandPhase;
@@ -328,7 +343,7 @@ void NEC765_FloppyController::impl::outU8(uint16_t port, uint16_t offset, std::u
         break;
     case NEC765_REG_DATA_RW:
         if (state_ == State::CommandPhase) {
-            std::println("Floppy: Command 0x{:02X} ({})", value, CommandName(value));
+            bus_.log().println("Floppy: Command 0x{:02X} ({})", value, CommandName(value));
             command_ = value;
             getCommandArgs();
         } else if (state_ == State::CommandArgsPhase) {
@@ -342,7 +357,7 @@ void NEC765_FloppyController::impl::outU8(uint16_t port, uint16_t offset, std::u
         break;
     case NEC765_REG_RESERVED:
         // This is actually connected to the HDC (FIXED disk controller data register)
-        std::println("Floppy: Warning write to reserved register value {:02X}", value);
+        bus_.log().println("Floppy: Warning write to reserved register value {:02X}", value);
         break;
     default:
         throw std::runtime_error { std::format("Floppy: Unsupported with to {:04X} value {:02X}", port, value) };
@@ -394,7 +409,7 @@ void NEC765_FloppyController::impl::executeCommand()
     result_.clear();
     switch (command_ & CMD_MASK) {
     case CMD_SPECIFY:
-        std::println("Floppy: SPECIFY {}", argsString);
+        bus_.log().println("Floppy: SPECIFY {}", argsString);
         if (commandArgs_[1] & 1)
             throw std::runtime_error { std::format("Floppy: Unsupported command 0x{:02X} 0b{:b} ({}){} - Non DMA mode", command_, command_, CommandName(command_), argsString) };
         break;
@@ -402,12 +417,12 @@ void NEC765_FloppyController::impl::executeCommand()
         const auto dr = commandArgs_[0] & 3;
         const auto& ds = driveState_[dr];
         auto st3 = static_cast<uint8_t>(dr | 1 << 5 | ds.head << 2 | (ds.cylinder == 0 ? 1 << 4 : 0));
-        std::println("Floppy: DRIVE STATUS {}: {:02X} 0b{:08b}", argsString, st3, st3);
+        bus_.log().println("Floppy: DRIVE STATUS {}: {:02X} 0b{:08b}", argsString, st3, st3);
         result_.push_back(st3);
         break;
     }
     case CMD_READ_DATA: {
-        std::println("Floppy: READ_DATA {}. HD={}, DR={} C={} / H={} / S={}", argsString, (commandArgs_[0] >> 3) & 1, commandArgs_[0] & 3, commandArgs_[1], commandArgs_[2], commandArgs_[3]);
+        bus_.log().println("Floppy: READ_DATA {}. HD={}, DR={} C={} / H={} / S={}", argsString, (commandArgs_[0] >> 3) & 1, commandArgs_[0] & 3, commandArgs_[1], commandArgs_[2], commandArgs_[3]);
         if (curDrive_ != (commandArgs_[0] & 3))
             throw std::runtime_error { std::format("Floppy: Unsupported command 0x{:02X} 0b{:b} ({}){} - Wrong drive {} - expected", command_, command_, CommandName(command_), argsString, curDrive_) };
         auto& dr = driveState_[curDrive_];
@@ -415,8 +430,8 @@ void NEC765_FloppyController::impl::executeCommand()
         if ((dr.head != (commandArgs_[0] & 4) >> 2) || dr.cylinder != commandArgs_[1] || dr.head != commandArgs_[2]) {
             // XXX: Bochs doesn't put in the 
             const auto msg = std::format("Floppy: Unsupported command 0x{:02X} 0b{:b} ({}){} - Wrong CH - {}/{}, expected {}/{}", command_, command_, CommandName(command_), argsString, commandArgs_[1], commandArgs_[2], dr.cylinder, dr.head);
-            std::println("{}", msg);
-            std::println("Floppy HACK: Auto seeking");
+            bus_.log().println("{}", msg);
+            bus_.log().println("Floppy HACK: Auto seeking");
             dr.cylinder = commandArgs_[1];
             dr.head = commandArgs_[2];
             //throw std::runtime_error { msg };
@@ -433,14 +448,14 @@ void NEC765_FloppyController::impl::executeCommand()
         return;
     }
     case CMD_RECALIBRATE:
-        std::println("Floppy: RECALIBRATE {}", argsString);
+        bus_.log().println("Floppy: RECALIBRATE {}", argsString);
         state_ = State::ExecutionPhase;
         setTransition(1000, [&]() {
             state_ = State::CommandPhase;
             curDrive_ = commandArgs_[0] & 3;
             driveState_[curDrive_].cylinder = 0;
             driveState_[curDrive_].head = 0;
-            std::println("Floppy: Drive {} recalibrated", curDrive_);
+            bus_.log().println("Floppy: Drive {} recalibrated", curDrive_);
             setSt0(ST0_MASK_SE);
             raiseIRQ();
         });
@@ -448,7 +463,7 @@ void NEC765_FloppyController::impl::executeCommand()
     case CMD_SENSE_INTERRUPT:
         if (resetCnt_) {
             const auto drive = static_cast<uint8_t>(4 - resetCnt_);
-            std::println("Floppy: Reset result for drive {}", drive);
+            bus_.log().println("Floppy: Reset result for drive {}", drive);
             result_.push_back(0xC0 | drive);
             result_.push_back(driveState_[drive].cylinder);
             resetCnt_--;
@@ -459,11 +474,11 @@ void NEC765_FloppyController::impl::executeCommand()
         }
         break;
     case CMD_SEEK: {
-        std::println("Floppy: SEEK {}", argsString);
+        bus_.log().println("Floppy: SEEK {}", argsString);
         state_ = State::ExecutionPhase;
         const auto& fmt = diskData_[curDrive_].format;
         if (((commandArgs_[0] & 4) && fmt.headsPerCylinder < 2) || commandArgs_[1] >= fmt.numCylinder) {
-            std::println("Floppy: Unsupported command 0x{:02X} 0b{:b} ({}){} - Invalid seek (disk format {}/{}/{})", command_, command_, CommandName(command_), argsString, fmt.headsPerCylinder, fmt.numCylinder, fmt.sectorsPerTrack);
+            bus_.log().println("Floppy: Unsupported command 0x{:02X} 0b{:b} ({}){} - Invalid seek (disk format {}/{}/{})", command_, command_, CommandName(command_), argsString, fmt.headsPerCylinder, fmt.numCylinder, fmt.sectorsPerTrack);
             commandArgs_[0] &= ~4;
             commandArgs_[1] = static_cast<uint8_t>(fmt.numCylinder - 1);
         }
@@ -472,7 +487,7 @@ void NEC765_FloppyController::impl::executeCommand()
             curDrive_ = commandArgs_[0] & 3;
             driveState_[curDrive_].head = (commandArgs_[0] & 4) != 0;
             driveState_[curDrive_].cylinder = commandArgs_[1];
-            std::println("Floppy: Drive {} SEEK cyl={} head={}", curDrive_, driveState_[curDrive_].cylinder, driveState_[curDrive_].head);
+            bus_.log().println("Floppy: Drive {} SEEK cyl={} head={}", curDrive_, driveState_[curDrive_].cylinder, driveState_[curDrive_].head);
             setSt0(ST0_MASK_SE);
             raiseIRQ();
         });
@@ -483,7 +498,7 @@ void NEC765_FloppyController::impl::executeCommand()
     }
 
     if (!result_.empty()) {
-        std::println("Floppy: Result phase {} bytes", result_.size());
+        bus_.log().println("Floppy: Result phase {} bytes", result_.size());
         state_ = State::ResultPhase;
     } else {
         state_ = State::CommandPhase;
@@ -502,8 +517,8 @@ uint8_t NEC765_FloppyController::impl::dmaGetU8()
     if (!fmt.validCHS(dr.cylinder, dr.head, dr.sector))
         throw std::runtime_error { std::format("Floppy: Read outside disk area {}/{}/{} (format {}/{}/{})", dr.head, dr.cylinder, dr.sector, fmt.headsPerCylinder, fmt.numCylinder, fmt.sectorsPerTrack) };
 
-    const uint8_t data = diskData_[curDrive_].data[fmt.toLBA(dr.cylinder, dr.head, dr.sector) * bytesPerSector + dr.sectorOffset];
-    //std::println("Floppy: Reading {}/{}/{} offset {} - {:02x}", dr.cylinder, dr.head, dr.sector, dr.sectorOffset, data);
+    const uint8_t data = diskData_[curDrive_].data.readU8(fmt.toLBA(dr.cylinder, dr.head, dr.sector) * bytesPerSector + dr.sectorOffset);
+    //bus_.log().println("Floppy: Reading {}/{}/{} offset {} - {:02x}", dr.cylinder, dr.head, dr.sector, dr.sectorOffset, data);
 
     if (++dr.sectorOffset == bytesPerSector) {
         dr.sectorOffset = 0;
@@ -523,7 +538,7 @@ void NEC765_FloppyController::impl::dmaDone()
     assert(state_ == State::ExecutionPhase);
     assert((command_ & CMD_MASK) == CMD_READ_DATA);
     auto& dr = driveState_[curDrive_];
-    std::println("Floppy: {} done", CommandName(command_));
+    bus_.log().println("Floppy: {} done", CommandName(command_));
     state_ = State::ResultPhase;
     setSt0(0);
     result_.push_back(st0_);
@@ -543,6 +558,16 @@ NEC765_FloppyController::NEC765_FloppyController(SystemBus& bus, const OnInterru
 
 NEC765_FloppyController::~NEC765_FloppyController() = default;
 
+void NEC765_FloppyController::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void NEC765_FloppyController::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void NEC765_FloppyController::insertDisk(uint8_t drive, const std::vector<uint8_t>& data)
 {
     impl_->insertDisk(drive, data);
@@ -551,4 +576,9 @@ void NEC765_FloppyController::insertDisk(uint8_t drive, const std::vector<uint8_
 void NEC765_FloppyController::insertDisk(uint8_t drive, std::string_view filename)
 {
     impl_->insertDisk(drive, filename);
+}
+
+void NEC765_FloppyController::shareDisks(const NEC765_FloppyController& other)
+{
+    impl_->shareDisks(*other.impl_);
 }
\ No newline at end of file
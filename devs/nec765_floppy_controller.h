@@ -15,8 +15,13 @@ public:
     explicit NEC765_FloppyController(SystemBus& bus, const OnInterrupt& onInt, const OnDmaStart& onDmaStart, bool reducedIORange = false);
     ~NEC765_FloppyController();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     void insertDisk(uint8_t drive, const std::vector<uint8_t>& data);
     void insertDisk(uint8_t drive, std::string_view filename);
+    // Insert copy-on-write copies of the disks in other
+    void shareDisks(const NEC765_FloppyController& other);
 
 private:
     class impl;
@@ -1,7 +1,7 @@
 #include "vga.h"
 #include "debugger.h"
+#include "snapshot.h"
 #include <stdexcept>
-#include <print>
 #include <format>
 #include <cstring>
 
@@ -11,8 +11,8 @@
 // https://wiki.osdev.org/VGA_Hardware
 // http://www.osdever.net/FreeVGA/vga/vga.htm
 
-#define LOG(...) std::println("VGA: " __VA_ARGS__)
-#define ERROR(...) do { std::println( "VGA: " __VA_ARGS__); THROW_FLIPFLOP(); } while (0)
+#define LOG(...) bus_.log().println("VGA: " __VA_ARGS__)
+#define ERROR(...) do { bus_.log().println( "VGA: " __VA_ARGS__); THROW_FLIPFLOP(); } while (0)
 
 namespace {
 
@@ -313,25 +313,25 @@ uint32_t CgaColor(uint8_t value)
 }
 
 template <size_t Size>
-void ShowRegisters(const char* title, const uint8_t (&registers)[Size], const char* const (&names)[Size])
+void ShowRegisters(Logger& log, const char* title, const uint8_t (&registers)[Size], const char* const (&names)[Size])
 {
-    std::println("{} registers:", title);
+    log.println("{} registers:", title);
     for (size_t i = 0; i < Size; ++i)
-        std::println("{:02X} = {:02X} 0b{:08b} {}", i, registers[i], registers[i], names[i]);
+        log.println("{:02X} = {:02X} 0b{:08b} {}", i, registers[i], registers[i], names[i]);
 }
 
 
 } // unnamed namespace
 
-class VGA::impl : public IOHandler, public CycleObserver, public MemoryHandler {
+class VGA::impl : public IOHandler, public MemoryHandler {
 public:
     explicit impl(SystemBus& bus);
 
     void reset();
     void setDrawFunction(const DrawFunction& onDraw);
 
-    void runCycles(std::uint64_t numCycles) override;
-    std::uint64_t nextAction() override;
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
 
     std::uint8_t inU8(std::uint16_t port, std::uint16_t offset) override;
     void outU8(std::uint16_t port, std::uint16_t offset, std::uint8_t value) override;
@@ -354,9 +354,11 @@ private:
     std::vector<Pixel> videoMem_;
     std::vector<uint32_t> displayBuffer_;
     const bool ega_ = true;
+    bool warnedAttrModeControl_ = false;
 
     uint32_t frameCount_;
-    uint64_t frameCycles_;
+    uint64_t frameStart_; // Bus time
+    ScheduledEvent frameEvent_;
     Pixel latch_;
     uint32_t palette_[256];
     uint32_t paletteCga_[16];
@@ -369,19 +371,19 @@ private:
                 uint16_t start, end;
             } blank, retrace;
 
-            void log(const char* label) const
+            void log(Logger& logger, const char* label) const
             {
-                LOG("{}total {} displayEnd {}", label, total, displayEnd);
-                LOG("{}blank {} {}", label, blank.start, blank.end);
-                LOG("{}retrace {} {}", label, retrace.start, retrace.end);
+                logger.println("VGA: {}total {} displayEnd {}", label, total, displayEnd);
+                logger.println("VGA: {}blank {} {}", label, blank.start, blank.end);
+                logger.println("VGA: {}retrace {} {}", label, retrace.start, retrace.end);
             }
         } h, v;
 
-        void log(bool alphaNumeric, uint8_t planeEnable) const
+        void log(Logger& logger, bool alphaNumeric, uint8_t planeEnable) const
         {
-            LOG("Display:");
+            logger.println("VGA: Display:");
             if (!clocksPerLine) {
-                LOG("Invalid mode");
+                logger.println("VGA: Invalid mode");
                 return;
             }
 
@@ -389,15 +391,15 @@ private:
             for (int i = 0; i < 4; ++i)
                 bpp += (planeEnable >> i) & 1;
 
-            LOG("{}x{}x{}, {} dots/char", dots * (h.displayEnd + 1), v.displayEnd + 1, bpp, dots);
+            logger.println("VGA: {}x{}x{}, {} dots/char", dots * (h.displayEnd + 1), v.displayEnd + 1, bpp, dots);
             if (alphaNumeric)
-                LOG("Text-mode {}x{} Font size {}x{}", (h.displayEnd + 1), (v.displayEnd + 1) / (charHeight + 1), dots, charHeight + 1);
-            h.log("H: ");
-            v.log("V: ");
+                logger.println("VGA: Text-mode {}x{} Font size {}x{}", (h.displayEnd + 1), (v.displayEnd + 1) / (charHeight + 1), dots, charHeight + 1);
+            h.log(logger, "H: ");
+            v.log(logger, "V: ");
 
             // clocks/line * (s/clocks)
 
-            LOG("Horizontal frequency: {:.2f} KHz, Display frequency: {:.3f} Hz ({:.2f} fps)", SysClockFreqHz * 0.001 / clocksPerLine, clocksPerFrame() / static_cast<double>(SysClockFreqHz), static_cast<double>(SysClockFreqHz) / clocksPerFrame());
+            logger.println("VGA: Horizontal frequency: {:.2f} KHz, Display frequency: {:.3f} Hz ({:.2f} fps)", SysClockFreqHz * 0.001 / clocksPerLine, clocksPerFrame() / static_cast<double>(SysClockFreqHz), static_cast<double>(SysClockFreqHz) / clocksPerFrame());
         }
 
         uint8_t dots, charHeight;
@@ -442,6 +444,7 @@ private:
 
     bool displayActive() const;
     void recalcMode();
+    void frameDone();
 
     uint8_t inputStatus0();
     uint8_t inputStatus1();
@@ -456,6 +459,7 @@ private:
 
 VGA::impl::impl(SystemBus& bus)
     : bus_ { bus }
+    , frameEvent_ { [this]() { frameDone(); }, "vga" }
 {
     bus.addIOHandler(portCrtcAddress, 2, *this, true);
     bus.addIOHandler(portInputStatus1, 1, *this, true);
@@ -464,8 +468,6 @@ VGA::impl::impl(SystemBus& bus)
 
     bus.addIOHandler(portAttrAddressData, 16, *this, true);
 
-    bus.addCycleObserver(*this);
-
     // A0000-BFFFF
     bus.addMemHandler(0xA0000, 128 * 1024, *this, true);
 
@@ -478,7 +480,8 @@ VGA::impl::impl(SystemBus& bus)
 void VGA::impl::reset()
 {
     frameCount_ = 0;
-    frameCycles_ = 0;
+    frameStart_ = bus_.time();
+    bus_.cancelEvent(frameEvent_);
     latch_ = Pixel {};
     std::memset(palette_, 0, sizeof(palette_));
 
@@ -513,6 +516,60 @@ void VGA::impl::setDrawFunction(const DrawFunction& onDraw)
     onDraw_ = onDraw;
 }
 
+void VGA::impl::saveState(SnapshotWriter& writer) const
+{
+    writer.section("vga");
+    writer.write(videoMem_);
+    writer.write(frameCount_);
+    writer.write(frameStart_);
+    writer.write(frameEvent_);
+    writer.write(latch_);
+    writer.write(palette_);
+    writer.write(paletteCga_);
+    writer.write(displayInfo_);
+    writer.write(dataFlipFlop_);
+    writer.write(miscOut_);
+    writer.write(attrAddr_);
+    writer.write(attrReg_);
+    writer.write(seqAddr_);
+    writer.write(seqReg_);
+    writer.write(crtcAddr_);
+    writer.write(crtcReg_);
+    writer.write(gcAddr_);
+    writer.write(gcReg_);
+    writer.write(pelReg_);
+    writer.write(pelReadReg_);
+    writer.write(pelRegState_);
+}
+
+void VGA::impl::loadState(SnapshotReader& reader)
+{
+    reader.section("vga");
+    reader.readFixed(videoMem_);
+    reader.read(frameCount_);
+    reader.read(frameStart_);
+    reader.read(bus_, frameEvent_);
+    reader.read(latch_);
+    reader.read(palette_);
+    reader.read(paletteCga_);
+    reader.read(displayInfo_);
+    reader.read(dataFlipFlop_);
+    reader.read(miscOut_);
+    reader.read(attrAddr_);
+    reader.read(attrReg_);
+    reader.read(seqAddr_);
+    reader.read(seqReg_);
+    reader.read(crtcAddr_);
+    reader.read(crtcReg_);
+    reader.read(gcAddr_);
+    reader.read(gcReg_);
+    reader.read(pelReg_);
+    reader.read(pelReadReg_);
+    reader.read(pelRegState_);
+    // Make the next frame log the mode
+    std::memset(&lastMode_, 0, sizeof(lastMode_));
+}
+
 bool VGA::impl::displayActive() const
 {
     if (!(crtcReg_[CRTC_REG_MODE_CONTROL] & CRTC_MODE_CONTROL_MASK_SE))
@@ -529,8 +586,10 @@ bool VGA::impl::displayActive() const
 
 void VGA::impl::recalcMode()
 {
-    if (!displayActive())
+    if (!displayActive()) {
+        bus_.cancelEvent(frameEvent_);
         return;
+    }
 
     // 0 = 14.31818MHz processor clock, 1 = 16Mhz on-board oscillator
     const auto clockSource = (miscOut_ & MISC_OUT_MASK_CLOCK_SOURCE) >> MISC_OUT_BIT_CLOCK_SOURCE;
@@ -574,31 +633,19 @@ void VGA::impl::recalcMode()
         displayInfo_.clocksUntilHorizontalBlank = static_cast<uint32_t>(displayInfo_.clocksUntilHorizontalBlank * adjust);
     }
 
-    frameCycles_ = 0;
-    bus_.recalcNextAction();
-}
-
-void VGA::impl::runCycles(std::uint64_t numCycles)
-{
-    if (!displayActive()) {
-        frameCycles_ = 0;
-        return;
-    }
-    frameCycles_ += numCycles;
-    while (frameCycles_ >= displayInfo_.clocksPerFrame()) {
-        frameCycles_ -= displayInfo_.clocksPerFrame();
-        renderFrame();
-        ++frameCount_;
-    }
+    frameStart_ = bus_.time();
+    if (displayInfo_.clocksPerFrame())
+        bus_.scheduleEvent(frameEvent_, frameStart_ + displayInfo_.clocksPerFrame());
+    else
+        bus_.cancelEvent(frameEvent_);
 }
 
-std::uint64_t VGA::impl::nextAction()
+void VGA::impl::frameDone()
 {
-    if (!displayActive() || !displayInfo_.clocksPerLine)
-        return UINT64_MAX;
-
-    assert(frameCycles_ < displayInfo_.clocksPerFrame());
-    return displayInfo_.clocksPerFrame() - frameCycles_;
+    frameStart_ += displayInfo_.clocksPerFrame();
+    bus_.scheduleEvent(frameEvent_, frameStart_ + displayInfo_.clocksPerFrame());
+    renderFrame();
+    ++frameCount_;
 }
 
 void VGA::impl::renderFrame()
@@ -607,8 +654,8 @@ void VGA::impl::renderFrame()
         LOG("Mode switch!");
         std::memcpy(&lastMode_, &displayInfo_, sizeof(displayInfo_));
         // for (size_t i = 0; i < std::size(crtcReg_); ++i)
-        //     std::println("CRTC reg {:02X} = {:02X} {}", i, crtcReg_[i], crtcRegName[i]);
-        displayInfo_.log(!(gcReg_[GC_REG_MISC] & GC_MISC_MASK_ALPHA_DIS), attrReg_[ATTR_REG_PLANE_ENABLE]);
+        //     bus_.log().println("CRTC reg {:02X} = {:02X} {}", i, crtcReg_[i], crtcRegName[i]);
+        displayInfo_.log(bus_.log(), !(gcReg_[GC_REG_MISC] & GC_MISC_MASK_ALPHA_DIS), attrReg_[ATTR_REG_PLANE_ENABLE]);
         displayBuffer_.resize((displayInfo_.v.displayEnd + 1) * (displayInfo_.h.displayEnd + 1) * displayInfo_.dots);
     }
 
@@ -709,10 +756,9 @@ void VGA::impl::renderFrameText(const uint32_t* palette)
 
     const auto attrModeControl = attrReg_[ATTR_REG_MODE_CONTROL];
     if (attrModeControl & (ATTR_MODE_CONTROL_MASK_LINE_GRAPHICS | ATTR_MODE_CONTROL_MASK_GRAPHICS)) {
-        static bool warned;
-        if (!warned) {
-            warned = true;
-            std::println("TODO: Attribute mode control in alpha numberic mode: 0b{:04b}", attrModeControl);
+        if (!warnedAttrModeControl_) {
+            warnedAttrModeControl_ = true;
+            bus_.log().println("TODO: Attribute mode control in alpha numberic mode: 0b{:04b}", attrModeControl);
             THROW_ONCE();
         }
     }
@@ -785,8 +831,9 @@ uint8_t VGA::impl::inputStatus1()
     if (!displayActive() || !displayInfo_.clocksPerLine) {
         ret |= INPUT_STATUS_1_MASK_VTRACE | INPUT_STATUS_1_MASK_DD;
     } else {
-        const auto vpos = frameCycles_ / displayInfo_.clocksPerLine;
-        const auto hpos = (frameCycles_ % displayInfo_.clocksPerLine) / displayInfo_.dots;
+        const auto frameCycles = bus_.time() - frameStart_;
+        const auto vpos = frameCycles / displayInfo_.clocksPerLine;
+        const auto hpos = (frameCycles % displayInfo_.clocksPerLine) / displayInfo_.dots;
 
         if (vpos > displayInfo_.v.displayEnd)
             ret |= INPUT_STATUS_1_MASK_VTRACE | INPUT_STATUS_1_MASK_DD;
@@ -1069,7 +1116,7 @@ std::uint8_t VGA::impl::readU8(std::uint64_t addr, std::uint64_t)
 {
     const auto offset = mapMem(static_cast<uint32_t>(addr));
     if (offset == INVALID_OFFSET) {
-        //std::println("Read from invalid address {:06X}", addr);
+        //bus_.log().println("Read from invalid address {:06X}", addr);
         return 0xFF;
     }
     assert(offset < videoMem_.size());
@@ -1090,7 +1137,7 @@ void VGA::impl::writeU8(std::uint64_t addr, std::uint64_t, std::uint8_t value)
 {
     const auto offset = mapMem(static_cast<uint32_t>(addr));
     if (offset == INVALID_OFFSET) {
-        //std::println("Write toinvalid address {:06X} value {:02X}", addr, value);
+        //bus_.log().println("Write toinvalid address {:06X} value {:02X}", addr, value);
         return;
     }
     assert(offset < videoMem_.size());
@@ -1205,7 +1252,7 @@ void VGA::impl::onDebugCommand(DebuggerInterface& dbg)
                 char c = '.';
                 if (pix.planes[0] >= ' ' && pix.planes[0] < 0x7f)
                     c = pix.planes[0];
-                std::println("{:04X} {:02X} {:02X} {:02X} {:02X}  {:c}", i, pix.planes[0], pix.planes[1], pix.planes[2], pix.planes[3], c);
+                bus_.log().println("{:04X} {:02X} {:02X} {:02X} {:02X}  {:c}", i, pix.planes[0], pix.planes[1], pix.planes[2], pix.planes[3], c);
             }
 
             return;
@@ -1227,20 +1274,20 @@ void VGA::impl::onDebugCommand(DebuggerInterface& dbg)
             throw std::runtime_error { std::format("Unknown VGA command \"{}\"", *w) };
     }
     if (showFlag & FLAG_SEQ)
-        ShowRegisters("Sequencer", seqReg_, seqRegName);
+        ShowRegisters(bus_.log(), "Sequencer", seqReg_, seqRegName);
     if (showFlag & FLAG_CRTC)
-        ShowRegisters("CRTC", crtcReg_, crtcRegName);
+        ShowRegisters(bus_.log(), "CRTC", crtcReg_, crtcRegName);
     if (showFlag & FLAG_EXT) {
-        std::println("External registers:");
-        std::println("Misc out. {:02X} 0b{:08b}", miscOut_, miscOut_);
+        bus_.log().println("External registers:");
+        bus_.log().println("Misc out. {:02X} 0b{:08b}", miscOut_, miscOut_);
         // Feature control/ Graphics position..
     }
     if (showFlag & FLAG_ATTR)
-        ShowRegisters("Attribute", attrReg_, attrRegName);
+        ShowRegisters(bus_.log(), "Attribute", attrReg_, attrRegName);
     if (showFlag & FLAG_GC)
-        ShowRegisters("Graphics controller", gcReg_, gcRegName);
+        ShowRegisters(bus_.log(), "Graphics controller", gcReg_, gcRegName);
     if (showFlag & FLAG_MODE)
-        displayInfo_.log(!(gcReg_[GC_REG_MISC] & GC_MISC_MASK_ALPHA_DIS), attrReg_[ATTR_REG_PLANE_ENABLE]);
+        displayInfo_.log(bus_.log(), !(gcReg_[GC_REG_MISC] & GC_MISC_MASK_ALPHA_DIS), attrReg_[ATTR_REG_PLANE_ENABLE]);
 }
 
 VGA::VGA(SystemBus& bus)
@@ -1250,6 +1297,16 @@ VGA::VGA(SystemBus& bus)
 
 VGA::~VGA() = default;
 
+void VGA::saveState(SnapshotWriter& writer) const
+{
+    impl_->saveState(writer);
+}
+
+void VGA::loadState(SnapshotReader& reader)
+{
+    impl_->loadState(reader);
+}
+
 void VGA::forceRedraw()
 {
     impl_->renderFrame();
@@ -10,6 +10,9 @@ public:
     explicit VGA(SystemBus& bus);
     ~VGA();
 
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
     using DrawFunction = std::function<void(const uint32_t* pixels, int w, int h)>;
     void setDrawFunction(const DrawFunction& onDraw);
     void registerDebugFunction(class Debugger& dbg);
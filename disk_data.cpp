@@ -30,7 +30,7 @@ DiskFormat DiskFormatFromData(const std::vector<uint8_t>& data)
 
 void DiskData::eject()
 {
-    data.clear();
+    data = SharedPages {};
     format = DiskFormat {};
     filename.clear();
     file = nullptr;
@@ -40,7 +40,7 @@ void DiskData::insert(std::vector<uint8_t>&& inData)
 {
     const auto fmt = DiskFormatFromData(inData);
     eject();
-    data = std::move(inData);
+    data = SharedPages { inData };
     format = fmt;
 }
 
@@ -70,7 +70,7 @@ void DiskData::insert(std::string_view diskFilename)
     DiskFormat fmt = DiskFormatFromData(diskData);
     //LOG("Format: {}/{}/{}", fmt.numCylinder, fmt.headsPerCylinder, fmt.sectorsPerTrack);
     eject();
-    data = std::move(diskData);
+    data = SharedPages { diskData };
     format = fmt;
     file = std::move(diskFile);
     filename = diskFilename;
@@ -84,11 +84,22 @@ void DiskData::afterWrite(size_t offset, size_t count)
     file->seekp(offset, std::ios::beg);
     if (!*file)
         throw std::runtime_error { std::format("File seek failed. Address = {:X} for {:?}.", offset, filename) };
-    file->write(reinterpret_cast<const char*>(&data[offset]), count);
+    std::vector<char> buffer(count);
+    data.read(offset, buffer.data(), count);
+    file->write(buffer.data(), count);
     if (!*file)
         throw std::runtime_error { std::format("HD file write failed. Address = {:X} Count = {:X} for {:?}", offset, count, filename) };
 }
 
+DiskData DiskData::share() const
+{
+    DiskData copy;
+    copy.data = data;
+    copy.format = format;
+    copy.filename = filename;
+    return copy;
+}
+
 void CreateDisk(std::string_view filename, const DiskFormat& fmt)
 {
     {
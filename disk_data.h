@@ -7,9 +7,10 @@
 #include <memory>
 #include <fstream>
 #include "disk_format.h"
+#include "shared_pages.h"
 
 struct DiskData {
-    std::vector<uint8_t> data;
+    SharedPages data;
     DiskFormat format;
     std::string filename;
     std::unique_ptr<std::fstream> file;
@@ -18,6 +19,9 @@ struct DiskData {
     void insert(std::vector<uint8_t>&& data);
     void insert(std::string_view filename);
     void afterWrite(size_t offset, size_t count);
+
+    // Copy of the disk that shares the data copy-on-write. Writes to it aren't written back to the file.
+    DiskData share() const;
 };
 
 void CreateDisk(std::string_view filename, const DiskFormat& fmt);
@@ -0,0 +1,331 @@
+#include "jit_x64.h"
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#if JIT_X64
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// JitCodeBuffer
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+JitCodeBuffer::JitCodeBuffer(size_t size)
+    : size_ { size }
+{
+#if !JIT_X64
+    throw std::runtime_error { "Native code generation is not supported on this host" };
+#elif defined(_WIN32)
+    base_ = static_cast<std::uint8_t*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READ));
+    if (!base_)
+        throw std::runtime_error { "Could not allocate executable memory" };
+#else
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error { "Could not allocate executable memory" };
+    base_ = static_cast<std::uint8_t*>(mem);
+#endif
+}
+
+JitCodeBuffer::~JitCodeBuffer()
+{
+#if JIT_X64
+#ifdef _WIN32
+    VirtualFree(base_, 0, MEM_RELEASE);
+#else
+    munmap(base_, size_);
+#endif
+#endif
+}
+
+const void* JitCodeBuffer::install(const std::vector<std::uint8_t>& code)
+{
+    constexpr size_t align = 16;
+    const auto start = (used_ + align - 1) & ~(align - 1);
+    if (start + code.size() > size_)
+        return nullptr;
+    setWritable(true);
+    std::memcpy(base_ + start, code.data(), code.size());
+    setWritable(false);
+#if JIT_X64 && defined(_WIN32)
+    FlushInstructionCache(GetCurrentProcess(), base_ + start, code.size());
+#endif
+    used_ = start + code.size();
+    return base_ + start;
+}
+
+void JitCodeBuffer::clear()
+{
+    used_ = 0;
+}
+
+void JitCodeBuffer::setWritable(bool writable)
+{
+#if JIT_X64
+#ifdef _WIN32
+    DWORD oldProtect;
+    if (!VirtualProtect(base_, size_, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &oldProtect))
+        throw std::runtime_error { "Could not change protection of executable memory" };
+#else
+    if (mprotect(base_, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC))
+        throw std::runtime_error { "Could not change protection of executable memory" };
+#endif
+#else
+    (void)writable;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// X64Emitter
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const std::vector<std::uint8_t>& X64Emitter::finish()
+{
+    for (const auto& [pos, label] : fixups_) {
+        assert(labels_[label] >= 0);
+        const auto rel = static_cast<std::int32_t>(labels_[label] - static_cast<std::ptrdiff_t>(pos + 4));
+        std::memcpy(&code_[pos], &rel, sizeof(rel));
+    }
+    fixups_.clear();
+    return code_;
+}
+
+void X64Emitter::emit8(std::uint8_t value)
+{
+    code_.push_back(value);
+}
+
+void X64Emitter::emit32(std::uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        emit8(static_cast<std::uint8_t>(value >> (8 * i)));
+}
+
+void X64Emitter::emit64(std::uint64_t value)
+{
+    emit32(static_cast<std::uint32_t>(value));
+    emit32(static_cast<std::uint32_t>(value >> 32));
+}
+
+void X64Emitter::rex(bool w, Reg reg, Reg rm)
+{
+    const std::uint8_t value = 0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (value != 0x40)
+        emit8(value);
+}
+
+void X64Emitter::modRMReg(Reg reg, Reg rm)
+{
+    emit8(static_cast<std::uint8_t>(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+void X64Emitter::modRMMem(Reg reg, Reg base, std::int32_t disp)
+{
+    emit8(static_cast<std::uint8_t>(0x80 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP)
+        emit8(0x24); // SIB without index
+    emit32(static_cast<std::uint32_t>(disp));
+}
+
+void X64Emitter::push(Reg r)
+{
+    rex(false, RAX, r);
+    emit8(static_cast<std::uint8_t>(0x50 + (r & 7)));
+}
+
+void X64Emitter::pop(Reg r)
+{
+    rex(false, RAX, r);
+    emit8(static_cast<std::uint8_t>(0x58 + (r & 7)));
+}
+
+void X64Emitter::ret()
+{
+    emit8(0xC3);
+}
+
+void X64Emitter::addRsp(std::int8_t amount)
+{
+    rex(true, RAX, RSP);
+    emit8(0x83);
+    modRMReg(RAX, RSP);
+    emit8(static_cast<std::uint8_t>(amount));
+}
+
+void X64Emitter::call(const void* func)
+{
+    mov64(RAX, reinterpret_cast<std::uint64_t>(func));
+    emit8(0xFF);
+    modRMReg(RDX, RAX); // /2
+}
+
+void X64Emitter::mov32(Reg dst, Reg src)
+{
+    rex(false, src, dst);
+    emit8(0x89);
+    modRMReg(src, dst);
+}
+
+void X64Emitter::mov32(Reg dst, std::uint32_t imm)
+{
+    rex(false, RAX, dst);
+    emit8(static_cast<std::uint8_t>(0xB8 + (dst & 7)));
+    emit32(imm);
+}
+
+void X64Emitter::mov64(Reg dst, Reg src)
+{
+    rex(true, src, dst);
+    emit8(0x89);
+    modRMReg(src, dst);
+}
+
+void X64Emitter::mov64(Reg dst, std::uint64_t imm)
+{
+    rex(true, RAX, dst);
+    emit8(static_cast<std::uint8_t>(0xB8 + (dst & 7)));
+    emit64(imm);
+}
+
+void X64Emitter::load32(Reg dst, Reg base, std::int32_t disp)
+{
+    rex(false, dst, base);
+    emit8(0x8B);
+    modRMMem(dst, base, disp);
+}
+
+void X64Emitter::store32(Reg base, std::int32_t disp, Reg src)
+{
+    rex(false, src, base);
+    emit8(0x89);
+    modRMMem(src, base, disp);
+}
+
+void X64Emitter::store64(Reg base, std::int32_t disp, Reg src)
+{
+    rex(true, src, base);
+    emit8(0x89);
+    modRMMem(src, base, disp);
+}
+
+void X64Emitter::store8(Reg base, std::int32_t disp, std::uint8_t imm)
+{
+    rex(false, RAX, base);
+    emit8(0xC6);
+    modRMMem(RAX, base, disp);
+    emit8(imm);
+}
+
+void X64Emitter::store32(Reg base, std::int32_t disp, std::uint32_t imm)
+{
+    rex(false, RAX, base);
+    emit8(0xC7);
+    modRMMem(RAX, base, disp);
+    emit32(imm);
+}
+
+void X64Emitter::alu32(AluOp op, Reg dst, Reg src)
+{
+    rex(false, src, dst);
+    emit8(static_cast<std::uint8_t>(static_cast<std::uint8_t>(op) * 8 + 1));
+    modRMReg(src, dst);
+}
+
+void X64Emitter::alu32(AluOp op, Reg dst, std::uint32_t imm)
+{
+    const auto signedImm = static_cast<std::int32_t>(imm);
+    const bool imm8 = signedImm >= -128 && signedImm <= 127;
+    rex(false, RAX, dst);
+    emit8(imm8 ? 0x83 : 0x81);
+    modRMReg(static_cast<Reg>(op), dst);
+    if (imm8)
+        emit8(static_cast<std::uint8_t>(imm));
+    else
+        emit32(imm);
+}
+
+void X64Emitter::test8(Reg l, Reg r)
+{
+    assert(l <= RBX && r <= RBX);
+    emit8(0x84);
+    modRMReg(r, l);
+}
+
+void X64Emitter::test32(Reg l, Reg r)
+{
+    rex(false, r, l);
+    emit8(0x85);
+    modRMReg(r, l);
+}
+
+void X64Emitter::test32(Reg r, std::uint32_t imm)
+{
+    rex(false, RAX, r);
+    emit8(0xF7);
+    modRMReg(RAX, r); // /0
+    emit32(imm);
+}
+
+void X64Emitter::test32(Reg base, std::int32_t disp, std::uint32_t imm)
+{
+    rex(false, RAX, base);
+    emit8(0xF7);
+    modRMMem(RAX, base, disp); // /0
+    emit32(imm);
+}
+
+void X64Emitter::not32(Reg r)
+{
+    rex(false, RAX, r);
+    emit8(0xF7);
+    modRMReg(RDX, r); // /2
+}
+
+void X64Emitter::shr32(Reg r, std::uint8_t count)
+{
+    rex(false, RAX, r);
+    emit8(0xC1);
+    modRMReg(RBP, r); // /5
+    emit8(count);
+}
+
+void X64Emitter::setcc(Cond cond, Reg dst)
+{
+    assert(dst <= RBX); // SPL etc. would need a REX prefix
+    emit8(0x0F);
+    emit8(static_cast<std::uint8_t>(0x90 + cond));
+    modRMReg(RAX, dst);
+}
+
+X64Emitter::Label X64Emitter::newLabel()
+{
+    labels_.push_back(-1);
+    return labels_.size() - 1;
+}
+
+void X64Emitter::bind(Label label)
+{
+    assert(labels_[label] < 0);
+    labels_[label] = static_cast<std::ptrdiff_t>(code_.size());
+}
+
+void X64Emitter::jcc(Cond cond, Label label)
+{
+    emit8(0x0F);
+    emit8(static_cast<std::uint8_t>(0x80 + cond));
+    fixups_.emplace_back(code_.size(), label);
+    emit32(0);
+}
+
+void X64Emitter::jmp(Label label)
+{
+    emit8(0xE9);
+    fixups_.emplace_back(code_.size(), label);
+    emit32(0);
+}
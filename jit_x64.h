@@ -0,0 +1,108 @@
+#ifndef JIT_X64_H
+#define JIT_X64_H
+
+// Native code generation is only available on x86-64 hosts, elsewhere the interpreter is used
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64 1
+#else
+#define JIT_X64 0
+#endif
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Executable memory that generated code is copied into. Code is only ever added until
+// the buffer is cleared (which invalidates everything installed so far). The memory is never
+// writable and executable at the same time, it's only made writable while code is being copied in.
+class JitCodeBuffer {
+public:
+    explicit JitCodeBuffer(size_t size);
+    ~JitCodeBuffer();
+
+    JitCodeBuffer(const JitCodeBuffer&) = delete;
+    JitCodeBuffer& operator=(const JitCodeBuffer&) = delete;
+
+    // Returns the address of the installed code, or nullptr if the buffer is full
+    const void* install(const std::vector<std::uint8_t>& code);
+    void clear();
+
+private:
+    std::uint8_t* base_;
+    size_t size_;
+    size_t used_ = 0;
+
+    void setWritable(bool writable);
+};
+
+// Minimal x86-64 assembler, only the instruction forms needed by the block compiler. Memory operands
+// are always [base + disp32] and all ALU operations are 32-bit (which zero extends the destination).
+class X64Emitter {
+public:
+    enum Reg : std::uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+    // Same encoding as the /digit of opcodes 81h/83h
+    enum class AluOp : std::uint8_t { add = 0, or_ = 1, adc = 2, sbb = 3, and_ = 4, sub = 5, xor_ = 6, cmp = 7 };
+
+    // Same numbering as the guest condition codes (Jcc opcode & 0xF)
+    enum Cond : std::uint8_t { O, NO, B, NB, Z, NZ, BE, NBE, S, NS, P, NP, L, NL, LE, NLE };
+
+    using Label = size_t;
+
+#ifdef _WIN32
+    static constexpr Reg ArgReg0 = RCX;
+    static constexpr Reg ArgReg1 = RDX;
+#else
+    static constexpr Reg ArgReg0 = RDI;
+    static constexpr Reg ArgReg1 = RSI;
+#endif
+
+    // Patches the jumps, must be called before the code is used
+    const std::vector<std::uint8_t>& finish();
+
+    void push(Reg r);
+    void pop(Reg r);
+    void ret();
+    void addRsp(std::int8_t amount);
+    void call(const void* func); // Clobbers RAX
+
+    void mov32(Reg dst, Reg src);
+    void mov32(Reg dst, std::uint32_t imm);
+    void mov64(Reg dst, Reg src);
+    void mov64(Reg dst, std::uint64_t imm);
+    void load32(Reg dst, Reg base, std::int32_t disp);
+    void store32(Reg base, std::int32_t disp, Reg src);
+    void store64(Reg base, std::int32_t disp, Reg src);
+    void store8(Reg base, std::int32_t disp, std::uint8_t imm);
+    void store32(Reg base, std::int32_t disp, std::uint32_t imm);
+
+    void alu32(AluOp op, Reg dst, Reg src);
+    void alu32(AluOp op, Reg dst, std::uint32_t imm);
+    void test8(Reg l, Reg r); // Only AL, CL, DL and BL
+    void test32(Reg l, Reg r);
+    void test32(Reg r, std::uint32_t imm);
+    void test32(Reg base, std::int32_t disp, std::uint32_t imm);
+    void not32(Reg r);
+    void shr32(Reg r, std::uint8_t count);
+    void setcc(Cond cond, Reg dst); // Only AL, CL, DL and BL
+
+    Label newLabel();
+    void bind(Label label);
+    void jcc(Cond cond, Label label);
+    void jmp(Label label);
+
+private:
+    std::vector<std::uint8_t> code_;
+    std::vector<std::ptrdiff_t> labels_; // -1 = not bound yet
+    std::vector<std::pair<size_t, Label>> fixups_; // rel32 positions
+
+    void emit8(std::uint8_t value);
+    void emit32(std::uint32_t value);
+    void emit64(std::uint64_t value);
+    void rex(bool w, Reg reg, Reg rm);
+    void modRMReg(Reg reg, Reg rm);
+    void modRMMem(Reg reg, Reg base, std::int32_t disp);
+};
+
+#endif
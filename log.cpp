@@ -0,0 +1,32 @@
+#include "log.h"
+#include <cstdio>
+
+namespace {
+
+thread_local Logger* currentLogger;
+
+} // unnamed namespace
+
+Logger::Logger()
+    : sink_ { [](std::string_view text) { std::fwrite(text.data(), 1, text.size(), stdout); } }
+{
+}
+
+Logger& Logger::current()
+{
+    if (currentLogger)
+        return *currentLogger;
+    thread_local Logger stdoutLogger;
+    return stdoutLogger;
+}
+
+Logger::Scope::Scope(Logger& logger)
+    : prev_ { currentLogger }
+{
+    currentLogger = &logger;
+}
+
+Logger::Scope::~Scope()
+{
+    currentLogger = prev_;
+}
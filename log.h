@@ -0,0 +1,72 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <format>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Destination for the diagnostic output of a machine. Every SystemBus owns one, so machines
+// running on different threads can be logged separately (or silenced by clearing the sink).
+class Logger {
+public:
+    using SinkType = std::function<void (std::string_view)>;
+
+    Logger(); // Logs to stdout
+
+    void setSink(const SinkType& sink)
+    {
+        sink_ = sink;
+    }
+
+    bool enabled() const
+    {
+        return static_cast<bool>(sink_);
+    }
+
+    void write(std::string_view text)
+    {
+        if (sink_)
+            sink_(text);
+    }
+
+    template <typename... Args>
+    void print(std::format_string<Args...> fmt, Args&&... args)
+    {
+        if (sink_)
+            sink_(std::format(fmt, std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    void println(std::format_string<Args...> fmt, Args&&... args)
+    {
+        if (sink_) {
+            auto text = std::format(fmt, std::forward<Args>(args)...);
+            text += '\n';
+            sink_(text);
+        }
+    }
+
+    // Logger for code that doesn't know which machine it belongs to (e.g. the default I/O handlers).
+    // This is the logger bound to the calling thread, or one logging to stdout.
+    static Logger& current();
+
+    // Binds a logger to the calling thread while in scope
+    class Scope {
+    public:
+        explicit Scope(Logger& logger);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Logger* prev_;
+    };
+
+private:
+    SinkType sink_;
+};
+
+#endif
@@ -3,6 +3,10 @@
 #include <functional>
 #include <fstream>
 #include <cstring>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <optional>
 #include "address.h"
 #include "fileio.h"
 #include "util.h"
@@ -20,10 +24,11 @@
 #include "devs/ata_controller.h"
 #include "bios_replacement.h"
 #include "disk_data.h"
+#include "snapshot.h"
 
 #define USE_EGA
 
-class XTPPI : public IOHandler, public CycleObserver {
+class XTPPI : public IOHandler {
 public:
     // https://github.com/tmk/tmk_keyboard/wiki/IBM-PC-XT-Keyboard-Protocol
     using IRQHandler = std::function<void (bool irqState)>;
@@ -31,9 +36,18 @@ public:
     explicit XTPPI(SystemBus& bus, const IRQHandler& irqHandler)
         : bus_ { bus }
         , irqHandler_ { irqHandler }
+        , resetEvent_ { [this]() {
+            bus_.log().println("XT keyboard - sending handhake");
+            setScancode(0xAA);
+        }, "xt-keyboard-reset" }
+        , keyEvent_ { [this]() {
+            if (canBufferKey()) {
+                setScancode(keyboardBuffer_.front());
+                keyboardBuffer_.erase(keyboardBuffer_.begin());
+            }
+        }, "xt-keyboard" }
     {
         bus.addIOHandler(0x60, 4, *this, true);
-        bus.addCycleObserver(*this);
         reset();
     }
 
@@ -42,34 +56,31 @@ public:
         portB_ = 0;
         hasScancode_ = false;
         scancode_ = 0;
-        resetCnt_ = 0;
+        bus_.cancelEvent(resetEvent_);
+        bus_.cancelEvent(keyEvent_);
         keyboardBuffer_.clear();
     }
 
-    void runCycles([[maybe_unused]] std::uint64_t numCycles) override
+    void saveState(SnapshotWriter& writer) const
     {
-        if (resetCnt_) {
-            if (numCycles > resetCnt_)
-                resetCnt_ = 0;
-            else
-                resetCnt_ -= static_cast<uint32_t>(numCycles);
-            if (!resetCnt_) {
-                std::println("XT keyboard - sending handhake");
-                setScancode(0xAA);
-                return;
-            }
-        }
-        if (canBufferKey()) {
-            setScancode(keyboardBuffer_.front());
-            keyboardBuffer_.erase(keyboardBuffer_.begin());
-        }
+        writer.section("ppi");
+        writer.write(portB_);
+        writer.write(hasScancode_);
+        writer.write(scancode_);
+        writer.write(keyboardBuffer_);
+        writer.write(resetEvent_);
+        writer.write(keyEvent_);
     }
 
-    std::uint64_t nextAction() override
+    void loadState(SnapshotReader& reader)
     {
-        if (resetCnt_)
-            return resetCnt_;
-        return canBufferKey() ? 1 : UINT64_MAX;
+        reader.section("ppi");
+        reader.read(portB_);
+        reader.read(hasScancode_);
+        reader.read(scancode_);
+        reader.read(keyboardBuffer_);
+        reader.read(bus_, resetEvent_);
+        reader.read(bus_, keyEvent_);
     }
 
     std::uint8_t inU8(std::uint16_t port, std::uint16_t offset) override
@@ -77,11 +88,12 @@ public:
         switch (offset) {
         case 0: // port A
             if (!hasScancode_) {
-                std::println("XT keyboard: Read wihout data");
+                bus_.log().println("XT keyboard: Read wihout data");
                 return scancode_ == 0xAA ? 0 : scancode_; // Return last..
             }
             hasScancode_ = false;
-            std::println("XT keyboard: Read scancode: {:02X}", scancode_);
+            bus_.log().println("XT keyboard: Read scancode: {:02X}", scancode_);
+            scheduleKey();
             return scancode_;
         case 1: // port B
             return portB_;
@@ -98,7 +110,7 @@ public:
         switch (offset) {
         case 0: // Port A
             // Used during POST
-            std::println("XT PPI: Port A output: {:02X}", value);
+            bus_.log().println("XT PPI: Port A output: {:02X}", value);
             break;
         case 1: // Port B
             // Bitfields for Progr. Peripheral Interface (8255) system control port [output]:
@@ -114,21 +126,22 @@ public:
             //  1	speaker data enable
             //  0	timer 2 gate to speaker enable
             // Note:	bits 2 and 3 are sometimes used as turbo switch
-            std::println("XT PPI: Port B write {:02X} 0b{:08b}", value, value);
+            bus_.log().println("XT PPI: Port B write {:02X} 0b{:08b}", value, value);
             if (value & 0x80) {
-                std::println("XT keyboard clear");
+                bus_.log().println("XT keyboard clear");
                 hasScancode_ = false;
                 irqHandler_(false);
             }
             if ((value & 0x40) && !(portB_ & 0x40)) {
-                std::println("XT keyboard reset");
+                bus_.log().println("XT keyboard reset");
                 //setScancode(0xAA);
-                resetCnt_ = 300; // Simulate time for handshake to clock out (for IBM PC XT BIOS, KBD_RESET with I=1)                
+                bus_.scheduleEvent(resetEvent_, bus_.time() + 300); // Simulate time for handshake to clock out (for IBM PC XT BIOS, KBD_RESET with I=1)
             }
             portB_ = value;
+            scheduleKey();
             break;
         case 3:
-            std::println("XT PPI: Control={:02X} 0b{:08b}", value, value);
+            bus_.log().println("XT PPI: Control={:02X} 0b{:08b}", value, value);
             // 89: A/B output, C input (port A used as output during POST by IBM XT BIOS)
             // 99: A=mode 0/input, B=mode0/output C=input
             if (value != 0x89 && value != 0x99)
@@ -141,7 +154,7 @@ public:
 
     void enqueueScancode(uint8_t scancode) {
         keyboardBuffer_.push_back(scancode);
-        bus_.recalcNextAction();
+        scheduleKey();
     }
 
 private:
@@ -150,14 +163,21 @@ private:
     uint8_t portB_;
     bool hasScancode_;
     uint8_t scancode_;
-    uint32_t resetCnt_;
     std::vector<uint8_t> keyboardBuffer_;
+    ScheduledEvent resetEvent_;
+    ScheduledEvent keyEvent_;
 
     bool canBufferKey() const
     {
         return !hasScancode_ && keyboardEnabled() && !keyboardBuffer_.empty();
     }
 
+    void scheduleKey()
+    {
+        if (canBufferKey() && !keyEvent_.scheduled())
+            bus_.scheduleEvent(keyEvent_, bus_.time() + 1);
+    }
+
     bool keyboardEnabled() const
     {
         return (portB_ & 0xC0) == 0x40;
@@ -169,7 +189,7 @@ private:
         //    return;
 
         if (hasScancode_) {
-            std::println("XT keyboard overrun");
+            bus_.log().println("XT keyboard overrun");
             scancode_ = 0xFF;
         } else {
             hasScancode_ = true;
@@ -186,19 +206,109 @@ public:
         , cpu { model, bus }
         , conventionalMem { baseMemSize }
     {
-        bus.addMemHandler(0, conventionalMem.size(), conventionalMem);
+        addRam(0, conventionalMem);
     }
 
     SystemBus bus;
     CPU cpu;
-    RamHandler conventionalMem;
+    SharedRamHandler conventionalMem;
 
     virtual void keyboardEvent(const KeyPress& key)
     {
-        std::println("Ignoring key scanCode=0x{:02X} down={}", key.scanCode, key.down);
+        bus.log().println("Ignoring key scanCode=0x{:02X} down={}", key.scanCode, key.down);
     }
 
     virtual void forceRedraw() { }
+
+    using DrawFunction = std::function<void (const uint32_t* pixels, int w, int h)>;
+    virtual void setDrawFunction(const DrawFunction& onDraw) = 0;
+    virtual void registerDebugFunctions(Debugger&) { }
+
+    // An empty filename ejects the disk
+    virtual void insertFloppy(uint8_t drive, const std::string& filename) = 0;
+
+    virtual void insertHardDisk(uint8_t drive, const std::string&)
+    {
+        throw std::runtime_error { std::format("No hard disk controller for drive {}", drive) };
+    }
+
+    // Map a ROM image owned by the machine
+    void addRom(std::uint64_t base, const std::vector<std::uint8_t>& data)
+    {
+        auto& rom = roms_.emplace_back(std::make_unique<RomHandler>(data));
+        bus.addMemHandler(base, rom->size(), *rom);
+    }
+
+    // Only valid between instructions. Disk images must be handled separately.
+    void saveSnapshot(const std::string& filename) const
+    {
+        SnapshotWriter writer { filename };
+        saveState(writer);
+        for (const auto* ram : ram_) {
+            writer.section("ram");
+            writer.write(ram->pages());
+        }
+        bus.log().println("Snapshot saved to {:?}", filename);
+    }
+
+    void loadSnapshot(const std::string& filename)
+    {
+        SnapshotReader reader { filename };
+        loadState(reader);
+        for (auto* ram : ram_) {
+            reader.section("ram");
+            reader.readFixed(ram->pages());
+        }
+        bus.remapMemory();
+        bus.log().println("Snapshot loaded from {:?}", filename);
+    }
+
+    // Make this machine a copy of other, which must have been set up the same way (ROMs etc.) and not be running.
+    // RAM and disks are shared copy-on-write, so only the pages written afterwards are copied.
+    void forkFrom(BaseMachine& other)
+    {
+        if (ram_.size() != other.ram_.size())
+            throw std::runtime_error { "Can't fork from a different machine type" };
+        SnapshotWriter writer;
+        other.saveState(writer);
+        SnapshotReader reader { writer.data() };
+        loadState(reader);
+        for (size_t i = 0; i < ram_.size(); ++i)
+            ram_[i]->shareFrom(*other.ram_[i]);
+        shareDisks(other);
+        // The pages of other are now shared as well
+        bus.remapMemory();
+        other.bus.remapMemory();
+    }
+
+protected:
+    void addRam(std::uint64_t base, SharedRamHandler& ram)
+    {
+        bus.addMemHandler(base, ram.size(), ram);
+        ram_.push_back(&ram);
+    }
+
+    virtual void saveDevices(SnapshotWriter& writer) const = 0;
+    virtual void loadDevices(SnapshotReader& reader) = 0;
+    virtual void shareDisks(const BaseMachine& other) = 0;
+
+private:
+    std::vector<SharedRamHandler*> ram_;
+    std::vector<std::unique_ptr<RomHandler>> roms_;
+
+    void saveState(SnapshotWriter& writer) const
+    {
+        bus.saveState(writer);
+        cpu.saveState(writer);
+        saveDevices(writer);
+    }
+
+    void loadState(SnapshotReader& reader)
+    {
+        bus.loadState(reader);
+        cpu.loadState(reader);
+        loadDevices(reader);
+    }
 };
 
 static constexpr bool isCommPort(uint16_t port)
@@ -246,18 +356,18 @@ static constexpr bool isATAPort(uint16_t port)
 
 class XTMachine : public BaseMachine, public IOHandler {
 public:
-    explicit XTMachine()
-        : BaseMachine { CPUModel::i8088 }
+    explicit XTMachine(CPUModel model = CPUModel::i8088, uint32_t baseMemSize = 640 * 1024)
+        : BaseMachine { model, baseMemSize }
         , pic { bus, 0x20 }
         , pit { bus,
             [this]() {
-                // std::println("PIT interrupt");
+                // bus.log().println("PIT interrupt");
                 pic.setInterrupt(PIC_IRQ_PIT);
             } }
         , dma { bus, 0x00, 0x81, false }
         , ppi { bus,
             [this](bool state) {
-                std::println("XT Keyboard interrupt state {}", state);
+                bus.log().println("XT Keyboard interrupt state {}", state);
                 if (state)
                     pic.setInterrupt(PIC_IRQ_KEYBOARD);
                 else
@@ -276,6 +386,7 @@ public:
     {
         bus.setDefaultIOHandler(this);
         cpu.setInterruptFunction([this]() { return pic.getInterrupt(); });
+        pic.setPendingCallback([this](bool pending) { cpu.setInterruptPending(pending); });
     }
     i8259a_PIC pic;
     i8253_PIT pit;
@@ -289,9 +400,8 @@ public:
         bool log = true;
         if (port == 0x201) {
             // game port (polled 100 times)
-            static bool warned = false;
-            if (!warned)
-                warned = true;
+            if (!warnedGamePort_)
+                warnedGamePort_ = true;
             else
                 log = false;
         } else if (port == 0x210) {
@@ -303,7 +413,7 @@ public:
             return IOHandler::inU8(port, port);
         }
         if (log)
-            std::println("{} TODO: IN8 0x{:04X}", cpu.currentIp(), port);
+            bus.log().println("{} TODO: IN8 0x{:04X}", cpu.currentIp(), port);
         return 0xFF;
     }
 
@@ -321,7 +431,7 @@ public:
         } else {
             IOHandler::outU8(port, port, value);
         }
-        std::println("{} TODO: OUT 0x{:04X} 0x{:02X}", cpu.currentIp(), port, value);
+        bus.log().println("{} TODO: OUT 0x{:04X} 0x{:02X}", cpu.currentIp(), port, value);
     }
 
     void keyboardEvent(const KeyPress& key) override
@@ -329,13 +439,59 @@ public:
         ppi.enqueueScancode(static_cast<uint8_t>(key.scanCode | (key.down ? 0 : 0x80)));
     }
 
+    void forceRedraw() override
+    {
+        cga.forceRedraw();
+    }
+
+    void setDrawFunction(const DrawFunction& onDraw) override
+    {
+        cga.setDrawFunction(onDraw);
+    }
+
+    void insertFloppy(uint8_t drive, const std::string& filename) override
+    {
+        if (filename.empty())
+            floppy.insertDisk(drive, filename);
+        else
+            floppy.insertDisk(drive, ReadFile(filename));
+    }
+
+protected:
+    void saveDevices(SnapshotWriter& writer) const override
+    {
+        pic.saveState(writer);
+        pit.saveState(writer);
+        dma.saveState(writer);
+        ppi.saveState(writer);
+        floppy.saveState(writer);
+        cga.saveState(writer);
+    }
+
+    void loadDevices(SnapshotReader& reader) override
+    {
+        pic.loadState(reader);
+        pit.loadState(reader);
+        dma.loadState(reader);
+        ppi.loadState(reader);
+        floppy.loadState(reader);
+        cga.loadState(reader);
+    }
+
+    void shareDisks(const BaseMachine& other) override
+    {
+        floppy.shareDisks(dynamic_cast<const XTMachine&>(other).floppy);
+    }
+
 private:
+    bool warnedGamePort_ = false;
 };
 
 class CMOS : public IOHandler {
 public:
     explicit CMOS(SystemBus& bus)
-        : data_(128)
+        : log_ { bus.log() }
+        , data_(128)
     {
         bus.addIOHandler(0x70, 2, *this);
         reset();
@@ -346,6 +502,20 @@ public:
         reg_ = 0;
     }
 
+    void saveState(SnapshotWriter& writer) const
+    {
+        writer.section("cmos");
+        writer.write(reg_);
+        writer.write(data_);
+    }
+
+    void loadState(SnapshotReader& reader)
+    {
+        reader.section("cmos");
+        reader.read(reg_);
+        reader.readFixed(data_);
+    }
+
     void set(uint8_t index, uint8_t value)
     {
         assert(index < data_.size());
@@ -356,10 +526,10 @@ public:
     {
         switch (offset) {
         case 1:
-            std::println("CMOS: Read from reg {:02X} -> {:02X}", reg_ & indexMask, data_[reg_ & indexMask]);
+            log_.println("CMOS: Read from reg {:02X} -> {:02X}", reg_ & indexMask, data_[reg_ & indexMask]);
             return data_[reg_ & indexMask];
         default:
-            std::println("CMOS: TODO!");
+            log_.println("CMOS: TODO!");
             return IOHandler::inU8(port, offset);
         }
     }
@@ -372,7 +542,7 @@ public:
             reg_ = value;
             break;
         case 1:
-            std::println("TODO: CMOS write offset 0x{:02X} value {:02X}", reg_ & indexMask, value);
+            log_.println("TODO: CMOS write offset 0x{:02X} value {:02X}", reg_ & indexMask, value);
             data_[reg_ & indexMask] = value;
             break;
         default:
@@ -382,6 +552,7 @@ public:
 
 private:
     static constexpr uint8_t indexMask = 127;
+    Logger& log_;
     uint8_t reg_;
     std::vector<uint8_t> data_;
 };
@@ -389,6 +560,7 @@ private:
 class BochsDebugHandler : public IOHandler {
 public:
     explicit BochsDebugHandler(SystemBus& bus)
+        : log_ { bus.log() }
     {
         bus.addIOHandler(0x80, 1, *this); // PORT_DIAG
         bus.addIOHandler(0x400, numLevels, *this); // PANIC_PORT, ...
@@ -399,6 +571,7 @@ private:
     static constexpr const char* const desc_[numLevels] = {
         "PANIC", "PANIC2", "INFO", "DEBUG"
     };
+    Logger& log_;
     std::string buffers_[numLevels];
     std::uint8_t diagLast_ = 0xcd;
     std::uint32_t diagCount_ = 0;
@@ -407,10 +580,10 @@ private:
     {
         if (port == 0x80) {
             if (value != diagLast_) {
-                std::print("BOCHS diag: 0x{:02X}", value);
+                log_.print("BOCHS diag: 0x{:02X}", value);
                 if (diagCount_)
-                    std::print(" ({} times 0x{:02X} ignored)", diagCount_, diagLast_);
-                std::println("");
+                    log_.print(" ({} times 0x{:02X} ignored)", diagCount_, diagLast_);
+                log_.println("");
                 diagLast_ = value;
                 diagCount_ = 0;
             } else {
@@ -422,7 +595,7 @@ private:
         assert(offset < numLevels);
         auto& buf = buffers_[offset];
         if (value == 10) {
-            std::println("BOCHS {}: {}", desc_[offset], buf);
+            log_.println("BOCHS {}: {}", desc_[offset], buf);
             buf.clear();
         } else {
             buf.push_back(value);
@@ -433,6 +606,7 @@ private:
 class PCIHandler : public IOHandler {
 public:
     explicit PCIHandler(SystemBus& bus)
+        : log_ { bus.log() }
     {
         bus.addIOHandler(0x4D0, 2, *this); // IRQ
         bus.addIOHandler(0xCF8, 8, *this); // Config
@@ -441,7 +615,7 @@ public:
     void outU8(std::uint16_t port, std::uint16_t offset, std::uint8_t value) override
     {
         if (port == 0x4D0 || port == 0x4D1) {
-            std::println("PCI: Ignoring IRQ config write to port {:04X} {:02X}", port, value);
+            log_.println("PCI: Ignoring IRQ config write to port {:04X} {:02X}", port, value);
             return;
         }
         IOHandler::outU8(port, offset, value);
@@ -453,7 +627,7 @@ public:
             return IOHandler::outU32(port, offset, value);
         if (offset != 0)
             throw std::runtime_error { std::format("PCI write to address {:08X} value {:08X}", address_, value) };
-        std::println("PCI: Selecting address {:08X}", value);
+        log_.println("PCI: Selecting address {:08X}", value);
         address_ = value;
     }
 
@@ -465,6 +639,7 @@ public:
     }
 
 private:
+    Logger& log_;
     uint32_t address_ = 0;
 };
 
@@ -484,7 +659,7 @@ public:
 
     void outU8([[maybe_unused]] std::uint16_t port, [[maybe_unused]] std::uint16_t offset, std::uint8_t value) override
     {
-        //std::println("Output to fast A20 port: {:02X}", value);
+        //bus_.log().println("Output to fast A20 port: {:02X}", value);
         if (value & ~PORTA_MASK_A20)
             throw std::runtime_error { std::format("Unsupported value written to port 0x92 (Fast A20): {:02X}", value) };
         fastA20_ = (value & PORTA_MASK_A20) != 0;
@@ -497,6 +672,21 @@ public:
         setA20State();
     }
 
+    void saveState(SnapshotWriter& writer) const
+    {
+        writer.section("a20");
+        writer.write(kbdA20Line_);
+        writer.write(fastA20_);
+    }
+
+    void loadState(SnapshotReader& reader)
+    {
+        reader.section("a20");
+        reader.read(kbdA20Line_);
+        reader.read(fastA20_);
+        setState(kbdA20Line_ || fastA20_);
+    }
+
 private:
     static constexpr uint8_t PORTA_MASK_A20 = 1 << 1;
 
@@ -507,7 +697,7 @@ private:
 
     void setState(bool enabled)
     {
-        //std::println("A20 gate {}!", enabled ? "enabled" : "disabled");
+        //bus_.log().println("A20 gate {}!", enabled ? "enabled" : "disabled");
         bus_.setAddressMask(UINT64_MAX & ~(enabled ? 0 : 1 << 20));
         curState_ = enabled;
     }
@@ -523,9 +713,9 @@ private:
 
 class Clone386Machine : public BaseMachine, public IOHandler {
 public:
-    explicit Clone386Machine()
-        : BaseMachine { CPUModel::i80386sx }
-        , extendedMem { 15 * 1024 * 1024 }
+    explicit Clone386Machine(CPUModel model = CPUModel::i80386sx, uint32_t baseMemSize = 640 * 1024, uint32_t extendedMemSize = 15 * 1024 * 1024)
+        : BaseMachine { model, baseMemSize }
+        , extendedMem { extendedMemSize }
         , a20control { bus }
         , cmos { bus }
         , dma1 { bus, 0x00, 0x81, false }
@@ -535,12 +725,12 @@ public:
         , pic2 { bus, 0xA0 }
         , pit { bus,
             [this]() {
-                // std::println("PIT interrupt");
+                // bus.log().println("PIT interrupt");
                 pic1.setInterrupt(PIC_IRQ_PIT);
             } }
         , ps2 { bus, 
             [this]() {
-                std::println("Keyboard interrupt");
+                bus.log().println("Keyboard interrupt");
                 pic1.setInterrupt(PIC_IRQ_KEYBOARD);
                },
             [this](bool value) {
@@ -560,14 +750,17 @@ public:
         , ata1 { bus, 0x1f0, 0x3f6, []() {
                     throw std::runtime_error { "TODO: ATA1 IRQ!" };
                 } }
+        , bochsDebug { bus }
+        , pci { bus }
     {
         bus.setDefaultIOHandler(this);
         cpu.setInterruptFunction([this]() { return pic1.getInterrupt(); });
+        pic1.setPendingCallback([this](bool pending) { cpu.setInterruptPending(pending); });
         pic1.addSlave(pic2);
-        bus.addMemHandler(1024 * 1024, extendedMem.size(), extendedMem);
+        addRam(1024 * 1024, extendedMem);
     }
 
-    RamHandler extendedMem;
+    SharedRamHandler extendedMem;
     A20Control a20control;
     CMOS cmos;
     i8237a_DMAController dma1;
@@ -583,6 +776,9 @@ public:
     i8042_PS2Controller ps2;
     NEC765_FloppyController floppy;
     ATAController ata1;
+    BochsDebugHandler bochsDebug;
+    PCIHandler pci;
+    UnmappedMemHandler unmappedRom;
     std::string serialData;
 
     void forceRedraw() override
@@ -590,6 +786,43 @@ public:
         video.forceRedraw();
     }
 
+    void setDrawFunction(const DrawFunction& onDraw) override
+    {
+        video.setDrawFunction(onDraw);
+    }
+
+    void registerDebugFunctions(Debugger& dbg) override
+    {
+#ifdef USE_EGA
+        video.registerDebugFunction(dbg);
+#else
+        (void)dbg;
+#endif
+    }
+
+    void insertFloppy(uint8_t drive, const std::string& filename) override
+    {
+        if (filename.empty())
+            floppy.insertDisk(drive, filename);
+        else
+            floppy.insertDisk(drive, ReadFile(filename));
+    }
+
+    void insertHardDisk(uint8_t drive, const std::string& filename) override
+    {
+        ata1.insertDisk(drive, filename);
+    }
+
+    // Map the system and video BIOS, the rest of the ROM area reads as 0xFF
+    void mapRoms(const std::vector<std::uint8_t>& bios, const std::vector<std::uint8_t>& videoBios)
+    {
+        if (!videoBios.empty())
+            addRom(0xC0000, videoBios);
+        addRom(0x100000 - bios.size(), bios);
+        const auto start = 0xC0000 + videoBios.size();
+        bus.addMemHandler(start, 0x100000 - bios.size() - start, unmappedRom);
+    }
+
     void keyboardEvent(const KeyPress& key) override
     {
         ps2.enqueueKey(key);
@@ -607,7 +840,7 @@ public:
             return 0xFF;
 
         if (port == 0xA20 || port == 0xA24) { // ??? Power management? (Win3.1)
-            std::println("Ignoring read from port {:04X}", port);
+            bus.log().println("Ignoring read from port {:04X}", port);
             return 0xFF;
         }
 
@@ -615,7 +848,7 @@ public:
         // Win3.1 install ?? 0x23x is BUS mouse
         // 3BA MDA
         if ((port >= 0x238 && port <= 0x23F) || port == 0x3BA || port >= 0x1000) {
-            std::println("Ignoring read from port {:04X}", port);
+            bus.log().println("Ignoring read from port {:04X}", port);
             return 0xFF;
         }
 
@@ -638,13 +871,13 @@ public:
                 if (value != 0x0C) // Sent by windows debug build
                     serialData += value;
                 if (value == '\n') {
-                    std::println("Serial data: {:?}", serialData);
+                    bus.log().println("Serial data: {:?}", serialData);
                     serialData.clear();
                 }
             }
             return;
         }
-        std::println("Ignoring write to port {:02X} value {:02X}", port, value);
+        bus.log().println("Ignoring write to port {:02X} value {:02X}", port, value);
         if (isCommPort(port) || isATAPort(port))
             return;
 
@@ -657,14 +890,480 @@ public:
         //case 0xEB:
         //case 0xEC:
         //case 0x8022: // XXX???
-        //    std::println("Ignoring write to port {:02X} value {:02X}", port, value);
+        //    bus.log().println("Ignoring write to port {:02X} value {:02X}", port, value);
         //    break;
         //default:
         //    IOHandler::outU8(port, offset, value);
         //}
     }
+
+protected:
+    void saveDevices(SnapshotWriter& writer) const override
+    {
+        a20control.saveState(writer);
+        cmos.saveState(writer);
+        dma1.saveState(writer);
+        dma2.saveState(writer);
+        video.saveState(writer);
+        pic1.saveState(writer);
+        pic2.saveState(writer);
+        pit.saveState(writer);
+        ps2.saveState(writer);
+        floppy.saveState(writer);
+        ata1.saveState(writer);
+    }
+
+    void loadDevices(SnapshotReader& reader) override
+    {
+        a20control.loadState(reader);
+        cmos.loadState(reader);
+        dma1.loadState(reader);
+        dma2.loadState(reader);
+        video.loadState(reader);
+        pic1.loadState(reader);
+        pic2.loadState(reader);
+        pit.loadState(reader);
+        ps2.loadState(reader);
+        floppy.loadState(reader);
+        ata1.loadState(reader);
+    }
+
+    void shareDisks(const BaseMachine& other) override
+    {
+        const auto& src = dynamic_cast<const Clone386Machine&>(other);
+        floppy.shareDisks(src.floppy);
+        ata1.shareDisks(src.ata1);
+    }
+};
+
+// Machine description, set with command line options (--key value or --key=value) and/or
+// config files (--config file) with "key = value" lines
+struct MachineConfig {
+    std::string machine = "at"; // "xt": 8088, CGA and floppy, "at": 386SX, EGA/VGA, floppy and ATA
+    std::optional<CPUModel> cpu; // Default depends on the machine
+    std::uint32_t ramKB = 640;
+    std::uint32_t extRamKB = 15 * 1024; // "at" only
+    std::string bios;
+    std::string videoBios;
+    std::string floppy[2];
+    std::string hd; // Written in place
+    std::string boot = "hd"; // "floppy", "hd" or "floppy,hd" ("at" only)
+    std::string loadState; // Snapshot to start from
+
+    bool headless = false;
+    std::string log; // stdout, stderr, none or a filename (default: stdout, stderr when headless)
+    bool traceExceptions = false; // Log every CPU exception (including page faults)
+    bool jit = false; // Run hot blocks in one go (native code where possible), breakpoints are then only checked between blocks
+    bool realTime = false; // Sleep while halted when the guest is ahead of the host (otherwise idle time is skipped)
+
+    // Stop conditions for headless runs (at least one is required)
+    std::uint64_t maxInstructions = 0;
+    std::uint64_t maxGuestMs = 0;
+    struct StopPort {
+        std::uint16_t port;
+        std::optional<std::uint32_t> value; // Any value if not set
+    };
+    std::vector<StopPort> stopPorts;
 };
 
+static const char* const MachineConfigUsage = R"(Usage: xemu [options]
+  --config FILE            Read options from FILE ("key = value" lines, # starts a comment)
+  --machine xt|at          Machine type (default at)
+  --cpu MODEL              8088, 8086, 80386sx, 80386 or 80586
+  --ram KB                 Conventional memory (default 640)
+  --extram KB              Extended memory, at only (default 15360)
+  --bios FILE              System BIOS, mapped below 1MB
+  --video-bios FILE        Video BIOS, mapped at C0000
+  --floppy0/--floppy1 FILE Floppy image (read into memory)
+  --hd FILE                Hard disk image, at only (written in place)
+  --boot ORDER             floppy, hd or floppy,hd, at only (default hd)
+  --load-state FILE        Start from a snapshot taken with the same machine description
+  --log DEST               stdout, stderr, none or a filename
+  --trace-exceptions       Log every CPU exception, by default #DE and #PF aren't logged
+  --jit                    Run hot code a block at a time, 32-bit code is compiled on x86-64 hosts
+  --real-time              Don't let the guest clock run ahead of the host while the CPU is halted
+  --headless               Run without GUI/debugger until a stop condition and print a JSON report
+  --max-instructions N     Stop after N instructions
+  --max-time MS            Stop after MS milliseconds of guest time
+  --stop-port PORT[:VALUE] Stop when PORT is written (with VALUE), e.g. 0x80:0xFF for a POST code
+Without options the built-in development setup is used.)";
+
+static CPUModel ParseCPUModel(std::string_view name)
+{
+    for (const auto& [modelName, model] : CPUModelNames) {
+        if (modelName != name)
+            continue;
+        if (!CPUModelSupported(model))
+            throw std::runtime_error { std::format("CPU model {} is not supported", name) };
+        return model;
+    }
+    throw std::runtime_error { std::format("Unknown CPU model {:?}", name) };
+}
+
+// Decimal or 0x prefixed hexadecimal
+static std::uint64_t ParseNumber(std::string_view key, const std::string& value)
+{
+    try {
+        size_t pos = 0;
+        const auto n = std::stoull(value, &pos, value.starts_with("0x") || value.starts_with("0X") ? 16 : 10);
+        if (pos == value.size())
+            return n;
+    } catch (const std::logic_error&) {
+    }
+    throw std::runtime_error { std::format("Invalid number for {}: {:?}", key, value) };
+}
+
+static void LoadConfigFile(MachineConfig& config, const std::string& filename);
+
+// Options that don't take a value on the command line
+static bool IsFlagOption(std::string_view key)
+{
+    return key == "headless" || key == "trace-exceptions" || key == "jit" || key == "real-time";
+}
+
+static bool ParseFlag(const std::string& value)
+{
+    return value.empty() || value == "1" || value == "true";
+}
+
+static void SetOption(MachineConfig& config, std::string_view key, const std::string& value)
+{
+    if (key == "config") {
+        LoadConfigFile(config, value);
+    } else if (key == "machine") {
+        if (value != "xt" && value != "at")
+            throw std::runtime_error { std::format("Unknown machine type {:?}", value) };
+        config.machine = value;
+    } else if (key == "cpu") {
+        config.cpu = ParseCPUModel(value);
+    } else if (key == "ram") {
+        config.ramKB = static_cast<std::uint32_t>(ParseNumber(key, value));
+        if (config.ramKB == 0 || config.ramKB > 640)
+            throw std::runtime_error { "Conventional memory must be 1-640 KB" };
+    } else if (key == "extram") {
+        config.extRamKB = static_cast<std::uint32_t>(ParseNumber(key, value));
+        if (config.extRamKB > 15 * 1024) // 24-bit address bus
+            throw std::runtime_error { "At most 15360 KB of extended memory is supported" };
+    } else if (key == "bios") {
+        config.bios = value;
+    } else if (key == "video-bios") {
+        config.videoBios = value;
+    } else if (key == "floppy0" || key == "floppy1") {
+        config.floppy[key.back() - '0'] = value;
+    } else if (key == "hd") {
+        config.hd = value;
+    } else if (key == "boot") {
+        if (value != "floppy" && value != "hd" && value != "floppy,hd")
+            throw std::runtime_error { std::format("Invalid boot order {:?}", value) };
+        config.boot = value;
+    } else if (key == "load-state") {
+        config.loadState = value;
+    } else if (key == "log") {
+        config.log = value;
+    } else if (key == "headless") {
+        config.headless = ParseFlag(value);
+    } else if (key == "trace-exceptions") {
+        config.traceExceptions = ParseFlag(value);
+    } else if (key == "jit") {
+        config.jit = ParseFlag(value);
+    } else if (key == "real-time") {
+        config.realTime = ParseFlag(value);
+    } else if (key == "max-instructions") {
+        config.maxInstructions = ParseNumber(key, value);
+    } else if (key == "max-time") {
+        config.maxGuestMs = ParseNumber(key, value);
+    } else if (key == "stop-port") {
+        MachineConfig::StopPort stopPort {};
+        const auto colon = value.find(':');
+        const auto port = ParseNumber(key, value.substr(0, colon));
+        if (port > 0xFFFF)
+            throw std::runtime_error { std::format("Invalid port number {:?}", value) };
+        stopPort.port = static_cast<std::uint16_t>(port);
+        if (colon != std::string::npos)
+            stopPort.value = static_cast<std::uint32_t>(ParseNumber(key, value.substr(colon + 1)));
+        config.stopPorts.push_back(stopPort);
+    } else {
+        throw std::runtime_error { std::format("Unknown option {:?}", key) };
+    }
+}
+
+static void LoadConfigFile(MachineConfig& config, const std::string& filename)
+{
+    std::ifstream in { filename };
+    if (!in)
+        throw std::runtime_error { std::format("Could not open config file {:?}", filename) };
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo) {
+        line = TrimString(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        const auto eq = line.find('=');
+        const auto key = TrimString(line.substr(0, eq));
+        const auto value = eq == std::string::npos ? std::string {} : TrimString(line.substr(eq + 1));
+        try {
+            SetOption(config, key, value);
+        } catch (const std::exception& e) {
+            throw std::runtime_error { std::format("{}:{}: {}", filename, lineNo, e.what()) };
+        }
+    }
+}
+
+static void ParseCommandLine(MachineConfig& config, int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg { argv[i] };
+        if (!arg.starts_with("--"))
+            throw std::runtime_error { std::format("Unexpected argument {:?}", arg) };
+        auto key = arg.substr(2);
+        std::string value;
+        if (const auto eq = key.find('='); eq != std::string_view::npos) {
+            value = key.substr(eq + 1);
+            key = key.substr(0, eq);
+        } else if (!IsFlagOption(key)) {
+            if (i + 1 == argc)
+                throw std::runtime_error { std::format("Missing value for {}", arg) };
+            value = argv[++i];
+        }
+        SetOption(config, key, value);
+    }
+}
+
+// The setup used during development (when started without options)
+static MachineConfig DefaultMachineConfig()
+{
+    MachineConfig config;
+    config.bios = R"(c:\Tools\bochs-2.7\bios\BIOS-bochs-legacy)";
+#ifdef USE_EGA
+    config.videoBios = R"(../misc/ega/ega.rom)";
+    //config.videoBios = R"(c:\Tools\bochs-2.7\bios\VGABIOS-lgpl-latest)";
+#else
+    config.videoBios = R"(bios/videobios.bin)";
+#endif
+    config.floppy[0] = "../misc/asmtest/egagfx/test.img";
+    config.hd = "hd.bin";
+    //config.hd = "win2.bin";
+    //config.hd = "freedos.bin";
+    return config;
+}
+
+static Logger::SinkType MakeLogSink(const MachineConfig& config)
+{
+    const auto& dest = config.log.empty() ? (config.headless ? "stderr" : "stdout") : config.log;
+    auto toFile = [](std::FILE* f) {
+        return [f](std::string_view text) { std::fwrite(text.data(), 1, text.size(), f); };
+    };
+    if (dest == "stdout")
+        return toFile(stdout);
+    else if (dest == "stderr")
+        return toFile(stderr);
+    else if (dest == "none")
+        return nullptr;
+    auto out = std::make_shared<std::ofstream>(dest, std::ios::binary);
+    if (!*out)
+        throw std::runtime_error { std::format("Could not create log file {:?}", dest) };
+    return [out](std::string_view text) { out->write(text.data(), text.size()); };
+}
+
+static std::unique_ptr<BaseMachine> CreateMachine(const MachineConfig& config)
+{
+    if (config.bios.empty())
+        throw std::runtime_error { "No BIOS given (--bios)" };
+    const auto bios = ReadFile(config.bios);
+    const auto videoBios = config.videoBios.empty() ? std::vector<std::uint8_t> {} : ReadFile(config.videoBios);
+
+    std::unique_ptr<BaseMachine> machine;
+    if (config.machine == "xt") {
+        auto xt = std::make_unique<XTMachine>(config.cpu.value_or(CPUModel::i8088), config.ramKB * 1024);
+        if (!videoBios.empty())
+            xt->addRom(0xC0000, videoBios);
+        xt->addRom(0x100000 - bios.size(), bios);
+        machine = std::move(xt);
+    } else {
+        auto at = std::make_unique<Clone386Machine>(config.cpu.value_or(CPUModel::i80386sx), config.ramKB * 1024, config.extRamKB * 1024);
+        at->cmos.set(0x10, 0x44); // 2x1.44MB floppy drives
+        const auto extMemSize = std::min(63U * 1024, config.extRamKB); // In KB
+        at->cmos.set(0x30, static_cast<uint8_t>(extMemSize & 0xff));
+        at->cmos.set(0x31, static_cast<uint8_t>(extMemSize >> 8));
+        at->cmos.set(0x3D, config.boot == "floppy" ? 0x01 : config.boot == "hd" ? 0x02 : 0x21);
+        at->mapRoms(bios, videoBios);
+        machine = std::move(at);
+    }
+    machine->bus.log().setSink(MakeLogSink(config));
+    if (config.traceExceptions)
+        machine->cpu.exceptionTraceMask(UINT32_MAX);
+    machine->cpu.jitEnabled(config.jit);
+
+    for (uint8_t drive = 0; drive < 2; ++drive) {
+        if (!config.floppy[drive].empty())
+            machine->insertFloppy(drive, config.floppy[drive]);
+    }
+    if (!config.hd.empty())
+        machine->insertHardDisk(0, config.hd);
+    if (!config.loadState.empty())
+        machine->loadSnapshot(config.loadState);
+    return machine;
+}
+
+// Time is skipped while the CPU is halted, call halted() to sleep instead while the guest is ahead of the host
+class RealTimeThrottle {
+public:
+    explicit RealTimeThrottle(const SystemBus& bus)
+        : bus_ { bus }
+    {
+        restart();
+    }
+
+    void halted()
+    {
+        const auto guestTime = std::chrono::microseconds { (bus_.time() - guestStart_) * 1000000 / SysClockFreqHz };
+        const auto ahead = guestTime - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStart_);
+        if (ahead > maxDrift || -ahead > maxDrift) {
+            restart(); // E.g. after loading a snapshot or stopping in the debugger
+            return;
+        }
+        if (ahead.count() > 0)
+            std::this_thread::sleep_for(std::min(ahead, std::chrono::microseconds { 10000 }));
+    }
+
+private:
+    static constexpr std::chrono::microseconds maxDrift { 1000000 };
+    const SystemBus& bus_;
+    std::uint64_t guestStart_;
+    std::chrono::steady_clock::time_point hostStart_;
+
+    void restart()
+    {
+        guestStart_ = bus_.time();
+        hostStart_ = std::chrono::steady_clock::now();
+    }
+};
+
+// Counts I/O port accesses and watches for the stop ports of a headless run
+class HeadlessIOMonitor : public IOObserver {
+public:
+    explicit HeadlessIOMonitor(const std::vector<MachineConfig::StopPort>& stopPorts)
+        : stopPorts_ { stopPorts }
+        , counts_(0x10000)
+    {
+    }
+
+    struct PortCounts {
+        std::uint64_t reads;
+        std::uint64_t writes;
+    };
+
+    const std::vector<PortCounts>& counts() const
+    {
+        return counts_;
+    }
+
+    // Port and value that stopped the run
+    const std::optional<std::pair<std::uint16_t, std::uint32_t>>& stopped() const
+    {
+        return stopped_;
+    }
+
+    void ioInput(std::uint16_t port, std::uint32_t, std::uint8_t) override
+    {
+        ++counts_[port].reads;
+    }
+
+    void ioOutput(std::uint16_t port, std::uint32_t value, std::uint8_t) override
+    {
+        ++counts_[port].writes;
+        for (const auto& sp : stopPorts_) {
+            if (sp.port == port && (!sp.value || *sp.value == value) && !stopped_)
+                stopped_ = { port, value };
+        }
+    }
+
+private:
+    std::vector<MachineConfig::StopPort> stopPorts_;
+    std::vector<PortCounts> counts_;
+    std::optional<std::pair<std::uint16_t, std::uint32_t>> stopped_;
+};
+
+// Run until a stop condition is met and print a JSON report to stdout. Returns the process exit code.
+static int RunHeadless(const MachineConfig& config)
+{
+    if (!config.maxInstructions && !config.maxGuestMs && config.stopPorts.empty())
+        throw std::runtime_error { "A headless run needs a stop condition (--max-instructions, --max-time or --stop-port)" };
+
+    auto machine = CreateMachine(config);
+    Logger::Scope logScope { machine->bus.log() };
+    HeadlessIOMonitor monitor { config.stopPorts };
+    machine->bus.addIOObserver(monitor);
+
+    auto& cpu = machine->cpu;
+    auto& bus = machine->bus;
+    const auto maxGuestTime = config.maxGuestMs * SysClockFreqHz / 1000;
+    const auto instructionsStart = cpu.instructionsExecuted();
+    const auto guestStart = bus.time();
+    const auto hostStart = std::chrono::steady_clock::now();
+    RealTimeThrottle throttle { bus };
+
+    std::string stopReason;
+    std::string error;
+    try {
+        for (;;) {
+            cpu.step();
+            if (config.realTime && cpu.halted())
+                throttle.halted();
+            if (monitor.stopped()) {
+                stopReason = "port";
+                break;
+            }
+            if (config.maxInstructions && cpu.instructionsExecuted() - instructionsStart >= config.maxInstructions) {
+                stopReason = "instructions";
+                break;
+            }
+            if (maxGuestTime && bus.time() - guestStart >= maxGuestTime) {
+                stopReason = "time";
+                break;
+            }
+        }
+    } catch (const CPUHaltedException&) {
+        stopReason = "halt"; // HLT with interrupts disabled
+    } catch (const std::exception& e) {
+        stopReason = "error";
+        error = e.what();
+    }
+
+    const std::chrono::duration<double> hostTime = std::chrono::steady_clock::now() - hostStart;
+    const auto instructions = cpu.instructionsExecuted() - instructionsStart;
+    const auto guestTime = static_cast<double>(bus.time() - guestStart) / SysClockFreqHz;
+
+    std::string report = "{\n";
+    report += std::format("  \"stop_reason\": {},\n", JsonString(stopReason));
+    if (!error.empty())
+        report += std::format("  \"error\": {},\n", JsonString(error));
+    if (const auto& stopped = monitor.stopped(); stopped)
+        report += std::format("  \"stop_port\": {}, \"stop_value\": {},\n", stopped->first, stopped->second);
+    report += std::format("  \"instructions\": {},\n", instructions);
+    report += std::format("  \"guest_seconds\": {:.6f},\n", guestTime);
+    report += std::format("  \"host_seconds\": {:.6f},\n", hostTime.count());
+    report += std::format("  \"mips\": {:.3f},\n", hostTime.count() > 0 ? instructions / hostTime.count() / 1e6 : 0.0);
+    report += std::format("  \"speed\": {:.3f},\n", hostTime.count() > 0 ? guestTime / hostTime.count() : 0.0);
+    report += "  \"events\": {";
+    const char* sep = "";
+    for (const auto& [name, count] : bus.eventCounts()) {
+        report += std::format("{}{}: {}", sep, JsonString(name), count);
+        sep = ", ";
+    }
+    report += "},\n  \"io_ports\": {";
+    sep = "";
+    for (size_t port = 0; port < monitor.counts().size(); ++port) {
+        const auto& counts = monitor.counts()[port];
+        if (counts.reads || counts.writes) {
+            report += std::format("{}\n    \"0x{:04X}\": {{ \"reads\": {}, \"writes\": {} }}", sep, port, counts.reads, counts.writes);
+            sep = ",";
+        }
+    }
+    report += "\n  }\n}";
+    std::println("{}", report);
+    return stopReason == "error" ? 1 : 0;
+}
+
 void StretchImage(uint32_t* dst, int dstW, int dstH, const uint32_t* src, int srcW, int srcH)
 {
     assert(srcW <= dstW && srcH <= dstH);
@@ -702,8 +1401,34 @@ void StretchImage(uint32_t* dst, int dstW, int dstH, const uint32_t* src, int sr
     }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    MachineConfig config;
+    try {
+        if (argc > 1) {
+            ParseCommandLine(config, argc, argv);
+        } else {
+            config = DefaultMachineConfig();
+            try {
+                CreateDisk(config.hd, diskFormatSL520);
+                std::println("Created HD");
+            } catch (...) {
+            }
+        }
+    } catch (const std::exception& e) {
+        std::println(stderr, "{}\n{}", e.what(), MachineConfigUsage);
+        return 2;
+    }
+
+    if (config.headless) {
+        try {
+            return RunHeadless(config);
+        } catch (const std::exception& e) {
+            std::println(stderr, "{}", e.what());
+            return 2;
+        }
+    }
+
     try {
         extern void TestDebugger();
         TestDebugger();
@@ -715,13 +1440,9 @@ int main()
         SetGuiActive(true);
         [[maybe_unused]] std::vector<uint32_t> screenBuffer(guiWidth * guiHeight);
 
-
-        std::function<void(uint8_t, std::string_view)> diskInsertionEvent = [](uint8_t drive, std::string_view filename) {
-            throw std::runtime_error { std::format("No support for disk insertion in drive {:02X} {:?}", drive, filename) };
-        };
-
-        Clone386Machine machine;
-        machine.video.setDrawFunction([&screenBuffer](const uint32_t* pixels, int w, int h) {
+        auto machine = CreateMachine(config);
+        Logger::Scope logScope { machine->bus.log() };
+        machine->setDrawFunction([&screenBuffer](const uint32_t* pixels, int w, int h) {
             if (!pixels) {
                 // No sync
                 for (int y = 0; y < guiHeight; ++y) {
@@ -736,64 +1457,16 @@ int main()
             DrawScreen(screenBuffer.data());
         });
 
-        const char* diskName = "../misc/asmtest/egagfx/test.img";
-       
-        try {
-            CreateDisk("hd.bin", diskFormatSL520);
-            std::println("Created HD");
-        } catch (...) {
-        }
-#ifdef USE_EGA
-        auto videoRomData = ReadFile(R"(../misc/ega/ega.rom)");
-        //auto videoRomData = ReadFile(R"(c:\Tools\bochs-2.7\bios\VGABIOS-lgpl-latest)");
-#else
-        auto videoRomData = ReadFile(R"(bios/videobios.bin)");
-#endif
-        auto videoRom = RomHandler { videoRomData };
-        machine.bus.addMemHandler(0xC0000, videoRom.size(), videoRom);
-
-        auto rom = RomHandler { ReadFile(R"(c:\Tools\bochs-2.7\bios\BIOS-bochs-legacy)") };
-        BochsDebugHandler bochsDbgHandler { machine.bus };
-        PCIHandler pciHandler { machine.bus };
-        machine.cmos.set(0x10, 0x44); // 2x1.44MB floppy drives
-
-        assert(machine.extendedMem.size() < 16ULL * 1024 * 1024); // TODO: CMOS 0x34/0x35 Extended Mem size in 64K blocks > 16MB
-        const auto extMemSize = std::min(size_t(63 * 1024), machine.extendedMem.size() >> 10); // In KB
-        machine.cmos.set(0x30, static_cast<uint8_t>(extMemSize & 0xff));
-        machine.cmos.set(0x31, static_cast<uint8_t>(extMemSize >> 8)); 
-
-
-        //machine.cmos.set(0x3D, 0x01); // Boot from floppy
-        machine.floppy.insertDisk(0, ReadFile(diskName));
-        ////machine.cmos.set(0x3D, 0x21); // Boot from floppy then HD
-        machine.cmos.set(0x3D, 0x02); // Boot from HD
-        machine.ata1.insertDisk(0, "hd.bin");
-        //machine.ata1.insertDisk(0, "win2.bin");
-        //machine.ata1.insertDisk(0, "freedos.bin");
-        
-        machine.bus.addMemHandler(0x100000 - rom.size(), rom.size(), rom);
-
-
-        // Ignore unmapped ROM area
-        struct IgnoredHandler : public MemoryHandler {
-            IgnoredHandler(SystemBus& bus, uint64_t start, uint64_t end) { bus.addMemHandler(start, end - start, *this); }
-            std::uint8_t readU8([[maybe_unused]] std::uint64_t addr, [[maybe_unused]] std::uint64_t offset) override { return 0xFF; }
-            void writeU8([[maybe_unused]] std::uint64_t addr, [[maybe_unused]] std::uint64_t offset, [[maybe_unused]] std::uint8_t value) override { }
-        } ignoredHandler {machine.bus, 0xC0000+videoRom.size(), 0x100000 - rom.size() };
-
-        diskInsertionEvent = [&](uint8_t drive, std::string_view filename) {
-            if (!filename.empty()) {
+        auto diskInsertionEvent = [&](uint8_t drive, std::string_view filename) {
+            if (!filename.empty())
                 std::println("Inserting in drive {:02X}: {:?}", drive, filename);
-                machine.floppy.insertDisk(drive, ReadFile(std::string(filename)));
-            } else {
-                std::println("Ejecting disk in drive {:02X}", drive, filename);
-                machine.floppy.insertDisk(drive, filename);
-
-            }
+            else
+                std::println("Ejecting disk in drive {:02X}", drive);
+            machine->insertFloppy(drive, std::string(filename));
         };
 
-        Debugger dbg { machine.cpu, machine.bus };
-        auto& cpu = machine.cpu;
+        Debugger dbg { machine->cpu, machine->bus };
+        auto& cpu = machine->cpu;
 
         struct DebugBreakHandler : public IOHandler {
             enum : uint16_t { magicPort = 0x8abc };
@@ -812,14 +1485,26 @@ int main()
             }
 
             Debugger& dbg_;
-        } dbgBreakHandler { machine.bus, dbg };
+        } dbgBreakHandler { machine->bus, dbg };
 
         dbg.setOnActive([&](bool active) {
             if (active)
-                machine.forceRedraw();
+                machine->forceRedraw();
             SetGuiActive(!active);
         });
-        machine.video.registerDebugFunction(dbg);
+        machine->registerDebugFunctions(dbg);
+        dbg.registerFunction("savestate", [&machine](DebuggerInterface& dbgIf, std::string_view) {
+            const auto filename = dbgIf.getString();
+            if (!filename)
+                throw std::runtime_error { "Usage: savestate filename" };
+            machine->saveSnapshot(*filename);
+        });
+        dbg.registerFunction("loadstate", [&machine](DebuggerInterface& dbgIf, std::string_view) {
+            const auto filename = dbgIf.getString();
+            if (!filename)
+                throw std::runtime_error { "Usage: loadstate filename" };
+            machine->loadSnapshot(*filename);
+        });
 
         //dbg.activate();
         //dbg.addBreakPoint((0xC000 << 4) + 0x448); // POD14_ERR
@@ -828,7 +1513,9 @@ int main()
         //dbg.addBreakPoint((0xC000 << 4) + 0x660); // PODSTG_ERR0
         //dbg.addBreakPoint((0xC000 << 4) + 0x5c3);
 
-        //machine.cpu.exceptionTraceMask(0);
+        //machine->cpu.exceptionTraceMask(0);
+
+        RealTimeThrottle throttle { machine->bus };
 
         bool quit = false;
         for (unsigned guiUpdateCnt = 0; !quit;) {
@@ -841,7 +1528,7 @@ int main()
                         quit = true;
                         break;
                     case GUI::EventType::keyboard:
-                        machine.keyboardEvent(evt.key);
+                        machine->keyboardEvent(evt.key);
                         break;
                     case GUI::EventType::diskInsert:
                         diskInsertionEvent(evt.diskInsert.drive, evt.diskInsert.filename);
@@ -860,6 +1547,12 @@ int main()
                 //if (cpu.ip_ == 0x02CD)
                 //    __nop();
                 cpu.step();
+                if (cpu.halted()) {
+                    // Time is skipped while halted, so keep the GUI responsive
+                    guiUpdateCnt = 0;
+                    if (config.realTime)
+                        throttle.halted();
+                }
                 //if (cpu.protectedMode() && (cpu.sdesc_[SREG_CS].flags & SD_FLAGS_MASK_DB)) {
                 //    static bool first = true;
                 //    if (first) {
@@ -0,0 +1,67 @@
+#include "shared_pages.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+SharedPages::SharedPages(std::uint64_t size)
+    : pages_((size + PageSize - 1) >> PageShift)
+    , size_ { size }
+{
+    for (auto& p : pages_)
+        p = std::make_shared<Page>(); // Value initialized (zero filled)
+}
+
+SharedPages::SharedPages(const std::vector<std::uint8_t>& data)
+    : SharedPages { data.size() }
+{
+    write(0, data.data(), data.size());
+}
+
+std::uint64_t SharedPages::privatePages() const
+{
+    return std::count_if(pages_.begin(), pages_.end(), [](const auto& p) { return p.use_count() == 1; });
+}
+
+std::uint8_t* SharedPages::writablePageData(std::uint64_t page)
+{
+    assert(page < pages_.size());
+    auto& p = pages_[page];
+    if (p.use_count() == 1) {
+        // The other copies may have read the page before releasing it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return p->data;
+    }
+    p = std::make_shared<Page>(*p);
+    return p->data;
+}
+
+void SharedPages::read(std::uint64_t offset, void* dst, std::uint64_t length) const
+{
+    if (offset > size_ || length > size_ - offset)
+        throw std::out_of_range { "SharedPages: read out of range" };
+    auto d = static_cast<std::uint8_t*>(dst);
+    while (length) {
+        const auto pageOffset = offset & (PageSize - 1);
+        const auto n = std::min(length, PageSize - pageOffset);
+        std::memcpy(d, pageData(offset >> PageShift) + pageOffset, n);
+        d += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+void SharedPages::write(std::uint64_t offset, const void* src, std::uint64_t length)
+{
+    if (offset > size_ || length > size_ - offset)
+        throw std::out_of_range { "SharedPages: write out of range" };
+    auto s = static_cast<const std::uint8_t*>(src);
+    while (length) {
+        const auto pageOffset = offset & (PageSize - 1);
+        const auto n = std::min(length, PageSize - pageOffset);
+        std::memcpy(writablePageData(offset >> PageShift) + pageOffset, s, n);
+        s += n;
+        offset += n;
+        length -= n;
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef SHARED_PAGES_H
+#define SHARED_PAGES_H
+
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+// Memory stored in fixed size pages that are shared copy-on-write between copies of the object, so
+// a copy only costs the pages that are written afterwards. Copies can be used from different threads,
+// but a SharedPages object must not be copied while it's being written.
+class SharedPages {
+public:
+    static constexpr std::uint32_t PageShift = 12;
+    static constexpr std::uint64_t PageSize = 1 << PageShift;
+
+    SharedPages()
+        : size_ { 0 }
+    {
+    }
+    explicit SharedPages(std::uint64_t size);
+    explicit SharedPages(const std::vector<std::uint8_t>& data);
+
+    std::uint64_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    std::uint64_t numPages() const
+    {
+        return pages_.size();
+    }
+
+    // Number of pages not shared with any other copy
+    std::uint64_t privatePages() const;
+
+    bool shared(std::uint64_t page) const
+    {
+        assert(page < pages_.size());
+        return pages_[page].use_count() > 1;
+    }
+
+    const std::uint8_t* pageData(std::uint64_t page) const
+    {
+        assert(page < pages_.size());
+        return pages_[page]->data;
+    }
+
+    // Copies the page first if it's shared
+    std::uint8_t* writablePageData(std::uint64_t page);
+
+    std::uint8_t readU8(std::uint64_t offset) const
+    {
+        assert(offset < size_);
+        return pageData(offset >> PageShift)[offset & (PageSize - 1)];
+    }
+
+    void writeU8(std::uint64_t offset, std::uint8_t value)
+    {
+        assert(offset < size_);
+        writablePageData(offset >> PageShift)[offset & (PageSize - 1)] = value;
+    }
+
+    void read(std::uint64_t offset, void* dst, std::uint64_t length) const;
+    void write(std::uint64_t offset, const void* src, std::uint64_t length);
+
+private:
+    struct Page {
+        std::uint8_t data[PageSize];
+    };
+    std::vector<std::shared_ptr<Page>> pages_;
+    std::uint64_t size_;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include "snapshot.h"
+#include "system_bus.h"
+#include "shared_pages.h"
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+
+namespace {
+
+constexpr char SnapshotMagic[8] = { 'X', 'E', 'M', 'U', 'S', 'N', 'A', 'P' };
+
+} // unnamed namespace
+
+SnapshotWriter::SnapshotWriter(const std::string& filename)
+    : f_ { gzopen(filename.c_str(), "wb1") }
+{
+    if (!f_)
+        throw std::runtime_error { std::format("Could not create snapshot \"{}\"", filename) };
+    gzbuffer(f_, 128 * 1024);
+    write(SnapshotMagic);
+    write(SnapshotVersion);
+}
+
+SnapshotWriter::SnapshotWriter()
+    : f_ { nullptr }
+{
+    write(SnapshotMagic);
+    write(SnapshotVersion);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (f_)
+        gzclose(f_);
+}
+
+void SnapshotWriter::section(std::string_view tag)
+{
+    write(static_cast<std::uint8_t>(tag.size()));
+    write(tag.data(), tag.size());
+}
+
+void SnapshotWriter::write(const void* data, std::size_t size)
+{
+    auto d = static_cast<const char*>(data);
+    if (!f_) {
+        data_.insert(data_.end(), d, d + size);
+        return;
+    }
+    while (size) {
+        const auto n = static_cast<unsigned>(std::min<std::size_t>(size, 1 << 30));
+        if (gzwrite(f_, d, n) != static_cast<int>(n))
+            throw std::runtime_error { "Error writing snapshot" };
+        d += n;
+        size -= n;
+    }
+}
+
+void SnapshotWriter::write(const ScheduledEvent& event)
+{
+    write(event.scheduled());
+    write(event.time());
+}
+
+void SnapshotWriter::write(const SharedPages& pages)
+{
+    write(pages.size());
+    for (std::uint64_t page = 0; page < pages.numPages(); ++page)
+        write(pages.pageData(page), std::min(SharedPages::PageSize, pages.size() - (page << SharedPages::PageShift)));
+}
+
+SnapshotReader::SnapshotReader(const std::string& filename)
+    : f_ { gzopen(filename.c_str(), "rb") }
+{
+    if (!f_)
+        throw std::runtime_error { std::format("Could not open snapshot \"{}\"", filename) };
+    gzbuffer(f_, 128 * 1024);
+    checkHeader(filename);
+}
+
+SnapshotReader::SnapshotReader(const std::vector<char>& data)
+    : f_ { nullptr }
+    , data_ { &data }
+{
+    checkHeader("<memory>");
+}
+
+SnapshotReader::~SnapshotReader()
+{
+    if (f_)
+        gzclose(f_);
+}
+
+void SnapshotReader::checkHeader(const std::string& name)
+{
+    char magic[sizeof(SnapshotMagic)];
+    std::uint32_t version;
+    read(magic);
+    read(version);
+    if (!std::equal(std::begin(magic), std::end(magic), SnapshotMagic))
+        throw std::runtime_error { std::format("\"{}\" is not a snapshot", name) };
+    if (version != SnapshotVersion)
+        throw std::runtime_error { std::format("Snapshot \"{}\" has unsupported version {} (expected {})", name, version, SnapshotVersion) };
+}
+
+void SnapshotReader::section(std::string_view tag)
+{
+    std::uint8_t size;
+    read(size);
+    std::string actual(size, '\0');
+    read(actual.data(), size);
+    if (actual != tag)
+        throw std::runtime_error { std::format("Snapshot: expected section \"{}\" got \"{}\"", tag, actual) };
+    section_ = actual;
+}
+
+void SnapshotReader::read(void* data, std::size_t size)
+{
+    auto d = static_cast<char*>(data);
+    if (!f_) {
+        if (size > data_->size() - pos_)
+            throw std::runtime_error { std::format("Snapshot: unexpected end of data in section \"{}\"", section_) };
+        std::memcpy(d, data_->data() + pos_, size);
+        pos_ += size;
+        return;
+    }
+    while (size) {
+        const auto n = static_cast<unsigned>(std::min<std::size_t>(size, 1 << 30));
+        if (gzread(f_, d, n) != static_cast<int>(n))
+            throw std::runtime_error { std::format("Snapshot: unexpected end of data in section \"{}\"", section_) };
+        d += n;
+        size -= n;
+    }
+}
+
+void SnapshotReader::read(SystemBus& bus, ScheduledEvent& event)
+{
+    bool scheduled;
+    std::uint64_t time;
+    read(scheduled);
+    read(time);
+    if (scheduled)
+        bus.scheduleEvent(event, time);
+    else
+        bus.cancelEvent(event);
+}
+
+void SnapshotReader::readFixed(SharedPages& pages)
+{
+    if (readSize() != pages.size())
+        throw std::runtime_error { "Snapshot: size mismatch in section \"" + section_ + "\"" };
+    for (std::uint64_t page = 0; page < pages.numPages(); ++page)
+        read(pages.writablePageData(page), std::min(SharedPages::PageSize, pages.size() - (page << SharedPages::PageShift)));
+}
+
+std::uint64_t SnapshotReader::readSize()
+{
+    std::uint64_t size;
+    read(size);
+    return size;
+}
@@ -0,0 +1,113 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+
+class SystemBus;
+class ScheduledEvent;
+class SharedPages;
+
+// Machine snapshots are a gzip compressed sequence of tagged sections. Structures are stored
+// in their in-memory representation, so a snapshot can only be restored by the same build.
+// Disk images aren't included.
+static constexpr std::uint32_t SnapshotVersion = 2;
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string& filename);
+    // Writes to memory (see data)
+    SnapshotWriter();
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Start of a section, the reader checks that the tags match up
+    void section(std::string_view tag);
+
+    void write(const void* data, std::size_t size);
+
+    template<typename T>
+        requires std::is_trivially_copyable_v<T>
+    void write(const T& value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    template<typename T>
+    void write(const std::vector<T>& v)
+    {
+        write(static_cast<std::uint64_t>(v.size()));
+        write(v.data(), v.size() * sizeof(T));
+    }
+
+    void write(const ScheduledEvent& event);
+    void write(const SharedPages& pages);
+
+    // Only for in-memory snapshots
+    const std::vector<char>& data() const
+    {
+        return data_;
+    }
+
+private:
+    struct gzFile_s* /*gzFile*/ f_;
+    std::vector<char> data_;
+};
+
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::string& filename);
+    // Reads an in-memory snapshot, data must stay valid while reading
+    explicit SnapshotReader(const std::vector<char>& data);
+    ~SnapshotReader();
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    void section(std::string_view tag);
+
+    void read(void* data, std::size_t size);
+
+    template<typename T>
+        requires std::is_trivially_copyable_v<T>
+    void read(T& value)
+    {
+        read(&value, sizeof(T));
+    }
+
+    template<typename T>
+    void read(std::vector<T>& v)
+    {
+        v.resize(readSize());
+        read(v.data(), v.size() * sizeof(T));
+    }
+
+    // For memory that may be mapped (and accessed through host pointers), the size must match
+    template<typename T>
+    void readFixed(std::vector<T>& v)
+    {
+        if (readSize() != v.size())
+            throw std::runtime_error { "Snapshot: size mismatch in section \"" + section_ + "\"" };
+        read(v.data(), v.size() * sizeof(T));
+    }
+
+    void readFixed(SharedPages& pages);
+
+    // (Re)schedules or cancels the event
+    void read(SystemBus& bus, ScheduledEvent& event);
+
+private:
+    struct gzFile_s* /*gzFile*/ f_;
+    const std::vector<char>* data_ = nullptr;
+    std::size_t pos_ = 0;
+    std::string section_;
+
+    void checkHeader(const std::string& name);
+    std::uint64_t readSize();
+};
+
+#endif
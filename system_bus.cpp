@@ -1,12 +1,12 @@
 #include "system_bus.h"
+#include "snapshot.h"
 #include <format>
-#include <print>
 #include <stdexcept>
 #include <utility>
 
 std::uint8_t IOHandler::inU8(std::uint16_t port, std::uint16_t)
 {
-    std::println("Unspported 8-bit I/O input from port 0x{:04X}", port);
+    Logger::current().println("Unspported 8-bit I/O input from port 0x{:04X}", port);
     THROW_FLIPFLOP();
     return 0xFF;
 }
@@ -25,7 +25,7 @@ std::uint32_t IOHandler::inU32(std::uint16_t port, std::uint16_t offset)
 
 void IOHandler::outU8(std::uint16_t port, std::uint16_t, std::uint8_t value)
 {
-    std::println("Unspported 8-bit I/O output to port 0x{:04X} value=0x{:02X}", port, value);
+    Logger::current().println("Unspported 8-bit I/O output to port 0x{:04X} value=0x{:02X}", port, value);
     THROW_FLIPFLOP();
 }
 
@@ -47,7 +47,7 @@ void DefaultMemHandler<ReadOnly>::writeU8(std::uint64_t addr, std::uint64_t offs
 {
     if constexpr (ReadOnly) {
         // IBM PC XT BIOS pushes with SS=F000
-        std::println("Write to ROM addr {:X} value {:02X}", addr, value);
+        Logger::current().println("Write to ROM addr {:X} value {:02X}", addr, value);
         //throw std::runtime_error { "XXX" };
     } else {
         assert(offset < data_.size());
@@ -58,12 +58,42 @@ void DefaultMemHandler<ReadOnly>::writeU8(std::uint64_t addr, std::uint64_t offs
 template class DefaultMemHandler<false>;
 template class DefaultMemHandler<true>;
 
+MemoryHandler::HostRegion MemoryHandler::pageRegion(std::uint64_t offset)
+{
+    auto region = hostRegion();
+    if (!region.data || !region.size || (region.size & (SystemBus::MemPageSize - 1)))
+        return {};
+    region.data += offset % region.size;
+    region.size = SystemBus::MemPageSize;
+    return region;
+}
+
+static_assert(SharedPages::PageSize == SystemBus::MemPageSize);
+
+MemoryHandler::HostRegion SharedRamHandler::pageRegion(std::uint64_t offset)
+{
+    const auto page = offset >> SharedPages::PageShift;
+    const bool shared = pages_.shared(page);
+    return HostRegion { const_cast<std::uint8_t*>(pages_.pageData(page)), SharedPages::PageSize, !shared, false, shared };
+}
+
+MemoryHandler::HostRegion SharedRamHandler::unsharePage(std::uint64_t offset)
+{
+    return HostRegion { pages_.writablePageData(offset >> SharedPages::PageShift), SharedPages::PageSize, true };
+}
+
 template <typename T>
 T SystemBus::read(std::uint64_t addr)
 {
-    addCycles(sizeof(T));
     addr &= addressMask_;
-    if (auto ah = findHandler(memHandlers_, addr); ah) {
+    if (const auto mp = memPages_.find(addr >> MemPageShift); mp) {
+        if (const auto offset = addr & (MemPageSize - 1); mp->host && offset + sizeof(T) <= MemPageSize) {
+            T value;
+            std::memcpy(&value, mp->host + offset, sizeof(T));
+            return value;
+        }
+    }
+    if (auto ah = findMemHandler(addr); ah) {
         if (ah->needSync)
             runCycles();
         if constexpr (sizeof(T) == 1)
@@ -77,7 +107,7 @@ T SystemBus::read(std::uint64_t addr)
             return ah->handler->readU64(addr, addr - ah->base);
         }
     }
-    std::println("Read of size {} from unmmaped address {:X}", sizeof(T), addr);
+    log_.println("Read of size {} from unmmaped address {:X}", sizeof(T), addr);
     if (addr == 0xC9FF8)
         throw std::runtime_error { "XXX" };
     if constexpr (sizeof(T) == 1)
@@ -89,18 +119,34 @@ T SystemBus::read(std::uint64_t addr)
 template <typename T>
 void SystemBus::write(std::uint64_t addr, T value)
 {
-    addCycles(sizeof(T));
     addr &= addressMask_;
 
     #if 0
     const auto watchAddr = 0x0038FFFD;
     if (addr <= watchAddr && addr + sizeof(T) - 1 >= watchAddr) {
-        std::println(">>>>>>>>> Write of size {} to address {:X} value={:0{}X}", sizeof(T), addr, value, sizeof(T) * 2);
+        log_.println(">>>>>>>>> Write of size {} to address {:X} value={:0{}X}", sizeof(T), addr, value, sizeof(T) * 2);
         THROW_ONCE();
     }
     #endif
 
-    if (auto ah = findHandler(memHandlers_, addr); ah) {
+    if (const auto page = addr >> MemPageShift; const auto mp = memPages_.find(page)) {
+        if (const auto offset = addr & (MemPageSize - 1); (mp->hostWritable || mp->copyOnWrite) && offset + sizeof(T) <= MemPageSize) {
+            if (!mp->hostWritable) [[unlikely]]
+                unsharePage(page);
+            std::memcpy(mp->host + offset, &value, sizeof(T));
+            notifyWrite(addr, sizeof(T));
+            return;
+        }
+    }
+
+    if ((addr >> WriteWatchShift) < writeWatch_.end())
+        checkWriteWatch(addr, sizeof(T));
+    // The handler writes its memory directly, so it mustn't be shared (e.g. for writes that cross a page)
+    for (auto page = addr >> MemPageShift; page <= (addr + sizeof(T) - 1) >> MemPageShift; ++page) {
+        if (const auto mp = memPages_.find(page); mp && mp->copyOnWrite)
+            unsharePage(page);
+    }
+    if (auto ah = findMemHandler(addr); ah) {
         if (ah->needSync)
             runCycles();
         if constexpr (sizeof(T) == 1)
@@ -113,36 +159,253 @@ void SystemBus::write(std::uint64_t addr, T value)
         }
     } else {
         THROW_ONCE();
-        std::println("Write of size {} to unmmaped address {:X} value={:0{}X}", sizeof(T), addr, value, sizeof(T)*2);
+        log_.println("Write of size {} to unmmaped address {:X} value={:0{}X}", sizeof(T), addr, value, sizeof(T)*2);
         //if (addr <1024*1024)
         //    throw std::runtime_error { std::format("Write of size {} to unmmaped address {:X} value={:0{}X}", sizeof(T), addr, value, sizeof(T) * 2) };
     }
 }
 
-void SystemBus::recalcNextAction()
+template <typename Func>
+void SystemBus::forEachSpan(std::uint64_t addr, std::uint64_t length, bool forWrite, Func&& func)
 {
-    nextAction_ = UINT64_MAX;
-    for (auto& obs : cycleObservers_)
-        nextAction_ = std::min(nextAction_, obs->nextAction());
+    for (std::uint64_t pos = 0; pos < length;) {
+        const auto offset = (addr + pos) & (MemPageSize - 1);
+        const auto n = std::min(length - pos, MemPageSize - offset);
+        auto host = hostPage(addr + pos, MemPageSize, forWrite);
+        func(addr + pos, host ? host + offset : nullptr, pos, n);
+        pos += n;
+    }
+}
+
+void SystemBus::readBlock(std::uint64_t addr, void* dst, std::uint64_t length)
+{
+    auto d = static_cast<std::uint8_t*>(dst);
+    forEachSpan(addr, length, false, [&](std::uint64_t spanAddr, const std::uint8_t* host, std::uint64_t pos, std::uint64_t n) {
+        if (host) {
+            std::memcpy(d + pos, host, n);
+        } else {
+            for (std::uint64_t i = 0; i < n; ++i)
+                d[pos + i] = read<std::uint8_t>(spanAddr + i);
+        }
+    });
+}
+
+void SystemBus::writeBlock(std::uint64_t addr, const void* src, std::uint64_t length)
+{
+    auto s = static_cast<const std::uint8_t*>(src);
+    forEachSpan(addr, length, true, [&](std::uint64_t spanAddr, std::uint8_t* host, std::uint64_t pos, std::uint64_t n) {
+        if (host) {
+            std::memcpy(host, s + pos, n);
+            notifyWrite(spanAddr & addressMask_, n);
+        } else {
+            for (std::uint64_t i = 0; i < n; ++i)
+                write<std::uint8_t>(spanAddr + i, s[pos + i]);
+        }
+    });
+}
+
+void SystemBus::peekBlock(std::uint64_t addr, void* dst, std::uint64_t length)
+{
+    auto d = static_cast<std::uint8_t*>(dst);
+    forEachSpan(addr, length, false, [&](std::uint64_t spanAddr, const std::uint8_t* host, std::uint64_t pos, std::uint64_t n) {
+        if (host) {
+            std::memcpy(d + pos, host, n);
+        } else {
+            for (std::uint64_t i = 0; i < n; ++i)
+                d[pos + i] = peekU8(spanAddr + i);
+        }
+    });
+}
+
+void SystemBus::rebuildMemPages()
+{
+    memoryEnd_ = 0;
+    for (const auto& ah : memHandlers_)
+        memoryEnd_ = std::max(memoryEnd_, (ah.base + ah.length + MemPageSize - 1) & ~(MemPageSize - 1));
+    memPages_.clear();
+    writeWatch_.forEach([](std::uint8_t& watch) { watch &= ~WatchHandler; });
+
+    // Handlers are sorted by base and findHandler returns the first match, so fill in reverse order to let that one win
+    for (auto it = memHandlers_.rbegin(); it != memHandlers_.rend(); ++it) {
+        auto& ah = *it;
+        const auto last = (ah.base + ah.length - 1) >> MemPageShift;
+        for (auto page = ah.base >> MemPageShift; page <= last; ++page) {
+            auto& mp = memPages_[page];
+            const auto pageAddr = page << MemPageShift;
+            if (pageAddr < ah.base || pageAddr + MemPageSize > ah.base + ah.length) {
+                mp = MemPage { nullptr, nullptr, false, false, true };
+                continue;
+            }
+            mp = MemPage { &ah, nullptr, false, false, false };
+            if (ah.needSync)
+                continue;
+            if (const auto region = ah.handler->pageRegion(pageAddr - ah.base); region.data) {
+                mp.host = region.data;
+                mp.hostWritable = region.writable;
+                mp.copyOnWrite = region.copyOnWrite && !region.writable;
+            }
+        }
+        if (const auto region = ah.handler->hostRegion(); region.notifyWrites) {
+            if (region.notifyGranularity && (region.notifyGranularity < WriteWatchBlockSize || (region.notifyGranularity & (region.notifyGranularity - 1))))
+                throw std::runtime_error { std::format("Invalid write notification granularity 0x{:X}", region.notifyGranularity) };
+            ah.notifyGranularity = std::max(region.notifyGranularity, WriteWatchBlockSize);
+            const auto lastBlock = (ah.base + ah.length - 1) >> WriteWatchShift;
+            for (auto block = ah.base >> WriteWatchShift; block <= lastBlock; ++block)
+                writeWatch_[block] |= WatchHandler;
+        }
+    }
+}
+
+void SystemBus::unsharePage(std::uint64_t page)
+{
+    auto& mp = *memPages_.find(page);
+    assert(mp.copyOnWrite && mp.area);
+    const auto region = mp.area->handler->unsharePage((page << MemPageShift) - mp.area->base);
+    if (!region.data || !region.writable)
+        throw std::runtime_error { std::format("Could not unshare memory page at 0x{:X}", page << MemPageShift) };
+    mp.host = region.data;
+    mp.hostWritable = true;
+    mp.copyOnWrite = false;
+    // Host pointers to the shared page may be cached
+    for (auto& obs : writeObservers_)
+        obs->memoryMapChanged();
+}
+
+void SystemBus::rebuildIOPorts()
+{
+    std::fill(ioPorts_.begin(), ioPorts_.end(), nullptr);
+    for (auto it = ioHandlers_.rbegin(); it != ioHandlers_.rend(); ++it) {
+        for (std::uint32_t port = it->base; port < std::uint32_t(it->base) + it->length && port < ioPorts_.size(); ++port)
+            ioPorts_[port] = &*it;
+    }
+}
+
+ScheduledEvent::~ScheduledEvent()
+{
+    if (scheduled())
+        bus_->cancelEvent(*this);
+}
+
+void SystemBus::scheduleEvent(ScheduledEvent& event, std::uint64_t time)
+{
+    assert(!event.bus_ || event.bus_ == this);
+    event.bus_ = this;
+    event.time_ = time;
+    if (!event.scheduled()) {
+        event.heapIndex_ = events_.size();
+        events_.push_back(&event);
+        siftEventUp(event.heapIndex_);
+    } else {
+        siftEventUp(event.heapIndex_);
+        siftEventDown(event.heapIndex_);
+    }
+    nextAction_ = std::min(nextAction_, untilEvent(*events_.front()));
 }
 
-void SystemBus::addCycles(std::uint64_t count)
+void SystemBus::cancelEvent(ScheduledEvent& event)
 {
-    count *= 2; // Fudge factor...
-    cycles_ += count;
-    if (cycles_ >= nextAction_)
-        runCycles();
+    if (event.scheduled())
+        removeEvent(event.heapIndex_);
+}
+
+void SystemBus::removeEvent(std::size_t index)
+{
+    events_[index]->heapIndex_ = ScheduledEvent::NotScheduled;
+    if (index != events_.size() - 1) {
+        events_[index] = events_.back();
+        events_[index]->heapIndex_ = index;
+        events_.pop_back();
+        siftEventUp(index);
+        siftEventDown(index);
+    } else {
+        events_.pop_back();
+    }
+}
+
+void SystemBus::siftEventUp(std::size_t index)
+{
+    while (index) {
+        const auto parent = (index - 1) / 2;
+        if (events_[parent]->time_ <= events_[index]->time_)
+            break;
+        std::swap(events_[parent], events_[index]);
+        events_[parent]->heapIndex_ = parent;
+        events_[index]->heapIndex_ = index;
+        index = parent;
+    }
+}
+
+void SystemBus::siftEventDown(std::size_t index)
+{
+    for (;;) {
+        auto smallest = index;
+        for (auto child = 2 * index + 1; child <= 2 * index + 2 && child < events_.size(); ++child) {
+            if (events_[child]->time_ < events_[smallest]->time_)
+                smallest = child;
+        }
+        if (smallest == index)
+            break;
+        std::swap(events_[smallest], events_[index]);
+        events_[smallest]->heapIndex_ = smallest;
+        events_[index]->heapIndex_ = index;
+        index = smallest;
+    }
+}
+
+void SystemBus::saveState(SnapshotWriter& writer) const
+{
+    writer.section("bus");
+    writer.write(time_);
+    writer.write(cycles_);
+    writer.write(addressMask_);
+}
+
+void SystemBus::loadState(SnapshotReader& reader)
+{
+    reader.section("bus");
+    reader.read(time_);
+    reader.read(cycles_);
+    std::uint64_t addressMask;
+    reader.read(addressMask);
+    setAddressMask(addressMask);
+    nextAction_ = 0; // Recalculated at the next sync (after the devices have rescheduled their events)
+}
+
+void SystemBus::recalcNextAction()
+{
+    nextAction_ = events_.empty() ? UINT64_MAX : untilEvent(*events_.front());
+    for (auto& obs : cycleObservers_)
+        nextAction_ = std::min(nextAction_, obs->nextAction());
 }
 
 void SystemBus::runCycles()
 {
     // Originally the system clock was 14.31818 MHz, /3 -> 4.77MHz for the CPU and /4 -> 3.579545 MHz for NTSC
     const auto cycles = std::exchange(cycles_, 0) * 3;
+    time_ += cycles;
     for (auto& obs : cycleObservers_)
         obs->runCycles(cycles);
+    while (!events_.empty() && events_.front()->time_ <= time_) {
+        auto& event = *events_.front();
+        removeEvent(0);
+        countEvent(event.name_);
+        event.callback_();
+    }
     recalcNextAction();
 }
 
+void SystemBus::countEvent(const char* name)
+{
+    // Only a handful of different events, and the names are compared by address
+    for (auto& [eventName, count] : eventCounts_) {
+        if (eventName == name) {
+            ++count;
+            return;
+        }
+    }
+    eventCounts_.emplace_back(name, 1);
+}
+
 
 template std::uint8_t SystemBus::read<std::uint8_t>(std::uint64_t addr);
 template std::uint16_t SystemBus::read<std::uint16_t>(std::uint64_t addr);
@@ -7,7 +7,11 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
+#include <memory>
 #include "util.h"
+#include "shared_pages.h"
+#include "log.h"
 
 
 // The system clock frequency is 4*f and the XT CPU runs at 4*f/3 where f is the NTSC clock freuency
@@ -53,6 +57,41 @@ public:
 
     virtual void writeU8(std::uint64_t addr, std::uint64_t offset, std::uint8_t value) = 0;
 
+    // Host memory that backs the handler and can be accessed directly (bypassing the read/write functions).
+    // The pointer must stay valid while the handler is mapped. If size is smaller than the mapped length
+    // the region is mirrored (size must then be a multiple of SystemBus::MemPageSize).
+    struct HostRegion {
+        std::uint8_t* data = nullptr;
+        std::uint64_t size = 0;
+        bool writable = false;
+        bool notifyWrites = false; // Call hostWritten after the memory has been written directly
+        bool copyOnWrite = false; // Shared read-only memory that becomes writable through unsharePage
+        // Size of the blocks passed to hostWritten, a power of two that's at least SystemBus::WriteWatchBlockSize
+        // (0 means that size). E.g. a frame buffer can ask for whole scan lines or tiles.
+        std::uint64_t notifyGranularity = 0;
+    };
+
+    virtual HostRegion hostRegion()
+    {
+        return {};
+    }
+
+    // Host memory backing the SystemBus::MemPageSize sized page at offset (by default taken from hostRegion).
+    // Handlers that aren't backed by a single contiguous region override this instead.
+    virtual HostRegion pageRegion(std::uint64_t offset);
+
+    // Called before the first write to a copyOnWrite page, the returned region must be writable
+    virtual HostRegion unsharePage(std::uint64_t offset)
+    {
+        return pageRegion(offset);
+    }
+
+    // Called with the HostRegion::notifyGranularity sized block containing the written bytes (once per
+    // block per write, the last block is cut off at the end of the mapped range)
+    virtual void hostWritten([[maybe_unused]] std::uint64_t offset, [[maybe_unused]] std::uint64_t length)
+    {
+    }
+
     virtual void writeU16(std::uint64_t addr, std::uint64_t offset, std::uint16_t value)
     {
         writeU8(addr, offset, value & 0xff);
@@ -92,6 +131,11 @@ public:
         return data_;
     }
 
+    const std::vector<uint8_t>& data() const
+    {
+        return data_;
+    }
+
     std::size_t size() const
     {
         return data_.size();
@@ -121,10 +165,64 @@ public:
 
     void writeU8(std::uint64_t addr, std::uint64_t offset, std::uint8_t value);
 
+    HostRegion hostRegion() override
+    {
+        return HostRegion { data_.data(), data_.size(), !ReadOnly };
+    }
+
 private:
     std::vector<uint8_t> data_;
 };
 
+// RAM that can share its pages copy-on-write with other instances (e.g. to fork a machine)
+class SharedRamHandler : public MemoryHandler {
+public:
+    explicit SharedRamHandler(std::size_t size)
+        : pages_ { size }
+    {
+    }
+
+    std::size_t size() const
+    {
+        return pages_.size();
+    }
+
+    SharedPages& pages()
+    {
+        return pages_;
+    }
+
+    const SharedPages& pages() const
+    {
+        return pages_;
+    }
+
+    // Afterwards the memory of both handlers is shared copy-on-write. SystemBus::remapMemory must
+    // be called for the busses that map either of them.
+    void shareFrom(const SharedRamHandler& other)
+    {
+        if (other.size() != size())
+            throw std::runtime_error { "SharedRamHandler: size mismatch" };
+        pages_ = other.pages_;
+    }
+
+    std::uint8_t readU8(std::uint64_t, std::uint64_t offset) override
+    {
+        return pages_.readU8(offset);
+    }
+
+    void writeU8(std::uint64_t, std::uint64_t offset, std::uint8_t value) override
+    {
+        pages_.writeU8(offset, value);
+    }
+
+    HostRegion pageRegion(std::uint64_t offset) override;
+    HostRegion unsharePage(std::uint64_t offset) override;
+
+private:
+    SharedPages pages_;
+};
+
 class RomHandler : public DefaultMemHandler<true> {
 public:
     explicit RomHandler(const std::vector<uint8_t>& data)
@@ -152,12 +250,136 @@ public:
     void writeU8(std::uint64_t, std::uint64_t, std::uint8_t) override { }
 };
 
+// Devices that are polled with the elapsed cycles on every sync. New devices should use ScheduledEvent instead.
 class CycleObserver {
 public:
     virtual void runCycles(std::uint64_t numCycles) = 0;
     virtual std::uint64_t nextAction() { return UINT64_MAX; }
 };
 
+class SystemBus;
+class SnapshotWriter;
+class SnapshotReader;
+
+// Callback that the SystemBus runs once its time (in system clock cycles) reaches the scheduled time
+class ScheduledEvent {
+public:
+    using CallbackType = std::function<void(void)>;
+
+    // name is used for statistics (see SystemBus::eventCounts) and must outlive the bus, e.g. a string literal
+    explicit ScheduledEvent(const CallbackType& callback, const char* name = "unnamed")
+        : callback_ { callback }
+        , name_ { name }
+    {
+    }
+    ScheduledEvent(const ScheduledEvent&) = delete;
+    ScheduledEvent& operator=(const ScheduledEvent&) = delete;
+    ~ScheduledEvent();
+
+    bool scheduled() const
+    {
+        return heapIndex_ != NotScheduled;
+    }
+
+    std::uint64_t time() const
+    {
+        return time_;
+    }
+
+private:
+    friend class SystemBus;
+    static constexpr std::size_t NotScheduled = SIZE_MAX;
+
+    CallbackType callback_;
+    const char* name_;
+    SystemBus* bus_ = nullptr;
+    std::uint64_t time_ = 0;
+    std::size_t heapIndex_ = NotScheduled;
+};
+
+class MemoryWriteObserver {
+public:
+    virtual ~MemoryWriteObserver() = default;
+
+    // Called (once) when a watched block is written or remapped
+    virtual void memoryWritten(std::uint64_t addr, std::uint64_t length) = 0;
+
+    // Called when memory handlers are added or the address mask changes
+    virtual void memoryMapChanged() { }
+};
+
+// Sees every I/O port access after it has been handled (e.g. to count them or watch a debug port)
+class IOObserver {
+public:
+    virtual void ioInput(std::uint16_t, std::uint32_t, std::uint8_t) { } // port, value, size
+    virtual void ioOutput(std::uint16_t, std::uint32_t, std::uint8_t) { } // port, value, size
+};
+
+// Table indexed by page (or block) number that only allocates storage for the chunks of 2^ChunkShift
+// entries that have been accessed through operator[], so e.g. a ROM mapped just below 4GB doesn't cost
+// an entry for every page below it. Entries start out value initialized.
+template <typename T, unsigned ChunkShift>
+class SparseTable {
+public:
+    static constexpr std::uint64_t ChunkSize = std::uint64_t(1) << ChunkShift;
+
+    // nullptr if the chunk containing index hasn't been allocated
+    T* find(std::uint64_t index)
+    {
+        const auto chunk = index >> ChunkShift;
+        if (chunk >= chunks_.size() || !chunks_[chunk])
+            return nullptr;
+        return &chunks_[chunk][index & (ChunkSize - 1)];
+    }
+
+    const T* find(std::uint64_t index) const
+    {
+        return const_cast<SparseTable*>(this)->find(index);
+    }
+
+    void allocate(std::uint64_t index)
+    {
+        (*this)[index];
+    }
+
+    // Allocates the chunk containing index if needed
+    T& operator[](std::uint64_t index)
+    {
+        const auto chunk = index >> ChunkShift;
+        if (chunk >= chunks_.size())
+            chunks_.resize(chunk + 1);
+        if (!chunks_[chunk])
+            chunks_[chunk] = std::make_unique<T[]>(ChunkSize);
+        return chunks_[chunk][index & (ChunkSize - 1)];
+    }
+
+    // One past the last index that can be allocated without growing the chunk list
+    std::uint64_t end() const
+    {
+        return chunks_.size() << ChunkShift;
+    }
+
+    void clear()
+    {
+        chunks_.clear();
+    }
+
+    // Calls func(entry) for every entry in the allocated chunks
+    template <typename Func>
+    void forEach(Func&& func)
+    {
+        for (auto& chunk : chunks_) {
+            if (!chunk)
+                continue;
+            for (std::uint64_t i = 0; i < ChunkSize; ++i)
+                func(chunk[i]);
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<T[]>> chunks_;
+};
+
 // TODO: Handle case where something straddles two areas
 class SystemBus {
 public:
@@ -165,14 +387,29 @@ public:
     SystemBus(const SystemBus&) = delete;
     SystemBus& operator=(const SystemBus&) = delete;
 
+    static constexpr std::uint32_t WriteWatchShift = 8;
+    static constexpr std::uint64_t WriteWatchBlockSize = 1 << WriteWatchShift;
+
+    // Granularity of the memory dispatch table
+    static constexpr std::uint32_t MemPageShift = 12;
+    static constexpr std::uint64_t MemPageSize = 1 << MemPageShift;
+
+    // The page and write watch tables are allocated in chunks covering this much of the address space
+    static constexpr std::uint32_t TableChunkShift = 22;
+
     void addMemHandler(std::uint64_t base, std::uint64_t length, MemoryHandler& handler, bool needSync = false)
     {
         addHandler(memHandlers_, AreaHandler { base, length, &handler, needSync });
+        rebuildMemPages();
+        checkWriteWatch(base, length, WatchObservers);
+        for (auto& obs : writeObservers_)
+            obs->memoryMapChanged();
     }
 
     void addIOHandler(std::uint16_t base, std::uint16_t length, IOHandler& handler, bool needSync = false)
     {
         addHandler(ioHandlers_, AreaHandler { base, length, &handler, needSync });
+        rebuildIOPorts();
     }
 
     void setDefaultIOHandler(IOHandler* handler)
@@ -185,9 +422,80 @@ public:
         cycleObservers_.push_back(&obs);
     }
 
+    void addWriteObserver(MemoryWriteObserver& obs)
+    {
+        writeObservers_.push_back(&obs);
+    }
+
+    void removeWriteObserver(MemoryWriteObserver& obs)
+    {
+        std::erase(writeObservers_, &obs);
+    }
+
+    void addIOObserver(IOObserver& obs)
+    {
+        ioObservers_.push_back(&obs);
+    }
+
+    // Notify the write observers on the next write to the block containing addr
+    void watchWrites(std::uint64_t addr)
+    {
+        writeWatch_[addr >> WriteWatchShift] |= WatchObservers;
+    }
+
     void setAddressMask(uint64_t mask)
     {
+        if (addressMask_ == mask)
+            return;
         addressMask_ = mask;
+        for (auto& obs : writeObservers_)
+            obs->memoryMapChanged();
+    }
+
+    uint64_t addressMask() const
+    {
+        return addressMask_;
+    }
+
+    // Current time in system clock cycles (including cycles that haven't been synchronized yet)
+    std::uint64_t time() const
+    {
+        return time_ + cycles_ * 3;
+    }
+
+    // Number of times the scheduled events have run, by event name
+    using EventCounts = std::vector<std::pair<const char*, std::uint64_t>>;
+    const EventCounts& eventCounts() const
+    {
+        return eventCounts_;
+    }
+
+    // Diagnostic output of the devices attached to this bus
+    Logger& log() const
+    {
+        return log_;
+    }
+
+    // Must be called when the host memory backing mapped handlers changes (e.g. after pages have been shared)
+    void remapMemory()
+    {
+        rebuildMemPages();
+        for (auto& obs : writeObservers_)
+            obs->memoryMapChanged();
+    }
+
+    // Time, pending cycles and the address mask. Devices save/restore their own events.
+    void saveState(SnapshotWriter& writer) const;
+    void loadState(SnapshotReader& reader);
+
+    // (Re)schedule event to run at the absolute time, the callback may reschedule the event
+    void scheduleEvent(ScheduledEvent& event, std::uint64_t time);
+    void cancelEvent(ScheduledEvent& event);
+
+    // True when a scheduled action (e.g. a timer tick) is due at the next sync
+    bool actionPending() const
+    {
+        return cycles_ >= nextAction_;
     }
 
     template <typename T>
@@ -196,10 +504,47 @@ public:
     template <typename T>
     void write(std::uint64_t addr, T value);
 
+    // Host pointer to the start of the (addressMask applied) page containing addr if it can be
+    // accessed directly, i.e. it's entirely backed by a host region (that's writable when writing).
+    std::uint8_t* hostPage(std::uint64_t addr, std::uint64_t pageSize, bool forWrite)
+    {
+        assert(pageSize && pageSize <= MemPageSize && !(pageSize & (pageSize - 1)));
+        addr &= addressMask_ & ~(pageSize - 1);
+        const auto page = addr >> MemPageShift;
+        const auto mpp = memPages_.find(page);
+        if (!mpp)
+            return nullptr;
+        const auto& mp = *mpp;
+        if (forWrite && mp.copyOnWrite) [[unlikely]]
+            unsharePage(page);
+        if (!mp.host || (forWrite && !mp.hostWritable))
+            return nullptr;
+        return mp.host + (addr & (MemPageSize - 1));
+    }
+
+    // Block accesses, the range is split at page boundaries. Host-backed pages are copied directly
+    // and the rest is accessed one byte at a time through the handlers (like readU8/writeU8/peekU8).
+    void readBlock(std::uint64_t addr, void* dst, std::uint64_t length);
+    void writeBlock(std::uint64_t addr, const void* src, std::uint64_t length);
+    void peekBlock(std::uint64_t addr, void* dst, std::uint64_t length);
+
+    // End of the highest mapped memory area (rounded up to a page)
+    std::uint64_t memoryEnd() const
+    {
+        return memoryEnd_;
+    }
+
+    // Must be called when memory returned by hostPage is written
+    void notifyWrite(std::uint64_t addr, std::uint64_t length)
+    {
+        if ((addr >> WriteWatchShift) < writeWatch_.end())
+            checkWriteWatch(addr, length);
+    }
+
     std::uint8_t peekU8(std::uint64_t addr)
     {
         addr &= addressMask_;
-        if (auto ah = findHandler(memHandlers_, addr); ah)
+        if (auto ah = findMemHandler(addr); ah)
             return ah->handler->peekU8(addr, addr - ah->base);
         throw std::runtime_error { "No handler for peek from 0x" + HexString(addr) };
     }
@@ -242,8 +587,7 @@ public:
     void ioOutput(std::uint16_t port, std::uint32_t value, std::uint8_t size)
     {
         assert(size == 1 || size == 2 || size == 4);
-        addCycles(1);
-        auto ah = findHandler(ioHandlers_, port);
+        auto ah = ioPorts_[port];
         if (!ah && defaultIoHandler_.handler)
             ah = &defaultIoHandler_;
         if (ah) {
@@ -256,6 +600,8 @@ public:
                 ah->handler->outU16(port, offset, static_cast<uint16_t>(value));
             else
                 ah->handler->outU32(port, offset, value);
+            for (auto& obs : ioObservers_)
+                obs->ioOutput(port, value, size);
         } else {
             throw std::runtime_error { "No handler for io output of size " + std::to_string(size) + " to 0x" + HexString(port) + " value " + HexString(value, 2 * size) };
         }
@@ -264,29 +610,51 @@ public:
     std::uint32_t ioInput(std::uint16_t port, std::uint8_t size)
     {
         assert(size == 1 || size == 2 || size == 4);
-        addCycles(1);
-        auto ah = findHandler(ioHandlers_, port);
+        auto ah = ioPorts_[port];
         if (!ah && defaultIoHandler_.handler)
             ah = &defaultIoHandler_;
         if (ah) {
             if (ah->needSync)
                 runCycles();
             const auto offset = static_cast<uint16_t>(port - ah->base);
+            std::uint32_t value;
             if (size == 1)
-                return ah->handler->inU8(port, offset);
+                value = ah->handler->inU8(port, offset);
             else if (size == 2)
-                return ah->handler->inU16(port, offset);
+                value = ah->handler->inU16(port, offset);
             else
-                return ah->handler->inU32(port, offset);
+                value = ah->handler->inU32(port, offset);
+            for (auto& obs : ioObservers_)
+                obs->ioInput(port, value, size);
+            return value;
         } else {
             throw std::runtime_error { "No handler for io input of size " + std::to_string(size) + " from 0x" + HexString(port)};
         }
     }
 
     void recalcNextAction();
-    void addCycles(std::uint64_t count);
     void runCycles();
 
+    // Cycles are only accumulated here, the observers are run at the next sync (e.g. at an
+    // instruction boundary) or when a handler that needs synchronization is accessed.
+    // Accesses through the bus aren't charged, the CPU accounts for its own (see CPU::BusAccessCycles).
+    void addCycles(std::uint64_t count)
+    {
+        cycles_ += count * 2; // Fudge factor...
+    }
+
+    void sync()
+    {
+        if (cycles_ >= nextAction_)
+            runCycles();
+    }
+
+    // Let time pass until the next scheduled action, but at most maxTime system clock cycles (e.g. when the CPU is halted)
+    void idle(std::uint64_t maxTime)
+    {
+        cycles_ = std::max(cycles_, std::min(nextAction_, cycles_ + maxTime / 3));
+    }
+
 private:
     template<typename T, typename L>
     struct AreaHandler {
@@ -294,17 +662,87 @@ private:
         L length;
         T* handler;
         bool needSync;
+        L notifyGranularity = 0; // From the host region (memory handlers with notifyWrites only)
     };
     using MemHandlerType = AreaHandler<MemoryHandler, std::uint64_t>;
     using IOHandlerType = AreaHandler<IOHandler, std::uint16_t>;
 
+    struct MemPage {
+        MemHandlerType* area; // nullptr if unmapped
+        std::uint8_t* host; // Start of the page if it's backed by a host region
+        bool hostWritable;
+        bool copyOnWrite; // Host memory is shared, unsharePage before writing
+        bool mixed; // Not covered by a single handler, use findHandler
+    };
+
+    enum : std::uint8_t {
+        WatchObservers = 1 << 0, // Notify write observers (once)
+        WatchHandler = 1 << 1, // Host region with notifyWrites
+    };
+
     std::vector<MemHandlerType> memHandlers_;
     std::vector<IOHandlerType> ioHandlers_;
+    SparseTable<MemPage, TableChunkShift - MemPageShift> memPages_; // Only the chunks with handlers are allocated
+    std::uint64_t memoryEnd_ = 0;
+    std::vector<IOHandlerType*> ioPorts_ = std::vector<IOHandlerType*>(0x10000);
     std::vector<CycleObserver*> cycleObservers_;
+    std::vector<ScheduledEvent*> events_; // Binary min-heap ordered by time
+    std::vector<MemoryWriteObserver*> writeObservers_;
+    std::vector<IOObserver*> ioObservers_;
+    EventCounts eventCounts_;
+    SparseTable<std::uint8_t, TableChunkShift - WriteWatchShift> writeWatch_;
     IOHandlerType defaultIoHandler_ {};
     std::uint64_t addressMask_ = UINT64_MAX;
     std::uint64_t cycles_ = 0;
     std::uint64_t nextAction_ = 0;
+    std::uint64_t time_ = 0;
+    mutable Logger log_;
+
+    std::uint64_t untilEvent(const ScheduledEvent& event) const
+    {
+        // Events are in system clock cycles, cycles_ is in (fudged) CPU cycles
+        return event.time_ > time_ ? (event.time_ - time_ + 2) / 3 : 0;
+    }
+    void removeEvent(std::size_t index);
+    void countEvent(const char* name);
+    void rebuildMemPages();
+    void unsharePage(std::uint64_t page);
+
+    // Calls func(addr, host, pos, length) for each page sized span of the range, host is nullptr if the page isn't host-backed
+    template <typename Func>
+    void forEachSpan(std::uint64_t addr, std::uint64_t length, bool forWrite, Func&& func);
+    void rebuildIOPorts();
+    void siftEventUp(std::size_t index);
+    void siftEventDown(std::size_t index);
+
+    void checkWriteWatch(std::uint64_t addr, std::uint64_t length, std::uint8_t watchMask = WatchObservers | WatchHandler)
+    {
+        const auto last = (addr + length - 1) >> WriteWatchShift;
+        const MemHandlerType* notified = nullptr; // Last hostWritten call, to only notify each granule once
+        std::uint64_t notifiedOffset = 0;
+        for (auto block = addr >> WriteWatchShift; block <= last && block < writeWatch_.end(); ++block) {
+            const auto entry = writeWatch_.find(block);
+            const auto watch = entry ? *entry & watchMask : 0;
+            if (!watch)
+                continue;
+            const auto blockAddr = block << WriteWatchShift;
+            if (watch & WatchHandler) {
+                if (auto ah = findMemHandler(blockAddr); ah) {
+                    const auto offset = (blockAddr - ah->base) & ~(ah->notifyGranularity - 1);
+                    if (ah != notified || offset != notifiedOffset) {
+                        notified = ah;
+                        notifiedOffset = offset;
+                        ah->handler->hostWritten(offset, std::min(ah->notifyGranularity, ah->length - offset));
+                    }
+                }
+            }
+            if (watch & WatchObservers) {
+                *entry &= ~WatchObservers;
+                for (auto& obs : writeObservers_)
+                    obs->memoryWritten(blockAddr, WriteWatchBlockSize);
+            }
+        }
+    }
 
     template <typename T, typename L>
     static void addHandler(std::vector<AreaHandler<T, L>>& handlers, AreaHandler<T, L>&& handler)
@@ -317,10 +755,20 @@ private:
         handlers.insert(it, handler);
     }
 
+    MemHandlerType* findMemHandler(std::uint64_t addr)
+    {
+        const auto mp = memPages_.find(addr >> MemPageShift);
+        if (!mp)
+            return nullptr;
+        if (!mp->mixed) [[likely]]
+            return mp->area;
+        return findHandler(memHandlers_, addr);
+    }
+
+    // Only used for pages that aren't covered by a single handler (and when building the tables)
     template <typename T, typename L>
     static AreaHandler<T, L>* findHandler(std::vector<AreaHandler<T, L>>& handlers, L addr)
     {
-        // TODO: Smarter search
         auto it = std::find_if(handlers.begin(), handlers.end(), [=](const auto& ah) {
             return addr >= ah.base && addr < ah.base + ah.length;
         });
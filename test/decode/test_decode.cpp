@@ -1,5 +1,7 @@
 #include "cpu.h"
 #include "util.h"
+#include "fileio.h"
+#include <chrono>
 #include <print>
 
 struct DecodeTestCase {
@@ -14,13 +16,7 @@ void RunTests(const CPUInfo& cpuInfo, const DecodeTestCase* tests, size_t numTes
         const auto& tc = tests[i];
         try {
             const auto bytes = HexDecode(tc.bytesHex);
-            size_t offset = 0;
-            auto fetch = [&]() {
-                if (offset == bytes.size())
-                    throw std::runtime_error { "Too many bytes read" };
-                return bytes[offset++];
-            };
-            const auto res = Decode(cpuInfo, fetch);
+            const auto res = Decode(cpuInfo, std::span { bytes });
 
             if (res.numInstructionBytes != bytes.size() && !(res.numInstructionBytes == MaxInstructionBytes && bytes.size() > res.numInstructionBytes))
                 throw std::runtime_error { "Only " + std::to_string(res.numInstructionBytes) + " / " + std::to_string(bytes.size()) + " bytes consumed" };
@@ -32,7 +28,7 @@ void RunTests(const CPUInfo& cpuInfo, const DecodeTestCase* tests, size_t numTes
                 throw std::runtime_error { "Expected " + std::format("\n{:?}", tc.expected) + " got\n" + std::format("{:?}", str) };
             }
         } catch (const std::exception& e) {
-            throw std::runtime_error { "Test failed for " + std::string { tc.bytesHex } + ": " + e.what() };
+            throw std::runtime_error { std::format("Test failed for {} ({}, {}-bit): {}", tc.bytesHex, CPUModelName(cpuInfo.model), cpuInfo.defaultOperandSize * 8, e.what()) };
         }
     }
 }
@@ -159,7 +155,53 @@ void TestDecode32(CPUModel model)
     RunTests(cpuInfo, t386);
 }
 
-int main()
+// Decode the file linearly (as both 16 and 32-bit code) and report the number of instructions/second
+template <typename DecodeFunc>
+void BenchmarkDecode(const char* name, const std::vector<std::uint8_t>& data, DecodeFunc decode)
+{
+    for (const std::uint8_t opSize : { 2, 4 }) {
+        const CPUInfo cpuInfo = {
+            CPUModel::i80386sx,
+            opSize,
+        };
+        uint64_t count = 0;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            for (size_t offset = 0; offset < data.size();) {
+                try {
+                    offset += decode(cpuInfo, data, offset).numInstructionBytes;
+                    ++count;
+                } catch (const std::runtime_error&) {
+                    ++offset; // Not code or truncated
+                }
+            }
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 1.0);
+        std::println("{:<13} {}-bit: {:10} instructions in {:.2f} s {:8.2f} M instructions/second", name, opSize * 8, count, elapsed.count(), count / elapsed.count() / 1e6);
+    }
+}
+
+void BenchmarkDecode(const std::string& filename)
+{
+    const auto data = ReadFile(filename);
+    std::println("Decoding {} ({} bytes)", filename, data.size());
+
+    BenchmarkDecode("span", data, [](const CPUInfo& cpuInfo, const std::vector<std::uint8_t>& data, size_t offset) {
+        return Decode(cpuInfo, std::span { data }.subspan(offset));
+    });
+    BenchmarkDecode("std::function", data, [](const CPUInfo& cpuInfo, const std::vector<std::uint8_t>& data, size_t offset) {
+        std::function<std::uint8_t()> fetch = [&]() {
+            if (offset == data.size())
+                throw std::runtime_error { "Instruction extends past end of buffer" };
+            return data[offset++];
+        };
+        return Decode(cpuInfo, fetch);
+    });
+}
+
+// Usage: test_decode [file to use for decoder benchmark, e.g. WIN386.386]
+int main(int argc, char* argv[])
 {
     try {
         //constexpr const DecodeTestCase tests[] = {
@@ -167,10 +209,16 @@ int main()
         //};
         //RunTests(CPUInfo { CPUModel::i80386, 4 }, tests);
 
-        TestDecode16(CPUModel::i8088);
-        TestDecode16(CPUModel::i8086);
-        TestDecode16(CPUModel::i80386sx);
-        TestDecode32(CPUModel::i80386sx);
+        for (const auto& [name, model] : CPUModelNames) {
+            if (!CPUModelSupported(model))
+                continue;
+            TestDecode16(model);
+            if (model >= CPUModel::i80386sx)
+                TestDecode32(model);
+        }
+
+        if (argc > 1)
+            BenchmarkDecode(argv[1]);
     } catch (const std::exception& e){
         std::println("{}", e.what());
         return 1;
@@ -0,0 +1,203 @@
+#include "test_machine.h"
+#include <optional>
+#include <print>
+
+// Physical memory layout of the guest
+constexpr std::uint32_t mainCode = 0x10000;
+constexpr std::uint32_t dmaCode = 0x11000;
+
+class DecodeCacheTestMachine {
+public:
+    explicit DecodeCacheTestMachine()
+        : cpu { CPUModel::i80386sx, bus }
+        , ram { 1024 * 1024 }
+    {
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+        EnterFlatProtectedMode(bus, cpu);
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    RamHandler ram;
+};
+
+// Every iteration patches the immediate of an instruction that has already been decoded
+// (and is about to run again) with the loop counter and sums the results.
+static void TestSelfModifyingCode()
+{
+    constexpr std::uint32_t iterations = 1000;
+    constexpr std::uint32_t patchAddress = mainCode + 0x0E; // Immediate of MOV EAX, imm32
+
+    DecodeCacheTestMachine m;
+    PokeHex(m.bus, mainCode,
+        "31D2" // XOR EDX, EDX
+        "B9" + HexString(&iterations, 4) + // MOV ECX, iterations
+        "890D" + HexString(&patchAddress, 4) + // MOV [patchAddress], ECX
+        "B800000000" // MOV EAX, 0
+        "01C2" // ADD EDX, EAX
+        "49" // DEC ECX
+        "75F0" // JNZ 0x10007
+        "F4"); // HLT
+
+    RunUntilHalt(m.cpu, mainCode);
+
+    constexpr std::uint64_t expected = iterations * (iterations + 1ULL) / 2;
+    if (m.cpu.regs_[REG_DX] != expected)
+        throw std::runtime_error { std::format("Self modifying code: Expected EDX={} got {}", expected, m.cpu.regs_[REG_DX]) };
+    if (m.cpu.decodeCacheStats().invalidations < iterations)
+        throw std::runtime_error { std::format("Self modifying code: Expected at least {} invalidations got {}", iterations, m.cpu.decodeCacheStats().invalidations) };
+}
+
+// Replaces code that has been run (and cached) through SystemBus::writeBlock, like a DMA transfer would
+static void TestBlockWrite()
+{
+    DecodeCacheTestMachine m;
+    PokeHex(m.bus, dmaCode, "B811111111F4"); // MOV EAX, 0x11111111 / HLT
+    for (int i = 0; i < 32; ++i) // Enough to also have it in the block cache
+        RunUntilHalt(m.cpu, dmaCode);
+    if (m.cpu.regs_[REG_AX] != 0x11111111)
+        throw std::runtime_error { std::format("Block write: Unexpected EAX={:08X}", m.cpu.regs_[REG_AX]) };
+
+    const auto invalidations = m.cpu.decodeCacheStats().invalidations;
+    const auto code = HexDecode("B822222222F4"); // MOV EAX, 0x22222222 / HLT
+    m.bus.writeBlock(dmaCode, code.data(), code.size());
+    RunUntilHalt(m.cpu, dmaCode);
+    if (m.cpu.regs_[REG_AX] != 0x22222222)
+        throw std::runtime_error { std::format("Block write: Stale code ran EAX={:08X}", m.cpu.regs_[REG_AX]) };
+    if (m.cpu.decodeCacheStats().invalidations == invalidations)
+        throw std::runtime_error { "Block write: Decode cache not invalidated" };
+}
+
+// The CPU must stop observing the bus when it's destroyed before it
+static void TestObserverLifetime()
+{
+    SystemBus bus;
+    RamHandler ram { 64 * 1024 };
+    bus.addMemHandler(0, ram.size(), ram);
+    {
+        CPU cpu { CPUModel::i80386sx, bus };
+        bus.watchWrites(0);
+    }
+    bus.writeU8(0, 0x90);
+    RamHandler more { 64 * 1024 };
+    bus.addMemHandler(ram.size(), more.size(), more);
+}
+
+// Code in RAM mapped just below 4GB (like a 386 BIOS ROM) must be cached and invalidated like anywhere else
+static void TestHighMemory()
+{
+    constexpr std::uint32_t highBase = 0xFFFF0000;
+    DecodeCacheTestMachine m;
+    RamHandler high { 64 * 1024 };
+    m.bus.addMemHandler(highBase, high.size(), high);
+    if (m.bus.memoryEnd() != 0x100000000)
+        throw std::runtime_error { std::format("High memory: Unexpected memory end {:X}", m.bus.memoryEnd()) };
+
+    PokeHex(m.bus, highBase, "B811111111F4"); // MOV EAX, 0x11111111 / HLT
+    for (int i = 0; i < 32; ++i)
+        RunUntilHalt(m.cpu, highBase);
+    PokeHex(m.bus, highBase, "B822222222F4"); // MOV EAX, 0x22222222 / HLT
+    RunUntilHalt(m.cpu, highBase);
+    if (m.cpu.regs_[REG_AX] != 0x22222222)
+        throw std::runtime_error { std::format("High memory: Stale code ran EAX={:08X}", m.cpu.regs_[REG_AX]) };
+    if (high.data()[1] != 0x22)
+        throw std::runtime_error { "High memory: Write didn't reach the handler" };
+}
+
+// RAM that wants to know about direct writes in 1KB blocks
+class WatchedRamHandler : public RamHandler {
+public:
+    explicit WatchedRamHandler(std::size_t size)
+        : RamHandler { size }
+    {
+    }
+
+    HostRegion hostRegion() override
+    {
+        auto region = RamHandler::hostRegion();
+        region.notifyWrites = true;
+        region.notifyGranularity = 1024;
+        return region;
+    }
+
+    void hostWritten(std::uint64_t offset, std::uint64_t length) override
+    {
+        written.emplace_back(offset, length);
+    }
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> written;
+};
+
+// Writes are reported in the granularity the host region asks for, once per block
+static void TestWriteNotification()
+{
+    constexpr std::uint32_t watchedBase = 0x100000;
+    DecodeCacheTestMachine m;
+    WatchedRamHandler watched { 0x2000 };
+    m.bus.addMemHandler(watchedBase, 0x1600, watched);
+
+    using Written = std::vector<std::pair<std::uint64_t, std::uint64_t>>;
+    auto check = [&](const char* what, const Written& expected) {
+        if (watched.written != expected)
+            throw std::runtime_error { std::format("Write notification: Unexpected calls after {}", what) };
+        watched.written.clear();
+    };
+
+    m.bus.write<std::uint32_t>(watchedBase + 0x404, 1);
+    check("CPU sized write", { { 0x400, 0x400 } });
+    const std::vector<std::uint8_t> block(0x300);
+    m.bus.writeBlock(watchedBase + 0x3F0, block.data(), block.size()); // Spans two blocks
+    check("block write", { { 0, 0x400 }, { 0x400, 0x400 } });
+    m.bus.write<std::uint8_t>(watchedBase + 0x15FF, 1);
+    check("write at the end", { { 0x1400, 0x200 } }); // Cut off at the end of the mapping
+}
+
+// Guest time only depends on the instructions run and the memory they access, not on whether the code is
+// cached or run as blocks, or on memory accesses being split (here across a page boundary)
+static void TestTiming()
+{
+    std::optional<std::uint64_t> expected;
+    for (const std::uint32_t data : { 0x20000, 0x20FFE }) {
+        for (int config = 0; config < 5; ++config) {
+            DecodeCacheTestMachine m;
+            m.cpu.decodeCacheEnabled(config & 1);
+            m.cpu.fastFetchEnabled(config & 2);
+            m.cpu.jitEnabled(config == 4);
+            PokeHex(m.bus, mainCode,
+                "B964000000" // MOV ECX, 100
+                "8B03" // MOV EAX, [EBX]
+                "014304" // ADD [EBX+4], EAX
+                "49" // DEC ECX
+                "75F8" // JNZ 0x10005
+                "89DE" // MOV ESI, EBX
+                "8DBB00010000" // LEA EDI, [EBX+0x100]
+                "B940000000" // MOV ECX, 64
+                "F3A5" // REP MOVSD
+                "F4"); // HLT
+            m.cpu.regs_[REG_BX] = data;
+            RunUntilHalt(m.cpu, mainCode);
+            const auto time = m.bus.time();
+            if (!expected)
+                expected = time;
+            else if (time != *expected)
+                throw std::runtime_error { std::format("Timing: Data at {:X} config {} took {} cycles, expected {}", data, config, time, *expected) };
+        }
+    }
+}
+
+int main()
+{
+    try {
+        TestSelfModifyingCode();
+        TestBlockWrite();
+        TestObserverLifetime();
+        TestHighMemory();
+        TestWriteNotification();
+        TestTiming();
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
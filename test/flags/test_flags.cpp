@@ -0,0 +1,232 @@
+#include "test_machine.h"
+#include <print>
+#include <span>
+
+// Physical memory layout of the guest (all in real mode)
+constexpr std::uint16_t codeSegment = 0x1000;
+constexpr std::uint16_t dataSegment = 0x2000;
+constexpr std::uint16_t stackSegment = 0x3000;
+constexpr std::uint16_t handlerOffset = 0xF000; // Every interrupt vector points to a HLT at codeSegment:handlerOffset
+
+// An instruction that sets the arithmetic flags followed by one that uses some of them (LAHF, ADC, Jcc etc.)
+// and HLT. The expected values are from before the flags were evaluated lazily, all bits of the flags
+// are compared (including the undefined ones). Faults (e.g. DIV) end up at the HLT.
+struct FlagsTest {
+    const char* code;
+    std::uint32_t ax, bx, cx, dx, flags;
+    std::uint32_t expectedAx, expectedDx, expectedSi, expectedFlags;
+};
+
+static const FlagsTest tests8088[] = {
+    { "01D89FF4", 0x7FFF, 0x100, 0x21, 0xF968, 0xF0C2, 0x86FF, 0xF968, 0x0, 0xF886 }, // ADD AX, BX / LAHF
+    { "01D811D8F4", 0x7189, 0xFFFF, 0x20, 0x1, 0xF817, 0x7188, 0x1, 0x0, 0xF017 }, // ADD AX, BX / ADC AX, BX
+    { "00D819DAF4", 0x1, 0xDEA4, 0x4, 0xFFFF, 0xF056, 0xA5, 0x215B, 0x0, 0xF002 }, // ADD AL, BL / SBB DX, BX
+    { "00D8D1DAF4", 0xFF, 0xFFFF, 0x1F, 0xCA15, 0xF8C3, 0xFE, 0xE50A, 0x0, 0xF093 }, // ADD AL, BL / RCR DX, 1
+    { "11D8700146F4", 0x75FD, 0x0, 0x1F, 0x9999, 0xF016, 0x75FD, 0x9999, 0x1, 0xF002 }, // ADC AX, BX / JO +1 / INC SI
+    { "11D8720146F4", 0xCE31, 0x7F, 0x11, 0xFFFF, 0xF0D3, 0xCEB1, 0xFFFF, 0x1, 0xF002 }, // ADC AX, BX / JB +1 / INC SI
+    { "29D8760146F4", 0x1, 0x0, 0x8, 0xF0F, 0xF803, 0x1, 0xF0F, 0x1, 0xF002 }, // SUB AX, BX / JBE +1 / INC SI
+    { "29D87A0146F4", 0x7573, 0x7FFF, 0x7, 0xF0F, 0xF012, 0xF574, 0xF0F, 0x0, 0xF097 }, // SUB AX, BX / JP +1 / INC SI
+    { "18D87C0146F4", 0xFF, 0x1, 0x11, 0x1234, 0xF8C6, 0xFE, 0x1234, 0x0, 0xF082 }, // SBB AL, BL / JL +1 / INC SI
+    { "18D87E0146F4", 0x7F, 0x9999, 0x4, 0xB4BE, 0xF043, 0xE5, 0xB4BE, 0x1, 0xF003 }, // SBB AL, BL / JLE +1 / INC SI
+    { "39D8780146F4", 0x0, 0x7FFF, 0x20, 0x100, 0xF0C7, 0x0, 0x100, 0x0, 0xF093 }, // CMP AX, BX / JS +1 / INC SI
+    { "39D8740146F4", 0x7F, 0x100, 0x9, 0xFFFF, 0xF0D6, 0x7F, 0xFFFF, 0x1, 0xF003 }, // CMP AX, BX / JZ +1 / INC SI
+    { "21D8F5F4", 0xAF24, 0x8000, 0x0, 0x9833, 0xF0D3, 0x8000, 0x9833, 0x0, 0xF087 }, // AND AX, BX / CMC
+    { "21D842F4", 0x0, 0x70FA, 0x10, 0x7E36, 0xF042, 0x0, 0x7E37, 0x0, 0xF002 }, // AND AX, BX / INC DX
+    { "08D890F4", 0xFFFF, 0xFA4B, 0x10, 0x5DE4, 0xF802, 0xFFFF, 0x5DE4, 0x0, 0xF086 }, // OR AL, BL / NOP
+    { "08D89FF4", 0x444E, 0x100, 0xF, 0xFF, 0xF852, 0x64E, 0xFF, 0x0, 0xF006 }, // OR AL, BL / LAHF
+    { "31D811D8F4", 0x1234, 0x1234, 0x8, 0x9999, 0xF0D6, 0x1234, 0x9999, 0x0, 0xF002 }, // XOR AX, BX / ADC AX, BX
+    { "31D819DAF4", 0x80, 0x1, 0xF, 0xFFFF, 0xF0C2, 0x81, 0xFFFE, 0x0, 0xF082 }, // XOR AX, BX / SBB DX, BX
+    { "85D8D1DAF4", 0x80, 0xC73C, 0x7, 0x9999, 0xF007, 0x80, 0x4CCC, 0x0, 0xF847 }, // TEST AX, BX / RCR DX, 1
+    { "85D8700146F4", 0xFF, 0x0, 0xF, 0xF0F, 0xF887, 0xFF, 0xF0F, 0x1, 0xF002 }, // TEST AX, BX / JO +1 / INC SI
+    { "40720146F4", 0xEAE6, 0xFF, 0x8, 0xFFFF, 0xF8C2, 0xEAE7, 0xFFFF, 0x1, 0xF002 }, // INC AX / JB +1 / INC SI
+    { "40760146F4", 0x7FFF, 0x7FFF, 0x8, 0xA778, 0xF013, 0x8000, 0xA778, 0x0, 0xF897 }, // INC AX / JBE +1 / INC SI
+    { "487A0146F4", 0x4EFC, 0x9999, 0x20, 0x6F83, 0xF057, 0x4EFB, 0x6F83, 0x1, 0xF003 }, // DEC AX / JP +1 / INC SI
+    { "487C0146F4", 0x0, 0x1234, 0x10, 0x9999, 0xF803, 0xFFFF, 0x9999, 0x0, 0xF097 }, // DEC AX / JL +1 / INC SI
+    { "F7D87E0146F4", 0xDDF6, 0x9929, 0x4, 0xD24A, 0xF097, 0x220A, 0xD24A, 0x1, 0xF003 }, // NEG AX / JLE +1 / INC SI
+    { "F7D8780146F4", 0x80, 0xFFFF, 0x7, 0x27CB, 0xF8C2, 0xFF80, 0x27CB, 0x0, 0xF083 }, // NEG AX / JS +1 / INC SI
+    { "F6D8740146F4", 0xCC20, 0x7F25, 0x9, 0xC05, 0xF842, 0xCCE0, 0xC05, 0x1, 0xF003 }, // NEG AL / JZ +1 / INC SI
+    { "F6D8F5F4", 0x9999, 0xF0F, 0xF, 0xF0F, 0xF093, 0x9967, 0xF0F, 0x0, 0xF012 }, // NEG AL / CMC
+    { "D3E042F4", 0x1234, 0xFFFF, 0x0, 0x0, 0xF893, 0x1234, 0x1, 0x0, 0xF003 }, // SHL AX, CL / INC DX
+    { "D3E090F4", 0xFFFF, 0xFFFF, 0x10, 0x7F, 0xF847, 0x0, 0x7F, 0x0, 0xF847 }, // SHL AX, CL / NOP
+    { "D2E89FF4", 0x1234, 0x80, 0x9, 0x8000, 0xF047, 0x4600, 0x8000, 0x0, 0xF046 }, // SHR AL, CL / LAHF
+    { "D2E811D8F4", 0x0, 0x1234, 0xF, 0xFF, 0xF0D6, 0x1234, 0xFF, 0x0, 0xF002 }, // SHR AL, CL / ADC AX, BX
+    { "D3F819DAF4", 0x39EE, 0x1, 0x9, 0x0, 0xF083, 0x1C, 0xFFFE, 0x0, 0xF093 }, // SAR AX, CL / SBB DX, BX
+    { "D3F8D1DAF4", 0xCEB2, 0x80, 0x4, 0x8000, 0xF053, 0xFCEB, 0x4000, 0x0, 0xF886 }, // SAR AX, CL / RCR DX, 1
+    { "D3C0700146F4", 0xFFFF, 0x7FFF, 0x10, 0x9999, 0xF847, 0xFFFF, 0x9999, 0x1, 0xF003 }, // ROL AX, CL / JO +1 / INC SI
+    { "D3C0720146F4", 0xDF15, 0x56E, 0x9, 0x7F, 0xF047, 0x2BBE, 0x7F, 0x1, 0xF002 }, // ROL AX, CL / JB +1 / INC SI
+    { "D2C8760146F4", 0x9999, 0x57BE, 0x9, 0x100, 0xF0C3, 0x99CC, 0x100, 0x0, 0xF0C3 }, // ROR AL, CL / JBE +1 / INC SI
+    { "D2C87A0146F4", 0xFF, 0x7FFF, 0x7, 0xF0F, 0xF897, 0xFF, 0xF0F, 0x0, 0xF097 }, // ROR AL, CL / JP +1 / INC SI
+    { "D3D07C0146F4", 0xFF, 0xFFFF, 0x21, 0x80, 0xF002, 0x7F, 0x80, 0x0, 0xF803 }, // RCL AX, CL / JL +1 / INC SI
+    { "D3D07E0146F4", 0xFF4E, 0xEB4D, 0x1, 0xDAE9, 0xF807, 0xFE9D, 0xDAE9, 0x1, 0xF003 }, // RCL AX, CL / JLE +1 / INC SI
+    { "D2D8780146F4", 0xA13, 0x80, 0xF, 0x100, 0xF896, 0xA98, 0x100, 0x0, 0xF896 }, // RCR AL, CL / JS +1 / INC SI
+    { "D2D8740146F4", 0x2D71, 0x8000, 0x1, 0xAAD0, 0xF017, 0x2DB8, 0xAAD0, 0x1, 0xF003 }, // RCR AL, CL / JZ +1 / INC SI
+    { "D1E0F5F4", 0x6D1C, 0xC4DF, 0x1, 0x0, 0xF8C7, 0xDA38, 0x0, 0x0, 0xF893 }, // SHL AX, 1 / CMC
+    { "D1E042F4", 0x137E, 0x80, 0x11, 0xF0F, 0xF893, 0x26FC, 0xF10, 0x0, 0xF012 }, // SHL AX, 1 / INC DX
+    { "D0F890F4", 0x80, 0x0, 0x7, 0x8000, 0xF8D6, 0xC0, 0x8000, 0x0, 0xF086 }, // SAR AL, 1 / NOP
+    { "D0F89FF4", 0xAB43, 0x8000, 0x21, 0x1777, 0xF847, 0x721, 0x1777, 0x0, 0xF007 }, // SAR AL, 1 / LAHF
+    { "F7E311D8F4", 0xF0F, 0x9999, 0xF, 0x1234, 0xF896, 0x9091, 0x908, 0x0, 0xF093 }, // MUL BX / ADC AX, BX
+    { "F7E319DAF4", 0xF25B, 0x8000, 0x8, 0xFF, 0xF883, 0x8000, 0xF92C, 0x0, 0xF883 }, // MUL BX / SBB DX, BX
+    { "F6EBD1DAF4", 0x8000, 0x1, 0x10, 0x80, 0xF893, 0x0, 0x40, 0x0, 0xF046 }, // IMUL BL / RCR DX, 1
+    { "F6EB700146F4", 0x7FFF, 0x9999, 0x7, 0x7FFF, 0xF882, 0x67, 0x7FFF, 0x1, 0xF002 }, // IMUL BL / JO +1 / INC SI
+    { "F6F3720146F4", 0x0, 0xCA29, 0x20, 0xF0F, 0xF056, 0x0, 0xF0F, 0x1, 0xF002 }, // DIV BL / JB +1 / INC SI
+    { "F6F3760146F4", 0xFFFF, 0xFF, 0x1, 0x80, 0xF002, 0xFFFF, 0x80, 0x0, 0xF002 }, // DIV BL / JBE +1 / INC SI
+    { "F7FB7A0146F4", 0x100, 0x1234, 0x1, 0x1, 0xF856, 0xE, 0x228, 0x0, 0xF856 }, // IDIV BX / JP +1 / INC SI
+    { "F7FB7C0146F4", 0x1, 0xFF, 0x9, 0xDC45, 0xF893, 0x1, 0xDC45, 0x0, 0xF893 }, // IDIV BX / JL +1 / INC SI
+    { "277E0146F4", 0x0, 0x2F1F, 0x1, 0xC00C, 0xF816, 0x6, 0xC00C, 0x1, 0xF002 }, // DAA / JLE +1 / INC SI
+    { "27780146F4", 0x1, 0x1234, 0x8, 0xFF, 0xF8D3, 0x67, 0xFF, 0x1, 0xF003 }, // DAA / JS +1 / INC SI
+    { "2F740146F4", 0x100, 0x4C60, 0x7, 0xE3B6, 0xF852, 0x1FA, 0xE3B6, 0x1, 0xF002 }, // DAS / JZ +1 / INC SI
+    { "2FF5F4", 0xCB92, 0xD64F, 0x0, 0x8CC9, 0xF0D2, 0xCB8C, 0x8CC9, 0x0, 0xF093 }, // DAS / CMC
+    { "3742F4", 0x7F, 0xF0F, 0x21, 0xECD, 0xF056, 0x105, 0xECE, 0x0, 0xF003 }, // AAA / INC DX
+    { "3790F4", 0x80, 0x272A, 0xF, 0x8000, 0xF853, 0x106, 0x8000, 0x0, 0xF853 }, // AAA / NOP
+    { "3F9FF4", 0xB26B, 0x1, 0x4, 0xAC6, 0xF802, 0x1305, 0xAC6, 0x0, 0xF813 }, // AAS / LAHF
+    { "3F11D8F4", 0x8E24, 0xFFFF, 0x21, 0x100, 0xF8D2, 0x8D0E, 0x100, 0x0, 0xF093 }, // AAS / ADC AX, BX
+    { "D40A19DAF4", 0xFFFF, 0x72BE, 0x4, 0x0, 0xF0C6, 0x1905, 0x8D42, 0x0, 0xF097 }, // AAM / SBB DX, BX
+    { "D40AD1DAF4", 0x0, 0x80, 0x9, 0xC060, 0xF007, 0x0, 0xE030, 0x0, 0xF046 }, // AAM / RCR DX, 1
+    { "D50A700146F4", 0x55F, 0x9999, 0x1, 0x1234, 0xF012, 0x91, 0x1234, 0x1, 0xF002 }, // AAD / JO +1 / INC SI
+    { "D50A720146F4", 0x1234, 0x100, 0x8, 0x80, 0xF052, 0xE8, 0x80, 0x1, 0xF002 }, // AAD / JB +1 / INC SI
+    { "D407760146F4", 0xFF, 0x9999, 0x1F, 0x4524, 0xF053, 0x2403, 0x4524, 0x0, 0xF017 }, // AAM 7 / JBE +1 / INC SI
+    { "D4077A0146F4", 0x0, 0x0, 0x0, 0x3FCA, 0xF816, 0x0, 0x3FCA, 0x0, 0xF856 }, // AAM 7 / JP +1 / INC SI
+};
+
+static const FlagsTest tests80386[] = {
+    { "01D89FF4", 0x69B7, 0xF968, 0x1F, 0x7FFF, 0xFFFC0012, 0x31F, 0x7FFF, 0x0, 0xFFFC0003 }, // ADD AX, BX / LAHF
+    { "01D811D8F4", 0x10000, 0x8000, 0x11, 0x0, 0xFFFC0092, 0x10000, 0x0, 0x0, 0xFFFC0847 }, // ADD AX, BX / ADC AX, BX
+    { "00D819DAF4", 0xFFFFFFFF, 0xFF, 0x1, 0x80, 0xFFFC0097, 0xFFFFFFFE, 0xFF80, 0x0, 0xFFFC0093 }, // ADD AL, BL / SBB DX, BX
+    { "00D8D1DAF4", 0x75FD, 0x12C2, 0x0, 0xC41E, 0xFFFC0813, 0x75BF, 0xE20F, 0x0, 0xFFFC0082 }, // ADD AL, BL / RCR DX, 1
+    { "11D8700146F4", 0x1234, 0x7FFFFFFF, 0x1, 0x1, 0xFFFC0002, 0x1233, 0x1, 0x1, 0xFFFC0003 }, // ADC AX, BX / JO +1 / INC SI
+    { "11D8720146F4", 0x399C, 0x7573, 0x1F, 0x85F, 0xFFFC00D7, 0xAF10, 0x85F, 0x1, 0xFFFC0002 }, // ADC AX, BX / JB +1 / INC SI
+    { "29D8760146F4", 0xFF, 0x100, 0x10, 0x0, 0xFFFC0052, 0xFFFF, 0x0, 0x0, 0xFFFC0087 }, // SUB AX, BX / JBE +1 / INC SI
+    { "29D87A0146F4", 0x80, 0x8000, 0xF, 0xF772, 0xFFFC00C7, 0x8080, 0xF772, 0x1, 0xFFFC0003 }, // SUB AX, BX / JP +1 / INC SI
+    { "18D87C0146F4", 0x80, 0x8000, 0x9, 0xFFFF, 0xFFFC00D6, 0x80, 0xFFFF, 0x0, 0xFFFC0082 }, // SBB AL, BL / JL +1 / INC SI
+    { "18D87E0146F4", 0x77DB, 0x9833, 0x1, 0x80000000, 0xFFFC0042, 0x77A8, 0x80000000, 0x0, 0xFFFC0082 }, // SBB AL, BL / JLE +1 / INC SI
+    { "39D8780146F4", 0x6F7D, 0x0, 0x7, 0x7FFF, 0xFFFC0002, 0x6F7D, 0x7FFF, 0x1, 0xFFFC0002 }, // CMP AX, BX / JS +1 / INC SI
+    { "39D8740146F4", 0x10000, 0x80000000, 0x9, 0x100, 0xFFFC00C6, 0x10000, 0x100, 0x0, 0xFFFC0046 }, // CMP AX, BX / JZ +1 / INC SI
+    { "21D8F5F4", 0xFEBB, 0x1234, 0x0, 0xFF, 0xFFFC00C2, 0x1230, 0xFF, 0x0, 0xFFFC0007 }, // AND AX, BX / CMC
+    { "21D842F4", 0x1, 0x7FFF, 0x1F, 0x80, 0xFFFC0016, 0x1, 0x81, 0x0, 0xFFFC0006 }, // AND AX, BX / INC DX
+    { "08D890F4", 0x80, 0xFF, 0x1F, 0x3077, 0xFFFC0856, 0xFF, 0x3077, 0x0, 0xFFFC0086 }, // OR AL, BL / NOP
+    { "08D80F9FC2F4", 0xEAE6, 0x1234, 0x11, 0x7FFFFFFF, 0xFFFC00D7, 0xEAF6, 0x7FFFFF00, 0x0, 0xFFFC0086 }, // OR AL, BL / SETG DL
+    { "31D80F97C2F4", 0x7FFF, 0xFF, 0x10, 0x4EFC, 0xFFFC0096, 0x7F00, 0x4E01, 0x0, 0xFFFC0006 }, // XOR AX, BX / SETA DL
+    { "31D80F9AC2F4", 0x9999, 0x0, 0x10, 0x10000, 0xFFFC0802, 0x9999, 0x10001, 0x0, 0xFFFC0086 }, // XOR AX, BX / SETP DL
+    { "85D89FF4", 0x7FFF, 0x9929, 0x10, 0x7F, 0xFFFC0846, 0x2FF, 0x7F, 0x0, 0xFFFC0002 }, // TEST AX, BX / LAHF
+    { "85D811D8F4", 0xFFFF, 0x10000, 0x8, 0x21A5, 0xFFFC0013, 0xFFFF, 0x21A5, 0x0, 0xFFFC0086 }, // TEST AX, BX / ADC AX, BX
+    { "4019DAF4", 0xC05, 0xFF, 0x11, 0xF0F, 0xFFFC0097, 0xC06, 0xE0F, 0x0, 0xFFFC0016 }, // INC AX / SBB DX, BX
+    { "40D1DAF4", 0x5AD0, 0xFFFF, 0x10, 0x5390, 0xFFFC00C6, 0x5AD1, 0x29C8, 0x0, 0xFFFC0006 }, // INC AX / RCR DX, 1
+    { "48700146F4", 0x10000, 0x7FFFFFFF, 0x20, 0x8000, 0xFFFC0093, 0x1FFFF, 0x8000, 0x1, 0xFFFC0003 }, // DEC AX / JO +1 / INC SI
+    { "48720146F4", 0xD31B, 0x1, 0x21, 0x6968, 0xFFFC0086, 0xD31A, 0x6968, 0x1, 0xFFFC0002 }, // DEC AX / JB +1 / INC SI
+    { "F7D8760146F4", 0xFFFFFFFF, 0xFFFFFFFF, 0x1, 0x1, 0xFFFC08D2, 0xFFFF0001, 0x1, 0x0, 0xFFFC0013 }, // NEG AX / JBE +1 / INC SI
+    { "F7D87A0146F4", 0xF0F, 0x80, 0x1F, 0x7F, 0xFFFC0016, 0xF0F1, 0x7F, 0x1, 0xFFFC0003 }, // NEG AX / JP +1 / INC SI
+    { "F6D87C0146F4", 0x7FFFFFFF, 0x9999, 0x9, 0xF0F, 0xFFFC0856, 0x7FFFFF01, 0xF0F, 0x1, 0xFFFC0003 }, // NEG AL / JL +1 / INC SI
+    { "F6D87E0146F4", 0x7F, 0x8CD9, 0x8, 0x57BE, 0xFFFC0817, 0x81, 0x57BE, 0x0, 0xFFFC0097 }, // NEG AL / JLE +1 / INC SI
+    { "D3E0780146F4", 0x3894, 0xFFFFFFFF, 0x7, 0xF0F, 0xFFFC0897, 0x4A00, 0xF0F, 0x1, 0xFFFC0002 }, // SHL AX, CL / JS +1 / INC SI
+    { "D3E0740146F4", 0xFF, 0x80000000, 0x1F, 0xFF, 0xFFFC0846, 0x0, 0xFF, 0x0, 0xFFFC0046 }, // SHL AX, CL / JZ +1 / INC SI
+    { "D2E8F5F4", 0x6AFC, 0x100, 0x1, 0x10000, 0xFFFC0087, 0x6A7E, 0x10000, 0x0, 0xFFFC0807 }, // SHR AL, CL / CMC
+    { "D2E842F4", 0x7FFF, 0x2D71, 0x11, 0xF0F, 0xFFFC0007, 0x7F00, 0xF10, 0x0, 0xFFFC0012 }, // SHR AL, CL / INC DX
+    { "D3F890F4", 0x6D1C, 0x10000, 0x10, 0xDC05, 0xFFFC0882, 0x0, 0xDC05, 0x0, 0xFFFC0046 }, // SAR AX, CL / NOP
+    { "D3F80F9FC2F4", 0x80, 0xF990, 0x11, 0x80, 0xFFFC0816, 0x0, 0x0, 0x0, 0xFFFC0046 }, // SAR AX, CL / SETG DL
+    { "D3C00F97C2F4", 0x80, 0x80000000, 0x0, 0x8000, 0xFFFC0057, 0x80, 0x8000, 0x0, 0xFFFC0057 }, // ROL AX, CL / SETA DL
+    { "D3C00F9AC2F4", 0x7F, 0x9999, 0x8, 0x7FFF, 0xFFFC08C6, 0x7F00, 0x7F01, 0x0, 0xFFFC00C6 }, // ROL AX, CL / SETP DL
+    { "D2C89FF4", 0x8000, 0xFF, 0x4, 0x8000, 0xFFFC0853, 0x5200, 0x8000, 0x0, 0xFFFC0052 }, // ROR AL, CL / LAHF
+    { "D2C811D8F4", 0xA71B, 0x7FFF, 0xF, 0x9999, 0xFFFC0847, 0x2735, 0x9999, 0x0, 0xFFFC0017 }, // ROR AL, CL / ADC AX, BX
+    { "D3D019DAF4", 0x0, 0x212E, 0x1, 0x7F, 0xFFFC0852, 0x0, 0xDF51, 0x0, 0xFFFC0083 }, // RCL AX, CL / SBB DX, BX
+    { "D3D0D1DAF4", 0x100, 0xFF, 0x21, 0x7F, 0xFFFC0812, 0x200, 0x3F, 0x0, 0xFFFC0013 }, // RCL AX, CL / RCR DX, 1
+    { "D2D8700146F4", 0x7F, 0x1, 0x9, 0x80000000, 0xFFFC0817, 0x7F, 0x80000000, 0x0, 0xFFFC0817 }, // RCR AL, CL / JO +1 / INC SI
+    { "D2D8720146F4", 0x0, 0xF0F, 0x0, 0x80000000, 0xFFFC0843, 0x0, 0x80000000, 0x0, 0xFFFC0843 }, // RCR AL, CL / JB +1 / INC SI
+    { "D1E0760146F4", 0x1234, 0xFF, 0x1F, 0x100, 0xFFFC0842, 0x2468, 0x100, 0x1, 0xFFFC0002 }, // SHL AX, 1 / JBE +1 / INC SI
+    { "D1E07A0146F4", 0x80, 0x7FFFFFFF, 0x0, 0xD64F, 0xFFFC08C3, 0x100, 0xD64F, 0x0, 0xFFFC0006 }, // SHL AX, 1 / JP +1 / INC SI
+    { "D0F87C0146F4", 0xFFFFFFFF, 0x1, 0x21, 0xECD, 0xFFFC0056, 0xFFFFFFFF, 0xECD, 0x0, 0xFFFC0087 }, // SAR AL, 1 / JL +1 / INC SI
+    { "D0F87E0146F4", 0x4CAC, 0x8000, 0x21, 0xF0F, 0xFFFC0092, 0x4CD6, 0xF0F, 0x0, 0xFFFC0082 }, // SAR AL, 1 / JLE +1 / INC SI
+    { "F7E3780146F4", 0xAC6, 0x0, 0x11, 0xFFFFFFFF, 0xFFFC0812, 0x0, 0xFFFF0000, 0x1, 0xFFFC0002 }, // MUL BX / JS +1 / INC SI
+    { "F7E3740146F4", 0x7FFF, 0x7FFF, 0x4, 0x0, 0xFFFC00C6, 0x1, 0x3FFF, 0x1, 0xFFFC0003 }, // MUL BX / JZ +1 / INC SI
+    { "F6EBF5F4", 0x8054, 0xC060, 0x7, 0xF0F, 0xFFFC0812, 0x1F80, 0xF0F, 0x0, 0xFFFC0812 }, // IMUL BL / CMC
+    { "F6EB42F4", 0x1234, 0xFF, 0x10, 0x100, 0xFFFC0057, 0xFFCC, 0x101, 0x0, 0xFFFC0002 }, // IMUL BL / INC DX
+    { "F6F390F4", 0xFFFFFFFF, 0x7FFFFFFF, 0x0, 0xF0F, 0xFFFC0883, 0xFFFFFFFF, 0xF0F, 0x0, 0xFFFC0883 }, // DIV BL / NOP
+    { "F6F30F9FC2F4", 0x0, 0x60CD, 0x1F, 0xCC14, 0xFFFC0057, 0x0, 0xCC00, 0x0, 0xFFFC0057 }, // DIV BL / SETG DL
+    { "F7FB0F97C2F4", 0x8000, 0x9999, 0x1F, 0x80000000, 0xFFFC00C3, 0xFFFF, 0x80001900, 0x0, 0xFFFC00C3 }, // IDIV BX / SETA DL
+    { "F7FB0F9AC2F4", 0x80, 0xFFFF, 0x11, 0x7F, 0xFFFC0097, 0x80, 0x7F, 0x0, 0xFFFC0097 }, // IDIV BX / SETP DL
+    { "279FF4", 0x80000000, 0x4958, 0x20, 0xFFFFFFFF, 0xFFFC0017, 0x80001766, 0xFFFFFFFF, 0x0, 0xFFFC0017 }, // DAA / LAHF
+    { "2711D8F4", 0x80000000, 0x0, 0x1F, 0x80000000, 0xFFFC0016, 0x80000006, 0x80000000, 0x0, 0xFFFC0006 }, // DAA / ADC AX, BX
+    { "2F19DAF4", 0xF549, 0x80000000, 0x0, 0x7F, 0xFFFC0803, 0xF5E9, 0x7E, 0x0, 0xFFFC0006 }, // DAS / SBB DX, BX
+    { "2FD1DAF4", 0x10000, 0x8D64, 0x21, 0x7FFFFFFF, 0xFFFC0857, 0x1009A, 0x7FFFFFFF, 0x0, 0xFFFC0097 }, // DAS / RCR DX, 1
+    { "37700146F4", 0xFF, 0x7F, 0x11, 0xFF, 0xFFFC0082, 0x205, 0xFF, 0x1, 0xFFFC0003 }, // AAA / JO +1 / INC SI
+    { "37720146F4", 0x1234, 0x7F, 0x9, 0xE626, 0xFFFC0007, 0x1204, 0xE626, 0x1, 0xFFFC0002 }, // AAA / JB +1 / INC SI
+    { "3F760146F4", 0xD4E, 0x5318, 0x1, 0x10000, 0xFFFC0817, 0xC08, 0x10000, 0x0, 0xFFFC0817 }, // AAS / JBE +1 / INC SI
+    { "3F7A0146F4", 0xF0F, 0x7FFF, 0x20, 0x80000000, 0xFFFC0017, 0xE09, 0x80000000, 0x0, 0xFFFC0017 }, // AAS / JP +1 / INC SI
+    { "D40A7C0146F4", 0xFFFF, 0xB72F, 0x1, 0x1, 0xFFFC0003, 0x1905, 0x1, 0x1, 0xFFFC0003 }, // AAM / JL +1 / INC SI
+    { "D40A7E0146F4", 0x46D3, 0x100, 0x11, 0x1234, 0xFFFC0086, 0x1501, 0x1234, 0x1, 0xFFFC0002 }, // AAM / JLE +1 / INC SI
+    { "D50A780146F4", 0x8912, 0x0, 0x1F, 0x7FFFFFFF, 0xFFFC0886, 0x6C, 0x7FFFFFFF, 0x1, 0xFFFC0002 }, // AAD / JS +1 / INC SI
+    { "D50A740146F4", 0xA77D, 0x7FFF, 0x20, 0x7FFFFFFF, 0xFFFC0853, 0x3, 0x7FFFFFFF, 0x1, 0xFFFC0003 }, // AAD / JZ +1 / INC SI
+    { "D407F5F4", 0x1, 0x0, 0x1F, 0x9999, 0xFFFC0893, 0x1, 0x9999, 0x0, 0xFFFC0812 }, // AAM 7 / CMC
+    { "D40742F4", 0x80, 0x22BB, 0x7, 0xFFFFFFFF, 0xFFFC0013, 0x1202, 0xFFFF0000, 0x0, 0xFFFC0057 }, // AAM 7 / INC DX
+    { "66D3E090F4", 0xFFFFFFFF, 0x9999, 0x11, 0x7FFF, 0xFFFC0003, 0xFFFE0000, 0x7FFF, 0x0, 0xFFFC0087 }, // SHL EAX, CL / NOP
+    { "66D3E00F9FC2F4", 0xFFFF, 0x10000, 0x8, 0xFFFF, 0xFFFC0896, 0xFFFF00, 0xFF01, 0x0, 0xFFFC0006 }, // SHL EAX, CL / SETG DL
+    { "6601D80F97C2F4", 0x80, 0xF0F, 0x7, 0x80, 0xFFFC0817, 0xF8F, 0x1, 0x0, 0xFFFC0002 }, // ADD EAX, EBX / SETA DL
+    { "6601D80F9AC2F4", 0xFFFF, 0x1234, 0x4, 0xFF, 0xFFFC00C2, 0x11233, 0x1, 0x0, 0xFFFC0016 }, // ADD EAX, EBX / SETP DL
+    { "6629D89FF4", 0x8000, 0x80000000, 0x4, 0x10000, 0xFFFC0086, 0x80008700, 0x10000, 0x0, 0xFFFC0887 }, // SUB EAX, EBX / LAHF
+    { "6629D811D8F4", 0x10000, 0xFFFF, 0x21, 0x10000, 0xFFFC0052, 0x0, 0x10000, 0x0, 0xFFFC0057 }, // SUB EAX, EBX / ADC AX, BX
+    { "66F7E319DAF4", 0xFFFF, 0xBD8A, 0x1, 0x2DEB, 0xFFFC0056, 0xBD894276, 0x4276, 0x0, 0xFFFC0013 }, // MUL EBX / SBB DX, BX
+    { "66F7E3D1DAF4", 0x7F, 0x10000, 0x9, 0x80000000, 0xFFFC0096, 0x7F0000, 0x0, 0x0, 0xFFFC0042 }, // MUL EBX / RCR DX, 1
+    { "0FA5D8700146F4", 0x1, 0xFFFFFFFF, 0x1, 0x8000, 0xFFFC0017, 0x3, 0x8000, 0x1, 0xFFFC0002 }, // SHLD AX, BX, CL / JO +1 / INC SI
+    { "0FA5D8720146F4", 0x100, 0xF0F, 0x4, 0x7FFF, 0xFFFC0886, 0x1000, 0x7FFF, 0x1, 0xFFFC0002 }, // SHLD AX, BX, CL / JB +1 / INC SI
+    { "0FADD8760146F4", 0x7FFF, 0x1234, 0x11, 0xB6CE, 0xFFFC0887, 0x91A, 0xB6CE, 0x1, 0xFFFC0002 }, // SHRD AX, BX, CL / JBE +1 / INC SI
+    { "0FADD87A0146F4", 0x1A6F, 0x10000, 0x10, 0xFFFFFFFF, 0xFFFC0807, 0x0, 0xFFFFFFFF, 0x0, 0xFFFC0046 }, // SHRD AX, BX, CL / JP +1 / INC SI
+    { "0FBCC37C0146F4", 0xA2F8, 0x0, 0x9, 0xB967, 0xFFFC0083, 0xA2F8, 0xB967, 0x0, 0xFFFC00C3 }, // BSF AX, BX / JL +1 / INC SI
+    { "0FBCC37E0146F4", 0x10000, 0xFFFF, 0x11, 0x10000, 0xFFFC0887, 0x10000, 0x10000, 0x1, 0xFFFC0003 }, // BSF AX, BX / JLE +1 / INC SI
+    { "0FBDC3780146F4", 0x7FFF, 0xFFFF, 0x9, 0x8000, 0xFFFC0806, 0xF, 0x8000, 0x1, 0xFFFC0002 }, // BSR AX, BX / JS +1 / INC SI
+    { "0FBDC3740146F4", 0x100, 0x9E31, 0x11, 0xDE87, 0xFFFC0083, 0xF, 0xDE87, 0x1, 0xFFFC0003 }, // BSR AX, BX / JZ +1 / INC SI
+    { "0FA3D8F5F4", 0x28CB, 0xFFFF, 0x11, 0x10000, 0xFFFC0003, 0x28CB, 0x10000, 0x0, 0xFFFC0803 }, // BT AX, BX / CMC
+    { "0FA3D842F4", 0x14D0, 0xA440, 0x0, 0x80, 0xFFFC0053, 0x14D0, 0x81, 0x0, 0xFFFC0006 }, // BT AX, BX / INC DX
+    { "0FAFC390F4", 0x8B15, 0x80, 0x4, 0xFF, 0xFFFC0096, 0x8A80, 0xFF, 0x0, 0xFFFC0887 }, // IMUL AX, BX / NOP
+    { "0FAFC30F9FC2F4", 0x10000, 0x10000, 0x20, 0x2872, 0xFFFC0017, 0x10000, 0x2800, 0x0, 0xFFFC0046 }, // IMUL AX, BX / SETG DL
+    { "6BC37F0F97C2F4", 0x44D8, 0xCAA9, 0x7, 0x8000, 0xFFFC00C7, 0x89D7, 0x8000, 0x0, 0xFFFC0883 }, // IMUL AX, BX, 0x7F / SETA DL
+    { "6BC37F0F9AC2F4", 0x3BB8, 0x10000, 0x11, 0x7F, 0xFFFC00C3, 0x0, 0x1, 0x0, 0xFFFC0046 }, // IMUL AX, BX, 0x7F / SETP DL
+};
+
+static void RunFlagsTests(CPUModel model, std::span<const FlagsTest> tests)
+{
+    SystemBus bus;
+    RamHandler ram { 1024 * 1024 };
+    bus.addMemHandler(0, ram.size(), ram);
+    CPU cpu { model, bus };
+    cpu.exceptionTraceMask(0);
+    for (int i = 0; i < 256; ++i)
+        PokeHex(bus, i * 4, HexString(&handlerOffset, 2) + HexString(&codeSegment, 2));
+    PokeHex(bus, codeSegment * 16 + handlerOffset, "F4"); // HLT
+
+    for (const auto& t : tests) {
+        cpu.reset();
+        cpu.loadSreg(SREG_CS, codeSegment);
+        cpu.loadSreg(SREG_DS, dataSegment);
+        cpu.loadSreg(SREG_ES, dataSegment);
+        cpu.loadSreg(SREG_SS, stackSegment);
+        cpu.regs_[REG_SP] = 0x8000;
+        cpu.regs_[REG_AX] = t.ax;
+        cpu.regs_[REG_BX] = t.bx;
+        cpu.regs_[REG_CX] = t.cx;
+        cpu.regs_[REG_DX] = t.dx;
+        cpu.regs_[REG_SI] = 0;
+        cpu.flags() = t.flags;
+        PokeHex(bus, codeSegment * 16, t.code);
+        RunUntilHalt(cpu, 0);
+
+        const auto ax = static_cast<std::uint32_t>(cpu.regs_[REG_AX]);
+        const auto dx = static_cast<std::uint32_t>(cpu.regs_[REG_DX]);
+        const auto si = static_cast<std::uint32_t>(cpu.regs_[REG_SI]);
+        const auto flags = cpu.flags();
+        if (ax != t.expectedAx || dx != t.expectedDx || si != t.expectedSi || flags != t.expectedFlags) {
+            throw std::runtime_error { std::format("{} {}: Got AX={:X} DX={:X} SI={:X} flags {} expected AX={:X} DX={:X} SI={:X} flags {}",
+                CPUModelName(model), t.code, ax, dx, si, FormatCPUFlags(flags), t.expectedAx, t.expectedDx, t.expectedSi, FormatCPUFlags(t.expectedFlags)) };
+        }
+    }
+}
+
+int main()
+{
+    try {
+        RunFlagsTests(CPUModel::i8088, tests8088);
+        RunFlagsTests(CPUModel::i80386sx, tests80386);
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "test_machine.h"
+#include "disk_data.h"
+#include "devs/ata_controller.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <print>
+
+// Physical memory layout of the guest
+constexpr std::uint32_t writeCode = 0x10000;
+constexpr std::uint32_t readCode = 0x10100;
+constexpr std::uint32_t dataPage = 0x20000; // Written by the CPU
+constexpr std::uint32_t blockPage = 0x21000; // Written with SystemBus::writeBlock
+
+constexpr std::uint16_t ataBase = 0x1F0;
+constexpr std::uint32_t testSector = 5;
+
+// CPU, RAM and an ATA controller set up like in BaseMachine::forkFrom (without the CPU/device state,
+// which is copied through a snapshot)
+class ForkTestMachine {
+public:
+    explicit ForkTestMachine()
+        : cpu { CPUModel::i80386sx, bus }
+        , ram { 1024 * 1024 }
+        , ata { bus, ataBase, 0x3F6, []() {} }
+    {
+        bus.log().setSink({});
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+
+        EnterFlatProtectedMode(bus, cpu);
+
+        constexpr std::uint32_t stringDest = dataPage + 0x100;
+        PokeHex(bus, writeCode,
+            "A3" + HexString(&dataPage, 4) + // MOV [dataPage], EAX
+            "BF" + HexString(&stringDest, 4) + // MOV EDI, dataPage+0x100
+            "B940000000" // MOV ECX, 0x40
+            "F3AB" // REP STOSD
+            "F4"); // HLT
+        PokeHex(bus, readCode,
+            "A1" + HexString(&dataPage, 4) + // MOV EAX, [dataPage]
+            "F4"); // HLT
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    SharedRamHandler ram;
+    ATAController ata;
+
+    // Stores value with a MOV and REP STOSD (both through the fast TLB)
+    void cpuWrite(std::uint32_t value)
+    {
+        cpu.regs_[REG_AX] = value;
+        RunUntilHalt(cpu, writeCode);
+    }
+
+    std::uint32_t cpuRead()
+    {
+        RunUntilHalt(cpu, readCode);
+        return static_cast<std::uint32_t>(cpu.regs_[REG_AX]);
+    }
+
+    std::uint32_t peek32(std::uint32_t address) const
+    {
+        std::uint32_t value;
+        ram.pages().read(address, &value, sizeof(value));
+        return value;
+    }
+
+    void forkFrom(ForkTestMachine& other)
+    {
+        ram.shareFrom(other.ram);
+        ata.shareDisks(other.ata);
+        bus.remapMemory();
+        other.bus.remapMemory();
+    }
+
+    void writeSector(std::uint32_t lba, const std::vector<std::uint8_t>& data)
+    {
+        ataCommand(lba, 0x30); // WRITE SECTORS
+        for (std::uint32_t i = 0; i < bytesPerSector; i += 2)
+            bus.ioOutput(ataBase, GetU16(&data[i]), 2);
+    }
+
+    std::vector<std::uint8_t> readSector(std::uint32_t lba)
+    {
+        ataCommand(lba, 0x20); // READ SECTORS
+        std::vector<std::uint8_t> data(bytesPerSector);
+        for (std::uint32_t i = 0; i < bytesPerSector; i += 2)
+            PutU16(&data[i], static_cast<std::uint16_t>(bus.ioInput(ataBase, 2)));
+        return data;
+    }
+
+private:
+    void ataCommand(std::uint32_t lba, std::uint8_t command)
+    {
+        bus.ioOutput(ataBase + 6, 0xE0 | (lba >> 24 & 0xF), 1); // LBA, drive 0
+        bus.ioOutput(ataBase + 2, 1, 1);
+        bus.ioOutput(ataBase + 3, lba & 0xFF, 1);
+        bus.ioOutput(ataBase + 4, lba >> 8 & 0xFF, 1);
+        bus.ioOutput(ataBase + 5, lba >> 16 & 0xFF, 1);
+        bus.ioOutput(ataBase + 7, command, 1);
+        while (bus.ioInput(ataBase + 7, 1) & 0x80) { // BSY
+            bus.addCycles(100);
+            bus.sync();
+        }
+    }
+};
+
+static void Check(const std::string& what, std::uint64_t expected, std::uint64_t actual)
+{
+    if (expected != actual)
+        throw std::runtime_error { std::format("{}: Expected {:X} got {:X}", what, expected, actual) };
+}
+
+// Both machines have written the page through their fast TLB before the fork, so stale host
+// pointers would write to (or read from) the shared copy
+static void TestMemory()
+{
+    ForkTestMachine parent;
+    ForkTestMachine child;
+    parent.cpuWrite(0x11111111);
+    child.cpuWrite(0x44444444);
+
+    child.forkFrom(parent);
+    Check("Private pages after fork (parent)", 0, parent.ram.pages().privatePages());
+    Check("Private pages after fork (child)", 0, child.ram.pages().privatePages());
+    Check("Child reads parent data", 0x11111111, child.cpuRead());
+
+    parent.cpuWrite(0x22222222);
+    Check("Private pages after CPU write (parent)", 1, parent.ram.pages().privatePages());
+    Check("Child sees old data", 0x11111111, child.cpuRead());
+    child.cpuWrite(0x33333333);
+    Check("Private pages after CPU write (child)", 1, child.ram.pages().privatePages());
+
+    for (const std::uint32_t offset : { 0x000, 0x100, 0x1FC }) {
+        Check(std::format("Parent data+{:X}", offset), 0x22222222, parent.peek32(dataPage + offset));
+        Check(std::format("Child data+{:X}", offset), 0x33333333, child.peek32(dataPage + offset));
+    }
+    Check("Parent CPU read", 0x22222222, parent.cpuRead());
+    Check("Child CPU read", 0x33333333, child.cpuRead());
+
+    const std::uint32_t parentBlock[4] = { 1, 2, 3, 4 };
+    const std::uint32_t childBlock[4] = { 5, 6, 7, 8 };
+    parent.bus.writeBlock(blockPage + 0x10, parentBlock, sizeof(parentBlock));
+    child.bus.writeBlock(blockPage + 0x10, childBlock, sizeof(childBlock));
+    Check("Private pages after block write (parent)", 2, parent.ram.pages().privatePages());
+    Check("Private pages after block write (child)", 2, child.ram.pages().privatePages());
+    for (std::uint32_t i = 0; i < 4; ++i) {
+        Check(std::format("Parent block[{}]", i), parentBlock[i], parent.peek32(blockPage + 0x10 + i * 4));
+        Check(std::format("Child block[{}]", i), childBlock[i], child.peek32(blockPage + 0x10 + i * 4));
+    }
+}
+
+// A sector written by the clone must be visible to it only, and not end up in the image file
+static void TestDisk()
+{
+    const auto filename = (std::filesystem::temp_directory_path() / "xemu_test_fork.img").string();
+    std::filesystem::remove(filename);
+    CreateDisk(filename, diskFormat1440K);
+
+    std::vector<std::uint8_t> pattern(bytesPerSector);
+    for (std::uint32_t i = 0; i < bytesPerSector; ++i)
+        pattern[i] = static_cast<std::uint8_t>(i * 7 + 1);
+    const std::vector<std::uint8_t> zeros(bytesPerSector);
+
+    {
+        ForkTestMachine source;
+        ForkTestMachine clone;
+        source.ata.insertDisk(0, filename);
+        clone.forkFrom(source);
+
+        clone.writeSector(testSector, pattern);
+        if (clone.readSector(testSector) != pattern)
+            throw std::runtime_error { "Disk: Clone doesn't read back its write" };
+        if (source.readSector(testSector) != zeros)
+            throw std::runtime_error { "Disk: Write in the clone is visible to the source" };
+
+        auto sourcePattern = pattern;
+        std::ranges::reverse(sourcePattern);
+        source.writeSector(testSector, sourcePattern);
+        if (clone.readSector(testSector) != pattern)
+            throw std::runtime_error { "Disk: Write in the source is visible to the clone" };
+    }
+
+    std::ifstream in { filename, std::ios::binary };
+    std::vector<std::uint8_t> fileSector(bytesPerSector);
+    in.seekg(testSector * bytesPerSector);
+    in.read(reinterpret_cast<char*>(fileSector.data()), fileSector.size());
+    in.close();
+    std::filesystem::remove(filename);
+    if (fileSector == pattern)
+        throw std::runtime_error { "Disk: Write in the clone ended up in the image file" };
+}
+
+int main()
+{
+    try {
+        TestMemory();
+        TestDisk();
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
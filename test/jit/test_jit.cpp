@@ -0,0 +1,272 @@
+#include "test_machine.h"
+#include <print>
+#include <random>
+
+// Physical memory layout of the guest
+constexpr std::uint32_t idtBase = 0x0800;
+constexpr std::uint32_t mainCode = 0x10000;
+constexpr std::uint32_t faultHandler = 0x12000;
+constexpr std::uint32_t dataArea = 0x20000;
+constexpr std::uint32_t stackTop = 0x30000;
+
+constexpr std::uint64_t smallData32Desc = 0x004292000000FFFF; // Limit 0x2FFFF
+
+// Runs the same code interpreted or with the blocks compiled to native code (or looped over in real mode)
+class JitTestMachine {
+public:
+    explicit JitTestMachine(bool jit, bool realMode = false)
+        : cpu { CPUModel::i80386sx, bus }
+        , ram { 1024 * 1024 }
+    {
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+        cpu.jitEnabled(jit);
+
+        if (realMode) {
+            // All segments at mainCode, #GP goes to faultHandler
+            constexpr std::uint16_t segment = mainCode >> 4;
+            PokeHex(bus, 13 * 4, "0020" + HexString(&segment, 2));
+            for (const auto sr : { SREG_CS, SREG_DS, SREG_ES, SREG_SS })
+                cpu.loadSreg(sr, segment);
+            cpu.regs_[REG_SP] = 0xFFFE;
+            return;
+        }
+        EnterFlatProtectedMode(bus, cpu);
+        Poke64(bus, gdtBase + 0x18, smallData32Desc);
+        cpu.gdt_ = DescriptorTable { 0x1f, gdtBase };
+        // #GP goes to an interrupt gate at faultHandler
+        Poke64(bus, idtBase + 13 * 8, InterruptGate(faultHandler));
+        cpu.idt_ = DescriptorTable { 0x7ff, idtBase };
+        cpu.regs_[REG_SP] = stackTop;
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    RamHandler ram;
+};
+
+static void Compare(const std::string& name, JitTestMachine& interpreted, JitTestMachine& native, bool compiled = true)
+{
+    if (compiled && !native.cpu.decodeCacheStats().nativeInstructions)
+        throw std::runtime_error { std::format("{}: No instructions executed as native code", name) };
+
+    for (int reg = 0; reg < 8; ++reg) {
+        if (interpreted.cpu.regs_[reg] != native.cpu.regs_[reg])
+            throw std::runtime_error { std::format("{}: Register {} differs, interpreted {:08X} native {:08X}", name, reg, interpreted.cpu.regs_[reg], native.cpu.regs_[reg]) };
+    }
+    if (interpreted.cpu.ip_ != native.cpu.ip_)
+        throw std::runtime_error { std::format("{}: EIP differs, interpreted {:08X} native {:08X}", name, interpreted.cpu.ip_, native.cpu.ip_) };
+    if (interpreted.cpu.flags() != native.cpu.flags())
+        throw std::runtime_error { std::format("{}: Flags differ, interpreted {} native {}", name, FormatCPUFlags(interpreted.cpu.flags()), FormatCPUFlags(native.cpu.flags())) };
+    if (interpreted.cpu.instructionsExecuted() != native.cpu.instructionsExecuted())
+        throw std::runtime_error { std::format("{}: Instruction count differs, interpreted {} native {}", name, interpreted.cpu.instructionsExecuted(), native.cpu.instructionsExecuted()) };
+    if (interpreted.bus.time() != native.bus.time())
+        throw std::runtime_error { std::format("{}: Time differs, interpreted {} native {}", name, interpreted.bus.time(), native.bus.time()) };
+    if (interpreted.ram.data() != native.ram.data())
+        throw std::runtime_error { std::format("{}: Memory differs", name) };
+}
+
+// Loops over randomly generated straight-line code with the translated instructions mixed with
+// interpreted ones (memory operands, shifts, 16-bit operations) and conditional branches
+static std::string RandomLoop(std::mt19937& rng, std::uint32_t iterations)
+{
+    static constexpr std::uint8_t regs[] = { REG_AX, REG_DX, REG_BX, REG_BP, REG_SI, REG_DI }; // ECX is the loop counter
+    static constexpr std::uint8_t aluOpcodes[] = { 0x01, 0x29, 0x21, 0x09, 0x31, 0x39, 0x85, 0x89, 0x11, 0x19 };
+    auto pick = [&](auto& choices) { return choices[rng() % std::size(choices)]; };
+    auto hex8 = [](std::uint32_t value) { return std::format("{:02X}", value & 0xff); };
+    auto hex32 = [](std::uint32_t value) { return HexString(&value, 4); };
+
+    std::string body;
+    int pushed = 0;
+    const auto count = 8 + rng() % 40;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const auto r = pick(regs);
+        switch (rng() % 12) {
+        case 0:
+        case 1:
+            body += hex8(pick(aluOpcodes)) + hex8(0xC0 | pick(regs) << 3 | r);
+            break;
+        case 2:
+            body += "81" + hex8(0xC0 | (rng() % 8) << 3 | r) + hex32(rng());
+            break;
+        case 3:
+            body += "83" + hex8(0xC0 | (rng() % 8) << 3 | r) + hex8(rng());
+            break;
+        case 4:
+            body += hex8(0xB8 + r) + hex32(rng() % 4 ? rng() % 4 : rng());
+            break;
+        case 5:
+            body += hex8((rng() & 1 ? 0x40 : 0x48) + r); // INC/DEC
+            break;
+        case 6:
+            if (pushed < 4) {
+                body += hex8(0x50 + r); // PUSH
+                ++pushed;
+            } else {
+                body += hex8(0x58 + r); // POP
+                --pushed;
+            }
+            break;
+        case 7:
+            if (pushed) {
+                body += hex8(0x58 + r); // POP
+                --pushed;
+            }
+            break;
+        case 8: // MOV [dataArea + disp], reg / ADD reg, [dataArea + disp]
+            body += (rng() & 1 ? "89" : "03") + hex8(r << 3 | 5) + hex32(dataArea + (rng() % 64) * 4);
+            break;
+        case 9: // SHL/SHR reg, 1
+            body += "D1" + hex8((rng() & 1 ? 0xE0 : 0xE8) | r);
+            break;
+        case 10: // ADD reg16, reg16
+            body += "6601" + hex8(0xC0 | pick(regs) << 3 | r);
+            break;
+        case 11: // Jcc over the next (2 byte) instruction
+            body += hex8(0x70 + rng() % 16) + "02" + hex8(pick(aluOpcodes)) + hex8(0xC0 | pick(regs) << 3 | r);
+            break;
+        }
+    }
+    for (; pushed; --pushed)
+        body += hex8(0x58 + pick(regs));
+
+    body += "49"; // DEC ECX
+    const auto loopDisp = -static_cast<std::int32_t>(body.size() / 2 + 6);
+    return "B9" + hex32(iterations) // MOV ECX, iterations
+        + body
+        + "0F85" + hex32(static_cast<std::uint32_t>(loopDisp)) // JNZ loop
+        + "F4"; // HLT
+}
+
+static void TestRandomCode()
+{
+    for (std::uint32_t seed = 0; seed < 200; ++seed) {
+        std::mt19937 rng { seed };
+        const auto code = RandomLoop(rng, 40);
+        std::uint64_t initialRegs[8];
+        for (auto& reg : initialRegs)
+            reg = rng();
+
+        JitTestMachine interpreted { false };
+        JitTestMachine native { true };
+        for (auto* m : { &interpreted, &native }) {
+            PokeHex(m->bus, mainCode, code);
+            for (const auto reg : { REG_AX, REG_DX, REG_BX, REG_BP, REG_SI, REG_DI })
+                m->cpu.regs_[reg] = initialRegs[reg];
+            RunUntilHalt(m->cpu, mainCode);
+        }
+        Compare(std::format("Random code (seed {})", seed), interpreted, native);
+    }
+}
+
+// A memory access in the middle of a compiled block faults once ESI passes the segment limit
+static void TestFault()
+{
+    JitTestMachine interpreted { false };
+    JitTestMachine native { true };
+    for (auto* m : { &interpreted, &native }) {
+        m->cpu.loadSreg(SREG_DS, 0x18);
+        for (const auto reg : { REG_AX, REG_DX, REG_BX, REG_BP, REG_SI, REG_DI })
+            m->cpu.regs_[reg] = 0;
+        PokeHex(m->bus, mainCode,
+            "81C600100000" // ADD ESI, 0x1000
+            "43" // INC EBX
+            "8B06" // MOV EAX, [ESI]
+            "01C2" // ADD EDX, EAX
+            "47" // INC EDI
+            "EBF2"); // JMP mainCode
+        PokeHex(m->bus, faultHandler, "BD78563412F4"); // MOV EBP, 0x12345678 / HLT
+        RunUntilHalt(m->cpu, mainCode);
+    }
+    if (native.cpu.regs_[REG_BP] != 0x12345678 || native.cpu.regs_[REG_BX] != 0x30)
+        throw std::runtime_error { std::format("Fault: Unexpected EBP={:08X} EBX={:08X}", native.cpu.regs_[REG_BP], native.cpu.regs_[REG_BX]) };
+    Compare("Fault", interpreted, native);
+}
+
+// Every 64 iterations the loop patches the immediate of an instruction in another block, which
+// has been compiled again by then
+static void TestSelfModifyingCode()
+{
+    constexpr std::uint32_t iterations = 1000;
+    constexpr std::uint32_t patchAddress = mainCode + 1; // Immediate of MOV EAX, imm32
+
+    std::uint64_t expected = 0;
+    for (std::uint32_t ecx = iterations, imm = 0;;) {
+        expected += imm;
+        if (!--ecx)
+            break;
+        if (!(ecx & 63))
+            imm = ecx;
+    }
+
+    JitTestMachine interpreted { false };
+    JitTestMachine native { true };
+    for (auto* m : { &interpreted, &native }) {
+        PokeHex(m->bus, mainCode,
+            "B800000000" // MOV EAX, 0
+            "01C2" // ADD EDX, EAX
+            "E9F4000000"); // JMP mainCode+0x100
+        PokeHex(m->bus, mainCode + 0x100, // In another write watch block
+            "49" // DEC ECX
+            "7417" // JZ mainCode+0x11A
+            "F7C13F000000" // TEST ECX, 0x3F
+            "0F85F1FEFFFF" // JNZ mainCode
+            "890D" + HexString(&patchAddress, 4) + // MOV [patchAddress], ECX
+            "E9E6FEFFFF" // JMP mainCode
+            "F4"); // HLT
+        m->cpu.regs_[REG_CX] = iterations;
+        m->cpu.regs_[REG_DX] = 0;
+        RunUntilHalt(m->cpu, mainCode);
+    }
+    if (native.cpu.regs_[REG_DX] != expected)
+        throw std::runtime_error { std::format("Self modifying code: Expected EDX={} got {}", expected, native.cpu.regs_[REG_DX]) };
+    if (native.cpu.decodeCacheStats().nativeBlocks < iterations / 64)
+        throw std::runtime_error { std::format("Self modifying code: Only {} blocks compiled", native.cpu.decodeCacheStats().nativeBlocks) };
+    Compare("Self modifying code", interpreted, native);
+}
+
+// Real mode code isn't compiled, the blocks are run as a loop over their micro-ops instead. The memory
+// access faults once SI+0xFFF reaches the segment limit.
+static void TestRealMode()
+{
+    JitTestMachine interpreted { false, true };
+    JitTestMachine looped { true, true };
+    for (auto* m : { &interpreted, &looped }) {
+        PokeHex(m->bus, mainCode,
+            "81C60001" // ADD SI, 0x100
+            "43" // INC BX
+            "8B84FF0F" // MOV AX, [SI+0xFFF]
+            "01C2" // ADD DX, AX
+            "50" // PUSH AX
+            "5F" // POP DI
+            "47" // INC DI
+            "EBF0"); // JMP mainCode
+        PokeHex(m->bus, faultHandler, "BD3412F4"); // MOV BP, 0x1234 / HLT
+        RunUntilHalt(m->cpu, 0);
+    }
+    const auto& stats = looped.cpu.decodeCacheStats();
+    if (looped.cpu.regs_[REG_BP] != 0x1234 || looped.cpu.regs_[REG_BX] != 0xF0)
+        throw std::runtime_error { std::format("Real mode: Unexpected BP={:04X} BX={:04X}", looped.cpu.regs_[REG_BP], looped.cpu.regs_[REG_BX]) };
+    if (stats.nativeInstructions || stats.blockInstructions < looped.cpu.instructionsExecuted() / 2)
+        throw std::runtime_error { std::format("Real mode: {} of {} instructions from blocks, {} native", stats.blockInstructions, looped.cpu.instructionsExecuted(), stats.nativeInstructions) };
+    Compare("Real mode", interpreted, looped, false);
+}
+
+int main()
+{
+    try {
+        JitTestMachine m { true };
+        if (!m.cpu.jitEnabled()) {
+            std::println("Native code generation not supported on this host");
+            return 0;
+        }
+        TestRandomCode();
+        TestFault();
+        TestSelfModifyingCode();
+        TestRealMode();
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <memory>
 #include <cstring>
+#include <string_view>
 #include "util.h"
 #include "gzstream.h"
 #include "cpu.h"
@@ -23,6 +24,7 @@
 //#include "devs/i8237a_dma_controller.h"
 
 static std::string mooTestDir = "../../../misc/SingleStepTests/";
+static bool jitMode; // --jit: History off and blocks enabled
 
 constexpr uint32_t MakeMooId(const char (&IdStr)[5])
 {
@@ -719,6 +721,11 @@ public:
         bus_.setAddressMask(memSize - 1);
         bus_.addMemHandler(0, memSize, *this);
         cpu_.exceptionTraceMask(0);
+        if (jitMode)
+            cpu_.jitEnabled(true);
+        else
+            cpu_.historyMode(CPU::HistoryMode::full);
+        cpu_.blockCacheMode(CPU::BlockCacheMode::always);
     }
 
     CPU& cpu()
@@ -977,7 +984,7 @@ private:
         case 12:
             return reinterpret_cast<uint16_t&>(cpu_.ip_);
         case MOO_RG16_FLAGS:
-            return reinterpret_cast<uint16_t&>(cpu_.flags_);
+            return reinterpret_cast<uint16_t&>(cpu_.flags());
         default:
             throw std::runtime_error { std::format("Invalid 16-bit register index {}", index) };
         }
@@ -1016,7 +1023,7 @@ private:
         case MOO_RG32_EIP:
             return reinterpret_cast<uint32_t&>(cpu_.ip_);
         case MOO_RG32_EFLAGS:
-            return cpu_.flags_;
+            return cpu_.flags();
         case MOO_RG32_DR6:
             return fakeDr6;
         case MOO_RG32_DR7:
@@ -1091,7 +1098,7 @@ static void TestMooFile(MooTestMachine& machine, const std::string& filename, ui
         } catch ([[maybe_unused]] const std::exception& e) {
             PrintTestInfo(test);
             machine.cpu().showHistory();
-            ShowCPUState(machine.cpu());
+            ShowCPUState(machine.cpu(), Logger::current());
             std::println("{:04X}:{:04X}", machine.cpu().sregs_[SREG_CS], machine.cpu().ip_);
             std::println("");
             if (test.flagsStackAddr)
@@ -1536,8 +1543,9 @@ static void TestMoo()
     RunTestsInDir(CPUModel::i8088, mooTestDir + "8088/", {}, commonIgnoredFlags);
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    jitMode = argc > 1 && std::string_view { argv[1] } == "--jit";
     try {
         TestMoo();
     } catch (const std::exception& e) {
@@ -0,0 +1,139 @@
+#include "test_machine.h"
+#include "cpu_exception.h"
+#include <chrono>
+#include <cstring>
+#include <print>
+
+// Physical memory layout of the guest
+constexpr std::uint32_t idtBase = 0x2000;
+constexpr std::uint32_t pageDirectory = 0x3000;
+constexpr std::uint32_t pageTable0 = 0x4000; // Identity maps the first megabyte
+constexpr std::uint32_t pageTable1 = 0x5000; // 0x400000-0x7FFFFF, populated on demand
+constexpr std::uint32_t faultCounter = 0x7000;
+constexpr std::uint32_t stackTop = 0x9000;
+constexpr std::uint32_t handlerCode = 0x8000;
+constexpr std::uint32_t mainCode = 0x10000;
+constexpr std::uint32_t demandFrame = 0x20000;
+constexpr std::uint32_t codeFrameA = 0x21000;
+constexpr std::uint32_t codeFrameB = 0x22000;
+
+class PagingTestMachine {
+public:
+    explicit PagingTestMachine()
+        : cpu { CPUModel::i80386sx, bus }
+        , ram { 1024 * 1024 }
+    {
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    RamHandler ram;
+
+    void poke32(std::uint32_t address, std::uint32_t value)
+    {
+        std::memcpy(&ram.data()[address], &value, sizeof(value));
+    }
+
+    std::uint32_t peek32(std::uint32_t address)
+    {
+        std::uint32_t value;
+        std::memcpy(&value, &ram.data()[address], sizeof(value));
+        return value;
+    }
+
+    // Identity maps the first megabyte, 0x400000-0x7FFFFF is left to the test
+    void enablePaging()
+    {
+        poke32(pageDirectory, pageTable0 | PT32_MASK_P | PT32_MASK_W);
+        poke32(pageDirectory + 4, pageTable1 | PT32_MASK_P | PT32_MASK_W);
+        for (std::uint32_t page = 0; page < 256; ++page)
+            poke32(pageTable0 + page * 4, page << 12 | PT32_MASK_P | PT32_MASK_W);
+        cpu.setCreg(3, pageDirectory);
+        cpu.setCreg(0, CR0_MASK_PE | CR0_MASK_PG);
+    }
+};
+
+// Touches a not-present page, has the #PF handler map it, then unmaps it again
+// and flushes the TLB. Every iteration takes exactly one page fault.
+static void RunDemandPagingLoop(std::uint32_t iterations)
+{
+    PagingTestMachine m;
+    auto& cpu = m.cpu;
+
+    EnterFlatProtectedMode(m.bus, cpu);
+    Poke64(m.bus, idtBase + 8 * CPUExceptionNumber::PageFault, InterruptGate(handlerCode));
+
+    PokeHex(m.bus, handlerCode,
+        "C70500500000" "03000200" // MOV DWORD [0x5000], 0x20003
+        "FF0500700000" // INC DWORD [0x7000]
+        "83C404" // ADD ESP, 4
+        "CF"); // IRETD
+    PokeHex(m.bus, mainCode,
+        "B9" + HexString(&iterations, 4) + // MOV ECX, iterations
+        "A300004000" // MOV [0x400000], EAX
+        "40" // INC EAX
+        "C70500500000" "00000000" // MOV DWORD [0x5000], 0
+        "0F20DB" // MOV EBX, CR3
+        "0F22DB" // MOV CR3, EBX
+        "49" // DEC ECX
+        "75E7" // JNZ 0x10005
+        "F4"); // HLT
+
+    cpu.idt_ = DescriptorTable { 8 * CPUExceptionNumber::PageFault + 7, idtBase };
+    m.enablePaging();
+    cpu.regs_[REG_SP] = stackTop;
+
+    const auto start = std::chrono::steady_clock::now();
+    RunUntilHalt(cpu, mainCode);
+    const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (m.peek32(faultCounter) != iterations)
+        throw std::runtime_error { std::format("Expected {} page faults got {}", iterations, m.peek32(faultCounter)) };
+    if (m.peek32(demandFrame) != iterations - 1)
+        throw std::runtime_error { std::format("Expected {:X} in demand paged frame got {:X}", iterations - 1, m.peek32(demandFrame)) };
+    if (cpu.cregs_[2] != 0x400000)
+        throw std::runtime_error { std::format("Unexpected CR2 value {:08X}", cpu.cregs_[2]) };
+
+    std::println("{} page faults in {:.1f} ms ({:.0f} faults/s, {:.2f} MIPS)", iterations, secs * 1000, iterations / secs, cpu.instructionsExecuted() / secs / 1e6);
+}
+
+// Code maps another frame at its own linear address and reloads CR3, the next instruction must be
+// fetched from the new frame (with and without the decode cache, i.e. through the fetch window)
+static void TestCodeRemap(bool decodeCache)
+{
+    PagingTestMachine m;
+    m.cpu.decodeCacheEnabled(decodeCache);
+    EnterFlatProtectedMode(m.bus, m.cpu);
+    m.enablePaging();
+    m.poke32(pageTable1, codeFrameA | PT32_MASK_P | PT32_MASK_W);
+
+    constexpr std::uint32_t jumpOffset = 0x400000 - (mainCode + 5);
+    PokeHex(m.bus, mainCode, "E9" + HexString(&jumpOffset, 4)); // JMP 0x400000
+    constexpr std::uint32_t frameBPte = codeFrameB | PT32_MASK_P | PT32_MASK_W;
+    PokeHex(m.bus, codeFrameA,
+        "C705" + HexString(&pageTable1, 4) + HexString(&frameBPte, 4) + // MOV DWORD [pageTable1], frameBPte
+        "0F20DB" // MOV EBX, CR3
+        "0F22DB" // MOV CR3, EBX
+        "B80A000000" // MOV EAX, 0xA
+        "F4"); // HLT
+    PokeHex(m.bus, codeFrameB + 16, "B80B000000F4"); // MOV EAX, 0xB / HLT
+
+    RunUntilHalt(m.cpu, mainCode);
+    if (m.cpu.regs_[REG_AX] != 0xB)
+        throw std::runtime_error { std::format("Code remap (decode cache {}): Old frame still used EAX={:X}", decodeCache, m.cpu.regs_[REG_AX]) };
+}
+
+int main(int argc, char* argv[])
+{
+    try {
+        TestCodeRemap(false);
+        TestCodeRemap(true);
+        RunDemandPagingLoop(argc > 1 ? std::stoi(argv[1]) : 100000);
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
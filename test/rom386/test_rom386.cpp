@@ -3,7 +3,9 @@
 #include "util.h"
 #include "fileio.h"
 #include "debugger.h"
+#include <chrono>
 #include <print>
+#include <string_view>
 
 static bool debugBreak;
 
@@ -55,7 +57,8 @@ public:
         case postPort:
             std::println("POST: 0x{:02X}", value);
             if (value == 0xff) {
-                std::println("Success!");
+                const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+                std::println("Success! {} instructions in {:.1f} ms ({:.2f} MIPS)", cpu.instructionsExecuted(), secs * 1000, cpu.instructionsExecuted() / secs / 1e6);
                 exit(0);
             }
             break;
@@ -87,13 +90,21 @@ private:
     RamHandler gfxMem_;
     RomHandler rom_;
     std::string debugBuffer_;
+    const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
 };
 
-int main()
+// With --jit the history is off so blocks can run (and be compiled to native code where supported)
+int main(int argc, char* argv[])
 {
+    const bool jit = argc > 1 && std::string_view { argv[1] } == "--jit";
     try {
         Test386Machine machine {};
         auto& cpu = machine.cpu;
+        if (jit)
+            cpu.jitEnabled(true);
+        else
+            cpu.historyMode(CPU::HistoryMode::full);
+        cpu.blockCacheMode(CPU::BlockCacheMode::always);
         Debugger dbg { cpu, machine.bus };
         if (!IsStdioInteractive()) {
             dbg.setOnActive([](bool active) {
@@ -0,0 +1,213 @@
+#include "test_machine.h"
+#include "snapshot.h"
+#include "devs/i8253_pit.h"
+#include <filesystem>
+#include <print>
+
+// Physical memory layout of the guest (real mode)
+constexpr std::uint32_t codeSegment = 0x1000;
+constexpr std::uint32_t dataSegment = 0x2000;
+constexpr std::uint16_t irqHandler = 0x0100; // In the code segment
+
+constexpr std::uint64_t stepsPerRun = 20000;
+
+// CPU, RAM and a PIT whose channel 0 interrupts the CPU. The guest reads the counter and stores
+// the values, so what it writes depends on the timing of the PIT events.
+class SnapshotTestMachine {
+public:
+    explicit SnapshotTestMachine()
+        : cpu { CPUModel::i80386sx, bus }
+        , ram { 1024 * 1024 }
+        , pit { bus, [this]() {
+            irqTimes.push_back(bus.time());
+            irqPending = true;
+            cpu.setInterruptPending(true);
+        } }
+    {
+        bus.log().setSink({});
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+        cpu.setInterruptFunction([this]() {
+            irqPending = false;
+            cpu.setInterruptPending(false);
+            return 8; // IRQ0
+        });
+
+        PokeHex(bus, 8 * 4, "0001" "0010"); // IVT entry: 1000:0100
+        PokeHex(bus, (codeSegment << 4) + irqHandler,
+            "FF060000" // INC WORD [0]
+            "CF"); // IRET
+        PokeHex(bus, codeSegment << 4,
+            "FB" // STI
+            "B034" // MOV AL, 0x34
+            "E643" // OUT 0x43, AL (channel 0, lobyte/hibyte, rate generator)
+            "B0E8" // MOV AL, 0xE8
+            "E640" // OUT 0x40, AL
+            "B003" // MOV AL, 0x03
+            "E640" // OUT 0x40, AL (count 1000)
+            "30C0" // XOR AL, AL
+            "E643" // OUT 0x43, AL (latch channel 0)
+            "E440" // IN AL, 0x40
+            "88C4" // MOV AH, AL
+            "E440" // IN AL, 0x40
+            "AB" // STOSW
+            "0107" // ADD [BX], AX
+            "43" // INC BX
+            "EBF0"); // JMP 13
+        cpu.loadSreg(SREG_CS, codeSegment);
+        for (const auto sr : { SREG_DS, SREG_ES, SREG_SS })
+            cpu.loadSreg(sr, dataSegment);
+        cpu.regs_[REG_SP] = 0xFFFE;
+        cpu.ip_ = 0;
+        cpu.prefetch_.flush(cpu.ip_);
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    SharedRamHandler ram;
+    i8253_PIT pit;
+    bool irqPending = false;
+    std::vector<std::uint64_t> irqTimes;
+
+    void run()
+    {
+        for (std::uint64_t i = 0; i < stepsPerRun; ++i)
+            cpu.step();
+    }
+
+    void saveState(SnapshotWriter& writer) const
+    {
+        bus.saveState(writer);
+        cpu.saveState(writer);
+        pit.saveState(writer);
+        writer.section("irq");
+        writer.write(irqPending);
+        writer.section("ram");
+        writer.write(ram.pages());
+    }
+
+    void loadState(SnapshotReader& reader)
+    {
+        bus.loadState(reader);
+        cpu.loadState(reader);
+        pit.loadState(reader);
+        reader.section("irq");
+        reader.read(irqPending);
+        cpu.setInterruptPending(irqPending);
+        reader.section("ram");
+        reader.readFixed(ram.pages());
+        bus.remapMemory();
+    }
+
+    std::vector<char> state() const
+    {
+        SnapshotWriter writer;
+        saveState(writer);
+        return writer.data();
+    }
+};
+
+// What a run ends with
+struct RunResult {
+    std::uint64_t regs[8];
+    std::uint64_t ip;
+    std::uint32_t flags;
+    std::uint64_t time;
+    std::vector<std::uint64_t> irqTimes;
+    std::vector<std::uint8_t> ram;
+    std::vector<char> state; // Everything else (e.g. scheduled events and device registers)
+};
+
+static RunResult Capture(SnapshotTestMachine& m)
+{
+    RunResult res {};
+    std::copy(m.cpu.regs_, m.cpu.regs_ + 8, res.regs);
+    res.ip = m.cpu.ip_;
+    res.flags = m.cpu.flags();
+    res.time = m.bus.time();
+    res.irqTimes = m.irqTimes;
+    res.ram.resize(m.ram.size());
+    m.ram.pages().read(0, res.ram.data(), res.ram.size());
+    res.state = m.state();
+    return res;
+}
+
+static void Compare(const std::string& name, const RunResult& expected, const RunResult& actual)
+{
+    for (int reg = 0; reg < 8; ++reg) {
+        if (expected.regs[reg] != actual.regs[reg])
+            throw std::runtime_error { std::format("{}: Register {} differs, expected {:08X} got {:08X}", name, reg, expected.regs[reg], actual.regs[reg]) };
+    }
+    if (expected.ip != actual.ip || expected.flags != actual.flags)
+        throw std::runtime_error { std::format("{}: IP/flags differ, expected {:04X} {} got {:04X} {}", name, expected.ip, FormatCPUFlags(expected.flags), actual.ip, FormatCPUFlags(actual.flags)) };
+    if (expected.time != actual.time)
+        throw std::runtime_error { std::format("{}: Bus time differs, expected {} got {}", name, expected.time, actual.time) };
+    if (expected.irqTimes != actual.irqTimes)
+        throw std::runtime_error { std::format("{}: PIT events differ, expected {} got {}", name, expected.irqTimes.size(), actual.irqTimes.size()) };
+    if (expected.ram != actual.ram)
+        throw std::runtime_error { std::format("{}: RAM differs", name) };
+    if (expected.state != actual.state)
+        throw std::runtime_error { std::format("{}: Machine state differs", name) };
+}
+
+// Save, run, restore and run again, the second run must end up in exactly the same state
+static void TestRoundTrip()
+{
+    SnapshotTestMachine m;
+    m.run(); // Get the PIT going
+    SnapshotWriter writer;
+    m.saveState(writer);
+    const auto before = m.state();
+
+    m.irqTimes.clear();
+    m.run();
+    const auto expected = Capture(m);
+    if (expected.irqTimes.empty())
+        throw std::runtime_error { "Round trip: No PIT interrupts" };
+    if (expected.state == before)
+        throw std::runtime_error { "Round trip: The machine state didn't change" };
+
+    SnapshotReader reader { writer.data() };
+    m.loadState(reader);
+    if (m.state() != before)
+        throw std::runtime_error { "Round trip: Restored state differs" };
+    m.irqTimes.clear();
+    m.run();
+    Compare("Round trip", expected, Capture(m));
+}
+
+// Through a file into a new machine
+static void TestFile()
+{
+    const auto filename = (std::filesystem::temp_directory_path() / "xemu_test_snapshot.gz").string();
+
+    SnapshotTestMachine m;
+    m.run();
+    {
+        SnapshotWriter writer { filename };
+        m.saveState(writer);
+    }
+    m.irqTimes.clear();
+    m.run();
+
+    SnapshotTestMachine restored;
+    {
+        SnapshotReader reader { filename };
+        restored.loadState(reader);
+    }
+    std::filesystem::remove(filename);
+    restored.run();
+    Compare("File", Capture(m), Capture(restored));
+}
+
+int main()
+{
+    try {
+        TestRoundTrip();
+        TestFile();
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
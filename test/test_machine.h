@@ -0,0 +1,63 @@
+#ifndef TEST_MACHINE_H
+#define TEST_MACHINE_H
+
+// Helpers for the tests that run small hand assembled programs on a CPU with only RAM attached
+
+#include "cpu.h"
+#include "system_bus.h"
+#include "util.h"
+#include <cstdint>
+#include <string>
+
+// The GDT set up by EnterFlatProtectedMode, selector 0x08 is code and 0x10 is data (both flat 4GB).
+// Entries from 0x18 are free for the tests to use.
+constexpr std::uint32_t gdtBase = 0x1000;
+constexpr std::uint64_t code32Desc = 0x00CF9A000000FFFF;
+constexpr std::uint64_t data32Desc = 0x00CF92000000FFFF;
+
+// Writes go through the bus so they work with any RAM handler and are seen by the write observers
+inline void Poke64(SystemBus& bus, std::uint32_t address, std::uint64_t value)
+{
+    bus.writeBlock(address, &value, sizeof(value));
+}
+
+inline void PokeHex(SystemBus& bus, std::uint32_t address, const std::string& hex)
+{
+    const auto bytes = HexDecode(hex);
+    bus.writeBlock(address, bytes.data(), bytes.size());
+}
+
+// 32-bit interrupt gate (DPL 0) to offset in the flat code segment
+constexpr std::uint64_t InterruptGate(std::uint32_t offset)
+{
+    return (offset & 0xffff) | 0x08 << 16 | 0x8EULL << 40 | static_cast<std::uint64_t>(offset >> 16) << 48;
+}
+
+// Switches directly to 32-bit protected mode with CS=0x08 and DS/ES/SS=0x10
+inline void EnterFlatProtectedMode(SystemBus& bus, CPU& cpu)
+{
+    Poke64(bus, gdtBase + 0x08, code32Desc);
+    Poke64(bus, gdtBase + 0x10, data32Desc);
+    cpu.gdt_ = DescriptorTable { 0x17, gdtBase };
+    cpu.setCreg(0, CR0_MASK_PE);
+    cpu.sregs_[SREG_CS] = 0x08;
+    cpu.sdesc_[SREG_CS] = SegmentDescriptor::fromU64(code32Desc);
+    for (const auto sr : { SREG_DS, SREG_ES, SREG_SS }) {
+        cpu.sregs_[sr] = 0x10;
+        cpu.sdesc_[sr] = SegmentDescriptor::fromU64(data32Desc);
+    }
+}
+
+// Runs from address (in the current code segment) until HLT
+inline void RunUntilHalt(CPU& cpu, std::uint32_t address)
+{
+    cpu.ip_ = address;
+    cpu.prefetch_.flush(cpu.ip_);
+    try {
+        for (;;)
+            cpu.step();
+    } catch (const CPUHaltedException&) {
+    }
+}
+
+#endif
@@ -0,0 +1,681 @@
+#include "cpu.h"
+#include "decode.h"
+#include "log.h"
+#include "system_bus.h"
+#include "util.h"
+#include "devs/i8253_pit.h"
+#include "devs/vga.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <print>
+#include <string>
+#include <vector>
+
+// Keeps the compiler from discarding results that are otherwise unused
+static volatile std::uint64_t benchSink;
+
+class BenchRunner {
+public:
+    // batch runs a fixed amount of work and returns the number of units (instructions, accesses, ...) it did
+    using BatchFunc = std::function<std::uint64_t ()>;
+
+    explicit BenchRunner(double minSeconds, const std::vector<std::string>& filters)
+        : minSeconds_ { minSeconds }
+        , filters_ { filters }
+    {
+    }
+
+    bool selected(std::string_view name) const
+    {
+        if (filters_.empty())
+            return true;
+        for (const auto& f : filters_) {
+            if (name.find(f) != std::string_view::npos)
+                return true;
+        }
+        return false;
+    }
+
+    void run(const std::string& name, const char* unit, const BatchFunc& batch)
+    {
+        if (!selected(name))
+            return;
+        // A batch that does nothing would make the result meaningless (or loop forever)
+        auto checkedBatch = [&]() {
+            const auto units = batch();
+            if (!units)
+                throw std::runtime_error { std::format("{}: A batch did no work", name) };
+            return units;
+        };
+        checkedBatch(); // Warm up (decode/block caches, TLB, first time allocations)
+        std::uint64_t count = 0, batches = 0;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            count += checkedBatch();
+            ++batches;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < minSeconds_);
+        results_.push_back(Result { name, unit, count, batches, elapsed.count() });
+    }
+
+    std::string json() const
+    {
+        std::string res = std::format("{{\n  \"min_seconds\": {},\n  \"benchmarks\": [", minSeconds_);
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const auto& r = results_[i];
+            res += i ? ",\n" : "\n";
+            res += std::format("    {{\"name\": {}, \"unit\": {}, \"count\": {}, \"batches\": {}, \"seconds\": {:.6f}, \"per_second\": {:.1f}}}",
+                JsonString(r.name), JsonString(r.unit), r.count, r.batches, r.seconds, r.count / r.seconds);
+        }
+        res += "\n  ]\n}\n";
+        return res;
+    }
+
+private:
+    struct Result {
+        std::string name;
+        const char* unit;
+        std::uint64_t count;
+        std::uint64_t batches;
+        double seconds;
+    };
+    double minSeconds_;
+    std::vector<std::string> filters_;
+    std::vector<Result> results_;
+};
+
+/////////////////////////////////////////////////////////////
+// Decoder
+/////////////////////////////////////////////////////////////
+
+static const char* const decodeMix16[] = {
+    "01D8", // ADD AX, BX
+    "8B4604", // MOV AX, [BP+4]
+    "89873412", // MOV [BX+0x1234], AX
+    "B83412", // MOV AX, 0x1234
+    "E8FDFF", // CALL $
+    "7405", // JZ +5
+    "50", // PUSH AX
+    "5B", // POP BX
+    "F3A4", // REP MOVSB
+    "26803E341200", // CMP BYTE [ES:0x1234], 0
+    "C3", // RET
+    "CD21", // INT 0x21
+    "D1E0", // SHL AX, 1
+    "F7E3", // MUL BX
+    "E420", // IN AL, 0x20
+    "EB00", // JMP +0
+    "8CD8", // MOV AX, DS
+    "C7060000FFFF", // MOV WORD [0], 0xFFFF
+};
+
+static const char* const decodeMix32[] = {
+    "01D8", // ADD EAX, EBX
+    "8B4504", // MOV EAX, [EBP+4]
+    "8B048D00100000", // MOV EAX, [ECX*4+0x1000]
+    "B878563412", // MOV EAX, 0x12345678
+    "E800000000", // CALL +0
+    "0F8400000000", // JZ +0
+    "50", // PUSH EAX
+    "5B", // POP EBX
+    "F3A5", // REP MOVSD
+    "0FB6C0", // MOVZX EAX, AL
+    "0FAFC3", // IMUL EAX, EBX
+    "8D440802", // LEA EAX, [EAX+ECX+2]
+    "C3", // RET
+    "0F20C0", // MOV EAX, CR0
+    "C70500100000FFFFFFFF", // MOV DWORD [0x1000], 0xFFFFFFFF
+    "66B83412", // MOV AX, 0x1234
+};
+
+template <size_t N>
+static std::vector<std::uint8_t> MakeCode(const char* const (&mix)[N], size_t minSize)
+{
+    std::vector<std::uint8_t> code;
+    while (code.size() < minSize) {
+        for (const auto hex : mix) {
+            const auto bytes = HexDecode(hex);
+            code.insert(code.end(), bytes.begin(), bytes.end());
+        }
+    }
+    return code;
+}
+
+static void BenchDecode(BenchRunner& runner)
+{
+    // Only whole copies of the mix, so decoding never runs past the end
+    const auto code16 = MakeCode(decodeMix16, 64 * 1024);
+    const auto code32 = MakeCode(decodeMix32, 64 * 1024);
+
+    for (const auto& [modelName, model] : CPUModelNames) {
+        if (!CPUModelSupported(model))
+            continue;
+        for (const std::uint8_t opSize : { 2, 4 }) {
+            if (opSize == 4 && model < CPUModel::i80386sx)
+                continue;
+            const CPUInfo cpuInfo { model, opSize };
+            const auto& code = opSize == 2 ? code16 : code32;
+            runner.run(std::format("decode/{}/{}", modelName, opSize * 8), "instructions", [&]() {
+                std::uint64_t count = 0;
+                for (size_t offset = 0; offset < code.size(); ++count)
+                    offset += Decode(cpuInfo, std::span { code }.subspan(offset)).numInstructionBytes;
+                return count;
+            });
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// CPU
+/////////////////////////////////////////////////////////////
+
+// Physical memory layout of the guest
+constexpr std::uint32_t gdtBase = 0x1000;
+constexpr std::uint32_t pageDirectory = 0x3000;
+constexpr std::uint32_t pageTable0 = 0x4000; // Identity maps the first megabyte
+constexpr std::uint32_t pageTable1 = 0x5000; // 0x400000-0x7FFFFF, aliases 64 frames from pageFrames
+constexpr std::uint32_t mainCode = 0x10000;
+constexpr std::uint32_t dataSegment = 0x20000; // Real mode DS/ES
+constexpr std::uint32_t pageFrames = 0x40000;
+
+constexpr std::uint64_t code32Desc = 0x00CF9A000000FFFF;
+constexpr std::uint64_t data32Desc = 0x00CF92000000FFFF;
+
+constexpr std::uint64_t stepsPerBatch = 10000;
+
+class BenchMachine {
+public:
+    explicit BenchMachine(CPUModel model)
+        : cpu { model, bus }
+        , ram { 1024 * 1024 }
+    {
+        bus.log().setSink({});
+        bus.addMemHandler(0, ram.size(), ram);
+        cpu.exceptionTraceMask(0);
+    }
+
+    SystemBus bus;
+    CPU cpu;
+    RamHandler ram;
+
+    void poke32(std::uint32_t address, std::uint32_t value)
+    {
+        std::memcpy(&ram.data()[address], &value, sizeof(value));
+    }
+
+    void poke64(std::uint32_t address, std::uint64_t value)
+    {
+        std::memcpy(&ram.data()[address], &value, sizeof(value));
+    }
+
+    void pokeCode(std::uint32_t address, const std::string& hex)
+    {
+        const auto bytes = HexDecode(hex);
+        std::memcpy(&ram.data()[address], bytes.data(), bytes.size());
+    }
+
+    void enterRealMode(const std::string& code)
+    {
+        pokeCode(mainCode, code);
+        cpu.loadSreg(SREG_CS, mainCode >> 4);
+        for (const auto sr : { SREG_DS, SREG_ES, SREG_SS })
+            cpu.loadSreg(sr, dataSegment >> 4);
+        cpu.ip_ = 0;
+        cpu.prefetch_.flush(cpu.ip_);
+    }
+
+    // Flat 32-bit segments, with paging the first megabyte is identity mapped
+    void enterProtectedMode(const std::string& code, bool paging)
+    {
+        pokeCode(mainCode, code);
+        poke64(gdtBase + 0x08, code32Desc);
+        poke64(gdtBase + 0x10, data32Desc);
+
+        std::uint32_t cr0 = CR0_MASK_PE;
+        if (paging) {
+            poke32(pageDirectory, pageTable0 | PT32_MASK_P | PT32_MASK_W);
+            poke32(pageDirectory + 4, pageTable1 | PT32_MASK_P | PT32_MASK_W);
+            for (std::uint32_t page = 0; page < 256; ++page)
+                poke32(pageTable0 + page * 4, page << 12 | PT32_MASK_P | PT32_MASK_W);
+            for (std::uint32_t page = 0; page < 1024; ++page)
+                poke32(pageTable1 + page * 4, (pageFrames + (page & 63) * 0x1000) | PT32_MASK_P | PT32_MASK_W);
+            cpu.setCreg(3, pageDirectory);
+            cr0 |= CR0_MASK_PG;
+        }
+
+        cpu.gdt_ = DescriptorTable { 0x17, gdtBase };
+        cpu.setCreg(0, cr0);
+        cpu.sregs_[SREG_CS] = 0x08;
+        cpu.sdesc_[SREG_CS] = SegmentDescriptor::fromU64(code32Desc);
+        for (const auto sr : { SREG_DS, SREG_ES, SREG_SS }) {
+            cpu.sregs_[sr] = 0x10;
+            cpu.sdesc_[sr] = SegmentDescriptor::fromU64(data32Desc);
+        }
+        cpu.ip_ = mainCode;
+        cpu.prefetch_.flush(cpu.ip_);
+    }
+
+    std::uint64_t run(std::uint64_t steps)
+    {
+        const auto start = cpu.instructionsExecuted();
+        for (std::uint64_t i = 0; i < steps; ++i)
+            cpu.step();
+        return cpu.instructionsExecuted() - start;
+    }
+};
+
+// Endless loops, the encodings are the same for 16- and 32-bit code unless noted
+static const std::string aluLoop =
+    "01D8" // ADD AX, BX
+    "31CA" // XOR DX, CX
+    "D1E0" // SHL AX, 1
+    "43" // INC BX
+    "EBF7"; // JMP 0
+
+static const std::string memLoop16 =
+    "8B04" // MOV AX, [SI]
+    "894402" // MOV [SI+2], AX
+    "0104" // ADD [SI], AX
+    "46" // INC SI
+    "81E6FF07" // AND SI, 0x7FF
+    "EBF2"; // JMP 0
+
+static const std::string memLoop32 =
+    "8B06" // MOV EAX, [ESI]
+    "894604" // MOV [ESI+4], EAX
+    "0106" // ADD [ESI], EAX
+    "46" // INC ESI
+    "81E6FF070000" // AND ESI, 0x7FF
+    "EBF0"; // JMP 0
+
+static const std::string stringLoop16 =
+    "BE0000" // MOV SI, 0
+    "BF0080" // MOV DI, 0x8000
+    "B90001" // MOV CX, 0x100
+    "F3A5" // REP MOVSW
+    "EBF3"; // JMP 0
+
+static const std::string stringLoop32 =
+    "BE00000200" // MOV ESI, 0x20000
+    "BF00000300" // MOV EDI, 0x30000
+    "B900040000" // MOV ECX, 0x400
+    "F3A5" // REP MOVSD
+    "EBED"; // JMP 0
+
+// Only instructions the block compiler translates (32-bit code)
+static const std::string branchLoop32 =
+    "B910000000" // MOV ECX, 16
+    "01D8" // ADD EAX, EBX
+    "31CA" // XOR EDX, ECX
+    "83EE03" // SUB ESI, 3
+    "39F0" // CMP EAX, ESI
+    "49" // DEC ECX
+    "75F4" // JNZ 5
+    "EBED"; // JMP 0
+
+// Reads one dword from each page of 0x400000 + (EBX & pageMask)
+static std::string TlbLoop(std::uint32_t pageMask, bool reloadCr3)
+{
+    return std::string { reloadCr3 ? "0F20D9" "0F22D9" : "" } + // MOV ECX, CR3 / MOV CR3, ECX
+        "8B03" // MOV EAX, [EBX]
+        "81C300100000" // ADD EBX, 0x1000
+        "81E3" + HexString(&pageMask, 4) + // AND EBX, pageMask
+        "81CB00004000" // OR EBX, 0x400000
+        + (reloadCr3 ? "EBE4" : "EBEA"); // JMP 0
+}
+
+static void BenchCPU(BenchRunner& runner)
+{
+    static constexpr CPUModel models[] = { CPUModel::i8088, CPUModel::i80386sx };
+    const std::pair<const char*, const std::string*> realLoops[] = {
+        { "alu", &aluLoop },
+        { "mem", &memLoop16 },
+        { "string", &stringLoop16 },
+    };
+    const std::pair<const char*, const std::string*> protectedLoops[] = {
+        { "alu", &aluLoop },
+        { "mem", &memLoop32 },
+        { "string", &stringLoop32 },
+        { "branch", &branchLoop32 },
+    };
+
+    // Real mode code isn't compiled, with the JIT enabled its blocks run as a loop over their micro-ops
+    for (const auto model : models) {
+        for (const bool jit : { false, true }) {
+            if (jit && model < CPUModel::i80386sx)
+                continue; // No block cache
+            for (const auto& [loopName, code] : realLoops) {
+                const auto name = std::format("step/real/{}/{}{}", loopName, CPUModelName(model), jit ? "/jit" : "");
+                if (!runner.selected(name))
+                    continue;
+                BenchMachine m { model };
+                m.cpu.jitEnabled(jit);
+                m.enterRealMode(*code);
+                runner.run(name, "instructions", [&]() { return m.run(stepsPerBatch); });
+            }
+        }
+    }
+
+    // With the JIT one step runs a whole block, the count is still in instructions
+    for (const bool jit : { false, true }) {
+        for (const bool paging : { false, true }) {
+            for (const auto& [loopName, code] : protectedLoops) {
+                const auto name = std::format("step/{}/{}/80386sx{}", paging ? "paged" : "protected", loopName, jit ? "/jit" : "");
+                if (!runner.selected(name))
+                    continue;
+                BenchMachine m { CPUModel::i80386sx };
+                m.cpu.jitEnabled(jit);
+                if (jit && !m.cpu.jitEnabled())
+                    continue; // Not supported on this host
+                m.enterProtectedMode(*code, paging);
+                runner.run(name, "instructions", [&]() { return m.run(stepsPerBatch); });
+            }
+        }
+    }
+
+    // Page lookups: 16 pages stay in the fast TLB, 1024 pages miss it on every access,
+    // and reloading CR3 before each access forces a page table walk
+    const struct {
+        const char* name;
+        std::uint32_t pageMask;
+        bool reloadCr3;
+    } tlbBenches[] = {
+        { "tlb/hit", 0x0000F000, false },
+        { "tlb/miss", 0x003FF000, false },
+        { "tlb/flush", 0x0000F000, true },
+    };
+    for (const auto& b : tlbBenches) {
+        if (!runner.selected(b.name))
+            continue;
+        BenchMachine m { CPUModel::i80386sx };
+        m.enterProtectedMode(TlbLoop(b.pageMask, b.reloadCr3), true);
+        m.cpu.regs_[REG_BX] = 0x400000;
+        runner.run(b.name, "instructions", [&]() { return m.run(stepsPerBatch); });
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// SystemBus
+/////////////////////////////////////////////////////////////
+
+// Memory mapped device registers (not backed by host memory, so every access goes through the handler)
+class RegisterMemHandler : public MemoryHandler {
+public:
+    std::uint8_t readU8(std::uint64_t, std::uint64_t offset) override
+    {
+        return regs_[offset & (sizeof(regs_) - 1)];
+    }
+
+    void writeU8(std::uint64_t, std::uint64_t offset, std::uint8_t value) override
+    {
+        regs_[offset & (sizeof(regs_) - 1)] = value;
+    }
+
+private:
+    std::uint8_t regs_[SystemBus::MemPageSize] {};
+};
+
+class LatchIOHandler : public IOHandler {
+public:
+    std::uint8_t inU8(std::uint16_t, std::uint16_t) override
+    {
+        return value_;
+    }
+
+    void outU8(std::uint16_t, std::uint16_t, std::uint8_t value) override
+    {
+        value_ = value;
+    }
+
+private:
+    std::uint8_t value_ = 0;
+};
+
+// Reschedules itself every period system clock cycles
+class PeriodicEvent {
+public:
+    explicit PeriodicEvent(SystemBus& bus, std::uint64_t period)
+        : bus_ { bus }
+        , period_ { period }
+        , event_ { [this]() { fired(); }, "bench" }
+    {
+        bus_.scheduleEvent(event_, bus_.time() + period_);
+    }
+
+    std::uint64_t count() const
+    {
+        return count_;
+    }
+
+private:
+    SystemBus& bus_;
+    std::uint64_t period_;
+    ScheduledEvent event_;
+    std::uint64_t count_ = 0;
+
+    void fired()
+    {
+        ++count_;
+        bus_.scheduleEvent(event_, event_.time() + period_);
+    }
+};
+
+static void BenchBus(BenchRunner& runner)
+{
+    constexpr std::uint32_t accessesPerBatch = 64 * 1024;
+    constexpr std::uint64_t deviceBase = 0xC0000;
+
+    SystemBus bus;
+    bus.log().setSink({});
+    RamHandler ram { 1024 * 1024 };
+    RegisterMemHandler device;
+    LatchIOHandler port;
+    bus.addMemHandler(0, ram.size(), ram);
+    bus.addMemHandler(deviceBase, SystemBus::MemPageSize, device);
+    bus.addIOHandler(0x80, 1, port);
+
+    runner.run("bus/ram/read8", "accesses", [&]() {
+        std::uint32_t sum = 0;
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            sum += bus.readU8(i * 17 & 0xFFFFF);
+        benchSink = sum;
+        return accessesPerBatch;
+    });
+    runner.run("bus/ram/read32", "accesses", [&]() {
+        std::uint32_t sum = 0;
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            sum += bus.readU32(i * 4 & 0xFFFFF);
+        benchSink = sum;
+        return accessesPerBatch;
+    });
+    runner.run("bus/ram/write32", "accesses", [&]() {
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            bus.writeU32(i * 4 & 0xFFFFF, i);
+        return accessesPerBatch;
+    });
+    runner.run("bus/handler/read8", "accesses", [&]() {
+        std::uint32_t sum = 0;
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            sum += bus.readU8(deviceBase + (i & (SystemBus::MemPageSize - 1)));
+        benchSink = sum;
+        return accessesPerBatch;
+    });
+    runner.run("bus/handler/write32", "accesses", [&]() {
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            bus.writeU32(deviceBase + (i * 4 & (SystemBus::MemPageSize - 1)), i);
+        return accessesPerBatch;
+    });
+    runner.run("bus/io/out8", "accesses", [&]() {
+        for (std::uint32_t i = 0; i < accessesPerBatch; ++i)
+            bus.ioOutput(0x80, i, 1);
+        return accessesPerBatch;
+    });
+
+    if (runner.selected("bus/events")) {
+        SystemBus eventBus;
+        std::vector<std::unique_ptr<PeriodicEvent>> events;
+        for (std::uint64_t period : { 7, 11, 13, 64, 100, 1000, 12345, 100000 })
+            events.push_back(std::make_unique<PeriodicEvent>(eventBus, period));
+        runner.run("bus/events", "events", [&]() {
+            std::uint64_t before = 0, after = 0;
+            for (const auto& e : events)
+                before += e->count();
+            for (std::uint32_t i = 0; i < accessesPerBatch; ++i) {
+                eventBus.addCycles(1);
+                eventBus.sync();
+            }
+            for (const auto& e : events)
+                after += e->count();
+            return after - before;
+        });
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// Devices
+/////////////////////////////////////////////////////////////
+
+struct VGAModeRegs {
+    std::uint8_t misc;
+    std::uint8_t seq[5];
+    std::uint8_t crtc[25];
+    std::uint8_t gc[9];
+    std::uint8_t attr[20];
+};
+
+// EGA BIOS parameters for the enhanced color display (640x350)
+constexpr VGAModeRegs egaMode03 = {
+    0xA7,
+    { 0x03, 0x01, 0x03, 0x00, 0x02 },
+    { 0x5B, 0x4F, 0x53, 0x37, 0x51, 0x5B, 0x6C, 0x1F, 0x00, 0x0D, 0x0B, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x5E, 0x2B, 0x5D, 0x28, 0x0F, 0x5E, 0x0A, 0xA3, 0xFF },
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0E, 0x00, 0xFF },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x08, 0x00, 0x0F, 0x00 },
+};
+
+constexpr VGAModeRegs egaMode10 = {
+    0xA7,
+    { 0x03, 0x01, 0x0F, 0x00, 0x06 },
+    { 0x5B, 0x4F, 0x53, 0x37, 0x52, 0x00, 0x6C, 0x1F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5E, 0x2B, 0x5D, 0x28, 0x0F, 0x5F, 0x0A, 0xE3, 0xFF },
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x0F, 0xFF },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x01, 0x00, 0x0F, 0x00 },
+};
+
+static void SetVGAMode(SystemBus& bus, const VGAModeRegs& regs)
+{
+    bus.ioOutput(0x3C2, regs.misc, 1);
+    for (std::uint8_t i = 0; i < std::size(regs.seq); ++i) {
+        bus.ioOutput(0x3C4, i, 1);
+        bus.ioOutput(0x3C5, regs.seq[i], 1);
+    }
+    for (std::uint8_t i = 0; i < std::size(regs.crtc); ++i) {
+        bus.ioOutput(0x3D4, i, 1);
+        bus.ioOutput(0x3D5, regs.crtc[i], 1);
+    }
+    for (std::uint8_t i = 0; i < std::size(regs.gc); ++i) {
+        bus.ioOutput(0x3CE, i, 1);
+        bus.ioOutput(0x3CF, regs.gc[i], 1);
+    }
+    bus.ioInput(0x3DA, 1); // Reset the attribute controller address/data flip flop
+    for (std::uint8_t i = 0; i < std::size(regs.attr); ++i) {
+        bus.ioOutput(0x3C0, i, 1);
+        bus.ioOutput(0x3C0, regs.attr[i], 1);
+    }
+    bus.ioOutput(0x3C0, 0x20, 1); // Palette address source (enable display)
+}
+
+static void BenchVGA(BenchRunner& runner)
+{
+    constexpr std::uint64_t framesPerBatch = 10;
+
+    const std::pair<const char*, const VGAModeRegs*> modes[] = {
+        { "vga/text", &egaMode03 },
+        { "vga/graphics", &egaMode10 },
+    };
+    for (const auto& [name, regs] : modes) {
+        if (!runner.selected(name))
+            continue;
+        SystemBus bus;
+        bus.log().setSink({});
+        VGA vga { bus };
+        std::uint64_t pixels = 0;
+        vga.setDrawFunction([&](const uint32_t*, int w, int h) {
+            pixels += w * h;
+        });
+        SetVGAMode(bus, *regs);
+        runner.run(name, "frames", [&]() {
+            for (std::uint64_t i = 0; i < framesPerBatch; ++i)
+                vga.forceRedraw();
+            return framesPerBatch;
+        });
+        if (!pixels)
+            throw std::runtime_error { std::format("{}: Nothing was rendered", name) };
+    }
+}
+
+static void BenchPIT(BenchRunner& runner)
+{
+    constexpr std::uint32_t reloadsPerBatch = 10000;
+
+    if (!runner.selected("pit/reprogram"))
+        return;
+
+    SystemBus bus;
+    bus.log().setSink({});
+    std::uint64_t irqs = 0;
+    i8253_PIT pit { bus, [&]() { ++irqs; } };
+    runner.run("pit/reprogram", "reloads", [&]() {
+        for (std::uint32_t i = 0; i < reloadsPerBatch; ++i) {
+            const auto count = static_cast<std::uint16_t>(2 + (i & 63));
+            bus.ioOutput(0x43, 0x34, 1); // Channel 0, lobyte/hibyte, rate generator
+            bus.ioOutput(0x40, count & 0xff, 1);
+            bus.ioOutput(0x40, count >> 8, 1);
+            bus.addCycles(16);
+            bus.sync();
+        }
+        return reloadsPerBatch;
+    });
+    benchSink = irqs;
+}
+
+static constexpr const char* const usage = R"(Usage: xemu_bench [--min-time SECONDS] [NAME-FILTER...]
+Runs the microbenchmarks whose name contains one of the filters (all by default)
+for at least SECONDS each (default 0.5) and prints the results as JSON.)";
+
+int main(int argc, char* argv[])
+{
+    // Devices without a bus handle log through the thread's logger
+    Logger silent;
+    silent.setSink({});
+    Logger::Scope logScope { silent };
+
+    double minSeconds = 0.5;
+    std::vector<std::string> filters;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc) {
+            minSeconds = std::stod(argv[++i]);
+        } else if (arg.starts_with("-")) {
+            std::println("{}", usage);
+            return 2;
+        } else {
+            filters.emplace_back(arg);
+        }
+    }
+
+    try {
+        BenchRunner runner { minSeconds, filters };
+        BenchDecode(runner);
+        BenchCPU(runner);
+        BenchBus(runner);
+        BenchVGA(runner);
+        BenchPIT(runner);
+        std::print("{}", runner.json());
+    } catch (const std::exception& e) {
+        std::println("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
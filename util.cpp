@@ -62,6 +62,36 @@ std::string TrimString(const std::string& s)
     return std::string { s.begin() + beg, s.begin() + end };
 }
 
+std::string JsonString(std::string_view s)
+{
+    std::string res = "\"";
+    for (const auto c : s) {
+        switch (c) {
+        case '"':
+            res += "\\\"";
+            break;
+        case '\\':
+            res += "\\\\";
+            break;
+        case '\n':
+            res += "\\n";
+            break;
+        case '\r':
+            res += "\\r";
+            break;
+        case '\t':
+            res += "\\t";
+            break;
+        default:
+            if (static_cast<uint8_t>(c) < 0x20)
+                res += "\\u00" + HexString(static_cast<uint8_t>(c));
+            else
+                res += c;
+        }
+    }
+    return res + "\"";
+}
+
 #include <print>
 void HexDump(uint64_t addr, const void* data, size_t size)
 {
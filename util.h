@@ -9,8 +9,9 @@
 #include <cassert>
 #include <utility>
 
-#define THROW_ONCE() do { static bool passed_before_; if (!passed_before_) { passed_before_ = true; throw std::runtime_error{"FORCE BREAK from " + std::string(__func__) + ":" + std::to_string(__LINE__)}; } } while (0)
-#define THROW_FLIPFLOP() do { static bool flipflop_; if (!std::exchange(flipflop_, !flipflop_)) throw std::runtime_error("FORCED FLIPFLOP BREAK from " + std::string(__func__) + ":" + std::to_string(__LINE__)); } while (0);
+// Debugging aids, the state is per thread so machines running on different threads don't affect each other
+#define THROW_ONCE() do { thread_local bool passed_before_; if (!passed_before_) { passed_before_ = true; throw std::runtime_error{"FORCE BREAK from " + std::string(__func__) + ":" + std::to_string(__LINE__)}; } } while (0)
+#define THROW_FLIPFLOP() do { thread_local bool flipflop_; if (!std::exchange(flipflop_, !flipflop_)) throw std::runtime_error("FORCED FLIPFLOP BREAK from " + std::string(__func__) + ":" + std::to_string(__LINE__)); } while (0);
 
 std::string FormatXString(std::uint64_t value, size_t width, uint8_t shift);
 
@@ -31,6 +32,7 @@ std::string HexString(const std::vector<uint8_t>& bytes);
 
 std::vector<std::uint8_t> HexDecode(std::string_view str);
 std::string TrimString(const std::string& s);
+std::string JsonString(std::string_view s); // Quoted and escaped
 
 std::uint8_t DigitValue(char ch); // 0xFF = invalid number
 